@@ -0,0 +1,203 @@
+#ifndef C_THREAD_H
+#define C_THREAD_H
+
+#include "pdef.h"
+#include "type.h"
+
+#if defined(C_WIN)
+	#define C_THREAD_LOCAL __declspec(thread)
+typedef HANDLE c_thread_t;
+typedef SRWLOCK c_mutex_t;
+typedef CONDITION_VARIABLE c_cond_t;
+#else
+	#include <pthread.h>
+	#define C_THREAD_LOCAL __thread
+typedef pthread_t c_thread_t;
+typedef pthread_mutex_t c_mutex_t;
+typedef pthread_cond_t c_cond_t;
+#endif
+
+typedef int (*c_thread_fn)(void *arg);
+
+PLTAPI int c_thread_create(c_thread_t *thread, c_thread_fn fn, void *arg);
+PLTAPI int c_thread_join(c_thread_t thread);
+PLTAPI void c_thread_yield();
+PLTAPI u32 c_thread_id();
+
+PLTAPI int c_mutex_init(c_mutex_t *mutex);
+PLTAPI int c_mutex_free(c_mutex_t *mutex);
+PLTAPI int c_mutex_lock(c_mutex_t *mutex);
+PLTAPI int c_mutex_unlock(c_mutex_t *mutex);
+
+PLTAPI int c_cond_init(c_cond_t *cond);
+PLTAPI int c_cond_free(c_cond_t *cond);
+PLTAPI int c_cond_wait(c_cond_t *cond, c_mutex_t *mutex, u32 milliseconds);
+PLTAPI int c_cond_signal(c_cond_t *cond);
+PLTAPI int c_cond_broadcast(c_cond_t *cond);
+
+// Loads acquire, stores release, read-modify-write operations are sequentially consistent.
+// Add and exchange return the previous value, cas returns non-zero on success.
+#if defined(C_WIN)
+	#include <intrin.h>
+
+static inline u32 c_atomic_load32(const volatile u32 *ptr)
+{
+	u32 val = *ptr;
+	_ReadWriteBarrier();
+	return val;
+}
+
+static inline void c_atomic_store32(volatile u32 *ptr, u32 val)
+{
+	_ReadWriteBarrier();
+	*ptr = val;
+}
+
+static inline u32 c_atomic_add32(volatile u32 *ptr, u32 val)
+{
+	return (u32)InterlockedExchangeAdd((volatile LONG *)ptr, (LONG)val);
+}
+
+static inline u32 c_atomic_xchg32(volatile u32 *ptr, u32 val)
+{
+	return (u32)InterlockedExchange((volatile LONG *)ptr, (LONG)val);
+}
+
+static inline int c_atomic_cas32(volatile u32 *ptr, u32 expected, u32 desired)
+{
+	return (u32)InterlockedCompareExchange((volatile LONG *)ptr, (LONG)desired, (LONG)expected) == expected;
+}
+
+static inline u64 c_atomic_load64(const volatile u64 *ptr)
+{
+	#if defined(C_WIN64)
+	u64 val = *ptr;
+	_ReadWriteBarrier();
+	return val;
+	#else
+	return (u64)InterlockedCompareExchange64((volatile LONG64 *)ptr, 0, 0);
+	#endif
+}
+
+static inline void c_atomic_store64(volatile u64 *ptr, u64 val)
+{
+	#if defined(C_WIN64)
+	_ReadWriteBarrier();
+	*ptr = val;
+	#else
+	InterlockedExchange64((volatile LONG64 *)ptr, (LONG64)val);
+	#endif
+}
+
+static inline u64 c_atomic_add64(volatile u64 *ptr, u64 val)
+{
+	return (u64)InterlockedExchangeAdd64((volatile LONG64 *)ptr, (LONG64)val);
+}
+
+static inline u64 c_atomic_xchg64(volatile u64 *ptr, u64 val)
+{
+	return (u64)InterlockedExchange64((volatile LONG64 *)ptr, (LONG64)val);
+}
+
+static inline int c_atomic_cas64(volatile u64 *ptr, u64 expected, u64 desired)
+{
+	return (u64)InterlockedCompareExchange64((volatile LONG64 *)ptr, (LONG64)desired, (LONG64)expected) == expected;
+}
+
+static inline void *c_atomic_loadp(void *const volatile *ptr)
+{
+	void *val = *ptr;
+	_ReadWriteBarrier();
+	return val;
+}
+
+static inline void c_atomic_storep(void *volatile *ptr, void *val)
+{
+	_ReadWriteBarrier();
+	*ptr = val;
+}
+
+static inline int c_atomic_casp(void *volatile *ptr, void *expected, void *desired)
+{
+	return InterlockedCompareExchangePointer(ptr, desired, expected) == expected;
+}
+
+static inline void c_atomic_pause()
+{
+	YieldProcessor();
+}
+#else
+static inline u32 c_atomic_load32(const volatile u32 *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void c_atomic_store32(volatile u32 *ptr, u32 val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+
+static inline u32 c_atomic_add32(volatile u32 *ptr, u32 val)
+{
+	return __atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+static inline u32 c_atomic_xchg32(volatile u32 *ptr, u32 val)
+{
+	return __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+static inline int c_atomic_cas32(volatile u32 *ptr, u32 expected, u32 desired)
+{
+	return __atomic_compare_exchange_n(ptr, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline u64 c_atomic_load64(const volatile u64 *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void c_atomic_store64(volatile u64 *ptr, u64 val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+
+static inline u64 c_atomic_add64(volatile u64 *ptr, u64 val)
+{
+	return __atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+static inline u64 c_atomic_xchg64(volatile u64 *ptr, u64 val)
+{
+	return __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+static inline int c_atomic_cas64(volatile u64 *ptr, u64 expected, u64 desired)
+{
+	return __atomic_compare_exchange_n(ptr, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline void *c_atomic_loadp(void *const volatile *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void c_atomic_storep(void *volatile *ptr, void *val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+
+static inline int c_atomic_casp(void *volatile *ptr, void *expected, void *desired)
+{
+	return __atomic_compare_exchange_n(ptr, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline void c_atomic_pause()
+{
+	#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+	#endif
+}
+#endif
+
+#endif
@@ -4,11 +4,69 @@
 #include "pdef.h"
 #include "type.h"
 
-#define C_TIME_BUF_SIZE 24
+#if defined(C_WIN)
+	#include <intrin.h>
+#endif
+
+#define C_TIME_BUF_SIZE	    24
+#define C_TIME_BUF_SIZE_MAX 32
+
+enum {
+	C_TIME_MS,
+	C_TIME_US,
+	C_TIME_NS,
+	C_TIME_PREC_MASK = 0x3,
+	C_TIME_ISO	 = 0x4,
+};
+
+enum {
+	C_CLOCK_MONO,
+	C_CLOCK_COARSE,
+	C_CLOCK_CYCLES,
+};
 
 PLTAPI u64 c_time();
 PLTAPI const char *c_time_str(char *buf);
+PLTAPI const char *c_time_fmt(char *buf, u64 time);
+
+// Formats "YYYY-MM-DD HH:MM:SS" followed by milli, micro or nanoseconds, or
+// "YYYY-MM-DDTHH:MM:SS.fffZ" with C_TIME_ISO. The date part is cached per thread,
+// so consecutive calls within the same second only render the fraction.
+PLTAPI const char *c_time_strf(char *buf, size_t size, int flags);
+PLTAPI const char *c_time_fmtf(char *buf, size_t size, u64 sec, u32 nsec, int flags);
 
 PLTAPI int c_sleep(u32 milliseconds);
 
+// Monotonic nanoseconds, unaffected by wall-clock adjustments. The coarse
+// variant is cheaper to read but only advances once per scheduler tick.
+PLTAPI u64 c_mono();
+PLTAPI u64 c_mono_coarse();
+
+// Reads one of the C_CLOCK_* sources in monotonic nanoseconds. C_CLOCK_CYCLES
+// falls back to C_CLOCK_MONO until the cycle counter is calibrated.
+PLTAPI u64 c_clock(int clock);
+
+// Calibrates the cycle counter against c_mono() by spinning for the given
+// window, cplatform_init() does it once before any threads are started. Fails
+// if the counter is not invariant, c_cycles_ns() then returns cycles unchanged.
+PLTAPI int c_cycles_calibrate(u32 milliseconds);
+PLTAPI u64 c_cycles_freq();
+PLTAPI u64 c_cycles_ns(u64 cycles);
+
+// Raw cycle counter, subtract two reads and convert with c_cycles_ns()
+static inline u64 c_cycles()
+{
+#if defined(C_WIN)
+	return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	u64 val;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(val));
+	return val;
+#else
+	return c_mono();
+#endif
+}
+
 #endif
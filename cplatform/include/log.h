@@ -1,6 +1,7 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include "c_thread.h"
 #include "c_time.h"
 #include "print.h"
 
@@ -11,7 +12,13 @@ typedef struct log_event_s {
 	const char *func;
 	const char *tag;
 	const char *fmt;
+	// Rendered once per record when a text sink accepts it, NULL otherwise
+	const char *head;
+	const char *msg;
+	int head_len;
+	int msg_len;
 	char time[C_TIME_BUF_SIZE];
+	u64 timestamp;
 	int line;
 	print_dst_t print;
 	int colors;
@@ -26,29 +33,77 @@ typedef struct log_callback_s {
 	print_dst_t print;
 	int level;
 	int header;
+	volatile u32 lock;
 } log_callback_t;
 
 #define LOG_MAX_CALLBACKS 32
 
+typedef struct log_async_s log_async_t;
+
 typedef struct log_s {
 	void *priv;
 	int level;
 	int quiet;
 	int header;
 	log_callback_t callbacks[LOG_MAX_CALLBACKS];
+	u32 callbacks_cnt;
+	log_async_t *async;
+	volatile u32 async_users;
 } log_t;
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
-#define log_trace(_pkg, _file, _tag, ...) log_log(LOG_TRACE, _pkg, _file, __func__, __LINE__, _tag, __VA_ARGS__)
-#define log_debug(_pkg, _file, _tag, ...) log_log(LOG_DEBUG, _pkg, _file, __func__, __LINE__, _tag, __VA_ARGS__)
-#define log_info(_pkg, _file, _tag, ...)  log_log(LOG_INFO, _pkg, _file, __func__, __LINE__, _tag, __VA_ARGS__)
-#define log_warn(_pkg, _file, _tag, ...)  log_log(LOG_WARN, _pkg, _file, __func__, __LINE__, _tag, __VA_ARGS__)
-#define log_error(_pkg, _file, _tag, ...) log_log(LOG_ERROR, _pkg, _file, __func__, __LINE__, _tag, __VA_ARGS__)
-#define log_fatal(_pkg, _file, _tag, ...) log_log(LOG_FATAL, _pkg, _file, __func__, __LINE__, _tag, __VA_ARGS__)
+enum { LOG_OVERFLOW_BLOCK, LOG_OVERFLOW_DROP_NEWEST, LOG_OVERFLOW_DROP_OLDEST };
+
+// Messages longer than this are truncated when queued in async mode
+#define LOG_ASYNC_MSG_SIZE 512
+
+// Records below LOG_COMPILE_LEVEL are compiled out, their arguments are never evaluated
+#ifndef LOG_COMPILE_LEVEL
+	#define LOG_COMPILE_LEVEL LOG_TRACE
+#endif
+
+typedef struct log_site_s {
+	u32 state;
+} log_site_t;
 
+// Bumped by every change that can affect which records are emitted, kept even so that
+// a call site stores its enabled flag in the lowest bit of the cached generation
+PLTAPI extern u32 log_generation;
+// Threads with a log of their own, the cached flag only holds for the process-wide log
+PLTAPI extern u32 log_locals;
+
+PLTAPI int log_site_update(log_site_t *site, int level);
+
+// clang-format off
+#define LOG_SITE(_level, _pkg, _file, _tag, ...)                                                                         \
+	do {                                                                                                             \
+		if ((_level) >= LOG_COMPILE_LEVEL) {                                                                     \
+			static log_site_t _log_site;                                                                     \
+			const u32 _log_gen   = c_atomic_load32(&log_generation);                                         \
+			const u32 _log_state = c_atomic_load32(&_log_site.state);                                        \
+			if ((_log_state ^ _log_gen) == 1 ||                                                              \
+			    ((_log_state != _log_gen || c_atomic_load32(&log_locals) != 0) && log_site_update(&_log_site, _level))) { \
+				log_log(_level, _pkg, _file, __func__, __LINE__, _tag, __VA_ARGS__);                     \
+			}                                                                                                \
+		}                                                                                                        \
+	} while (0)
+// clang-format on
+
+#define log_trace(_pkg, _file, _tag, ...) LOG_SITE(LOG_TRACE, _pkg, _file, _tag, __VA_ARGS__)
+#define log_debug(_pkg, _file, _tag, ...) LOG_SITE(LOG_DEBUG, _pkg, _file, _tag, __VA_ARGS__)
+#define log_info(_pkg, _file, _tag, ...)  LOG_SITE(LOG_INFO, _pkg, _file, _tag, __VA_ARGS__)
+#define log_warn(_pkg, _file, _tag, ...)  LOG_SITE(LOG_WARN, _pkg, _file, _tag, __VA_ARGS__)
+#define log_error(_pkg, _file, _tag, ...) LOG_SITE(LOG_ERROR, _pkg, _file, _tag, __VA_ARGS__)
+#define log_fatal(_pkg, _file, _tag, ...) LOG_SITE(LOG_FATAL, _pkg, _file, _tag, __VA_ARGS__)
+
+// Callbacks filled into callbacks[] directly instead of with log_add_callback()
+// are counted up to the first empty entry when the log is set, adding them
+// after that has no effect
 PLTAPI log_t *log_init(log_t *log);
 PLTAPI log_t *log_set(log_t *log);
+// Overrides the log used by the calling thread, NULL falls back to the process-wide log
+PLTAPI log_t *log_set_local(log_t *log);
 PLTAPI const log_t *log_get();
 
 PLTAPI int log_std_cb(log_event_t *ev);
@@ -57,7 +112,12 @@ PLTAPI const char *log_level_str(int level);
 PLTAPI int log_set_level(int level);
 PLTAPI int log_set_quiet(int enable);
 PLTAPI int log_set_header(int enable);
-PLTAPI int log_add_callback(log_cb log, print_dst_t print, int level, int header);
+PLTAPI int log_add_callback(log_cb cb, print_dst_t print, int level, int header);
+
+PLTAPI int log_async_start(size_t size, int overflow);
+PLTAPI int log_async_stop();
+PLTAPI int log_async_dropped(u64 *newest, u64 *oldest);
+PLTAPI int log_flush();
 
 PLTAPI int log_log(int level, const char *pkg, const char *file, const char *func, int line, const char *tag, const char *fmt, ...);
 
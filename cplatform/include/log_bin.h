@@ -0,0 +1,44 @@
+#ifndef LOG_BIN_H
+#define LOG_BIN_H
+
+#include "c_thread.h"
+#include "log.h"
+
+#define LOG_BIN_MAX_SITES 1024
+#define LOG_BIN_MAX_ARGS  16
+
+typedef struct log_bin_site_s {
+	const char *fmt;
+	const char *pkg;
+	const char *file;
+	const char *func;
+	const char *tag;
+	int line;
+	u32 id;
+	u8 args;
+	u8 types[LOG_BIN_MAX_ARGS];
+	s16 precs[LOG_BIN_MAX_ARGS];
+} log_bin_site_t;
+
+typedef struct log_bin_s {
+	FILE *file;
+	c_mutex_t mutex;
+	u32 sites_cnt;
+	log_bin_site_t sites[LOG_BIN_MAX_SITES];
+} log_bin_t;
+
+// Records call-site ids and raw arguments instead of text. Strings passed
+// as fmt, pkg, file, func and tag are interned by pointer, so they must be
+// constant for the lifetime of the sink.
+PLTAPI log_bin_t *log_bin_init(log_bin_t *bin, FILE *file);
+PLTAPI int log_bin_free(log_bin_t *bin);
+
+PLTAPI int log_bin_cb(log_event_t *ev);
+
+PLTAPI int log_bin_decode(FILE *file, print_dst_t dst);
+
+// clang-format off
+#define PRINT_DST_BIN(_bin) (print_dst_t) { .priv = _bin }
+// clang-format on
+
+#endif
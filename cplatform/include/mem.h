@@ -4,12 +4,48 @@
 #include "print.h"
 #include "type.h"
 
+#define MEM_CLASSES   24
+#define MEM_CLASS_MAX 2048
+
+// Cache line size assumed for padding, mem_cache_line() returns the actual one
+#define MEM_CACHE_LINE 64
+
+enum {
+	MEM_SIMD_NONE,
+	MEM_SIMD_SSE2,
+	MEM_SIMD_AVX2,
+	MEM_SIMD_AVX512,
+};
+
+enum {
+	MEM_MAP_HUGE	= 1 << 0,
+	MEM_MAP_HUGETLB = 1 << 1,
+};
+
+typedef struct mem_class_s {
+	size_t size;
+	size_t hits;
+	size_t misses;
+	size_t cached;
+} mem_class_t;
+
 typedef struct mem_s {
 	size_t mem;
 	size_t peak;
 	size_t total;
 	uint allocs;
 	uint reallocs;
+	size_t arena_mem;
+	size_t arena_peak;
+	uint arena_chunks;
+	size_t pool_mem;
+	size_t pool_used;
+	size_t pool_live;
+	uint pool_slabs;
+	size_t map_mem;
+	size_t map_resident;
+	uint maps;
+	mem_class_t classes[MEM_CLASSES];
 } mem_t;
 
 mem_t *mem_init(mem_t *mem);
@@ -22,14 +58,54 @@ void *mem_alloc(size_t size);
 void *mem_calloc(size_t count, size_t size);
 void *mem_realloc(void *memory, size_t new_size, size_t old_size);
 
+// Same as above, attributing sampled allocations to the given call site
+void *mem_alloc_at(size_t size, const char *file, int line, const char *func);
+void *mem_calloc_at(size_t count, size_t size, const char *file, int line, const char *func);
+void *mem_realloc_at(void *memory, size_t new_size, size_t old_size, const char *file, int line, const char *func);
+
+#define mem_alloc_site(_size)			        mem_alloc_at(_size, __FILE__, __LINE__, __func__)
+#define mem_calloc_site(_count, _size)		        mem_calloc_at(_count, _size, __FILE__, __LINE__, __func__)
+#define mem_realloc_site(_memory, _new_size, _old_size) mem_realloc_at(_memory, _new_size, _old_size, __FILE__, __LINE__, __func__)
+
+// Alignment must be a power of two, aligned blocks are freed with mem_free_aligned()
+void *mem_alloc_aligned(size_t size, size_t align);
+void *mem_calloc_aligned(size_t count, size_t size, size_t align);
+void *mem_realloc_aligned(void *memory, size_t new_size, size_t old_size, size_t align);
+void mem_free_aligned(void *memory, size_t size);
+
+size_t mem_cache_line();
+
 void *mem_set(void *dst, int val, size_t size);
 void *mem_cpy(void *dst, size_t size, const void *src, size_t len);
 int mem_cmp(const void *l, const void *r, size_t size);
 
 int mem_swap(void *ptr1, void *ptr2, size_t size);
 
+// Selects the kernels behind mem_set(), mem_cpy(), mem_cmp() and mem_swap(),
+// capped by what the CPU and OS support, and returns the level in use.
+// mem_set() and mem_cpy() bypass the caches with streaming stores from
+// stream bytes on, 0 uses the size of the last level cache.
+// cplatform_init() selects the best level.
+int mem_simd_set(int level, size_t stream);
+int mem_simd_get();
+
 void mem_free(void *memory, size_t size);
 
 void mem_oom(int oom);
 
+// Lets every thread keep up to max bytes of freed blocks of at most
+// MEM_CLASS_MAX bytes, binned by size class, to serve later allocations.
+// Overflow moves in batches to shared per-class lists. 0 disables caching
+// and releases the shared lists. Threads not started with c_thread_create()
+// return their cache and statistics with mem_cache_flush() before exiting.
+int mem_cache_set(size_t max);
+int mem_cache_flush();
+
+// Serves allocations of at least threshold bytes with their own page mappings,
+// grown in place or moved without copying by mem_realloc(). MEM_MAP_HUGE asks
+// for transparent huge pages, MEM_MAP_HUGETLB for reserved huge pages falling
+// back to normal ones. A few freed mappings are kept for reuse with their
+// pages given back to the system. 0 disables it and unmaps the kept ones.
+int mem_map_set(size_t threshold, int flags);
+
 #endif
@@ -0,0 +1,38 @@
+#ifndef MEM_ARENA_H
+#define MEM_ARENA_H
+
+#include "pdef.h"
+#include "type.h"
+
+typedef struct mem_arena_chunk_s mem_arena_chunk_t;
+
+typedef struct mem_arena_s {
+	mem_arena_chunk_t *chunk;
+	size_t chunk_size;
+	size_t used;
+	size_t peak;
+	uint chunks;
+} mem_arena_t;
+
+typedef struct mem_arena_mark_s {
+	mem_arena_chunk_t *chunk;
+	size_t off;
+	size_t used;
+} mem_arena_mark_t;
+
+// Bump allocator carving objects from chunks of chunk_size bytes obtained
+// through mem_alloc. Objects are not freed individually, only by rewinding
+// to a mark, resetting or freeing the whole arena.
+PLTAPI mem_arena_t *mem_arena_init(mem_arena_t *arena, size_t chunk_size);
+PLTAPI int mem_arena_free(mem_arena_t *arena);
+
+PLTAPI void *mem_arena_alloc(mem_arena_t *arena, size_t size);
+PLTAPI void *mem_arena_alloc_aligned(mem_arena_t *arena, size_t size, size_t align);
+
+PLTAPI mem_arena_mark_t mem_arena_mark(const mem_arena_t *arena);
+PLTAPI int mem_arena_rewind(mem_arena_t *arena, mem_arena_mark_t mark);
+
+// Releases all chunks but the first one, which is kept for reuse
+PLTAPI int mem_arena_reset(mem_arena_t *arena);
+
+#endif
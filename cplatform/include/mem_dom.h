@@ -0,0 +1,56 @@
+#ifndef MEM_DOM_H
+#define MEM_DOM_H
+
+#include "pdef.h"
+#include "print.h"
+#include "type.h"
+
+typedef struct mem_dom_s mem_dom_t;
+
+typedef void (*mem_dom_cb)(mem_dom_t *dom, void *priv);
+
+struct mem_dom_s {
+	const char *name;
+	mem_dom_t *parent;
+	mem_dom_t *child;
+	mem_dom_t *next;
+	volatile u64 mem;
+	volatile u64 peak;
+	volatile u64 total;
+	volatile u64 allocs;
+	size_t soft;
+	size_t hard;
+	mem_dom_cb on_soft;
+	void *priv;
+	volatile u32 over;
+	volatile u32 users;
+};
+
+// Named accounting domain, a child of parent or a top-level one if parent is
+// NULL. Allocations are charged to the domain and all of its ancestors.
+// Blocks have to be freed under the domain they were allocated in, just like
+// they are freed with the size they were allocated with. mem_dom_free() fails
+// while the domain has children or is set on a thread other than the calling
+// one, those have to mem_dom_set() another domain first.
+PLTAPI mem_dom_t *mem_dom_init(mem_dom_t *dom, const char *name, mem_dom_t *parent);
+PLTAPI int mem_dom_free(mem_dom_t *dom);
+
+// Allocations pushing the domain or an ancestor above hard bytes fail, crossing
+// soft bytes calls on_soft once on the allocating thread until the domain
+// drops below soft again. 0 disables a budget.
+PLTAPI int mem_dom_budget(mem_dom_t *dom, size_t soft, size_t hard, mem_dom_cb on_soft, void *priv);
+
+// Sets the domain allocations of the current thread are charged to, returns the previous one
+PLTAPI mem_dom_t *mem_dom_set(mem_dom_t *dom);
+PLTAPI mem_dom_t *mem_dom_get();
+
+// Charges the given domain instead of the one of the current thread
+PLTAPI void *mem_dom_alloc(mem_dom_t *dom, size_t size);
+PLTAPI void *mem_dom_calloc(mem_dom_t *dom, size_t count, size_t size);
+PLTAPI void *mem_dom_realloc(mem_dom_t *dom, void *memory, size_t new_size, size_t old_size);
+PLTAPI void mem_dom_release(mem_dom_t *dom, void *memory, size_t size);
+
+// Prints the domain tree, mem_print() includes it
+PLTAPI int mem_dom_print(print_dst_t dst);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef MEM_POOL_H
+#define MEM_POOL_H
+
+#include "pdef.h"
+#include "type.h"
+
+#define MEM_POOL_CACHE_SIZE 32
+
+enum {
+	MEM_POOL_CACHE = 1 << 0,
+};
+
+typedef struct mem_pool_slab_s mem_pool_slab_t;
+
+typedef struct mem_pool_s {
+	size_t size;
+	size_t slot;
+	u32 slab_cnt;
+	int flags;
+	u32 id;
+	u32 cache;
+	u32 lock;
+	void *free;
+	mem_pool_slab_t *slabs;
+	u32 slabs_cnt;
+	size_t live;
+	size_t peak;
+} mem_pool_t;
+
+// Fixed-size object allocator. Slots are cache-line sized or a power of two
+// dividing a cache line, so objects never straddle lines, and are carved
+// from slabs of slab_cnt slots. With MEM_POOL_CACHE every thread keeps up to
+// MEM_POOL_CACHE_SIZE free objects per pool and returns them with
+// mem_pool_flush(). Up to 16 pools can be cached at a time, the ones created
+// past that are not. Objects other threads still cache when the pool is freed
+// are discarded by those threads on their next use of a pool, a freed pool
+// hands out NULL until it is initialized again.
+PLTAPI mem_pool_t *mem_pool_init(mem_pool_t *pool, size_t size, u32 slab_cnt, int flags);
+PLTAPI int mem_pool_free(mem_pool_t *pool);
+
+PLTAPI void *mem_pool_alloc(mem_pool_t *pool);
+PLTAPI void mem_pool_release(mem_pool_t *pool, void *ptr);
+
+PLTAPI int mem_pool_flush(mem_pool_t *pool);
+
+#endif
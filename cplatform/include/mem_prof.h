@@ -0,0 +1,35 @@
+#ifndef MEM_PROF_H
+#define MEM_PROF_H
+
+#include "pdef.h"
+#include "print.h"
+#include "type.h"
+
+#define MEM_PROF_SITES	   1024
+#define MEM_PROF_LIVE_MAX  8192
+#define MEM_PROF_FRAMES	   8
+#define MEM_PROF_TOP	   10
+
+enum {
+	MEM_PROF_BACKTRACE = 1 << 0,
+};
+
+enum {
+	MEM_PROF_ALLOCS,
+	MEM_PROF_LIVE,
+};
+
+// Samples on average one allocation per rate bytes with exponentially
+// distributed intervals, so large allocations are always seen and the totals
+// are estimated without bias. Sites come from the mem_*_site macros, other
+// allocations are attributed to an unknown site unless backtraces are enabled.
+PLTAPI int mem_prof_start(size_t rate, int flags);
+PLTAPI int mem_prof_stop();
+
+// Prints the top allocating sites by estimated bytes
+PLTAPI int mem_prof_print(print_dst_t dst, int top);
+
+// Dumps a folded-stack profile, one "frame;frame;site value" line per site
+PLTAPI int mem_prof_dump(print_dst_t dst, int kind);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef MEM_TRACE_H
+#define MEM_TRACE_H
+
+#include "pdef.h"
+#include "print.h"
+#include "type.h"
+
+enum {
+	MEM_TRACE_ALLOC,
+	MEM_TRACE_CALLOC,
+	MEM_TRACE_REALLOC,
+	MEM_TRACE_FREE,
+	__MEM_TRACE_MAX,
+};
+
+typedef struct mem_trace_op_s {
+	int op;
+	u32 thread;
+	u64 time;
+	u64 id;
+	size_t size;
+	size_t old_size;
+} mem_trace_op_t;
+
+// Streams every mem_alloc(), mem_calloc(), mem_realloc() and mem_free() to the
+// buffer as variable-length records: op, c_mono() time since the previous
+// record, thread, block id and sizes. Blocks keep their id across reallocs,
+// blocks allocated before the start are not recorded.
+PLTAPI int mem_trace_start(print_buf_t *pbuf);
+PLTAPI int mem_trace_stop();
+
+// Reads a trace back, op accumulates the time so it has to start zeroed
+PLTAPI int mem_trace_header(FILE *file);
+PLTAPI int mem_trace_read(FILE *file, mem_trace_op_t *op);
+
+#endif
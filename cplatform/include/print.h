@@ -1,6 +1,7 @@
 #ifndef PRINT_H
 #define PRINT_H
 
+#include "c_thread.h"
 #include "pdef.h"
 #include "type.h"
 
@@ -27,6 +28,27 @@ PLTAPI int c_fwprintf(FILE *file, const wchar *fmt, ...);
 PLTAPI int c_swprintv(wchar *buf, size_t size, int off, const wchar *fmt, va_list args);
 PLTAPI int c_swprintf(wchar *buf, size_t size, int off, const wchar *fmt, ...);
 
+// Length of the valid UTF-8 prefix of str
+PLTAPI size_t c_utf8_valid(const char *str, size_t len);
+
+// Transcode like snprintf(): write what fits into dst of size characters with
+// the terminator and return the length of the whole output. Invalid sequences
+// and lone surrogates become U+FFFD, wchar is UTF-16 where it has 16 bits.
+PLTAPI size_t c_utf8_to_wchar(wchar *dst, size_t size, const char *src, size_t len);
+PLTAPI size_t c_wchar_to_utf8(char *dst, size_t size, const wchar *src, size_t len);
+
+// Fits the output of c_dtoa() and c_ftoa() with the terminator
+#define PRINT_DTOA_SIZE 32
+
+// Shortest digits that read back as the same value, laid out like %.17g for
+// doubles and %.9g for floats. Return the length like snprintf().
+PLTAPI int c_dtoa(double val, char *buf, size_t size);
+PLTAPI int c_ftoa(float val, char *buf, size_t size);
+
+// Correctly rounded like %.*f and %.*e
+PLTAPI int c_dtoa_fixed(double val, int prec, char *buf, size_t size);
+PLTAPI int c_dtoa_exp(double val, int prec, char *buf, size_t size);
+
 PLTAPI int c_fflush(FILE *file);
 
 PLTAPI int c_setmode(FILE *file, int mode);
@@ -62,6 +84,135 @@ struct wprint_dst_s {
 	void *priv;
 };
 
+// User-space buffer in front of a file descriptor. Output is written with
+// write(2)/writev(2) when the buffer is full, when flush_ms elapsed since the
+// last flush, when dsync() ends a record with a level at or above flush_level,
+// and on c_fflush() of the file it was created for. There is no timer of its
+// own, flush_ms is checked on writes and by print_bufs_flush_due(), which the
+// thread of an async log calls whenever it goes idle. Without one, the tail of
+// a buffer that stops being written stays there until the application calls
+// print_bufs_flush_due(), c_fflush() or print_buf_flush(). At most
+// PRINT_BUFS_MAX buffers can exist at a time, print_buf_init() fails past that.
+typedef struct print_buf_s {
+	FILE *file;
+	int fd;
+	char *data;
+	size_t size;
+	size_t len;
+	u32 flush_ms;
+	int flush_level;
+	u64 flushed;
+	int err;
+	volatile u32 users;
+	c_mutex_t mutex;
+} print_buf_t;
+
+#define PRINT_BUF_LEVEL_NONE -1
+#define PRINT_BUFS_MAX	     16
+
+PLTAPI print_buf_t *print_buf_init(print_buf_t *pbuf, FILE *file, size_t size, u32 flush_ms, int flush_level);
+PLTAPI int print_buf_free(print_buf_t *pbuf);
+PLTAPI int print_buf_flush(print_buf_t *pbuf);
+// Flushes every buffer whose flush_ms elapsed since its last flush
+PLTAPI int print_bufs_flush_due();
+
+// Appends raw bytes, for binary records that do not go through a format
+PLTAPI int print_buf_write(print_buf_t *pbuf, const void *data, size_t len);
+
+PLTAPI int c_bprintv_cb(print_dst_t dst, const char *fmt, va_list args);
+
+#define PRINT_DYN_INLINE 128
+
+// Growable string owned by one thread. Short strings stay in the inline
+// storage, longer ones move to a mem_alloc() buffer grown geometrically with
+// mem_realloc(). Formats straight into the free capacity and formats again
+// only when the output did not fit. The data pointer refers to the struct, so
+// it must not be moved while in use.
+typedef struct print_dyn_s {
+	char *data;
+	size_t size;
+	size_t len;
+	int err;
+	char buf[PRINT_DYN_INLINE];
+} print_dyn_t;
+
+PLTAPI print_dyn_t *print_dyn_init(print_dyn_t *dyn, size_t size);
+PLTAPI int print_dyn_free(print_dyn_t *dyn);
+PLTAPI void print_dyn_reset(print_dyn_t *dyn);
+
+// Hands over the string as a mem_alloc() block to be freed with mem_free() and
+// the returned size, the destination is left empty. NULL if nothing was printed.
+PLTAPI char *print_dyn_take(print_dyn_t *dyn, size_t *size);
+
+PLTAPI int c_dynprintv_cb(print_dst_t dst, const char *fmt, va_list args);
+
+#define PRINT_IOV_SLICES  64
+#define PRINT_IOV_SCRATCH 1024
+
+typedef struct print_slice_s {
+	const char *data;
+	size_t len;
+} print_slice_t;
+
+// Output gathered as slices and written with a single writev(2). Format
+// literals and %s arguments are referenced where they are instead of copied,
+// the rest is formatted into the scratch. Referenced memory has to stay valid
+// until the output is written: by dsync() at the end of a record, by
+// print_iov_flush(), or during a print when the slices or the scratch run out.
+// Prints between flushes go out together.
+typedef struct print_iov_s {
+	FILE *file;
+	int fd;
+	size_t cnt;
+	size_t len;
+	int err;
+	c_mutex_t mutex;
+	print_slice_t slices[PRINT_IOV_SLICES];
+	char scratch[PRINT_IOV_SCRATCH];
+} print_iov_t;
+
+PLTAPI print_iov_t *print_iov_init(print_iov_t *iov, FILE *file);
+PLTAPI int print_iov_free(print_iov_t *iov);
+PLTAPI int print_iov_flush(print_iov_t *iov);
+
+PLTAPI int c_iovprintv_cb(print_dst_t dst, const char *fmt, va_list args);
+
+// File appended to through a shared mapping of its end, without stdio or a
+// write per print. Output is formatted straight into the mapped window. When
+// the window is full the file is preallocated by at least chunk bytes, 4 MB
+// for 0, and the window moves there. Written pages are handed to the system
+// with an asynchronous msync(2) every sync_bytes, when the window moves and
+// when dsync() ends a record with a level at or above sync_level, unless it is
+// PRINT_BUF_LEVEL_NONE. The preallocated tail reads as zeros until
+// print_map_free() truncates the file to the written length. Output already in
+// the file is appended to.
+typedef struct print_map_s {
+#if defined(C_WIN)
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+	char *data;
+	u64 base;
+	size_t size;
+	u64 len;
+	u64 synced;
+	size_t chunk;
+	size_t sync_bytes;
+	int sync_level;
+	int err;
+	c_mutex_t mutex;
+} print_map_t;
+
+PLTAPI print_map_t *print_map_init(print_map_t *map, const char *path, size_t chunk, size_t sync_bytes, int sync_level);
+PLTAPI int print_map_free(print_map_t *map);
+
+// Writes everything printed so far to the file and waits for it
+PLTAPI int print_map_sync(print_map_t *map);
+
+PLTAPI int c_mapprintv_cb(print_dst_t dst, const char *fmt, va_list args);
+
 PLTAPI int c_wprintv_cb(wprint_dst_t dst, const wchar *fmt, va_list args);
 PLTAPI int c_swprintv_cb(wprint_dst_t dst, const wchar *fmt, va_list args);
 PLTAPI int c_fwprintv_cb(wprint_dst_t dst, const wchar *fmt, va_list args);
@@ -69,6 +220,18 @@ PLTAPI int c_fwprintv_cb(wprint_dst_t dst, const wchar *fmt, va_list args);
 PLTAPI int dprintv(print_dst_t dst, const char *fmt, va_list args);
 PLTAPI int dprintf(print_dst_t dst, const char *fmt, ...);
 
+// dprintf() for formats that stay in place and unchanged, string literals in
+// practice. The format is compiled once into a program cached by its address
+// and later calls run the program instead of parsing the format again.
+// Destinations with their own callback still get the plain format.
+PLTAPI int dcprintv(print_dst_t dst, const char *fmt, va_list args);
+PLTAPI int dcprintf(print_dst_t dst, const char *fmt, ...);
+
+// Ends a record of the given level, buffered destinations flush if it reaches
+// their flush level, mapped ones sync if it reaches their sync level and
+// vectored ones write it
+PLTAPI int dsync(print_dst_t dst, int level);
+
 PLTAPI int dwprintv(wprint_dst_t dst, const wchar *fmt, va_list args);
 PLTAPI int dwprintf(wprint_dst_t dst, const wchar *fmt, ...);
 
@@ -77,6 +240,10 @@ PLTAPI int dwprintf(wprint_dst_t dst, const wchar *fmt, ...);
 #define PRINT_DST_STD() (print_dst_t) { .cb = c_printv_cb }
 #define PRINT_DST_BUF(_buf, _size, _off) (print_dst_t) { .cb = c_sprintv_cb, .out.buf=_buf, .size=_size, .off=_off }
 #define PRINT_DST_FILE(_file) (print_dst_t) { .cb=c_fprintv_cb, .out.file=_file }
+#define PRINT_DST_BUFFERED(_pbuf) (print_dst_t) { .cb=c_bprintv_cb, .priv=_pbuf }
+#define PRINT_DST_DYN(_dyn) (print_dst_t) { .cb=c_dynprintv_cb, .priv=_dyn }
+#define PRINT_DST_IOV(_iov) (print_dst_t) { .cb=c_iovprintv_cb, .priv=_iov }
+#define PRINT_DST_MMAP(_map) (print_dst_t) { .cb=c_mapprintv_cb, .priv=_map }
 
 #define PRINT_DST_WNONE() (wprint_dst_t) { 0 }
 #define PRINT_DST_WSTD() (wprint_dst_t) { .cb = c_wprintv_cb }
@@ -0,0 +1,218 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "c_thread.h"
+
+#include "log.h"
+#include "mem.h"
+#include "platform.h"
+
+#include <stdlib.h>
+
+#if defined(C_WIN)
+#else
+	#include <sched.h>
+	#include <time.h>
+#endif
+
+typedef struct thread_start_s {
+	c_thread_fn fn;
+	void *arg;
+} thread_start_t;
+
+#if defined(C_WIN)
+static DWORD WINAPI thread_start(LPVOID param)
+{
+	thread_start_t start = *(thread_start_t *)param;
+	free(param);
+	DWORD ret = (DWORD)start.fn(start.arg);
+	mem_cache_flush();
+	return ret;
+}
+#else
+static void *thread_start(void *param)
+{
+	thread_start_t start = *(thread_start_t *)param;
+	free(param);
+	int ret = start.fn(start.arg);
+	mem_cache_flush();
+	return (void *)(intptr_t)ret;
+}
+#endif
+
+int c_thread_create(c_thread_t *thread, c_thread_fn fn, void *arg)
+{
+	if (thread == NULL || fn == NULL) {
+		return 1;
+	}
+
+	thread_start_t *start = malloc(sizeof(thread_start_t));
+	if (start == NULL) {
+		log_error("cplatform", "thread", NULL, "out of memory");
+		return 1;
+	}
+
+	start->fn  = fn;
+	start->arg = arg;
+
+#if defined(C_WIN)
+	*thread = CreateThread(NULL, 0, thread_start, start, 0, NULL);
+	if (*thread == NULL) {
+		log_error("cplatform", "thread", NULL, "failed to create thread: %d", GetLastError());
+		free(start);
+		return 1;
+	}
+#else
+	int errnum = pthread_create(thread, NULL, thread_start, start);
+	if (errnum != 0) {
+		log_error("cplatform", "thread", NULL, "failed to create thread: %s (%d)", log_strerror(errnum), errnum);
+		free(start);
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+int c_thread_join(c_thread_t thread)
+{
+#if defined(C_WIN)
+	DWORD ret = 0;
+	WaitForSingleObject(thread, INFINITE);
+	GetExitCodeThread(thread, &ret);
+	CloseHandle(thread);
+	return (int)ret;
+#else
+	void *ret = NULL;
+	if (pthread_join(thread, &ret) != 0) {
+		return 1;
+	}
+	return (int)(intptr_t)ret;
+#endif
+}
+
+void c_thread_yield()
+{
+#if defined(C_WIN)
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+u32 c_thread_id()
+{
+	static u32 next;
+	static C_THREAD_LOCAL u32 id;
+
+	if (id == 0) {
+		id = c_atomic_add32(&next, 1) + 1;
+	}
+
+	return id;
+}
+
+int c_mutex_init(c_mutex_t *mutex)
+{
+	if (mutex == NULL) {
+		return 1;
+	}
+#if defined(C_WIN)
+	InitializeSRWLock(mutex);
+	return 0;
+#else
+	return pthread_mutex_init(mutex, NULL) != 0;
+#endif
+}
+
+int c_mutex_free(c_mutex_t *mutex)
+{
+	if (mutex == NULL) {
+		return 1;
+	}
+#if defined(C_WIN)
+	return 0;
+#else
+	return pthread_mutex_destroy(mutex) != 0;
+#endif
+}
+
+int c_mutex_lock(c_mutex_t *mutex)
+{
+#if defined(C_WIN)
+	AcquireSRWLockExclusive(mutex);
+	return 0;
+#else
+	return pthread_mutex_lock(mutex) != 0;
+#endif
+}
+
+int c_mutex_unlock(c_mutex_t *mutex)
+{
+#if defined(C_WIN)
+	ReleaseSRWLockExclusive(mutex);
+	return 0;
+#else
+	return pthread_mutex_unlock(mutex) != 0;
+#endif
+}
+
+int c_cond_init(c_cond_t *cond)
+{
+	if (cond == NULL) {
+		return 1;
+	}
+#if defined(C_WIN)
+	InitializeConditionVariable(cond);
+	return 0;
+#else
+	return pthread_cond_init(cond, NULL) != 0;
+#endif
+}
+
+int c_cond_free(c_cond_t *cond)
+{
+	if (cond == NULL) {
+		return 1;
+	}
+#if defined(C_WIN)
+	return 0;
+#else
+	return pthread_cond_destroy(cond) != 0;
+#endif
+}
+
+int c_cond_wait(c_cond_t *cond, c_mutex_t *mutex, u32 milliseconds)
+{
+#if defined(C_WIN)
+	return SleepConditionVariableSRW(cond, mutex, milliseconds, 0) == 0;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += milliseconds / 1000;
+	ts.tv_nsec += (long)(milliseconds % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	return pthread_cond_timedwait(cond, mutex, &ts) != 0;
+#endif
+}
+
+int c_cond_signal(c_cond_t *cond)
+{
+#if defined(C_WIN)
+	WakeConditionVariable(cond);
+	return 0;
+#else
+	return pthread_cond_signal(cond) != 0;
+#endif
+}
+
+int c_cond_broadcast(c_cond_t *cond)
+{
+#if defined(C_WIN)
+	WakeAllConditionVariable(cond);
+	return 0;
+#else
+	return pthread_cond_broadcast(cond) != 0;
+#endif
+}
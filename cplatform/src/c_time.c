@@ -1,37 +1,63 @@
+#define _POSIX_C_SOURCE 199506L
+
 #include "c_time.h"
 
+#include "c_thread.h"
 #include "platform.h"
-#include "print.h"
 
-#include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #if defined(C_WIN)
 #else
 	#include <sys/time.h>
 	#include <unistd.h>
+	#if defined(__x86_64__) || defined(__i386__)
+		#include <cpuid.h>
+	#endif
 #endif
 
 typedef struct ctime_s {
 	time_t sec;
-	u32 msec;
+	u32 nsec;
 } ctime_t;
 
+// Rendered "YYYY-MM-DD HH:MM:SS" of the last formatted second
+typedef struct time_cache_s {
+	u64 sec;
+	u64 min;
+	char date[19];
+} time_cache_t;
+
+// ns = cycles * mult >> shift, base maps the counter onto c_mono()
+typedef struct cycles_s {
+	u64 freq;
+	u32 mult;
+	u32 shift;
+	u64 base_cycles;
+	u64 base_ns;
+	u32 ready;
+} cycles_t;
+
+static C_THREAD_LOCAL time_cache_t s_cache = { .sec = U64_MAX, .min = U64_MAX };
+static cycles_t s_cycles;
+
 static ctime_t get_time()
 {
 #if defined(C_WIN)
-	SYSTEMTIME st;
-	GetSystemTime(&st);
+	FILETIME ft;
+	GetSystemTimePreciseAsFileTime(&ft);
+	const u64 t	  = (((u64)ft.dwHighDateTime << 32) | ft.dwLowDateTime) - 116444736000000000ULL;
 	const ctime_t now = {
-		.sec  = time(NULL),
-		.msec = st.wMilliseconds,
+		.sec  = (time_t)(t / 10000000),
+		.nsec = (u32)(t % 10000000) * 100,
 	};
 #else
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
 	const ctime_t now = {
-		.sec  = tv.tv_sec,
-		.msec = tv.tv_usec / 1000,
+		.sec  = ts.tv_sec,
+		.nsec = (u32)ts.tv_nsec,
 	};
 #endif
 	return now;
@@ -40,27 +66,102 @@ static ctime_t get_time()
 u64 c_time()
 {
 	const ctime_t now = get_time();
-	return (u64)now.sec * 1000 + (u64)now.msec;
+	return (u64)now.sec * 1000 + (u64)now.nsec / 1000000;
 }
 
 const char *c_time_str(char *buf)
 {
-	if (buf == NULL) {
-		return NULL;
+	return c_time_fmt(buf, c_time());
+}
+
+const char *c_time_fmt(char *buf, u64 time)
+{
+	return c_time_fmtf(buf, C_TIME_BUF_SIZE, time / 1000, (u32)(time % 1000) * 1000000, C_TIME_MS);
+}
+
+const char *c_time_strf(char *buf, size_t size, int flags)
+{
+	const ctime_t now = get_time();
+	return c_time_fmtf(buf, size, (u64)now.sec, now.nsec, flags);
+}
+
+static void put_digits(char *buf, u32 val, int digits)
+{
+	for (int i = digits - 1; i >= 0; i--) {
+		buf[i] = (char)('0' + val % 10);
+		val /= 10;
 	}
+}
 
+static void cache_date(time_cache_t *cache, u64 sec)
+{
+	const u64 min = sec / 60;
+
+	if (min == cache->min) {
+		put_digits(&cache->date[17], (u32)(sec % 60), 2);
+		cache->sec = sec;
+		return;
+	}
+
+	const time_t t = (time_t)sec;
 	struct tm *timeinfo;
-	const ctime_t now = get_time();
 #if defined(C_WIN)
 	struct tm ti;
-	gmtime_s(&ti, &now.sec);
+	gmtime_s(&ti, &t);
 	timeinfo = &ti;
 #else
-	timeinfo = gmtime(&now.sec);
+	struct tm ti;
+	timeinfo = gmtime_r(&t, &ti);
 #endif
 
-	strftime(buf, C_TIME_BUF_SIZE, "%Y-%m-%d %H:%M:%S", timeinfo);
-	c_sprintf(buf, C_TIME_BUF_SIZE, 19, ".%03ld", now.msec);
+	char *date = cache->date;
+	put_digits(&date[0], (u32)(timeinfo->tm_year + 1900), 4);
+	date[4] = '-';
+	put_digits(&date[5], (u32)(timeinfo->tm_mon + 1), 2);
+	date[7] = '-';
+	put_digits(&date[8], (u32)timeinfo->tm_mday, 2);
+	date[10] = ' ';
+	put_digits(&date[11], (u32)timeinfo->tm_hour, 2);
+	date[13] = ':';
+	put_digits(&date[14], (u32)timeinfo->tm_min, 2);
+	date[16] = ':';
+	put_digits(&date[17], (u32)timeinfo->tm_sec, 2);
+
+	cache->sec = sec;
+	cache->min = min;
+}
+
+const char *c_time_fmtf(char *buf, size_t size, u64 sec, u32 nsec, int flags)
+{
+	static const int digits[] = { 3, 6, 9 };
+	static const u32 divs[]	  = { 1000000, 1000, 1 };
+
+	const int prec = flags & C_TIME_PREC_MASK;
+	const int iso  = (flags & C_TIME_ISO) != 0;
+
+	if (buf == NULL || prec > C_TIME_NS || size < (size_t)(sizeof(s_cache.date) + 1 + digits[prec] + iso + 1)) {
+		return NULL;
+	}
+
+	time_cache_t *cache = &s_cache;
+	if (sec != cache->sec) {
+		cache_date(cache, sec);
+	}
+
+	size_t len = sizeof(cache->date);
+	memcpy(buf, cache->date, len);
+	if (iso) {
+		buf[10] = 'T';
+	}
+
+	buf[len++] = '.';
+	put_digits(&buf[len], nsec / divs[prec], digits[prec]);
+	len += digits[prec];
+
+	if (iso) {
+		buf[len++] = 'Z';
+	}
+	buf[len] = '\0';
 
 	return buf;
 }
@@ -78,3 +179,127 @@ int c_sleep(u32 milliseconds)
 	return 0;
 #endif
 }
+
+u64 c_mono()
+{
+#if defined(C_WIN)
+	static LARGE_INTEGER freq;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	LARGE_INTEGER cnt;
+	QueryPerformanceCounter(&cnt);
+	const u64 c = (u64)cnt.QuadPart;
+	const u64 f = (u64)freq.QuadPart;
+	return c / f * 1000000000 + c % f * 1000000000 / f;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+#endif
+}
+
+u64 c_mono_coarse()
+{
+#if defined(C_WIN)
+	return (u64)GetTickCount64() * 1000000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+#endif
+}
+
+u64 c_clock(int clock)
+{
+	switch (clock) {
+	case C_CLOCK_COARSE: return c_mono_coarse();
+	case C_CLOCK_CYCLES:
+		if (c_atomic_load32(&s_cycles.ready)) {
+			return s_cycles.base_ns + c_cycles_ns(c_cycles() - s_cycles.base_cycles);
+		}
+		return c_mono();
+	default: return c_mono();
+	}
+}
+
+static int cycles_invariant()
+{
+#if defined(C_WIN)
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if ((u32)regs[0] < 0x80000007) {
+		return 0;
+	}
+	__cpuid(regs, 0x80000007);
+	return (regs[3] >> 8) & 1;
+#elif defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	return (edx >> 8) & 1;
+#elif defined(__aarch64__)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+int c_cycles_calibrate(u32 milliseconds)
+{
+	if (milliseconds == 0 || !cycles_invariant()) {
+		return 1;
+	}
+
+	const u64 window = (u64)milliseconds * 1000000;
+
+	u64 t0 = c_mono();
+	u64 c0 = c_cycles();
+	t0     = (t0 + c_mono()) / 2;
+
+	u64 t1, c1;
+	do {
+		t1 = c_mono();
+		c1 = c_cycles();
+		t1 = (t1 + c_mono()) / 2;
+	} while (t1 - t0 < window);
+
+	if (c1 <= c0) {
+		return 1;
+	}
+
+	const u64 freq = (u64)((double)(c1 - c0) * 1000000000.0 / (double)(t1 - t0));
+
+	// Largest shift that keeps mult in 32 bits, so conversions never overflow
+	u32 shift = 32;
+	while (shift > 0 && (((u64)1000000000 << shift) + freq / 2) / freq > U32_MAX) {
+		shift--;
+	}
+
+	c_atomic_store32(&s_cycles.ready, 0);
+	s_cycles.freq	     = freq;
+	s_cycles.mult	     = (u32)((((u64)1000000000 << shift) + freq / 2) / freq);
+	s_cycles.shift	     = shift;
+	s_cycles.base_cycles = c1;
+	s_cycles.base_ns     = t1;
+	c_atomic_store32(&s_cycles.ready, 1);
+
+	return 0;
+}
+
+u64 c_cycles_freq()
+{
+	return c_atomic_load32(&s_cycles.ready) ? s_cycles.freq : 0;
+}
+
+u64 c_cycles_ns(u64 cycles)
+{
+	if (!c_atomic_load32(&s_cycles.ready)) {
+		return cycles;
+	}
+
+	const u64 hi = cycles >> 32;
+	const u64 lo = cycles & U32_MAX;
+	return ((hi * s_cycles.mult) << (32 - s_cycles.shift)) + ((lo * s_cycles.mult) >> s_cycles.shift);
+}
@@ -1,5 +1,9 @@
 #include "cplatform.h"
 
+#include "c_time.h"
+
+#define CYCLES_CALIBRATE_MS 5
+
 cplatform_t *cplatform_init(cplatform_t *cplatform)
 {
 	if (cplatform == NULL) {
@@ -11,6 +15,12 @@ cplatform_t *cplatform_init(cplatform_t *cplatform)
 
 	c_print_init();
 
+	mem_simd_set(MEM_SIMD_AVX512, 0);
+
+	if (c_cycles_freq() == 0) {
+		c_cycles_calibrate(CYCLES_CALIBRATE_MS);
+	}
+
 	return cplatform;
 }
 
@@ -20,5 +30,11 @@ int cplatform_free(cplatform_t *cplatform)
 		return 1;
 	}
 
+	if (cplatform->log.async != NULL) {
+		log_t *log = log_set(&cplatform->log);
+		log_async_stop();
+		log_set(log);
+	}
+
 	return 0;
 }
@@ -1,6 +1,8 @@
 #include "log.h"
 
+#include "c_thread.h"
 #include "c_time.h"
+#include "mem.h"
 #include "platform.h"
 
 #include <string.h>
@@ -9,13 +11,67 @@
 #define DEFAULT_QUIET  0
 #define DEFAULT_HEADER 1
 
+#define ASYNC_SPIN    64
+#define ASYNC_IDLE_MS 10
+
+#define RENDER_MSG_SIZE	 1024
+#define RENDER_HEAD_SIZE 256
+#define RENDER_NONE	 -1
+#define RENDER_FAILED	 -2
+
+typedef struct log_render_s {
+	char msg[RENDER_MSG_SIZE];
+	char heads[4][RENDER_HEAD_SIZE];
+	int head_lens[4];
+} log_render_t;
+
+typedef struct log_rec_s {
+	volatile u64 seq;
+	const char *pkg;
+	const char *file;
+	const char *func;
+	const char *tag;
+	int line;
+	int level;
+	u64 timestamp;
+	char time[C_TIME_BUF_SIZE];
+	char msg[LOG_ASYNC_MSG_SIZE];
+} log_rec_t;
+
+struct log_async_s {
+	log_t *log;
+	log_rec_t *recs;
+	size_t size;
+	int overflow;
+	c_mutex_t mutex;
+	c_cond_t cond;
+	c_thread_t thread;
+	volatile u32 sleeping;
+	volatile u32 stop;
+	char pad0[64];
+	volatile u64 head;
+	char pad1[64];
+	volatile u64 tail;
+	volatile u64 done;
+	char pad2[64];
+	volatile u64 dropped_newest;
+	volatile u64 dropped_oldest;
+};
+
 static log_t *s_log;
+static C_THREAD_LOCAL log_t *s_local;
+static volatile u32 s_lock;
+
+u32 log_generation = 2;
+u32 log_locals;
+
+static C_THREAD_LOCAL int s_drain;
 
 static const char *level_strs[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL" };
 
 static const char *level_colors[] = { "\033[94m", "\033[36m", "\033[32m", "\033[33m", "\033[31m", "\033[35m" };
 
-int log_std_cb(log_event_t *ev)
+static int print_head(const log_event_t *ev, print_dst_t dst)
 {
 	const char *tag_s = "";
 	const char *tag_e = "";
@@ -26,51 +82,128 @@ int log_std_cb(log_event_t *ev)
 		tag   = ev->tag;
 	}
 
-	int off = ev->print.off;
+	int off = dst.off;
 
 	if (ev->header) {
 		if (ev->colors) {
-			ev->print.off += dprintf(ev->print, "%s %s%-5s\033[0m [%s:%s] \033[90m%s:%d:\033[0m %s%s%s", ev->time, level_colors[ev->level],
-						 level_strs[ev->level], ev->pkg, ev->file, ev->func, ev->line, tag_s, tag, tag_e);
+			dst.off += dcprintf(dst, "%s %s%-5s\033[0m [%s:%s] \033[90m%s:%d:\033[0m %s%s%s", ev->time, level_colors[ev->level], level_strs[ev->level],
+					    ev->pkg, ev->file, ev->func, ev->line, tag_s, tag, tag_e);
 		} else {
-			ev->print.off += dprintf(ev->print, "%s %-5s [%s:%s] %s:%d: %s%s%s", ev->time, level_strs[ev->level], ev->pkg, ev->file, ev->func, ev->line,
-						 tag_s, tag, tag_e);
+			dst.off += dcprintf(dst, "%s %-5s [%s:%s] %s:%d: %s%s%s", ev->time, level_strs[ev->level], ev->pkg, ev->file, ev->func, ev->line, tag_s, tag,
+					    tag_e);
 		}
 	} else {
-		ev->print.off += dprintf(ev->print, "%s%s%s", tag_s, tag, tag_e);
+		dst.off += dcprintf(dst, "%s%s%s", tag_s, tag, tag_e);
 	}
 
+	return dst.off - off;
+}
+
+int log_std_cb(log_event_t *ev)
+{
+	if (ev->head != NULL && ev->msg != NULL) {
+		return dcprintf(ev->print, "%.*s%.*s\n", ev->head_len, ev->head, ev->msg_len, ev->msg);
+	}
+
+	int off = ev->print.off;
+
+	ev->print.off += print_head(ev, ev->print);
 	ev->print.off += dprintv(ev->print, ev->fmt, ev->ap);
 	ev->print.off += dprintf(ev->print, "\n");
 	return ev->print.off - off;
 }
 
+static log_t *cur_log()
+{
+	return s_local != NULL ? s_local : c_atomic_loadp((void *const volatile *)&s_log);
+}
+
+static int get_int(const int *val)
+{
+	return (int)c_atomic_load32((const volatile u32 *)val);
+}
+
+static int set_int(int *val, int set)
+{
+	return (int)c_atomic_xchg32((volatile u32 *)val, (u32)set);
+}
+
+static void lock()
+{
+	while (!c_atomic_cas32(&s_lock, 0, 1)) {
+		c_atomic_pause();
+	}
+}
+
+static void unlock()
+{
+	c_atomic_store32(&s_lock, 0);
+}
+
+// Counts entries filled in directly instead of through log_add_callback(), up to the first empty one
+static void count_callbacks(log_t *log)
+{
+	if (log == NULL) {
+		return;
+	}
+
+	lock();
+	u32 cnt = c_atomic_load32(&log->callbacks_cnt);
+	if (cnt == 0) {
+		while (cnt < LOG_MAX_CALLBACKS && log->callbacks[cnt].log != NULL) {
+			cnt++;
+		}
+		c_atomic_store32(&log->callbacks_cnt, cnt);
+	}
+	unlock();
+}
+
 log_t *log_init(log_t *log)
 {
-	s_log = log;
+	count_callbacks(log);
+	c_atomic_storep((void *volatile *)&s_log, log);
 
-	if (s_log == NULL) {
+	if (log == NULL) {
 		return NULL;
 	}
 
-	s_log->level  = DEFAULT_LEVEL;
-	s_log->quiet  = DEFAULT_QUIET;
-	s_log->header = DEFAULT_HEADER;
+	set_int(&log->level, DEFAULT_LEVEL);
+	set_int(&log->quiet, DEFAULT_QUIET);
+	set_int(&log->header, DEFAULT_HEADER);
 
+	c_atomic_add32(&log_generation, 2);
 	return log;
 }
 
 log_t *log_set(log_t *log)
 {
-	log_t *cur = s_log;
+	log_t *cur = c_atomic_loadp((void *const volatile *)&s_log);
+
+	count_callbacks(log);
+	c_atomic_storep((void *volatile *)&s_log, log);
+	c_atomic_add32(&log_generation, 2);
+	return cur;
+}
+
+log_t *log_set_local(log_t *log)
+{
+	log_t *cur = s_local;
+
+	if (cur == NULL && log != NULL) {
+		c_atomic_add32(&log_locals, 1);
+	} else if (cur != NULL && log == NULL) {
+		c_atomic_add32(&log_locals, (u32)-1);
+	}
 
-	s_log = log;
+	count_callbacks(log);
+	s_local = log;
+	c_atomic_add32(&log_generation, 2);
 	return cur;
 }
 
 const log_t *log_get()
 {
-	return s_log;
+	return cur_log();
 }
 
 const char *log_level_str(int level)
@@ -80,74 +213,492 @@ const char *log_level_str(int level)
 
 int log_set_level(int level)
 {
-	if (s_log == NULL) {
+	log_t *log = cur_log();
+	if (log == NULL) {
 		return DEFAULT_LEVEL;
 	}
 
-	const int cur = s_log->level;
-
-	s_log->level = level;
+	const int cur = set_int(&log->level, level);
+	c_atomic_add32(&log_generation, 2);
 	return cur;
 }
 
 int log_set_quiet(int enable)
 {
-	if (s_log == NULL) {
+	log_t *log = cur_log();
+	if (log == NULL) {
 		return DEFAULT_QUIET;
 	}
 
-	const int quiet = s_log->quiet;
-
-	s_log->quiet = enable;
+	const int quiet = set_int(&log->quiet, enable);
+	c_atomic_add32(&log_generation, 2);
 	return quiet;
 }
 
 int log_set_header(int enable)
 {
-	if (s_log == NULL) {
+	log_t *log = cur_log();
+	if (log == NULL) {
 		return DEFAULT_HEADER;
 	}
 
-	const int header = s_log->header;
-
-	s_log->header = enable;
-	return header;
+	return set_int(&log->header, enable);
 }
 
-int log_add_callback(log_cb log, print_dst_t print, int level, int header)
+int log_add_callback(log_cb cb, print_dst_t print, int level, int header)
 {
-	if (s_log == NULL) {
+	log_t *log = cur_log();
+	if (log == NULL) {
 		return 1;
 	}
 
-	for (int i = 0; i < LOG_MAX_CALLBACKS; i++) {
-		if (!s_log->callbacks[i].log) {
-			s_log->callbacks[i] = (log_callback_t){
-				.log	= log,
-				.print	= print,
-				.level	= level,
-				.header = header,
-			};
-			return 0;
-		}
+	lock();
+
+	// Published entries are never modified, readers see either the old count or the new entry
+	const u32 cnt = c_atomic_load32(&log->callbacks_cnt);
+	if (cnt >= LOG_MAX_CALLBACKS) {
+		unlock();
+		return 1;
 	}
-	return 1;
+
+	log->callbacks[cnt] = (log_callback_t){
+		.log	= cb,
+		.print	= print,
+		.level	= level,
+		.header = header,
+	};
+
+	c_atomic_store32(&log->callbacks_cnt, cnt + 1);
+	unlock();
+
+	c_atomic_add32(&log_generation, 2);
+	return 0;
 }
 
-static int init_event(log_event_t *ev, print_dst_t print, int colors, int header)
+static int init_event(log_event_t *ev, log_render_t *render, print_dst_t print, int colors, int header)
 {
 	if (!ev->time[0]) {
-		c_time_str(ev->time);
+		ev->timestamp = c_time();
+		c_time_fmt(ev->time, ev->timestamp);
 	}
 	ev->print  = print;
 	ev->colors = colors;
 	ev->header = header;
+	ev->head   = NULL;
+
+	if (ev->msg == NULL) {
+		return 0;
+	}
+
+	const int i = (colors ? 2 : 0) | (header ? 1 : 0);
+	if (render->head_lens[i] == RENDER_NONE) {
+		char *buf = render->heads[i];
+		int len	  = print_head(ev, PRINT_DST_BUF(buf, RENDER_HEAD_SIZE, 0));
+		if ((len == 0 && buf[0] != '\0') || len >= RENDER_HEAD_SIZE - 1) {
+			len = RENDER_FAILED;
+		}
+		render->head_lens[i] = len;
+	}
+
+	if (render->head_lens[i] >= 0) {
+		ev->head     = render->heads[i];
+		ev->head_len = render->head_lens[i];
+	}
+
+	return 0;
+}
+
+static int accepts_std(const log_t *log, int level)
+{
+	return !get_int(&log->quiet) && level >= get_int(&log->level);
+}
+
+static int accepts(const log_t *log, int level)
+{
+	if (accepts_std(log, level)) {
+		return 1;
+	}
+
+	const u32 cnt = c_atomic_load32(&log->callbacks_cnt);
+	for (u32 i = 0; i < cnt; i++) {
+		if (level >= log->callbacks[i].level) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int log_site_update(log_site_t *site, int level)
+{
+	const u32 gen	  = c_atomic_load32(&log_generation);
+	const log_t *log  = c_atomic_loadp((void *const volatile *)&s_log);
+	const int enabled = log != NULL && accepts(log, level);
+
+	// Shared by all threads, so it caches the process-wide log and a local one is asked every time
+	c_atomic_store32(&site->state, gen | (u32)enabled);
+	return s_local != NULL ? accepts(s_local, level) : enabled;
+}
+
+static int accepts_text(const log_t *log, int level)
+{
+	if (accepts_std(log, level)) {
+		return 1;
+	}
+
+	const u32 cnt = c_atomic_load32(&log->callbacks_cnt);
+	for (u32 i = 0; i < cnt; i++) {
+		if (log->callbacks[i].log == log_std_cb && level >= log->callbacks[i].level) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void dispatch(log_t *log, log_event_t *ev, va_list ap)
+{
+	log_render_t render;
+	for (int i = 0; i < 4; i++) {
+		render.head_lens[i] = RENDER_NONE;
+	}
+
+	if (ev->msg == NULL && accepts_text(log, ev->level)) {
+		va_list copy;
+		va_copy(copy, ap);
+		int len = c_sprintv(render.msg, sizeof(render.msg), 0, ev->fmt, copy);
+		va_end(copy);
+		if ((len > 0 || render.msg[0] == '\0') && len < RENDER_MSG_SIZE - 1) {
+			ev->msg	    = render.msg;
+			ev->msg_len = len;
+		}
+	}
+
+	if (accepts_std(log, ev->level)) {
+		init_event(ev, &render, PRINT_DST_FILE(stderr), 1, get_int(&log->header));
+		va_copy(ev->ap, ap);
+		log_std_cb(ev);
+		va_end(ev->ap);
+	}
+
+	const u32 cnt = c_atomic_load32(&log->callbacks_cnt);
+	for (u32 i = 0; i < cnt; i++) {
+		log_callback_t *cb = &log->callbacks[i];
+		if (ev->level >= cb->level) {
+			// A buffer sink is written at its offset, one record at a time so they do not overlap
+			const int at_off = cb->print.cb == c_sprintv_cb;
+			if (at_off) {
+				while (!c_atomic_cas32(&cb->lock, 0, 1)) {
+					c_atomic_pause();
+				}
+			}
+
+			init_event(ev, &render, cb->print, 0, cb->header);
+			va_copy(ev->ap, ap);
+			const int len = cb->log(ev);
+			va_end(ev->ap);
+
+			if (at_off) {
+				cb->print.off += len;
+				c_atomic_store32(&cb->lock, 0);
+			} else {
+				c_atomic_add32((volatile u32 *)&cb->print.off, (u32)len);
+			}
+			dsync(cb->print, ev->level);
+		}
+	}
+}
+
+static void dispatch_msg(log_t *log, log_event_t *ev, ...)
+{
+	va_list ap;
+	va_start(ap, ev);
+	dispatch(log, ev, ap);
+	va_end(ap);
+}
+
+static void async_wake(log_async_t *async)
+{
+	if (!c_atomic_load32(&async->sleeping)) {
+		return;
+	}
+
+	c_mutex_lock(&async->mutex);
+	c_cond_signal(&async->cond);
+	c_mutex_unlock(&async->mutex);
+}
+
+static log_rec_t *async_take(log_async_t *async, u64 *pos)
+{
+	u64 cur = c_atomic_load64(&async->tail);
+	for (;;) {
+		log_rec_t *rec = &async->recs[cur & (async->size - 1)];
+		s64 dif	       = (s64)(c_atomic_load64(&rec->seq) - (cur + 1));
+		if (dif == 0) {
+			if (c_atomic_cas64(&async->tail, cur, cur + 1)) {
+				*pos = cur;
+				return rec;
+			}
+		} else if (dif < 0) {
+			return NULL;
+		}
+		cur = c_atomic_load64(&async->tail);
+	}
+}
+
+static void async_release(log_async_t *async, log_rec_t *rec, u64 pos)
+{
+	c_atomic_store64(&rec->seq, pos + async->size);
+	c_atomic_add64(&async->done, 1);
+}
+
+static log_rec_t *async_claim(log_async_t *async, u64 *pos)
+{
+	u64 cur = c_atomic_load64(&async->head);
+	for (;;) {
+		log_rec_t *rec = &async->recs[cur & (async->size - 1)];
+		s64 dif	       = (s64)(c_atomic_load64(&rec->seq) - cur);
+		if (dif == 0) {
+			if (c_atomic_cas64(&async->head, cur, cur + 1)) {
+				*pos = cur;
+				return rec;
+			}
+		} else if (dif < 0) {
+			switch (async->overflow) {
+			case LOG_OVERFLOW_DROP_NEWEST:
+				c_atomic_add64(&async->dropped_newest, 1);
+				return NULL;
+			case LOG_OVERFLOW_DROP_OLDEST: {
+				u64 old;
+				log_rec_t *oldest = async_take(async, &old);
+				if (oldest != NULL) {
+					async_release(async, oldest, old);
+					c_atomic_add64(&async->dropped_oldest, 1);
+				}
+				break;
+			}
+			default:
+				async_wake(async);
+				c_thread_yield();
+				break;
+			}
+		}
+		cur = c_atomic_load64(&async->head);
+	}
+}
+
+static int async_push(log_async_t *async, log_event_t *ev, va_list ap)
+{
+	u64 pos;
+	log_rec_t *rec = async_claim(async, &pos);
+	if (rec == NULL) {
+		return 1;
+	}
+
+	rec->pkg   = ev->pkg;
+	rec->file  = ev->file;
+	rec->func  = ev->func;
+	rec->tag   = ev->tag;
+	rec->line  = ev->line;
+	rec->level = ev->level;
+	rec->timestamp = c_time();
+	c_time_fmt(rec->time, rec->timestamp);
+	c_sprintv(rec->msg, sizeof(rec->msg), 0, ev->fmt, ap);
+
+	c_atomic_store64(&rec->seq, pos + 1);
+	async_wake(async);
+	return 0;
+}
+
+static int async_drain(void *arg)
+{
+	log_async_t *async = arg;
+
+	s_drain = 1;
+
+	int idle = 0;
+	for (;;) {
+		u64 pos;
+		log_rec_t *rec = async_take(async, &pos);
+		if (rec != NULL) {
+			log_event_t ev = {
+				.pkg	   = rec->pkg,
+				.file	   = rec->file,
+				.func	   = rec->func,
+				.tag	   = rec->tag,
+				.fmt	   = "%s",
+				.timestamp = rec->timestamp,
+				.line	   = rec->line,
+				.level	   = rec->level,
+			};
+			memcpy(ev.time, rec->time, sizeof(ev.time));
+			ev.msg	   = rec->msg;
+			ev.msg_len = (int)strlen(rec->msg);
+			dispatch_msg(async->log, &ev, rec->msg);
+			async_release(async, rec, pos);
+			idle = 0;
+			continue;
+		}
+
+		if (c_atomic_load32(&async->stop) && c_atomic_load64(&async->done) == c_atomic_load64(&async->head)) {
+			break;
+		}
+
+		if (++idle < ASYNC_SPIN) {
+			c_atomic_pause();
+			continue;
+		}
+
+		c_mutex_lock(&async->mutex);
+		c_atomic_xchg32(&async->sleeping, 1);
+		if (c_atomic_load64(&async->tail) == c_atomic_load64(&async->head) && !c_atomic_load32(&async->stop)) {
+			c_cond_wait(&async->cond, &async->mutex, ASYNC_IDLE_MS);
+		}
+		c_atomic_store32(&async->sleeping, 0);
+		c_mutex_unlock(&async->mutex);
+		idle = 0;
+
+		// Woken at least every ASYNC_IDLE_MS, the tails of quiet buffers go out meanwhile
+		print_bufs_flush_due();
+	}
+
+	return 0;
+}
+
+// Pins the queue of the log until async_leave, stop frees it only when nobody is inside
+static log_async_t *async_enter(log_t *log)
+{
+	c_atomic_add32(&log->async_users, 1);
+	log_async_t *async = c_atomic_loadp((void *const volatile *)&log->async);
+	if (async == NULL) {
+		c_atomic_add32(&log->async_users, (u32)-1);
+	}
+	return async;
+}
+
+static void async_leave(log_t *log)
+{
+	c_atomic_add32(&log->async_users, (u32)-1);
+}
+
+int log_async_start(size_t size, int overflow)
+{
+	log_t *log = cur_log();
+	if (log == NULL || log->async != NULL || size == 0) {
+		return 1;
+	}
+
+	size_t cap = 1;
+	while (cap < size) {
+		cap <<= 1;
+	}
+
+	log_async_t *async = mem_calloc(1, sizeof(log_async_t));
+	if (async == NULL) {
+		return 1;
+	}
+
+	async->recs = mem_alloc(cap * sizeof(log_rec_t));
+	if (async->recs == NULL) {
+		mem_free(async, sizeof(log_async_t));
+		return 1;
+	}
+
+	for (size_t i = 0; i < cap; i++) {
+		async->recs[i].seq = i;
+	}
+
+	async->log	= log;
+	async->size	= cap;
+	async->overflow = overflow;
+
+	c_mutex_init(&async->mutex);
+	c_cond_init(&async->cond);
+
+	if (c_thread_create(&async->thread, async_drain, async)) {
+		c_cond_free(&async->cond);
+		c_mutex_free(&async->mutex);
+		mem_free(async->recs, cap * sizeof(log_rec_t));
+		mem_free(async, sizeof(log_async_t));
+		return 1;
+	}
+
+	c_atomic_storep((void *volatile *)&log->async, async);
+	return 0;
+}
+
+int log_async_stop()
+{
+	log_t *log = cur_log();
+	if (log == NULL || log->async == NULL || s_drain) {
+		return 1;
+	}
+
+	log_async_t *async = log->async;
+	if (!c_atomic_casp((void *volatile *)&log->async, async, NULL)) {
+		return 1;
+	}
+
+	// Producers that saw the queue finish pushing before the final drain, the ones after it go to the sinks directly
+	while (c_atomic_load32(&log->async_users) != 0) {
+		c_thread_yield();
+	}
+
+	c_atomic_store32(&async->stop, 1);
+	c_mutex_lock(&async->mutex);
+	c_cond_signal(&async->cond);
+	c_mutex_unlock(&async->mutex);
+	c_thread_join(async->thread);
+
+	c_cond_free(&async->cond);
+	c_mutex_free(&async->mutex);
+	mem_free(async->recs, async->size * sizeof(log_rec_t));
+	mem_free(async, sizeof(log_async_t));
+	return 0;
+}
+
+int log_async_dropped(u64 *newest, u64 *oldest)
+{
+	log_t *log = cur_log();
+	log_async_t *async = log == NULL ? NULL : async_enter(log);
+	if (async == NULL) {
+		return 1;
+	}
+
+	if (newest) {
+		*newest = c_atomic_load64(&async->dropped_newest);
+	}
+
+	if (oldest) {
+		*oldest = c_atomic_load64(&async->dropped_oldest);
+	}
+
+	async_leave(log);
+	return 0;
+}
+
+int log_flush()
+{
+	log_t *log = cur_log();
+	log_async_t *async = log == NULL || s_drain ? NULL : async_enter(log);
+	if (async == NULL) {
+		return 0;
+	}
+
+	const u64 target = c_atomic_load64(&async->head);
+	while (c_atomic_load64(&async->done) < target) {
+		c_mutex_lock(&async->mutex);
+		c_cond_signal(&async->cond);
+		c_mutex_unlock(&async->mutex);
+		c_thread_yield();
+	}
+
+	async_leave(log);
 	return 0;
 }
 
 int log_log(int level, const char *pkg, const char *file, const char *func, int line, const char *tag, const char *fmt, ...)
 {
-	if (s_log == NULL || file == NULL || fmt == NULL) {
+	log_t *log = cur_log();
+	if (log == NULL || file == NULL || fmt == NULL) {
 		return 1;
 	}
 
@@ -161,23 +712,22 @@ int log_log(int level, const char *pkg, const char *file, const char *func, int
 		.level = level,
 	};
 
-	if (!s_log->quiet && level >= s_log->level) {
-		init_event(&ev, PRINT_DST_FILE(stderr), 1, s_log->header);
-		va_start(ev.ap, fmt);
-		log_std_cb(&ev);
-		va_end(ev.ap);
-	}
+	int ret = 0;
 
-	for (int i = 0; i < LOG_MAX_CALLBACKS && s_log->callbacks[i].log; i++) {
-		log_callback_t *cb = &s_log->callbacks[i];
-		if (level >= cb->level) {
-			init_event(&ev, cb->print, 0, cb->header);
-			va_start(ev.ap, fmt);
-			cb->print.off += cb->log(&ev);
-			va_end(ev.ap);
+	va_list ap;
+	va_start(ap, fmt);
+	log_async_t *async = s_drain ? NULL : async_enter(log);
+	if (async != NULL) {
+		if (accepts(log, level)) {
+			ret = async_push(async, &ev, ap);
 		}
+		async_leave(log);
+	} else {
+		dispatch(log, &ev, ap);
 	}
-	return 0;
+	va_end(ap);
+
+	return ret;
 }
 
 const char *log_strerror(int errnum)
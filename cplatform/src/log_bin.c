@@ -0,0 +1,728 @@
+#include "log_bin.h"
+
+#include "mem.h"
+#include "platform.h"
+
+#include <string.h>
+
+#define BIN_MAGIC     "CPLOGBIN"
+#define BIN_ORDER     0x01020304
+#define BIN_SITE_TEXT 0xFF
+#define BIN_SITE_OVER U32_MAX
+#define BIN_STR_NULL  U32_MAX
+
+enum { REC_SITE = 'S', REC_EVENT = 'E' };
+
+enum {
+	ARG_INT,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_SIZE,
+	ARG_INTMAX,
+	ARG_PTRDIFF,
+	ARG_DOUBLE,
+	ARG_LDOUBLE,
+	ARG_PTR,
+	ARG_STR,
+	ARG_WINT,
+	ARG_WSTR,
+	ARG_NONE,
+};
+
+enum { PREC_NONE = -1, PREC_ARG = -2 };
+
+typedef struct spec_s {
+	size_t len;
+	int width_arg;
+	int prec_arg;
+	int prec;
+	int type;
+} spec_t;
+
+typedef struct bin_buf_s {
+	FILE *file;
+	size_t len;
+	size_t total;
+	u8 data[1024];
+} bin_buf_t;
+
+typedef struct dsite_s {
+	char *strs[5];
+	int line;
+	u8 args;
+} dsite_t;
+
+enum { DSTR_FMT, DSTR_PKG, DSTR_FILE, DSTR_FUNC, DSTR_TAG };
+
+// Parses a conversion starting at '%', type is -1 for "%%"
+static int parse_spec(const char *fmt, spec_t *spec)
+{
+	const char *c = fmt + 1;
+
+	*spec = (spec_t){
+		.prec = PREC_NONE,
+		.type = -1,
+	};
+
+	if (*c == '%') {
+		spec->len = 2;
+		return 0;
+	}
+
+	while (*c == '-' || *c == '+' || *c == ' ' || *c == '#' || *c == '0') {
+		c++;
+	}
+
+	if (*c == '*') {
+		spec->width_arg = 1;
+		c++;
+	} else {
+		while (*c >= '0' && *c <= '9') {
+			c++;
+		}
+		if (*c == '$') {
+			return 1;
+		}
+	}
+
+	if (*c == '.') {
+		c++;
+		if (*c == '*') {
+			spec->prec_arg = 1;
+			spec->prec     = PREC_ARG;
+			c++;
+		} else {
+			spec->prec = 0;
+			while (*c >= '0' && *c <= '9') {
+				spec->prec = spec->prec * 10 + (*c - '0');
+				c++;
+			}
+		}
+	}
+
+	int len = 0;
+	switch (*c) {
+	case 'h':
+		c += c[1] == 'h' ? 2 : 1;
+		break;
+	case 'l':
+		if (c[1] == 'l') {
+			len = 'q';
+			c += 2;
+		} else {
+			len = 'l';
+			c++;
+		}
+		break;
+	case 'z':
+	case 'j':
+	case 't':
+	case 'L': len = *c++; break;
+	default: break;
+	}
+
+	switch (*c) {
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		switch (len) {
+		case 'l': spec->type = ARG_LONG; break;
+		case 'q': spec->type = ARG_LLONG; break;
+		case 'z': spec->type = ARG_SIZE; break;
+		case 'j': spec->type = ARG_INTMAX; break;
+		case 't': spec->type = ARG_PTRDIFF; break;
+		default: spec->type = ARG_INT; break;
+		}
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A': spec->type = len == 'L' ? ARG_LDOUBLE : ARG_DOUBLE; break;
+	case 'c': spec->type = len == 'l' ? ARG_WINT : ARG_INT; break;
+	case 's': spec->type = len == 'l' ? ARG_WSTR : ARG_STR; break;
+	case 'p': spec->type = ARG_PTR; break;
+	case 'n': spec->type = ARG_NONE; break;
+	default: return 1;
+	}
+
+	spec->len = (size_t)(c - fmt) + 1;
+	return 0;
+}
+
+static void site_compile(log_bin_site_t *site)
+{
+	site->args = 0;
+
+	for (const char *c = site->fmt; *c; c++) {
+		if (*c != '%') {
+			continue;
+		}
+
+		spec_t spec;
+		if (parse_spec(c, &spec)) {
+			site->args = BIN_SITE_TEXT;
+			return;
+		}
+
+		c += spec.len - 1;
+		if (spec.type < 0) {
+			continue;
+		}
+
+		// Its bytes are not portable between platforms and a double loses digits, the text is kept instead
+		if (spec.type == ARG_LDOUBLE) {
+			site->args = BIN_SITE_TEXT;
+			return;
+		}
+
+		if (site->args + spec.width_arg + spec.prec_arg + 1 > LOG_BIN_MAX_ARGS) {
+			site->args = BIN_SITE_TEXT;
+			return;
+		}
+
+		if (spec.width_arg) {
+			site->precs[site->args]	  = PREC_NONE;
+			site->types[site->args++] = ARG_INT;
+		}
+		if (spec.prec_arg) {
+			site->precs[site->args]	  = PREC_NONE;
+			site->types[site->args++] = ARG_INT;
+		}
+		site->precs[site->args]	  = (s16)spec.prec;
+		site->types[site->args++] = (u8)spec.type;
+	}
+}
+
+static void bin_flush(bin_buf_t *buf)
+{
+	if (buf->len > 0) {
+		fwrite(buf->data, 1, buf->len, buf->file);
+		buf->len = 0;
+	}
+}
+
+static void bin_write(bin_buf_t *buf, const void *data, size_t size)
+{
+	buf->total += size;
+
+	if (buf->len + size > sizeof(buf->data)) {
+		bin_flush(buf);
+		if (size > sizeof(buf->data)) {
+			fwrite(data, 1, size, buf->file);
+			return;
+		}
+	}
+
+	memcpy(&buf->data[buf->len], data, size);
+	buf->len += size;
+}
+
+static void bin_write_u8(bin_buf_t *buf, u8 val)
+{
+	bin_write(buf, &val, sizeof(val));
+}
+
+static void bin_write_u32(bin_buf_t *buf, u32 val)
+{
+	bin_write(buf, &val, sizeof(val));
+}
+
+static void bin_write_u64(bin_buf_t *buf, u64 val)
+{
+	bin_write(buf, &val, sizeof(val));
+}
+
+static void bin_write_str(bin_buf_t *buf, const char *str, size_t max)
+{
+	if (str == NULL) {
+		bin_write_u32(buf, BIN_STR_NULL);
+		return;
+	}
+
+	size_t len = 0;
+	while (len < max && str[len]) {
+		len++;
+	}
+
+	bin_write_u32(buf, (u32)len);
+	bin_write(buf, str, len);
+}
+
+static void bin_write_site(bin_buf_t *buf, const log_bin_site_t *site)
+{
+	bin_write_u8(buf, REC_SITE);
+	bin_write_u32(buf, site->id);
+	bin_write_u8(buf, site->args == BIN_SITE_TEXT ? BIN_SITE_TEXT : 0);
+	bin_write_u32(buf, (u32)site->line);
+	bin_write_str(buf, site->fmt, (size_t)-1);
+	bin_write_str(buf, site->pkg, (size_t)-1);
+	bin_write_str(buf, site->file, (size_t)-1);
+	bin_write_str(buf, site->func, (size_t)-1);
+	bin_write_str(buf, site->tag, (size_t)-1);
+}
+
+static void bin_write_args(bin_buf_t *buf, const log_bin_site_t *site, va_list ap)
+{
+	int prev = 0;
+
+	for (u8 i = 0; i < site->args; i++) {
+		switch (site->types[i]) {
+		case ARG_INT:
+			prev = va_arg(ap, int);
+			bin_write_u64(buf, (u64)(s64)prev);
+			break;
+		case ARG_LONG: bin_write_u64(buf, (u64)va_arg(ap, long)); break;
+		case ARG_LLONG: bin_write_u64(buf, (u64)va_arg(ap, long long)); break;
+		case ARG_SIZE: bin_write_u64(buf, (u64)va_arg(ap, size_t)); break;
+		case ARG_INTMAX: bin_write_u64(buf, (u64)va_arg(ap, intmax_t)); break;
+		case ARG_PTRDIFF: bin_write_u64(buf, (u64)va_arg(ap, ptrdiff_t)); break;
+		case ARG_PTR: bin_write_u64(buf, (u64)(uintptr_t)va_arg(ap, void *)); break;
+		case ARG_WINT: bin_write_u64(buf, (u64)va_arg(ap, int)); break;
+		case ARG_NONE: va_arg(ap, void *); break;
+		case ARG_DOUBLE: {
+			double val = va_arg(ap, double);
+			bin_write(buf, &val, sizeof(val));
+			break;
+		}
+		case ARG_STR: {
+			size_t max = (size_t)-1;
+			if (site->precs[i] >= 0) {
+				max = (size_t)site->precs[i];
+			} else if (site->precs[i] == PREC_ARG && prev >= 0) {
+				max = (size_t)prev;
+			}
+			bin_write_str(buf, va_arg(ap, const char *), max);
+			break;
+		}
+		case ARG_WSTR: {
+			const wchar *str = va_arg(ap, const wchar *);
+			if (str == NULL) {
+				bin_write_u32(buf, BIN_STR_NULL);
+				break;
+			}
+			size_t len = wcslen(str);
+			bin_write_u32(buf, (u32)len);
+			bin_write(buf, str, len * sizeof(wchar));
+			break;
+		}
+		default: break;
+		}
+	}
+}
+
+static u32 site_hash(const log_event_t *ev)
+{
+	uintptr_t h = (uintptr_t)ev->fmt ^ ((uintptr_t)ev->func << 7) ^ ((uintptr_t)ev->line * 2654435761u);
+	h ^= h >> 17;
+	h *= 0x9e3779b1u;
+	h ^= h >> 13;
+	return (u32)h;
+}
+
+static int site_eq(const log_bin_site_t *site, const log_event_t *ev)
+{
+	return site->fmt == ev->fmt && site->line == ev->line && site->func == ev->func && site->file == ev->file && site->pkg == ev->pkg &&
+	       site->tag == ev->tag;
+}
+
+log_bin_t *log_bin_init(log_bin_t *bin, FILE *file)
+{
+	if (bin == NULL || file == NULL) {
+		return NULL;
+	}
+
+	mem_set(bin, 0, sizeof(log_bin_t));
+	bin->file = file;
+	c_mutex_init(&bin->mutex);
+
+	const u32 order = BIN_ORDER;
+	fwrite(BIN_MAGIC, 1, sizeof(BIN_MAGIC) - 1, file);
+	fwrite(&order, sizeof(order), 1, file);
+
+	return bin;
+}
+
+int log_bin_free(log_bin_t *bin)
+{
+	if (bin == NULL) {
+		return 1;
+	}
+
+	c_fflush(bin->file);
+	c_mutex_free(&bin->mutex);
+	return 0;
+}
+
+int log_bin_cb(log_event_t *ev)
+{
+	log_bin_t *bin = ev->print.priv;
+	if (bin == NULL || bin->file == NULL) {
+		return 0;
+	}
+
+	c_mutex_lock(&bin->mutex);
+
+	bin_buf_t buf = {
+		.file = bin->file,
+	};
+
+	log_bin_site_t *site = NULL;
+	log_bin_site_t over;
+
+	u32 i = site_hash(ev) & (LOG_BIN_MAX_SITES - 1);
+	while (bin->sites[i].fmt != NULL && !site_eq(&bin->sites[i], ev)) {
+		i = (i + 1) & (LOG_BIN_MAX_SITES - 1);
+	}
+
+	if (bin->sites[i].fmt != NULL) {
+		site = &bin->sites[i];
+	} else {
+		if (bin->sites_cnt < LOG_BIN_MAX_SITES - 1) {
+			site = &bin->sites[i];
+			site->id = bin->sites_cnt++;
+		} else {
+			site	 = &over;
+			site->id = BIN_SITE_OVER;
+		}
+
+		site->fmt  = ev->fmt;
+		site->pkg  = ev->pkg;
+		site->file = ev->file;
+		site->func = ev->func;
+		site->tag  = ev->tag;
+		site->line = ev->line;
+		site_compile(site);
+		if (site->id == BIN_SITE_OVER) {
+			site->args = BIN_SITE_TEXT;
+		}
+		bin_write_site(&buf, site);
+	}
+
+	bin_write_u8(&buf, REC_EVENT);
+	bin_write_u32(&buf, site->id);
+	bin_write_u8(&buf, (u8)ev->level);
+	bin_write_u8(&buf, (u8)ev->header);
+	bin_write_u64(&buf, ev->timestamp);
+
+	if (site->args == BIN_SITE_TEXT) {
+		char text[LOG_ASYNC_MSG_SIZE] = { 0 };
+		c_sprintv(text, sizeof(text), 0, ev->fmt, ev->ap);
+		bin_write_str(&buf, text, sizeof(text));
+	} else {
+		bin_write_args(&buf, site, ev->ap);
+	}
+
+	bin_flush(&buf);
+
+	c_mutex_unlock(&bin->mutex);
+	return (int)buf.total;
+}
+
+static int bin_read(FILE *file, void *data, size_t size)
+{
+	return size > 0 && fread(data, size, 1, file) != 1;
+}
+
+static int bin_read_str(FILE *file, char **str, u32 *len)
+{
+	if (bin_read(file, len, sizeof(*len))) {
+		return 1;
+	}
+
+	if (*len == BIN_STR_NULL) {
+		*str = NULL;
+		return 0;
+	}
+
+	*str = mem_alloc((size_t)*len + 1);
+	if (*str == NULL) {
+		return 1;
+	}
+
+	if (bin_read(file, *str, *len)) {
+		mem_free(*str, (size_t)*len + 1);
+		*str = NULL;
+		return 1;
+	}
+
+	(*str)[*len] = '\0';
+	return 0;
+}
+
+static void str_free(char *str)
+{
+	if (str != NULL) {
+		mem_free(str, strlen(str) + 1);
+	}
+}
+
+static void dsite_free(dsite_t *site)
+{
+	for (int i = 0; i < 5; i++) {
+		str_free(site->strs[i]);
+		site->strs[i] = NULL;
+	}
+}
+
+static int decode_site(FILE *file, dsite_t *sites, dsite_t *over)
+{
+	u32 id;
+	u32 line;
+	u8 flags;
+	if (bin_read(file, &id, sizeof(id)) || bin_read(file, &flags, sizeof(flags)) || bin_read(file, &line, sizeof(line))) {
+		return 1;
+	}
+
+	if (id != BIN_SITE_OVER && id >= LOG_BIN_MAX_SITES) {
+		return 1;
+	}
+
+	dsite_t *site = id == BIN_SITE_OVER ? over : &sites[id];
+	dsite_free(site);
+
+	site->line = (int)line;
+	site->args = flags;
+
+	for (int i = 0; i < 5; i++) {
+		u32 len;
+		if (bin_read_str(file, &site->strs[i], &len)) {
+			return 1;
+		}
+	}
+
+	return site->strs[DSTR_FMT] == NULL;
+}
+
+#define PRINT_ARG(_val)                                                                     \
+	(stars == 0 ? dprintf(dst, spec_buf, _val) :                                        \
+	 stars == 1 ? dprintf(dst, spec_buf, star[0], _val) :                               \
+		      dprintf(dst, spec_buf, star[0], star[1], _val))
+
+static int decode_args(FILE *file, const char *fmt, print_dst_t dst)
+{
+	int off = dst.off;
+
+	const char *c = fmt;
+	while (*c) {
+		const char *lit = c;
+		while (*c && *c != '%') {
+			c++;
+		}
+		if (c > lit) {
+			dst.off += dprintf(dst, "%.*s", (int)(c - lit), lit);
+		}
+		if (*c == '\0') {
+			break;
+		}
+
+		spec_t spec;
+		if (parse_spec(c, &spec)) {
+			return -1;
+		}
+
+		char spec_buf[64] = { 0 };
+		if (spec.len >= sizeof(spec_buf)) {
+			return -1;
+		}
+		memcpy(spec_buf, c, spec.len);
+		c += spec.len;
+
+		if (spec.type < 0) {
+			dst.off += dprintf(dst, "%%");
+			continue;
+		}
+
+		int star[2];
+		int stars = 0;
+		for (int i = 0; i < spec.width_arg + spec.prec_arg; i++) {
+			u64 val;
+			if (bin_read(file, &val, sizeof(val))) {
+				return -1;
+			}
+			star[stars++] = (int)(s64)val;
+		}
+
+		int ret = 0;
+		switch (spec.type) {
+		case ARG_DOUBLE:
+		case ARG_LDOUBLE: {
+			// Long doubles are only here in files written before they were kept as text
+			double val;
+			if (bin_read(file, &val, sizeof(val))) {
+				return -1;
+			}
+			ret = spec.type == ARG_DOUBLE ? PRINT_ARG(val) : PRINT_ARG((long double)val);
+			break;
+		}
+		case ARG_STR: {
+			char *str;
+			u32 len;
+			if (bin_read_str(file, &str, &len)) {
+				return -1;
+			}
+			ret = PRINT_ARG(str);
+			if (str != NULL) {
+				mem_free(str, (size_t)len + 1);
+			}
+			break;
+		}
+		case ARG_WSTR: {
+			u32 len;
+			if (bin_read(file, &len, sizeof(len))) {
+				return -1;
+			}
+			if (len == BIN_STR_NULL) {
+				ret = PRINT_ARG((wchar *)NULL);
+				break;
+			}
+			wchar *str = mem_alloc(((size_t)len + 1) * sizeof(wchar));
+			if (str == NULL || bin_read(file, str, len * sizeof(wchar))) {
+				if (str != NULL) {
+					mem_free(str, ((size_t)len + 1) * sizeof(wchar));
+				}
+				return -1;
+			}
+			str[len] = L'\0';
+			ret	 = PRINT_ARG(str);
+			mem_free(str, ((size_t)len + 1) * sizeof(wchar));
+			break;
+		}
+		case ARG_NONE: break;
+		default: {
+			u64 val;
+			if (bin_read(file, &val, sizeof(val))) {
+				return -1;
+			}
+			switch (spec.type) {
+			case ARG_INT: ret = PRINT_ARG((int)val); break;
+			case ARG_LONG: ret = PRINT_ARG((long)val); break;
+			case ARG_LLONG: ret = PRINT_ARG((long long)val); break;
+			case ARG_SIZE: ret = PRINT_ARG((size_t)val); break;
+			case ARG_INTMAX: ret = PRINT_ARG((intmax_t)val); break;
+			case ARG_PTRDIFF: ret = PRINT_ARG((ptrdiff_t)val); break;
+			case ARG_PTR: ret = PRINT_ARG((void *)(uintptr_t)val); break;
+			case ARG_WINT: ret = PRINT_ARG((wint_t)val); break;
+			default: break;
+			}
+			break;
+		}
+		}
+		dst.off += ret;
+	}
+
+	return dst.off - off;
+}
+
+static int decode_event(FILE *file, const dsite_t *sites, const dsite_t *over, print_dst_t *dst)
+{
+	u32 id;
+	u8 level;
+	u8 header;
+	u64 timestamp;
+	if (bin_read(file, &id, sizeof(id)) || bin_read(file, &level, sizeof(level)) || bin_read(file, &header, sizeof(header)) ||
+	    bin_read(file, &timestamp, sizeof(timestamp))) {
+		return 1;
+	}
+
+	if ((id != BIN_SITE_OVER && id >= LOG_BIN_MAX_SITES) || level > LOG_FATAL) {
+		return 1;
+	}
+
+	const dsite_t *site = id == BIN_SITE_OVER ? over : &sites[id];
+	if (site->strs[DSTR_FMT] == NULL) {
+		return 1;
+	}
+
+	const char *tag_s = "";
+	const char *tag_e = "";
+	const char *tag	  = "";
+	if (site->strs[DSTR_TAG] != NULL) {
+		tag_s = "[";
+		tag_e = "] ";
+		tag   = site->strs[DSTR_TAG];
+	}
+
+	if (header) {
+		char time[C_TIME_BUF_SIZE] = { 0 };
+		c_time_fmt(time, timestamp);
+		dst->off += dprintf(*dst, "%s %-5s [%s:%s] %s:%d: %s%s%s", time, log_level_str(level), site->strs[DSTR_PKG], site->strs[DSTR_FILE],
+				    site->strs[DSTR_FUNC], site->line, tag_s, tag, tag_e);
+	} else {
+		dst->off += dprintf(*dst, "%s%s%s", tag_s, tag, tag_e);
+	}
+
+	if (site->args == BIN_SITE_TEXT) {
+		char *text;
+		u32 len;
+		if (bin_read_str(file, &text, &len)) {
+			return 1;
+		}
+		dst->off += dprintf(*dst, "%s", text);
+		if (text != NULL) {
+			mem_free(text, (size_t)len + 1);
+		}
+	} else {
+		int ret = decode_args(file, site->strs[DSTR_FMT], *dst);
+		if (ret < 0) {
+			return 1;
+		}
+		dst->off += ret;
+	}
+
+	dst->off += dprintf(*dst, "\n");
+	return 0;
+}
+
+int log_bin_decode(FILE *file, print_dst_t dst)
+{
+	if (file == NULL) {
+		return 1;
+	}
+
+	char magic[sizeof(BIN_MAGIC) - 1];
+	u32 order;
+	if (bin_read(file, magic, sizeof(magic)) || mem_cmp(magic, BIN_MAGIC, sizeof(magic)) || bin_read(file, &order, sizeof(order)) ||
+	    order != BIN_ORDER) {
+		log_error("cplatform", "log_bin", NULL, "invalid binary log");
+		return 1;
+	}
+
+	dsite_t *sites = mem_calloc(LOG_BIN_MAX_SITES, sizeof(dsite_t));
+	if (sites == NULL) {
+		return 1;
+	}
+
+	dsite_t over = { 0 };
+
+	int ret = 0;
+	int type;
+	while ((type = fgetc(file)) != EOF) {
+		if (type == REC_SITE) {
+			ret = decode_site(file, sites, &over);
+		} else if (type == REC_EVENT) {
+			ret = decode_event(file, sites, &over, &dst);
+		} else {
+			ret = 1;
+		}
+
+		if (ret) {
+			log_error("cplatform", "log_bin", NULL, "corrupted binary log");
+			break;
+		}
+	}
+
+	for (int i = 0; i < LOG_BIN_MAX_SITES; i++) {
+		dsite_free(&sites[i]);
+	}
+	dsite_free(&over);
+	mem_free(sites, LOG_BIN_MAX_SITES * sizeof(dsite_t));
+
+	return ret;
+}
@@ -1,17 +1,198 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include "mem.h"
 
+#include "c_thread.h"
 #include "log.h"
+#include "mem_dom.h"
+#include "mem_priv.h"
+#include "mem_prof.h"
+#include "mem_trace.h"
 #include "platform.h"
 
 #include <memory.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#if defined(C_WIN)
+#else
+	#include <unistd.h>
+#endif
+
+// Growth of a thread since its last fold that triggers one, bounds the peak error to MEM_FOLD_SIZE per thread
+#define MEM_FOLD_SIZE (64 * 1024)
+
+enum {
+	SHARD_MEM,
+	SHARD_TOTAL,
+	SHARD_ALLOCS,
+	SHARD_REALLOCS,
+	SHARD_ARENA_MEM,
+	SHARD_ARENA_CHUNKS,
+	SHARD_POOL_MEM,
+	SHARD_POOL_USED,
+	SHARD_POOL_LIVE,
+	SHARD_POOL_SLABS,
+	SHARD_MAP_MEM,
+	SHARD_MAPS,
+	// Hits, misses and cached bytes of every size class
+	SHARD_CLASSES,
+	__SHARD_MAX = SHARD_CLASSES + MEM_CLASSES * 3,
+};
+
+// Running totals of one thread, written only by it with plain stores and folded into s_mem
+// lazily. Shards are never freed, the one of an exited thread is taken by the next new one
+typedef struct mem_shard_s mem_shard_t;
+struct mem_shard_s {
+	volatile u64 vals[__SHARD_MAX];
+	u64 folded[__SHARD_MAX];
+	mem_shard_t *next;
+	volatile u32 used;
+	char pad[MEM_CACHE_LINE];
+};
+
 static mem_t *s_mem;
 static int s_oom;
+static mem_shard_t *s_shards;
+static volatile u32 s_fold_lock;
+
+static C_THREAD_LOCAL mem_shard_t *s_shard;
+static C_THREAD_LOCAL s64 s_grown;
+
+static mem_t *cur_mem()
+{
+	return c_atomic_loadp((void *const volatile *)&s_mem);
+}
+
+// Held while walking all threads, waiters give up the processor instead of spinning on it
+static void fold_lock()
+{
+	while (!c_atomic_cas32(&s_fold_lock, 0, 1)) {
+		c_thread_yield();
+	}
+}
+
+static void fold_unlock()
+{
+	c_atomic_store32(&s_fold_lock, 0);
+}
+
+#define MAX(a, b) (a) > (b) ? (a) : (b)
+
+// Moves what the shards gained since the last fold into mem, or drops it if mem is NULL
+static void fold(mem_t *mem)
+{
+	u64 vals[__SHARD_MAX] = { 0 };
+
+	mem_shard_t *sh = c_atomic_loadp((void *const volatile *)&s_shards);
+	for (; sh != NULL; sh = sh->next) {
+		for (int j = 0; j < __SHARD_MAX; j++) {
+			const u64 cur = c_atomic_load64(&sh->vals[j]);
+			vals[j] += cur - sh->folded[j];
+			sh->folded[j] = cur;
+		}
+	}
+
+	if (mem == NULL) {
+		return;
+	}
+
+	mem->mem += (size_t)vals[SHARD_MEM];
+	mem->peak = MAX(mem->mem, mem->peak);
+	mem->total += (size_t)vals[SHARD_TOTAL];
+	mem->allocs += (uint)vals[SHARD_ALLOCS];
+	mem->reallocs += (uint)vals[SHARD_REALLOCS];
+	mem->arena_mem += (size_t)vals[SHARD_ARENA_MEM];
+	mem->arena_peak = MAX(mem->arena_mem, mem->arena_peak);
+	mem->arena_chunks += (uint)vals[SHARD_ARENA_CHUNKS];
+	mem->pool_mem += (size_t)vals[SHARD_POOL_MEM];
+	mem->pool_used += (size_t)vals[SHARD_POOL_USED];
+	mem->pool_live += (size_t)vals[SHARD_POOL_LIVE];
+	mem->pool_slabs += (uint)vals[SHARD_POOL_SLABS];
+	mem->map_mem += (size_t)vals[SHARD_MAP_MEM];
+	mem->maps += (uint)vals[SHARD_MAPS];
+
+	for (int i = 0; i < MEM_CLASSES; i++) {
+		mem_class_t *cls = &mem->classes[i];
+		cls->size	 = mem_cache_size(i);
+		cls->hits += (size_t)vals[SHARD_CLASSES + i * 3];
+		cls->misses += (size_t)vals[SHARD_CLASSES + i * 3 + 1];
+		cls->cached += (size_t)vals[SHARD_CLASSES + i * 3 + 2];
+	}
+}
+
+static void mem_fold()
+{
+	fold_lock();
+	fold(cur_mem());
+	fold_unlock();
+}
+
+static mem_shard_t *shard_new()
+{
+	mem_shard_t *sh = c_atomic_loadp((void *const volatile *)&s_shards);
+	for (; sh != NULL; sh = sh->next) {
+		if (c_atomic_load32(&sh->used) == 0 && c_atomic_cas32(&sh->used, 0, 1)) {
+			return sh;
+		}
+	}
+
+	// Not counted anywhere, allocating it here would count itself
+	sh = calloc(1, sizeof(mem_shard_t));
+	if (sh == NULL) {
+		return NULL;
+	}
+
+	sh->used = 1;
+	do {
+		sh->next = c_atomic_loadp((void *const volatile *)&s_shards);
+	} while (!c_atomic_casp((void *volatile *)&s_shards, sh->next, sh));
+
+	return sh;
+}
+
+static mem_shard_t *shard()
+{
+	if (s_shard == NULL) {
+		s_shard = shard_new();
+	}
+	return s_shard;
+}
+
+void mem_stat_release()
+{
+	if (s_shard != NULL) {
+		mem_shard_t *sh = s_shard;
+		s_shard		= NULL;
+		s_grown		= 0;
+		c_atomic_store32(&sh->used, 0);
+	}
+}
+
+// Only this thread writes its shard, folding once it grew by MEM_FOLD_SIZE so the peaks stay close
+static void shard_add(mem_shard_t *sh, int val, u64 delta)
+{
+	if (sh == NULL) {
+		return;
+	}
+
+	c_atomic_store64(&sh->vals[val], sh->vals[val] + delta);
+	if (val == SHARD_MEM || val == SHARD_ARENA_MEM) {
+		s_grown += (s64)delta;
+		if (s_grown > MEM_FOLD_SIZE) {
+			s_grown = 0;
+			mem_fold();
+		}
+	}
+}
 
 mem_t *mem_init(mem_t *mem)
 {
-	s_mem = mem;
+	fold_lock();
+	fold(s_mem);
+	c_atomic_storep((void *volatile *)&s_mem, mem);
+	fold_unlock();
+
 	s_oom = 0;
 
 	return mem;
@@ -19,13 +200,25 @@ mem_t *mem_init(mem_t *mem)
 
 mem_t *mem_sset(mem_t *mem)
 {
-	s_mem = mem;
+	fold_lock();
+	fold(s_mem);
+	c_atomic_storep((void *volatile *)&s_mem, mem);
+	fold_unlock();
+
 	return mem;
 }
 
 const mem_t *mem_get()
 {
-	return s_mem;
+	mem_cache_publish();
+	mem_fold();
+
+	mem_t *mem = cur_mem();
+	if (mem != NULL) {
+		mem->map_resident = mem->maps > 0 ? mem_map_resident() : 0;
+	}
+
+	return mem;
 }
 
 static void get_max_unit(size_t *size, char *u)
@@ -62,7 +255,8 @@ static int print_mem(size_t mem, print_dst_t dst)
 
 int mem_print(print_dst_t dst)
 {
-	if (s_mem == NULL) {
+	const mem_t *mem = mem_get();
+	if (mem == NULL) {
 		return 0;
 	}
 
@@ -70,76 +264,228 @@ int mem_print(print_dst_t dst)
 
 	dst.off += dprintf(dst, "memory stats:\n");
 	dst.off += dprintf(dst, "    unfreed:  ");
-	dst.off += print_mem(s_mem->mem, dst);
+	dst.off += print_mem(mem->mem, dst);
 	dst.off += dprintf(dst, "    peak:     ");
-	dst.off += print_mem(s_mem->peak, dst);
+	dst.off += print_mem(mem->peak, dst);
 	dst.off += dprintf(dst, "    total:    ");
-	dst.off += print_mem(s_mem->total, dst);
-	dst.off += dprintf(dst, "    allocs:   %d\n", s_mem->allocs);
-	dst.off += dprintf(dst, "    reallocs: %d\n", s_mem->reallocs);
+	dst.off += print_mem(mem->total, dst);
+	dst.off += dprintf(dst, "    allocs:   %d\n", mem->allocs);
+	dst.off += dprintf(dst, "    reallocs: %d\n", mem->reallocs);
+
+	if (mem->arena_peak > 0) {
+		dst.off += dprintf(dst, "arena stats:\n");
+		dst.off += dprintf(dst, "    used:     ");
+		dst.off += print_mem(mem->arena_mem, dst);
+		dst.off += dprintf(dst, "    peak:     ");
+		dst.off += print_mem(mem->arena_peak, dst);
+		dst.off += dprintf(dst, "    chunks:   %d\n", mem->arena_chunks);
+	}
+
+	if (mem->pool_slabs > 0) {
+		const size_t frag = (mem->pool_mem - mem->pool_used) * 100 / mem->pool_mem;
+		dst.off += dprintf(dst, "pool stats:\n");
+		dst.off += dprintf(dst, "    slabs:    %d\n", mem->pool_slabs);
+		dst.off += dprintf(dst, "    memory:   ");
+		dst.off += print_mem(mem->pool_mem, dst);
+		dst.off += dprintf(dst, "    live:     %zu\n", mem->pool_live);
+		dst.off += dprintf(dst, "    frag:     %zu%%\n", frag);
+	}
+
+	if (mem->maps > 0) {
+		dst.off += dprintf(dst, "map stats:\n");
+		dst.off += dprintf(dst, "    maps:     %d\n", mem->maps);
+		dst.off += dprintf(dst, "    mapped:   ");
+		dst.off += print_mem(mem->map_mem, dst);
+		dst.off += dprintf(dst, "    resident: ");
+		dst.off += print_mem(mem->map_resident, dst);
+	}
+
+	int cached = 0;
+	for (int i = 0; i < MEM_CLASSES && !cached; i++) {
+		cached = mem->classes[i].hits > 0 || mem->classes[i].misses > 0;
+	}
+
+	if (cached) {
+		dst.off += dprintf(dst, "cache stats:\n");
+		for (int i = 0; i < MEM_CLASSES; i++) {
+			const mem_class_t *cls = &mem->classes[i];
+			if (cls->hits == 0 && cls->misses == 0) {
+				continue;
+			}
+			dst.off += dprintf(dst, "    %4zu B: hits: %zu, misses: %zu, cached: %zu B\n", cls->size, cls->hits, cls->misses, cls->cached);
+		}
+	}
+
+	dst.off += mem_dom_print(dst);
+
+	if (mem_prof_active()) {
+		dst.off += mem_prof_print(dst, MEM_PROF_TOP);
+	}
 
 	return dst.off - off;
 }
 
 int mem_check()
 {
-	if (s_mem->mem == 0) {
+	const mem_t *mem = mem_get();
+	if (mem->mem == 0) {
 		return 0;
 	}
 
-	log_warn("cutils", "mem", NULL, "%d bytes were not freed", s_mem->mem);
+	log_warn("cutils", "mem", NULL, "%d bytes were not freed", mem->mem);
 	return 1;
 }
 
-#define MAX(a, b) (a) > (b) ? (a) : (b)
+// Misses are allocated with the size of their class, so any of them can be cached
+static void *cache_alloc(int cls)
+{
+	void *ptr = mem_cache_get(cls);
+	if (ptr != NULL) {
+		return ptr;
+	}
 
-void *mem_alloc(size_t size)
+	return malloc(mem_cache_size(cls));
+}
+
+// Large blocks get their own mapping once it is enabled
+static void *block_alloc(size_t size)
+{
+	// Rounded up to their class only while caching, so they can be cached when freed
+	const int cls = mem_cache_on() ? mem_cache_class(size) : -1;
+	if (cls >= 0) {
+		return cache_alloc(cls);
+	}
+
+	return mem_map_use(size) ? mem_map_alloc(size, 0) : malloc(size);
+}
+
+// count * size would wrap and hand out a block smaller than asked for
+static int calloc_overflows(size_t count, size_t size)
+{
+	if (size != 0 && count > SIZE_MAX / size) {
+		log_error("cutils", "mem", NULL, "out of memory: calloc %zu x %zu bytes", count, size);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *block_calloc(size_t count, size_t size)
+{
+	const int cls = mem_cache_on() ? mem_cache_class(count * size) : -1;
+	if (cls >= 0) {
+		void *ptr = cache_alloc(cls);
+		return ptr == NULL ? NULL : memset(ptr, 0, count * size);
+	}
+
+	return mem_map_use(count * size) ? mem_map_alloc(count * size, 1) : calloc(count, size);
+}
+
+static void *block_realloc(void *memory, size_t new_size, size_t old_size)
+{
+	if (mem_map_has(memory, old_size)) {
+		return mem_map_realloc(memory, new_size, old_size);
+	}
+
+	if (mem_map_use(new_size)) {
+		void *ptr = mem_map_alloc(new_size, 0);
+		if (ptr != NULL) {
+			memcpy(ptr, memory, old_size < new_size ? old_size : new_size);
+			free(memory);
+		}
+		return ptr;
+	}
+
+	// Blocks keep the size of their class while caching, so they can be cached when freed
+	const int cls = mem_cache_on() ? mem_cache_class(new_size) : -1;
+	return realloc(memory, cls >= 0 ? mem_cache_size(cls) : new_size);
+}
+
+void *mem_alloc_at(size_t size, const char *file, int line, const char *func)
 {
 	if (size == 0) {
 		log_warn("cutils", "mem", NULL, "malloc 0 bytes");
 	}
 
-	void *ptr = size > 0 && s_oom ? NULL : malloc(size);
+	mem_dom_t *dom = mem_dom_get();
+	if (dom != NULL && mem_dom_charge(dom, size, 1)) {
+		return NULL;
+	}
+
+	void *ptr = size > 0 && s_oom ? NULL : block_alloc(size);
 
 	if (ptr == NULL) {
+		mem_dom_uncharge(dom, size);
 		log_error("cutils", "mem", NULL, "out of memory");
 		return NULL;
 	}
 
-	if (s_mem) {
-		s_mem->mem += size;
-		s_mem->peak = MAX(s_mem->mem, s_mem->peak);
-		s_mem->total += size;
-		s_mem->allocs++;
+	if (cur_mem()) {
+		mem_shard_t *sh = shard();
+		shard_add(sh, SHARD_TOTAL, size);
+		shard_add(sh, SHARD_ALLOCS, 1);
+		shard_add(sh, SHARD_MEM, size);
 	}
 
+	if (mem_prof_sample(size)) {
+		mem_prof_alloc(ptr, size, file, line, func);
+	}
+
+	mem_trace_alloc(MEM_TRACE_ALLOC, ptr, size);
+
 	return ptr;
 }
 
-void *mem_calloc(size_t count, size_t size)
+void *mem_alloc(size_t size)
+{
+	return mem_alloc_at(size, NULL, 0, NULL);
+}
+
+void *mem_calloc_at(size_t count, size_t size, const char *file, int line, const char *func)
 {
 	if (size == 0) {
 		log_warn("cutils", "mem", NULL, "calloc 0 bytes");
 	}
 
-	void *ptr = count * size > 0 && s_oom ? NULL : calloc(count, size);
+	if (calloc_overflows(count, size)) {
+		return NULL;
+	}
+
+	mem_dom_t *dom = mem_dom_get();
+	if (dom != NULL && mem_dom_charge(dom, count * size, 1)) {
+		return NULL;
+	}
+
+	void *ptr = count * size > 0 && s_oom ? NULL : block_calloc(count, size);
 
 	if (ptr == NULL) {
+		mem_dom_uncharge(dom, count * size);
 		log_error("cutils", "mem", NULL, "out of memory");
 		return NULL;
 	}
 
-	if (s_mem) {
-		s_mem->mem += count * size;
-		s_mem->peak = MAX(s_mem->mem, s_mem->peak);
-		s_mem->total += size;
-		s_mem->allocs++;
+	if (cur_mem()) {
+		mem_shard_t *sh = shard();
+		shard_add(sh, SHARD_TOTAL, size);
+		shard_add(sh, SHARD_ALLOCS, 1);
+		shard_add(sh, SHARD_MEM, count * size);
+	}
+
+	if (mem_prof_sample(count * size)) {
+		mem_prof_alloc(ptr, count * size, file, line, func);
 	}
 
+	mem_trace_alloc(MEM_TRACE_CALLOC, ptr, count * size);
+
 	return ptr;
 }
 
-void *mem_realloc(void *memory, size_t new_size, size_t old_size)
+void *mem_calloc(size_t count, size_t size)
+{
+	return mem_calloc_at(count, size, NULL, 0, NULL);
+}
+
+void *mem_realloc_at(void *memory, size_t new_size, size_t old_size, const char *file, int line, const char *func)
 {
 	if (memory == NULL) {
 		log_error("cutils", "mem", NULL, "realloc NULL");
@@ -157,71 +503,259 @@ void *mem_realloc(void *memory, size_t new_size, size_t old_size)
 	}
 
 	if (old_size == 0) {
-		return mem_alloc(new_size);
+		return mem_alloc_at(new_size, file, line, func);
 	}
 
-	void *ptr = new_size > old_size && s_oom ? NULL : realloc(memory, new_size);
+	// Growth is charged up front, so a block over budget is left untouched
+	mem_dom_t *dom = mem_dom_get();
+	if (dom != NULL && new_size > old_size && mem_dom_charge(dom, new_size - old_size, 0)) {
+		return NULL;
+	}
+
+	// Held across the realloc, so no other thread records the freed address before this record
+	const int traced = mem_trace_lock();
+	// Taken before the realloc, memory must not be used once it may have been freed
+	const uintptr_t key = (uintptr_t)memory;
+
+	void *ptr = new_size > old_size && s_oom ? NULL : block_realloc(memory, new_size, old_size);
+
+	if (traced) {
+		mem_trace_realloc(key, ptr, new_size, old_size);
+	}
 
 	if (ptr == NULL) {
+		if (new_size > old_size) {
+			mem_dom_uncharge(dom, new_size - old_size);
+		}
 		log_error("cutils", "mem", NULL, "out of memory");
 		return NULL;
 	}
 
-	if (s_mem) {
-		s_mem->mem -= old_size;
-		s_mem->mem += new_size;
-		s_mem->peak = MAX(s_mem->mem, s_mem->peak);
-		s_mem->total += new_size - old_size;
-		s_mem->reallocs++;
+	if (new_size < old_size) {
+		mem_dom_uncharge(dom, old_size - new_size);
+	}
+
+	if (cur_mem()) {
+		mem_shard_t *sh = shard();
+		shard_add(sh, SHARD_TOTAL, new_size - old_size);
+		shard_add(sh, SHARD_REALLOCS, 1);
+		shard_add(sh, SHARD_MEM, new_size - old_size);
+	}
+
+	mem_prof_free(memory);
+	if (mem_prof_sample(new_size)) {
+		mem_prof_alloc(ptr, new_size, file, line, func);
 	}
 
 	return ptr;
 }
 
-void *mem_set(void *dst, int val, size_t size)
+void *mem_realloc(void *memory, size_t new_size, size_t old_size)
 {
-	if (dst == NULL) {
-		return NULL;
+	return mem_realloc_at(memory, new_size, old_size, NULL, 0, NULL);
+}
+
+static int check_align(size_t align)
+{
+	if (align == 0 || (align & (align - 1)) != 0) {
+		log_error("cutils", "mem", NULL, "alignment %zu is not a power of two", align);
+		return 1;
 	}
 
-	return memset(dst, val, size);
+	return 0;
 }
 
-void *mem_cpy(void *dst, size_t size, const void *src, size_t len)
+// Mappings are page aligned, so large blocks can still get their own one
+static void *aligned_alloc_block(size_t size, size_t align)
 {
-	if (len > size) {
-		log_error("cutils", "mem", NULL, "destination too small %d/%d", size, len);
-		return NULL;
+	if (mem_map_use(size) && align <= mem_map_page()) {
+		return mem_map_alloc(size, 0);
 	}
+
+	align = align < sizeof(void *) ? sizeof(void *) : align;
 #if defined(C_WIN)
-	memcpy_s(dst, size, src, len);
+	return _aligned_malloc(size, align);
 #else
-	memcpy(dst, src, len);
+	void *ptr = NULL;
+	return posix_memalign(&ptr, align, size) == 0 ? ptr : NULL;
 #endif
-	return dst;
 }
 
-int mem_cmp(const void *l, const void *r, size_t size)
+static void aligned_free_block(void *memory, size_t size)
 {
-	return memcmp(l, r, size);
+	if (mem_map_release(memory, size)) {
+		return;
+	}
+
+#if defined(C_WIN)
+	_aligned_free(memory);
+#else
+	free(memory);
+#endif
 }
 
-int mem_swap(void *ptr1, void *ptr2, size_t size)
+void *mem_alloc_aligned(size_t size, size_t align)
 {
-	if (ptr1 == NULL || ptr2 == NULL) {
-		return 1;
+	if (check_align(align)) {
+		return NULL;
 	}
 
-	unsigned char *byte_ptr1 = (unsigned char *)ptr1;
-	unsigned char *byte_ptr2 = (unsigned char *)ptr2;
+	if (size == 0) {
+		log_warn("cutils", "mem", NULL, "malloc 0 bytes");
+	}
 
-	for (size_t i = 0; i < size; i++) {
-		unsigned char temp = byte_ptr1[i];
-		byte_ptr1[i]	   = byte_ptr2[i];
-		byte_ptr2[i]	   = temp;
+	mem_dom_t *dom = mem_dom_get();
+	if (dom != NULL && mem_dom_charge(dom, size, 1)) {
+		return NULL;
 	}
 
-	return 0;
+	void *ptr = size > 0 && s_oom ? NULL : aligned_alloc_block(size, align);
+
+	if (ptr == NULL) {
+		mem_dom_uncharge(dom, size);
+		log_error("cutils", "mem", NULL, "out of memory");
+		return NULL;
+	}
+
+	if (cur_mem()) {
+		mem_shard_t *sh = shard();
+		shard_add(sh, SHARD_TOTAL, size);
+		shard_add(sh, SHARD_ALLOCS, 1);
+		shard_add(sh, SHARD_MEM, size);
+	}
+
+	if (mem_prof_sample(size)) {
+		mem_prof_alloc(ptr, size, NULL, 0, NULL);
+	}
+
+	return ptr;
+}
+
+void *mem_calloc_aligned(size_t count, size_t size, size_t align)
+{
+	if (calloc_overflows(count, size)) {
+		return NULL;
+	}
+
+	void *ptr = mem_alloc_aligned(count * size, align);
+	if (ptr == NULL) {
+		return NULL;
+	}
+
+	return memset(ptr, 0, count * size);
+}
+
+void *mem_realloc_aligned(void *memory, size_t new_size, size_t old_size, size_t align)
+{
+	if (memory == NULL) {
+		log_error("cutils", "mem", NULL, "realloc NULL");
+		return NULL;
+	}
+
+	if (check_align(align)) {
+		return NULL;
+	}
+
+	if (new_size == 0 || new_size == old_size) {
+		log_warn("cutils", "mem", NULL, "realloc %zu -> %zu bytes", old_size, new_size);
+		return memory;
+	}
+
+	if (old_size == 0) {
+		return mem_alloc_aligned(new_size, align);
+	}
+
+	mem_dom_t *dom = mem_dom_get();
+	if (dom != NULL && new_size > old_size && mem_dom_charge(dom, new_size - old_size, 0)) {
+		return NULL;
+	}
+
+	void *ptr = NULL;
+	if (new_size <= old_size || !s_oom) {
+		if (mem_map_has(memory, old_size) && align <= mem_map_page()) {
+			ptr = mem_map_realloc(memory, new_size, old_size);
+		} else {
+			// There is no aligned realloc in libc, the block always moves
+			ptr = aligned_alloc_block(new_size, align);
+			if (ptr != NULL) {
+				memcpy(ptr, memory, old_size < new_size ? old_size : new_size);
+				aligned_free_block(memory, old_size);
+			}
+		}
+	}
+
+	if (ptr == NULL) {
+		if (new_size > old_size) {
+			mem_dom_uncharge(dom, new_size - old_size);
+		}
+		log_error("cutils", "mem", NULL, "out of memory");
+		return NULL;
+	}
+
+	if (new_size < old_size) {
+		mem_dom_uncharge(dom, old_size - new_size);
+	}
+
+	if (cur_mem()) {
+		mem_shard_t *sh = shard();
+		shard_add(sh, SHARD_TOTAL, new_size - old_size);
+		shard_add(sh, SHARD_REALLOCS, 1);
+		shard_add(sh, SHARD_MEM, new_size - old_size);
+	}
+
+	mem_prof_free(memory);
+	if (mem_prof_sample(new_size)) {
+		mem_prof_alloc(ptr, new_size, NULL, 0, NULL);
+	}
+
+	return ptr;
+}
+
+void mem_free_aligned(void *memory, size_t size)
+{
+	if (memory == NULL) {
+		return;
+	}
+
+	if (cur_mem()) {
+		shard_add(shard(), SHARD_MEM, (u64)0 - size);
+	}
+
+	mem_dom_uncharge(mem_dom_get(), size);
+	mem_prof_free(memory);
+	aligned_free_block(memory, size);
+}
+
+size_t mem_cache_line()
+{
+	static volatile u32 line;
+
+	u32 size = c_atomic_load32(&line);
+	if (size != 0) {
+		return size;
+	}
+
+#if defined(C_WIN)
+	DWORD len = 0;
+	GetLogicalProcessorInformation(NULL, &len);
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info = malloc(len);
+	if (info != NULL && GetLogicalProcessorInformation(info, &len)) {
+		for (DWORD i = 0; i < len / sizeof(*info); i++) {
+			if (info[i].Relationship == RelationCache && info[i].Cache.Level == 1) {
+				size = info[i].Cache.LineSize;
+				break;
+			}
+		}
+	}
+	free(info);
+#else
+	const long res = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+	size	       = res > 0 ? (u32)res : 0;
+#endif
+
+	size = size > 0 ? size : MEM_CACHE_LINE;
+	c_atomic_store32(&line, size);
+	return size;
 }
 
 void mem_free(void *memory, size_t size)
@@ -230,13 +764,84 @@ void mem_free(void *memory, size_t size)
 		return;
 	}
 
-	if (s_mem) {
-		s_mem->mem -= size;
+	// Before the block is freed, so no other thread records its address first
+	mem_trace_free(memory, size);
+
+	if (cur_mem()) {
+		shard_add(shard(), SHARD_MEM, (u64)0 - size);
+	}
+
+	mem_dom_uncharge(mem_dom_get(), size);
+	mem_prof_free(memory);
+
+	if (mem_map_release(memory, size)) {
+		return;
+	}
+
+	const int cls = mem_cache_class(size);
+	if (cls >= 0 && mem_cache_put(memory, cls)) {
+		return;
 	}
 
 	free(memory);
 }
 
+void mem_stat_arena(ptrdiff_t used, int chunks)
+{
+	if (cur_mem() == NULL) {
+		return;
+	}
+
+	mem_shard_t *sh = shard();
+	shard_add(sh, SHARD_ARENA_CHUNKS, (u64)chunks);
+	shard_add(sh, SHARD_ARENA_MEM, (u64)used);
+}
+
+void mem_stat_cache(int cls, int hits, int misses, ptrdiff_t cached)
+{
+	if (cur_mem() == NULL) {
+		return;
+	}
+
+	mem_shard_t *sh = shard();
+	if (hits) {
+		shard_add(sh, SHARD_CLASSES + cls * 3, (u64)hits);
+	}
+	if (misses) {
+		shard_add(sh, SHARD_CLASSES + cls * 3 + 1, (u64)misses);
+	}
+	shard_add(sh, SHARD_CLASSES + cls * 3 + 2, (u64)cached);
+}
+
+void mem_stat_map(ptrdiff_t mapped, int maps)
+{
+	if (cur_mem() == NULL) {
+		return;
+	}
+
+	mem_shard_t *sh = shard();
+	shard_add(sh, SHARD_MAP_MEM, (u64)mapped);
+	shard_add(sh, SHARD_MAPS, (u64)maps);
+}
+
+void mem_stat_pool(ptrdiff_t mem, int slabs, ptrdiff_t live, size_t size)
+{
+	if (cur_mem() == NULL) {
+		return;
+	}
+
+	mem_shard_t *sh = shard();
+	shard_add(sh, SHARD_POOL_MEM, (u64)mem);
+	shard_add(sh, SHARD_POOL_SLABS, (u64)slabs);
+	shard_add(sh, SHARD_POOL_LIVE, (u64)live);
+	shard_add(sh, SHARD_POOL_USED, (u64)live * size);
+}
+
+int mem_map_set(size_t threshold, int flags)
+{
+	return mem_map_conf(threshold, (flags & MEM_MAP_HUGE) != 0, (flags & MEM_MAP_HUGETLB) != 0);
+}
+
 void mem_oom(int oom)
 {
 	s_oom = oom;
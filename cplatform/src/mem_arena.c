@@ -0,0 +1,173 @@
+#include "mem_arena.h"
+
+#include "log.h"
+#include "mem.h"
+#include "mem_priv.h"
+
+#define MEM_ARENA_ALIGN 16
+
+struct mem_arena_chunk_s {
+	mem_arena_chunk_t *prev;
+	size_t size;
+	size_t off;
+	size_t pad;
+};
+
+static char *chunk_data(mem_arena_chunk_t *chunk)
+{
+	return (char *)chunk + sizeof(mem_arena_chunk_t);
+}
+
+static void chunk_free(mem_arena_t *arena, mem_arena_chunk_t *chunk)
+{
+	mem_free(chunk, sizeof(mem_arena_chunk_t) + chunk->size);
+	arena->chunks--;
+	mem_stat_arena(0, -1);
+}
+
+mem_arena_t *mem_arena_init(mem_arena_t *arena, size_t chunk_size)
+{
+	if (arena == NULL || chunk_size == 0) {
+		return NULL;
+	}
+
+	arena->chunk	  = NULL;
+	arena->chunk_size = chunk_size;
+	arena->used	  = 0;
+	arena->peak	  = 0;
+	arena->chunks	  = 0;
+
+	return arena;
+}
+
+int mem_arena_free(mem_arena_t *arena)
+{
+	if (arena == NULL) {
+		return 1;
+	}
+
+	mem_arena_mark_t mark = { 0 };
+	return mem_arena_rewind(arena, mark);
+}
+
+static mem_arena_chunk_t *chunk_add(mem_arena_t *arena, size_t size)
+{
+	size = size > arena->chunk_size ? size : arena->chunk_size;
+
+	mem_arena_chunk_t *chunk = mem_alloc(sizeof(mem_arena_chunk_t) + size);
+	if (chunk == NULL) {
+		return NULL;
+	}
+
+	chunk->prev = arena->chunk;
+	chunk->size = size;
+	chunk->off  = 0;
+
+	arena->chunk = chunk;
+	arena->chunks++;
+	mem_stat_arena(0, 1);
+
+	log_trace("cplatform", "mem_arena", NULL, "new chunk of %zu bytes", size);
+	return chunk;
+}
+
+void *mem_arena_alloc(mem_arena_t *arena, size_t size)
+{
+	return mem_arena_alloc_aligned(arena, size, MEM_ARENA_ALIGN);
+}
+
+void *mem_arena_alloc_aligned(mem_arena_t *arena, size_t size, size_t align)
+{
+	if (arena == NULL || arena->chunk_size == 0 || align == 0 || (align & (align - 1)) != 0) {
+		return NULL;
+	}
+
+	mem_arena_chunk_t *chunk = arena->chunk;
+
+	size_t off = 0;
+	if (chunk != NULL) {
+		const size_t addr = (size_t)chunk_data(chunk) + chunk->off;
+		off		  = chunk->off + ((align - addr % align) % align);
+	}
+
+	if (chunk == NULL || off > chunk->size || size > chunk->size - off) {
+		// Chunk data is only as aligned as mem_alloc() returns, which can be less than
+		// MEM_ARENA_ALIGN, so reserve room for any padding
+		if (size > (size_t)-1 - (align - 1)) {
+			return NULL;
+		}
+		chunk = chunk_add(arena, size + align - 1);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		const size_t addr = (size_t)chunk_data(chunk);
+		off		  = (align - addr % align) % align;
+	}
+
+	chunk->off = off + size;
+
+	arena->used += size;
+	arena->peak = arena->used > arena->peak ? arena->used : arena->peak;
+	mem_stat_arena((ptrdiff_t)size, 0);
+
+	return chunk_data(chunk) + off;
+}
+
+mem_arena_mark_t mem_arena_mark(const mem_arena_t *arena)
+{
+	mem_arena_mark_t mark = { 0 };
+	if (arena == NULL || arena->chunk == NULL) {
+		return mark;
+	}
+
+	mark.chunk = arena->chunk;
+	mark.off   = arena->chunk->off;
+	mark.used  = arena->used;
+	return mark;
+}
+
+int mem_arena_rewind(mem_arena_t *arena, mem_arena_mark_t mark)
+{
+	if (arena == NULL || mark.used > arena->used) {
+		return 1;
+	}
+
+	while (arena->chunk != NULL && arena->chunk != mark.chunk) {
+		mem_arena_chunk_t *chunk = arena->chunk;
+		arena->chunk		 = chunk->prev;
+		chunk_free(arena, chunk);
+	}
+
+	if (arena->chunk == NULL && mark.chunk != NULL) {
+		log_error("cplatform", "mem_arena", NULL, "mark does not belong to the arena");
+		return 1;
+	}
+
+	if (arena->chunk != NULL) {
+		arena->chunk->off = mark.off;
+	}
+
+	mem_stat_arena(-(ptrdiff_t)(arena->used - mark.used), 0);
+	arena->used = mark.used;
+
+	return 0;
+}
+
+int mem_arena_reset(mem_arena_t *arena)
+{
+	if (arena == NULL) {
+		return 1;
+	}
+
+	mem_arena_chunk_t *first = arena->chunk;
+	while (first != NULL && first->prev != NULL) {
+		first = first->prev;
+	}
+
+	mem_arena_mark_t mark = {
+		.chunk = first,
+		.off   = 0,
+		.used  = 0,
+	};
+	return mem_arena_rewind(arena, mark);
+}
@@ -0,0 +1,283 @@
+#include "mem.h"
+
+#include "c_thread.h"
+#include "mem_priv.h"
+
+#include <malloc.h>
+#include <stdlib.h>
+
+// Objects moved between a thread and the central lists at once
+#define CACHE_BATCH 32
+// Batches kept per class in the central lists, the rest goes back to libc
+#define CENTRAL_MAX 64
+// Cache operations of a thread between publishing its statistics
+#define CACHE_PUBLISH 256
+
+typedef struct cache_bin_s {
+	void *head;
+	u32 cnt;
+	u32 hits;
+	u32 misses;
+	ptrdiff_t cached;
+} cache_bin_t;
+
+// Batches of one class returned by threads, linked through the second word of their first object
+typedef struct central_s {
+	volatile u32 lock;
+	volatile u32 cnt;
+	void *batches;
+	char pad[MEM_CACHE_LINE];
+} central_t;
+
+static volatile u64 s_max;
+static central_t s_central[MEM_CLASSES];
+
+static C_THREAD_LOCAL cache_bin_t s_bins[MEM_CLASSES];
+static C_THREAD_LOCAL size_t s_bytes;
+static C_THREAD_LOCAL u32 s_ops;
+
+int mem_cache_class(size_t size)
+{
+	if (size == 0 || size > MEM_CLASS_MAX) {
+		return -1;
+	}
+
+	if (size <= 128) {
+		return (int)((size - 1) >> 4);
+	}
+
+	int e = 7;
+	while (((size - 1) >> (e + 1)) != 0) {
+		e++;
+	}
+
+	return 8 + (e - 7) * 4 + (int)((size - 1) >> (e - 2)) - 4;
+}
+
+size_t mem_cache_size(int cls)
+{
+	if (cls < 8) {
+		return (size_t)(cls + 1) * 16;
+	}
+
+	return (size_t)(5 + (cls - 8) % 4) << ((cls - 8) / 4 + 5);
+}
+
+int mem_cache_on()
+{
+	return c_atomic_load64(&s_max) != 0;
+}
+
+// Statistics are counted per thread and moved to mem_t in bulk, keeping the fast paths free of atomics
+void mem_cache_publish()
+{
+	for (int cls = 0; cls < MEM_CLASSES; cls++) {
+		cache_bin_t *bin = &s_bins[cls];
+		if (bin->hits == 0 && bin->misses == 0 && bin->cached == 0) {
+			continue;
+		}
+
+		mem_stat_cache(cls, (int)bin->hits, (int)bin->misses, bin->cached);
+		bin->hits   = 0;
+		bin->misses = 0;
+		bin->cached = 0;
+	}
+
+	s_ops = 0;
+}
+
+static void count_op()
+{
+	if (++s_ops >= CACHE_PUBLISH) {
+		mem_cache_publish();
+	}
+}
+
+static void central_lock(central_t *central)
+{
+	while (!c_atomic_cas32(&central->lock, 0, 1)) {
+		c_atomic_pause();
+	}
+}
+
+static void central_unlock(central_t *central)
+{
+	c_atomic_store32(&central->lock, 0);
+}
+
+static u32 list_free(void *head)
+{
+	u32 cnt = 0;
+	while (head != NULL) {
+		void *next = *(void **)head;
+		free(head);
+		head = next;
+		cnt++;
+	}
+	return cnt;
+}
+
+static void central_give(int cls, void *batch)
+{
+	central_t *central = &s_central[cls];
+
+	// Once caching is disabled nothing drains the central lists anymore
+	central_lock(central);
+	if (mem_cache_on() && central->cnt < CENTRAL_MAX) {
+		((void **)batch)[1] = central->batches;
+		central->batches    = batch;
+		c_atomic_store32(&central->cnt, central->cnt + 1);
+		batch = NULL;
+	}
+	central_unlock(central);
+
+	if (batch != NULL) {
+		mem_stat_cache(cls, 0, 0, -(ptrdiff_t)(list_free(batch) * mem_cache_size(cls)));
+	}
+}
+
+static void *central_take(int cls)
+{
+	central_t *central = &s_central[cls];
+	if (c_atomic_load32(&central->cnt) == 0) {
+		return NULL;
+	}
+
+	central_lock(central);
+	void *batch = central->batches;
+	if (batch != NULL) {
+		central->batches = ((void **)batch)[1];
+		c_atomic_store32(&central->cnt, central->cnt - 1);
+	}
+	central_unlock(central);
+
+	return batch;
+}
+
+void *mem_cache_get(int cls)
+{
+	cache_bin_t *bin = &s_bins[cls];
+
+	if (bin->head == NULL) {
+		bin->head = central_take(cls);
+		if (bin->head == NULL) {
+			bin->misses++;
+			count_op();
+			return NULL;
+		}
+
+		bin->cnt = 0;
+		for (void *obj = bin->head; obj != NULL; obj = *(void **)obj) {
+			bin->cnt++;
+		}
+		s_bytes += bin->cnt * mem_cache_size(cls);
+	}
+
+	void *obj = bin->head;
+	bin->head = *(void **)obj;
+	bin->cnt--;
+	s_bytes -= mem_cache_size(cls);
+
+	bin->hits++;
+	bin->cached -= (ptrdiff_t)mem_cache_size(cls);
+	count_op();
+	return obj;
+}
+
+// Detaches up to cnt objects from the front of a bin as a NULL terminated list
+static void *bin_take(cache_bin_t *bin, int cls, u32 cnt)
+{
+	void *head = bin->head;
+	void *tail = head;
+	u32 n	   = 1;
+	while (n < cnt && *(void **)tail != NULL) {
+		tail = *(void **)tail;
+		n++;
+	}
+
+	bin->head      = *(void **)tail;
+	*(void **)tail = NULL;
+	bin->cnt -= n;
+	s_bytes -= n * mem_cache_size(cls);
+
+	return head;
+}
+
+// Blocks allocated while caching was disabled were not rounded up to their class
+static size_t block_size(void *ptr)
+{
+#if defined(C_WIN)
+	return _msize(ptr);
+#else
+	return malloc_usable_size(ptr);
+#endif
+}
+
+int mem_cache_put(void *ptr, int cls)
+{
+	const u64 max = c_atomic_load64(&s_max);
+	if (max == 0 || block_size(ptr) < mem_cache_size(cls)) {
+		return 0;
+	}
+
+	const size_t size = mem_cache_size(cls);
+	cache_bin_t *bin  = &s_bins[cls];
+
+	*(void **)ptr = bin->head;
+	bin->head     = ptr;
+	bin->cnt++;
+	s_bytes += size;
+
+	bin->cached += (ptrdiff_t)size;
+
+	if (bin->cnt >= CACHE_BATCH * 2 || s_bytes > max) {
+		central_give(cls, bin_take(bin, cls, CACHE_BATCH));
+	}
+
+	count_op();
+	return 1;
+}
+
+int mem_cache_flush()
+{
+	for (int cls = 0; cls < MEM_CLASSES; cls++) {
+		cache_bin_t *bin = &s_bins[cls];
+		while (bin->head != NULL) {
+			central_give(cls, bin_take(bin, cls, CACHE_BATCH));
+		}
+	}
+
+	mem_cache_publish();
+	mem_stat_release();
+	return 0;
+}
+
+int mem_cache_set(size_t max)
+{
+	c_atomic_store64(&s_max, max);
+
+	if (max != 0) {
+		return 0;
+	}
+
+	// Disabled, give everything cached by this thread and the central lists back to libc
+	mem_cache_flush();
+
+	for (int cls = 0; cls < MEM_CLASSES; cls++) {
+		central_t *central = &s_central[cls];
+
+		central_lock(central);
+		void *batches	 = central->batches;
+		central->batches = NULL;
+		c_atomic_store32(&central->cnt, 0);
+		central_unlock(central);
+
+		while (batches != NULL) {
+			void *next = ((void **)batches)[1];
+			mem_stat_cache(cls, 0, 0, -(ptrdiff_t)(list_free(batches) * mem_cache_size(cls)));
+			batches = next;
+		}
+	}
+
+	return 0;
+}
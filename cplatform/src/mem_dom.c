@@ -0,0 +1,257 @@
+#include "mem_dom.h"
+
+#include "c_thread.h"
+#include "log.h"
+#include "mem.h"
+#include "mem_priv.h"
+
+static volatile u32 s_lock;
+// Top-level domains, children hang off their parents
+static mem_dom_t *s_doms;
+
+static C_THREAD_LOCAL mem_dom_t *s_cur;
+
+static void dom_lock()
+{
+	while (!c_atomic_cas32(&s_lock, 0, 1)) {
+		c_atomic_pause();
+	}
+}
+
+static void dom_unlock()
+{
+	c_atomic_store32(&s_lock, 0);
+}
+
+static void update_peak(mem_dom_t *dom, u64 mem)
+{
+	u64 peak = c_atomic_load64(&dom->peak);
+	while (mem > peak && !c_atomic_cas64(&dom->peak, peak, mem)) {
+		peak = c_atomic_load64(&dom->peak);
+	}
+}
+
+mem_dom_t *mem_dom_init(mem_dom_t *dom, const char *name, mem_dom_t *parent)
+{
+	if (dom == NULL) {
+		return NULL;
+	}
+
+	*dom = (mem_dom_t){ .name = name, .parent = parent };
+
+	dom_lock();
+	mem_dom_t **head = parent == NULL ? &s_doms : &parent->child;
+	dom->next	 = *head;
+	*head		 = dom;
+	dom_unlock();
+
+	return dom;
+}
+
+int mem_dom_free(mem_dom_t *dom)
+{
+	if (dom == NULL) {
+		return 1;
+	}
+
+	// The calling thread lets go of it here, any other one has to first
+	const u32 own = s_cur == dom;
+
+	dom_lock();
+	if (dom->child != NULL) {
+		dom_unlock();
+		log_error("cplatform", "mem_dom", NULL, "%s: domain has children", dom->name);
+		return 1;
+	}
+
+	if (c_atomic_load32(&dom->users) > own) {
+		dom_unlock();
+		log_error("cplatform", "mem_dom", NULL, "%s: domain is set on another thread", dom->name);
+		return 1;
+	}
+
+	mem_dom_t **link = dom->parent == NULL ? &s_doms : &dom->parent->child;
+	while (*link != NULL && *link != dom) {
+		link = &(*link)->next;
+	}
+	if (*link == dom) {
+		*link = dom->next;
+	}
+	dom_unlock();
+
+	if (own) {
+		mem_dom_set(NULL);
+	}
+
+	const u64 mem = c_atomic_load64(&dom->mem);
+	if (mem != 0) {
+		log_warn("cplatform", "mem_dom", NULL, "%s: %llu bytes were not freed", dom->name, (unsigned long long)mem);
+	}
+
+	return mem != 0;
+}
+
+int mem_dom_budget(mem_dom_t *dom, size_t soft, size_t hard, mem_dom_cb on_soft, void *priv)
+{
+	if (dom == NULL) {
+		return 1;
+	}
+
+	dom->soft    = soft;
+	dom->hard    = hard;
+	dom->on_soft = on_soft;
+	dom->priv    = priv;
+	c_atomic_store32(&dom->over, 0);
+	return 0;
+}
+
+mem_dom_t *mem_dom_set(mem_dom_t *dom)
+{
+	mem_dom_t *prev = s_cur;
+	if (prev == dom) {
+		return prev;
+	}
+
+	// Threads it is set on, mem_dom_free() refuses while any other one is left
+	if (dom != NULL) {
+		c_atomic_add32(&dom->users, 1);
+	}
+	if (prev != NULL) {
+		c_atomic_add32(&prev->users, (u32)-1);
+	}
+
+	s_cur = dom;
+	return prev;
+}
+
+mem_dom_t *mem_dom_get()
+{
+	return s_cur;
+}
+
+int mem_dom_charge(mem_dom_t *dom, size_t size, int allocs)
+{
+	for (mem_dom_t *d = dom; d != NULL; d = d->parent) {
+		const u64 mem = c_atomic_add64(&d->mem, size) + size;
+		if (d->hard == 0 || mem <= d->hard) {
+			continue;
+		}
+
+		for (mem_dom_t *u = dom;; u = u->parent) {
+			c_atomic_add64(&u->mem, (u64)0 - size);
+			if (u == d) {
+				break;
+			}
+		}
+
+		log_error("cplatform", "mem_dom", NULL, "%s: budget of %zu bytes exceeded", d->name, d->hard);
+		return 1;
+	}
+
+	for (mem_dom_t *d = dom; d != NULL; d = d->parent) {
+		const u64 mem = c_atomic_load64(&d->mem);
+		update_peak(d, mem);
+		c_atomic_add64(&d->total, size);
+		c_atomic_add64(&d->allocs, (u64)allocs);
+
+		// Once per crossing, the callback may free memory of this domain
+		if (d->soft > 0 && mem > d->soft && d->on_soft != NULL && c_atomic_cas32(&d->over, 0, 1)) {
+			d->on_soft(d, d->priv);
+		}
+	}
+
+	return 0;
+}
+
+void mem_dom_uncharge(mem_dom_t *dom, size_t size)
+{
+	for (mem_dom_t *d = dom; d != NULL; d = d->parent) {
+		const u64 mem = c_atomic_add64(&d->mem, (u64)0 - size) - size;
+		if (d->soft > 0 && mem <= d->soft) {
+			c_atomic_store32(&d->over, 0);
+		}
+	}
+}
+
+void *mem_dom_alloc(mem_dom_t *dom, size_t size)
+{
+	mem_dom_t *prev = mem_dom_set(dom);
+	void *ptr	= mem_alloc(size);
+	mem_dom_set(prev);
+	return ptr;
+}
+
+void *mem_dom_calloc(mem_dom_t *dom, size_t count, size_t size)
+{
+	mem_dom_t *prev = mem_dom_set(dom);
+	void *ptr	= mem_calloc(count, size);
+	mem_dom_set(prev);
+	return ptr;
+}
+
+void *mem_dom_realloc(mem_dom_t *dom, void *memory, size_t new_size, size_t old_size)
+{
+	mem_dom_t *prev = mem_dom_set(dom);
+	void *ptr	= mem_realloc(memory, new_size, old_size);
+	mem_dom_set(prev);
+	return ptr;
+}
+
+void mem_dom_release(mem_dom_t *dom, void *memory, size_t size)
+{
+	mem_dom_t *prev = mem_dom_set(dom);
+	mem_free(memory, size);
+	mem_dom_set(prev);
+}
+
+static int print_dom(print_dst_t dst, const mem_dom_t *dom, int depth)
+{
+	int off = dst.off;
+
+	dst.off += dprintf(dst, "%*s%s: mem: %llu B, peak: %llu B, total: %llu B, allocs: %llu", 4 + depth * 4, "", dom->name,
+			   (unsigned long long)c_atomic_load64(&dom->mem), (unsigned long long)c_atomic_load64(&dom->peak),
+			   (unsigned long long)c_atomic_load64(&dom->total), (unsigned long long)c_atomic_load64(&dom->allocs));
+	if (dom->soft > 0) {
+		dst.off += dprintf(dst, ", soft: %zu B", dom->soft);
+	}
+	if (dom->hard > 0) {
+		dst.off += dprintf(dst, ", hard: %zu B", dom->hard);
+	}
+	dst.off += dprintf(dst, "\n");
+
+	return dst.off - off;
+}
+
+int mem_dom_print(print_dst_t dst)
+{
+	int off = dst.off;
+
+	dom_lock();
+	if (s_doms != NULL) {
+		dst.off += dprintf(dst, "domain stats:\n");
+	}
+
+	// Depth-first without recursion, the tree links lead back up
+	const mem_dom_t *dom = s_doms;
+	int depth	     = 0;
+	while (dom != NULL) {
+		dst.off += print_dom(dst, dom, depth);
+
+		if (dom->child != NULL) {
+			dom = dom->child;
+			depth++;
+			continue;
+		}
+
+		while (dom != NULL && dom->next == NULL) {
+			dom = dom->parent;
+			depth--;
+		}
+		if (dom != NULL) {
+			dom = dom->next;
+		}
+	}
+	dom_unlock();
+
+	return dst.off - off;
+}
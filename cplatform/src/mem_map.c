@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+
+#include "c_thread.h"
+#include "mem_priv.h"
+#include "platform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(C_WIN)
+#else
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+#define MAP_HUGE_SIZE (2 * 1024 * 1024)
+// Released mappings kept for reuse, their pages are given back to the kernel
+#define MAP_CACHE 4
+// Pages checked by one mincore() call
+#define MAP_VEC 4096
+
+typedef struct map_s {
+	void *ptr;
+	size_t size;
+	size_t len;
+	int hugetlb;
+	int cached;
+} map_t;
+
+static volatile u64 s_threshold;
+static volatile u32 s_huge;
+static volatile u32 s_hugetlb;
+// Smallest size a live mapping was requested with, cheaper frees skip the lookup below it.
+// Only changed under the lock, from the mappings that are live at the time
+static volatile u64 s_min = U64_MAX;
+
+static volatile u32 s_lock;
+static map_t *s_maps;
+static u32 s_maps_cnt;
+static u32 s_maps_cap;
+static u32 s_cached;
+
+static void map_lock()
+{
+	while (!c_atomic_cas32(&s_lock, 0, 1)) {
+		c_atomic_pause();
+	}
+}
+
+static void map_unlock()
+{
+	c_atomic_store32(&s_lock, 0);
+}
+
+static size_t page_size()
+{
+	static size_t size;
+	if (size == 0) {
+#if defined(C_WIN)
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		size = info.dwPageSize;
+#else
+		size = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	}
+	return size;
+}
+
+static size_t round_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+static size_t map_len(size_t size, int hugetlb)
+{
+	return round_up(size, hugetlb ? MAP_HUGE_SIZE : page_size());
+}
+
+static void os_unmap(void *ptr, size_t len)
+{
+#if defined(C_WIN)
+	(void)len;
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, len);
+#endif
+}
+
+static void *os_map(size_t size, int huge, int *hugetlb)
+{
+#if defined(C_WIN)
+	(void)huge;
+
+	if (c_atomic_load32(&s_hugetlb)) {
+		const size_t large = GetLargePageMinimum();
+		if (large > 0) {
+			void *ptr = VirtualAlloc(NULL, round_up(size, large), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (ptr != NULL) {
+				*hugetlb = 1;
+				return ptr;
+			}
+		}
+	}
+
+	*hugetlb = 0;
+	return VirtualAlloc(NULL, map_len(size, 0), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	#if defined(MAP_HUGETLB)
+	if (c_atomic_load32(&s_hugetlb)) {
+		void *ptr = mmap(NULL, map_len(size, 1), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED) {
+			*hugetlb = 1;
+			return ptr;
+		}
+	}
+	#endif
+
+	*hugetlb	 = 0;
+	const size_t len = map_len(size, 0);
+
+	#if defined(MADV_HUGEPAGE)
+	if (huge && len >= MAP_HUGE_SIZE) {
+		// Over-map and trim, transparent huge pages need huge page aligned ranges
+		char *raw = mmap(NULL, len + MAP_HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == MAP_FAILED) {
+			return NULL;
+		}
+
+		char *ptr	  = (char *)round_up((size_t)raw, MAP_HUGE_SIZE);
+		const size_t head = (size_t)(ptr - raw);
+		if (head > 0) {
+			munmap(raw, head);
+		}
+		munmap(ptr + len, MAP_HUGE_SIZE - head);
+
+		madvise(ptr, len, MADV_HUGEPAGE);
+		return ptr;
+	}
+	#endif
+
+	void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return ptr == MAP_FAILED ? NULL : ptr;
+#endif
+}
+
+// Resizes a mapping without copying, NULL if the system can not
+static void *os_remap(void *ptr, size_t old_len, size_t new_len)
+{
+#if defined(C_WIN)
+	(void)ptr;
+	(void)old_len;
+	(void)new_len;
+	return NULL;
+#else
+	void *res = mremap(ptr, old_len, new_len, MREMAP_MAYMOVE);
+	return res == MAP_FAILED ? NULL : res;
+#endif
+}
+
+// Keeps the range mapped but lets the system reclaim its pages
+static void os_release(void *ptr, size_t len)
+{
+#if defined(C_WIN)
+	VirtualAlloc(ptr, len, MEM_RESET, PAGE_READWRITE);
+#else
+	#if defined(MADV_FREE)
+	if (madvise(ptr, len, MADV_FREE) == 0) {
+		return;
+	}
+	#endif
+	madvise(ptr, len, MADV_DONTNEED);
+#endif
+}
+
+static size_t os_resident(void *ptr, size_t len)
+{
+#if defined(C_WIN)
+	(void)ptr;
+	return len;
+#else
+	const size_t page = page_size();
+	unsigned char vec[MAP_VEC];
+
+	size_t resident = 0;
+	for (size_t off = 0; off < len; off += MAP_VEC * page) {
+		const size_t chunk = len - off < MAP_VEC * page ? len - off : MAP_VEC * page;
+		if (mincore((char *)ptr + off, chunk, vec) != 0) {
+			return len;
+		}
+
+		const size_t pages = (chunk + page - 1) / page;
+		for (size_t i = 0; i < pages; i++) {
+			resident += (vec[i] & 1) * page;
+		}
+	}
+
+	return resident;
+#endif
+}
+
+// Recomputed as mappings come and go, so a shrunk or freed one does not keep slowing down frees
+static void update_min()
+{
+	u64 min = U64_MAX;
+	for (u32 i = 0; i < s_maps_cnt; i++) {
+		if (!s_maps[i].cached && s_maps[i].size < min) {
+			min = s_maps[i].size;
+		}
+	}
+	c_atomic_store64(&s_min, min);
+}
+
+static map_t *find(void *ptr)
+{
+	for (u32 i = 0; i < s_maps_cnt; i++) {
+		if (s_maps[i].ptr == ptr && !s_maps[i].cached) {
+			return &s_maps[i];
+		}
+	}
+	return NULL;
+}
+
+static int add(void *ptr, size_t size, size_t len, int hugetlb)
+{
+	if (s_maps_cnt >= s_maps_cap) {
+		const u32 cap = s_maps_cap == 0 ? 16 : s_maps_cap * 2;
+		map_t *maps   = realloc(s_maps, cap * sizeof(map_t));
+		if (maps == NULL) {
+			return 1;
+		}
+		s_maps	   = maps;
+		s_maps_cap = cap;
+	}
+
+	s_maps[s_maps_cnt++] = (map_t){ .ptr = ptr, .size = size, .len = len, .hugetlb = hugetlb };
+	return 0;
+}
+
+static void del(map_t *map)
+{
+	*map = s_maps[--s_maps_cnt];
+}
+
+size_t mem_map_page()
+{
+	return page_size();
+}
+
+int mem_map_use(size_t size)
+{
+	const u64 threshold = c_atomic_load64(&s_threshold);
+	return threshold > 0 && size >= threshold;
+}
+
+// Reuses the smallest released mapping that fits without wasting more than its size
+static void *reuse(size_t size)
+{
+	map_t *best = NULL;
+	for (u32 i = 0; i < s_maps_cnt; i++) {
+		map_t *map = &s_maps[i];
+		if (map->cached && map->len >= map_len(size, map->hugetlb) && map->len / 2 <= size && (best == NULL || map->len < best->len)) {
+			best = map;
+		}
+	}
+
+	if (best == NULL) {
+		return NULL;
+	}
+
+	best->size   = size;
+	best->cached = 0;
+	s_cached--;
+	update_min();
+	return best->ptr;
+}
+
+void *mem_map_alloc(size_t size, int zero)
+{
+	map_lock();
+	void *ptr = reuse(size);
+	map_unlock();
+
+	if (ptr != NULL) {
+		// Released pages may still hold old data until the system reclaims them
+		if (zero) {
+			memset(ptr, 0, size);
+		}
+		return ptr;
+	}
+
+	int hugetlb;
+	ptr = os_map(size, (int)c_atomic_load32(&s_huge), &hugetlb);
+	if (ptr == NULL) {
+		return NULL;
+	}
+
+	const size_t len = map_len(size, hugetlb);
+
+	map_lock();
+	const int err = add(ptr, size, len, hugetlb);
+	if (!err) {
+		update_min();
+	}
+	map_unlock();
+
+	if (err) {
+		os_unmap(ptr, len);
+		return NULL;
+	}
+
+	mem_stat_map((ptrdiff_t)len, 1);
+	return ptr;
+}
+
+int mem_map_has(void *ptr, size_t size)
+{
+	if (size < c_atomic_load64(&s_min)) {
+		return 0;
+	}
+
+	map_lock();
+	const int has = find(ptr) != NULL;
+	map_unlock();
+
+	return has;
+}
+
+void *mem_map_realloc(void *ptr, size_t new_size, size_t old_size)
+{
+	map_lock();
+	map_t *map = find(ptr);
+	if (map == NULL) {
+		map_unlock();
+		return NULL;
+	}
+
+	const size_t old_len = map->len;
+	const size_t new_len = map_len(new_size, map->hugetlb);
+
+	if (new_len == old_len) {
+		map->size = new_size;
+		update_min();
+		map_unlock();
+		return ptr;
+	}
+
+	void *res = os_remap(ptr, old_len, new_len);
+	if (res != NULL) {
+		map->ptr  = res;
+		map->size = new_size;
+		map->len  = new_len;
+		update_min();
+		map_unlock();
+
+		mem_stat_map((ptrdiff_t)new_len - (ptrdiff_t)old_len, 0);
+		return res;
+	}
+	map_unlock();
+
+	res = mem_map_alloc(new_size, 0);
+	if (res == NULL) {
+		return NULL;
+	}
+
+	memcpy(res, ptr, old_size < new_size ? old_size : new_size);
+	mem_map_release(ptr, old_size);
+	return res;
+}
+
+int mem_map_release(void *ptr, size_t size)
+{
+	if (size < c_atomic_load64(&s_min)) {
+		return 0;
+	}
+
+	map_lock();
+	map_t *map = find(ptr);
+	if (map == NULL) {
+		map_unlock();
+		return 0;
+	}
+
+	const size_t len = map->len;
+	if (s_cached < MAP_CACHE && c_atomic_load64(&s_threshold) > 0) {
+		// Before it can be reused, so the pages of its next owner are not discarded
+		os_release(ptr, len);
+		map->cached = 1;
+		s_cached++;
+		update_min();
+		map_unlock();
+		return 1;
+	}
+
+	del(map);
+	update_min();
+	map_unlock();
+
+	os_unmap(ptr, len);
+	mem_stat_map(-(ptrdiff_t)len, -1);
+	return 1;
+}
+
+size_t mem_map_resident()
+{
+	map_lock();
+	size_t resident = 0;
+	for (u32 i = 0; i < s_maps_cnt; i++) {
+		resident += os_resident(s_maps[i].ptr, s_maps[i].len);
+	}
+	map_unlock();
+
+	return resident;
+}
+
+int mem_map_conf(size_t threshold, int huge, int hugetlb)
+{
+	c_atomic_store32(&s_huge, (u32)huge);
+	c_atomic_store32(&s_hugetlb, (u32)hugetlb);
+	c_atomic_store64(&s_threshold, threshold);
+
+	if (threshold != 0) {
+		return 0;
+	}
+
+	// Disabled, unmap the released mappings kept for reuse, live ones are unmapped when freed
+	map_lock();
+	for (u32 i = 0; i < s_maps_cnt;) {
+		map_t *map = &s_maps[i];
+		if (!map->cached) {
+			i++;
+			continue;
+		}
+
+		os_unmap(map->ptr, map->len);
+		mem_stat_map(-(ptrdiff_t)map->len, -1);
+		del(map);
+	}
+	s_cached = 0;
+	map_unlock();
+
+	return 0;
+}
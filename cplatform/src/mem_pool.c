@@ -0,0 +1,300 @@
+#include "mem_pool.h"
+
+#include "c_thread.h"
+#include "log.h"
+#include "mem.h"
+#include "mem_priv.h"
+
+#define POOL_LINE   MEM_CACHE_LINE
+#define POOL_CACHES 16
+
+struct mem_pool_slab_s {
+	mem_pool_slab_t *next;
+	size_t size;
+};
+
+// Free objects of one pool cached by the current thread
+typedef struct pool_cache_s {
+	u32 id;
+	u32 cnt;
+	void *head;
+} pool_cache_t;
+
+static C_THREAD_LOCAL pool_cache_t s_caches[POOL_CACHES];
+static u32 s_ids;
+// Id of the live pool owning each cache, so an entry with another id is left from a freed pool
+static volatile u32 s_owners[POOL_CACHES];
+
+static void pool_lock(mem_pool_t *pool)
+{
+	while (!c_atomic_cas32(&pool->lock, 0, 1)) {
+		c_atomic_pause();
+	}
+}
+
+static void pool_unlock(mem_pool_t *pool)
+{
+	c_atomic_store32(&pool->lock, 0);
+}
+
+static size_t slot_size(size_t size)
+{
+	size = size < sizeof(void *) ? sizeof(void *) : size;
+
+	if (size > POOL_LINE) {
+		return (size + POOL_LINE - 1) / POOL_LINE * POOL_LINE;
+	}
+
+	size_t slot = sizeof(void *);
+	while (slot < size) {
+		slot <<= 1;
+	}
+	return slot;
+}
+
+mem_pool_t *mem_pool_init(mem_pool_t *pool, size_t size, u32 slab_cnt, int flags)
+{
+	if (pool == NULL || size == 0 || slab_cnt == 0) {
+		return NULL;
+	}
+
+	pool->size	= size;
+	pool->slot	= slot_size(size);
+	pool->slab_cnt	= slab_cnt;
+	pool->flags	= flags;
+	pool->id	= c_atomic_add32(&s_ids, 1) + 1;
+	pool->cache	= POOL_CACHES;
+	pool->lock	= 0;
+	pool->free	= NULL;
+	pool->slabs	= NULL;
+	pool->slabs_cnt = 0;
+	pool->live	= 0;
+	pool->peak	= 0;
+
+	// Without a free cache the pool works uncached
+	for (u32 i = 0; (flags & MEM_POOL_CACHE) && i < POOL_CACHES; i++) {
+		if (c_atomic_cas32(&s_owners[i], 0, pool->id)) {
+			pool->cache = i;
+			break;
+		}
+	}
+
+	return pool;
+}
+
+int mem_pool_free(mem_pool_t *pool)
+{
+	if (pool == NULL) {
+		return 1;
+	}
+
+	mem_pool_flush(pool);
+
+	// Objects other threads still cache point into the slabs freed below, their entries are
+	// discarded by the next pool given this cache
+	if (pool->cache < POOL_CACHES) {
+		c_atomic_store32(&s_owners[pool->cache], 0);
+	}
+
+	mem_stat_pool(0, 0, -(ptrdiff_t)pool->live, pool->size);
+
+	mem_pool_slab_t *slab = pool->slabs;
+	while (slab != NULL) {
+		mem_pool_slab_t *next = slab->next;
+		mem_stat_pool(-(ptrdiff_t)slab->size, -1, 0, 0);
+		mem_free(slab, slab->size);
+		slab = next;
+	}
+
+	pool->free	= NULL;
+	pool->slabs	= NULL;
+	pool->slabs_cnt = 0;
+	pool->live	= 0;
+	pool->slot	= 0;
+	pool->id	= 0;
+	pool->cache	= POOL_CACHES;
+
+	return 0;
+}
+
+static int slab_add(mem_pool_t *pool)
+{
+	const size_t size = sizeof(mem_pool_slab_t) + POOL_LINE + pool->slot * pool->slab_cnt;
+
+	mem_pool_slab_t *slab = mem_alloc(size);
+	if (slab == NULL) {
+		return 1;
+	}
+
+	slab->next  = pool->slabs;
+	slab->size  = size;
+	pool->slabs = slab;
+	pool->slabs_cnt++;
+	mem_stat_pool((ptrdiff_t)size, 1, 0, 0);
+
+	const size_t addr = (size_t)slab + sizeof(mem_pool_slab_t);
+	char *data	  = (char *)slab + sizeof(mem_pool_slab_t) + (POOL_LINE - addr % POOL_LINE) % POOL_LINE;
+
+	// Linked back to front so objects are handed out in address order
+	for (u32 i = pool->slab_cnt; i > 0; i--) {
+		void *obj     = data + (size_t)(i - 1) * pool->slot;
+		*(void **)obj = pool->free;
+		pool->free    = obj;
+	}
+
+	return 0;
+}
+
+static void pool_live(mem_pool_t *pool, ptrdiff_t cnt)
+{
+	pool->live += (size_t)cnt;
+	pool->peak = pool->live > pool->peak ? pool->live : pool->peak;
+	mem_stat_pool(0, 0, cnt, pool->size);
+}
+
+// Takes up to cnt objects from the shared free list
+static void *pool_take(mem_pool_t *pool, u32 cnt, u32 *taken)
+{
+	pool_lock(pool);
+
+	if (pool->free == NULL && slab_add(pool)) {
+		pool_unlock(pool);
+		*taken = 0;
+		return NULL;
+	}
+
+	void *head = pool->free;
+	void *tail = head;
+	u32 n	   = 1;
+	while (n < cnt && *(void **)tail != NULL) {
+		tail = *(void **)tail;
+		n++;
+	}
+
+	pool->free     = *(void **)tail;
+	*(void **)tail = NULL;
+	pool_live(pool, (ptrdiff_t)n);
+
+	pool_unlock(pool);
+
+	*taken = n;
+	return head;
+}
+
+// Returns a list of cnt objects ending at tail to the shared free list
+static void pool_give(mem_pool_t *pool, void *head, void *tail, u32 cnt)
+{
+	pool_lock(pool);
+	*(void **)tail = pool->free;
+	pool->free     = head;
+	pool_live(pool, -(ptrdiff_t)cnt);
+	pool_unlock(pool);
+}
+
+static pool_cache_t *cache_get(const mem_pool_t *pool)
+{
+	if (pool->cache >= POOL_CACHES) {
+		return NULL;
+	}
+
+	pool_cache_t *cache = &s_caches[pool->cache];
+	if (cache->id != pool->id) {
+		// Left from a freed pool, its objects are gone with its slabs
+		cache->id   = pool->id;
+		cache->cnt  = 0;
+		cache->head = NULL;
+	}
+
+	return cache;
+}
+
+void *mem_pool_alloc(mem_pool_t *pool)
+{
+	if (pool == NULL || pool->slot == 0) {
+		return NULL;
+	}
+
+	u32 taken;
+
+	pool_cache_t *cache = cache_get(pool);
+	if (cache == NULL) {
+		return pool_take(pool, 1, &taken);
+	}
+
+	if (cache->head == NULL) {
+		cache->head = pool_take(pool, MEM_POOL_CACHE_SIZE / 2, &taken);
+		cache->cnt  = taken;
+		if (cache->head == NULL) {
+			return NULL;
+		}
+	}
+
+	void *obj   = cache->head;
+	cache->head = *(void **)obj;
+	cache->cnt--;
+	return obj;
+}
+
+void mem_pool_release(mem_pool_t *pool, void *ptr)
+{
+	if (pool == NULL || pool->slot == 0 || ptr == NULL) {
+		return;
+	}
+
+	pool_cache_t *cache = cache_get(pool);
+	if (cache == NULL) {
+		pool_give(pool, ptr, ptr, 1);
+		return;
+	}
+
+	*(void **)ptr = cache->head;
+	cache->head   = ptr;
+	cache->cnt++;
+
+	if (cache->cnt < MEM_POOL_CACHE_SIZE) {
+		return;
+	}
+
+	// Keep half of the cache, return the rest in one batch
+	void *tail = cache->head;
+	for (u32 i = 1; i < MEM_POOL_CACHE_SIZE / 2; i++) {
+		tail = *(void **)tail;
+	}
+
+	void *head     = *(void **)tail;
+	*(void **)tail = NULL;
+	void *last     = head;
+	while (*(void **)last != NULL) {
+		last = *(void **)last;
+	}
+
+	pool_give(pool, head, last, cache->cnt - MEM_POOL_CACHE_SIZE / 2);
+	cache->cnt = MEM_POOL_CACHE_SIZE / 2;
+}
+
+int mem_pool_flush(mem_pool_t *pool)
+{
+	if (pool == NULL) {
+		return 1;
+	}
+
+	if (pool->cache >= POOL_CACHES) {
+		return 0;
+	}
+
+	pool_cache_t *cache = &s_caches[pool->cache];
+	if (cache->id != pool->id || cache->head == NULL) {
+		return 0;
+	}
+
+	void *tail = cache->head;
+	while (*(void **)tail != NULL) {
+		tail = *(void **)tail;
+	}
+
+	pool_give(pool, cache->head, tail, cache->cnt);
+	cache->head = NULL;
+	cache->cnt  = 0;
+
+	return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef MEM_PRIV_H
+#define MEM_PRIV_H
+
+#include "type.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct mem_dom_s;
+
+void mem_stat_arena(ptrdiff_t used, int chunks);
+void mem_stat_pool(ptrdiff_t mem, int slabs, ptrdiff_t live, size_t size);
+
+void mem_stat_cache(int cls, int hits, int misses, ptrdiff_t cached);
+void mem_stat_map(ptrdiff_t mapped, int maps);
+// Hands the statistics of an exiting thread over to the next new thread
+void mem_stat_release();
+
+int mem_cache_class(size_t size);
+size_t mem_cache_size(int cls);
+int mem_cache_on();
+void *mem_cache_get(int cls);
+int mem_cache_put(void *ptr, int cls);
+void mem_cache_publish();
+
+int mem_map_conf(size_t threshold, int huge, int hugetlb);
+size_t mem_map_page();
+int mem_map_use(size_t size);
+int mem_map_has(void *ptr, size_t size);
+void *mem_map_alloc(size_t size, int zero);
+void *mem_map_realloc(void *ptr, size_t new_size, size_t old_size);
+int mem_map_release(void *ptr, size_t size);
+size_t mem_map_resident();
+
+int mem_prof_sample(size_t size);
+void mem_prof_alloc(void *ptr, size_t size, const char *file, int line, const char *func);
+void mem_prof_free(void *ptr);
+int mem_prof_active();
+
+// Charges size bytes to the domain and its ancestors, fails without charging over a hard budget
+int mem_dom_charge(struct mem_dom_s *dom, size_t size, int allocs);
+void mem_dom_uncharge(struct mem_dom_s *dom, size_t size);
+
+int mem_trace_lock();
+void mem_trace_alloc(int op, void *ptr, size_t size);
+// memory is the address of the block before it was reallocated, it may be freed already
+void mem_trace_realloc(uintptr_t memory, void *ptr, size_t new_size, size_t old_size);
+void mem_trace_free(void *ptr, size_t size);
+
+#endif
@@ -0,0 +1,440 @@
+#include "mem_prof.h"
+
+#include "c_thread.h"
+#include "c_time.h"
+#include "mem_priv.h"
+
+#if defined(C_WIN)
+#else
+	#include <execinfo.h>
+#endif
+
+#define FILTER_SLOTS (1 << 14)
+// Frames of mem_prof_alloc() and the mem_*_at() entry point
+#define SKIP_FRAMES 2
+// Sites mem_prof_dump() copies out at a time
+#define DUMP_BATCH 32
+
+typedef struct prof_site_s {
+	const char *file;
+	const char *func;
+	int line;
+	int frames_cnt;
+	void *frames[MEM_PROF_FRAMES];
+	u64 hash;
+	u64 allocs;
+	u64 alloc_bytes;
+	u64 live;
+	u64 live_bytes;
+} prof_site_t;
+
+// Sampled allocation that was not freed yet
+typedef struct prof_live_s {
+	void *ptr;
+	prof_site_t *site;
+	u64 count;
+	u64 bytes;
+} prof_live_t;
+
+static volatile u64 s_rate;
+static int s_flags;
+static volatile u32 s_lock;
+static volatile u32 s_tracking;
+static u64 s_samples;
+
+static prof_site_t s_sites[MEM_PROF_SITES];
+static u32 s_sites_cnt;
+static prof_site_t s_other;
+
+static prof_live_t s_live[MEM_PROF_LIVE_MAX];
+static u32 s_live_cnt;
+
+// Live entries per pointer hash, lets mem_free() skip the lock. Counted so a
+// slot clears again once its last entry is freed.
+static volatile u32 s_filter[FILTER_SLOTS];
+
+static C_THREAD_LOCAL s64 s_left;
+static C_THREAD_LOCAL u64 s_left_rate;
+static C_THREAD_LOCAL u64 s_rand;
+
+static void prof_lock()
+{
+	while (!c_atomic_cas32(&s_lock, 0, 1)) {
+		c_atomic_pause();
+	}
+}
+
+static void prof_unlock()
+{
+	c_atomic_store32(&s_lock, 0);
+}
+
+static u64 hash_ptr(const void *ptr)
+{
+	return ((u64)(size_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+static u32 filter_slot(const void *ptr)
+{
+	// High bits, s_live indexes by the middle ones
+	return (u32)(hash_ptr(ptr) >> 50) & (FILTER_SLOTS - 1);
+}
+
+static u64 prof_rand()
+{
+	if (s_rand == 0) {
+		s_rand = (c_cycles() ^ ((u64)c_thread_id() << 32)) | 1;
+	}
+	s_rand ^= s_rand << 13;
+	s_rand ^= s_rand >> 7;
+	s_rand ^= s_rand << 17;
+	return s_rand;
+}
+
+// ln(x) for x >= 1 without libm, accurate to about 1e-5
+static double prof_ln(u64 x)
+{
+	int e = 0;
+	while ((x >> (e + 1)) != 0) {
+		e++;
+	}
+
+	const double m	= (double)x / (double)((u64)1 << e);
+	const double t	= (m - 1) / (m + 1);
+	const double t2 = t * t;
+	return e * 0.6931471805599453 + 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7))));
+}
+
+// exp(-x) for 0 <= x <= 16 without libm
+static double prof_exp_neg(double x)
+{
+	const double y = x / 16;
+	double r       = 1 - y * (1 - y / 2 * (1 - y / 3 * (1 - y / 4 * (1 - y / 5))));
+	for (int i = 0; i < 4; i++) {
+		r *= r;
+	}
+	return r;
+}
+
+// Exponentially distributed distance to the next sampled byte
+static s64 prof_next(u64 rate)
+{
+	const u64 u = (prof_rand() >> 38) + 1;
+	return (s64)((26 * 0.6931471805599453 - prof_ln(u)) * (double)rate) + 1;
+}
+
+int mem_prof_sample(size_t size)
+{
+	const u64 rate = c_atomic_load64(&s_rate);
+	if (rate == 0) {
+		return 0;
+	}
+
+	if (s_left_rate != rate) {
+		s_left_rate = rate;
+		s_left	    = prof_next(rate);
+	}
+
+	s_left -= (s64)size;
+	if (s_left > 0) {
+		return 0;
+	}
+
+	s_left = prof_next(rate);
+	return 1;
+}
+
+static prof_site_t *site_get(const char *file, int line, const char *func, void **frames, int frames_cnt)
+{
+	u64 hash = hash_ptr(file) ^ hash_ptr(func) ^ ((u64)(u32)line * 0xC2B2AE3D27D4EB4FULL);
+	for (int i = 0; i < frames_cnt; i++) {
+		hash = (hash ^ hash_ptr(frames[i])) * 0x100000001B3ULL;
+	}
+
+	for (u32 i = 0; i < MEM_PROF_SITES; i++) {
+		prof_site_t *site = &s_sites[(hash + i) % MEM_PROF_SITES];
+		if (site->hash == 0 && site->allocs == 0) {
+			if (s_sites_cnt >= MEM_PROF_SITES * 3 / 4) {
+				return &s_other;
+			}
+			site->file	 = file;
+			site->func	 = func;
+			site->line	 = line;
+			site->frames_cnt = frames_cnt;
+			for (int j = 0; j < frames_cnt; j++) {
+				site->frames[j] = frames[j];
+			}
+			site->hash = hash | 1;
+			s_sites_cnt++;
+			return site;
+		}
+
+		if (site->hash == (hash | 1) && site->file == file && site->line == line && site->func == func && site->frames_cnt == frames_cnt) {
+			int same = 1;
+			for (int j = 0; j < frames_cnt && same; j++) {
+				same = site->frames[j] == frames[j];
+			}
+			if (same) {
+				return site;
+			}
+		}
+	}
+
+	return &s_other;
+}
+
+static void live_add(void *ptr, prof_site_t *site, u64 count, u64 bytes)
+{
+	if (s_live_cnt >= MEM_PROF_LIVE_MAX * 3 / 4) {
+		return;
+	}
+
+	const u32 mask = MEM_PROF_LIVE_MAX - 1;
+	u32 i	       = (u32)(hash_ptr(ptr) >> 32) & mask;
+	while (s_live[i].ptr != NULL) {
+		i = (i + 1) & mask;
+	}
+
+	s_live[i] = (prof_live_t){ .ptr = ptr, .site = site, .count = count, .bytes = bytes };
+	s_live_cnt++;
+
+	site->live += count;
+	site->live_bytes += bytes;
+
+	// Only changed under the lock
+	volatile u32 *slot = &s_filter[filter_slot(ptr)];
+	c_atomic_store32(slot, c_atomic_load32(slot) + 1);
+}
+
+// Linear probing delete with backward shift, keeps probe chains intact without tombstones
+static void live_del(u32 i)
+{
+	const u32 mask = MEM_PROF_LIVE_MAX - 1;
+
+	volatile u32 *slot = &s_filter[filter_slot(s_live[i].ptr)];
+	c_atomic_store32(slot, c_atomic_load32(slot) - 1);
+
+	s_live_cnt--;
+	for (;;) {
+		s_live[i].ptr = NULL;
+		u32 j	      = i;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (s_live[j].ptr == NULL) {
+				return;
+			}
+			const u32 k = (u32)(hash_ptr(s_live[j].ptr) >> 32) & mask;
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+				continue;
+			}
+			s_live[i] = s_live[j];
+			i	  = j;
+			break;
+		}
+	}
+}
+
+void mem_prof_alloc(void *ptr, size_t size, const char *file, int line, const char *func)
+{
+	void *frames[MEM_PROF_FRAMES + SKIP_FRAMES];
+	int frames_cnt = 0;
+
+	if (s_flags & MEM_PROF_BACKTRACE) {
+#if defined(C_WIN)
+		frames_cnt = CaptureStackBackTrace(SKIP_FRAMES, MEM_PROF_FRAMES, frames, NULL);
+#else
+		frames_cnt = backtrace(frames, MEM_PROF_FRAMES + SKIP_FRAMES) - SKIP_FRAMES;
+		for (int i = 0; i < frames_cnt; i++) {
+			frames[i] = frames[i + SKIP_FRAMES];
+		}
+#endif
+		frames_cnt = frames_cnt < 0 ? 0 : frames_cnt;
+	}
+
+	// An allocation of size bytes is sampled with probability 1 - exp(-size / rate)
+	const u64 rate = c_atomic_load64(&s_rate);
+	const double x = rate == 0 ? 16 : (double)size / (double)rate;
+	const double p = x >= 16 ? 1 : 1 - prof_exp_neg(x);
+	const u64 cnt  = p > 0 ? (u64)(1 / p + 0.5) : 1;
+	const u64 est  = p > 0 ? (u64)((double)size / p + 0.5) : size;
+
+	prof_lock();
+
+	prof_site_t *site = site_get(file, line, func, frames, frames_cnt);
+	site->allocs += cnt;
+	site->alloc_bytes += est;
+	s_samples++;
+
+	live_add(ptr, site, cnt, est);
+
+	prof_unlock();
+}
+
+void mem_prof_free(void *ptr)
+{
+	if (ptr == NULL || !c_atomic_load32(&s_tracking)) {
+		return;
+	}
+
+	if (c_atomic_load32(&s_filter[filter_slot(ptr)]) == 0) {
+		return;
+	}
+
+	prof_lock();
+
+	const u32 mask = MEM_PROF_LIVE_MAX - 1;
+	u32 i	       = (u32)(hash_ptr(ptr) >> 32) & mask;
+	while (s_live[i].ptr != NULL) {
+		if (s_live[i].ptr == ptr) {
+			prof_site_t *site = s_live[i].site;
+			site->live -= s_live[i].count;
+			site->live_bytes -= s_live[i].bytes;
+			live_del(i);
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+
+	prof_unlock();
+}
+
+int mem_prof_active()
+{
+	return c_atomic_load32(&s_tracking) && s_samples > 0;
+}
+
+int mem_prof_start(size_t rate, int flags)
+{
+	if (rate == 0) {
+		return 1;
+	}
+
+	prof_lock();
+
+	for (u32 i = 0; i < MEM_PROF_SITES; i++) {
+		s_sites[i] = (prof_site_t){ 0 };
+	}
+	s_other = (prof_site_t){ 0 };
+	for (u32 i = 0; i < MEM_PROF_LIVE_MAX; i++) {
+		s_live[i].ptr = NULL;
+	}
+	for (u32 i = 0; i < FILTER_SLOTS; i++) {
+		c_atomic_store32(&s_filter[i], 0);
+	}
+
+	s_sites_cnt = 0;
+	s_live_cnt  = 0;
+	s_samples   = 0;
+	s_flags	    = flags;
+	c_atomic_store32(&s_tracking, 1);
+	c_atomic_store64(&s_rate, rate);
+
+	prof_unlock();
+	return 0;
+}
+
+int mem_prof_stop()
+{
+	// Frees of sampled allocations are still tracked, so the live profile stays valid
+	return c_atomic_xchg64(&s_rate, 0) == 0;
+}
+
+static int print_site(print_dst_t dst, const prof_site_t *site)
+{
+	int off = dst.off;
+
+	if (site->file != NULL) {
+		dst.off += dprintf(dst, "%s (%s:%d)", site->func ? site->func : "?", site->file, site->line);
+	} else if (site->frames_cnt > 0) {
+		dst.off += dprintf(dst, "%p", site->frames[0]);
+	} else {
+		dst.off += dprintf(dst, "?");
+	}
+
+	return dst.off - off;
+}
+
+int mem_prof_print(print_dst_t dst, int top)
+{
+	const prof_site_t *picked[MEM_PROF_TOP];
+	prof_site_t tops[MEM_PROF_TOP];
+	int cnt = 0;
+
+	top = top < 0 ? 0 : top > MEM_PROF_TOP ? MEM_PROF_TOP : top;
+
+	// Copied out so the lock is not held while printing
+	prof_lock();
+	for (; cnt < top; cnt++) {
+		const prof_site_t *max = NULL;
+		for (u32 i = 0; i <= MEM_PROF_SITES; i++) {
+			const prof_site_t *site = i < MEM_PROF_SITES ? &s_sites[i] : &s_other;
+			if (site->allocs == 0 || (max != NULL && site->alloc_bytes <= max->alloc_bytes)) {
+				continue;
+			}
+			int taken = 0;
+			for (int j = 0; j < cnt && !taken; j++) {
+				taken = picked[j] == site;
+			}
+			if (!taken) {
+				max = site;
+			}
+		}
+		if (max == NULL) {
+			break;
+		}
+		picked[cnt] = max;
+		tops[cnt]   = *max;
+	}
+	prof_unlock();
+
+	int off = dst.off;
+
+	dst.off += dprintf(dst, "top sites:\n");
+	for (int i = 0; i < cnt; i++) {
+		dst.off += dprintf(dst, "    %10llu B %8llu  ", (unsigned long long)tops[i].alloc_bytes, (unsigned long long)tops[i].allocs);
+		dst.off += print_site(dst, &tops[i]);
+		dst.off += dprintf(dst, "\n");
+	}
+
+	return dst.off - off;
+}
+
+int mem_prof_dump(print_dst_t dst, int kind)
+{
+	prof_site_t batch[DUMP_BATCH];
+
+	int off = dst.off;
+
+	// Copied out in batches so the lock is not held while printing, destinations may allocate
+	for (u32 i = 0; i <= MEM_PROF_SITES;) {
+		int cnt = 0;
+
+		prof_lock();
+		for (; i <= MEM_PROF_SITES && cnt < DUMP_BATCH; i++) {
+			const prof_site_t *site = i < MEM_PROF_SITES ? &s_sites[i] : &s_other;
+			if ((kind == MEM_PROF_LIVE ? site->live_bytes : site->alloc_bytes) != 0) {
+				batch[cnt++] = *site;
+			}
+		}
+		prof_unlock();
+
+		for (int k = 0; k < cnt; k++) {
+			const prof_site_t *site = &batch[k];
+			const u64 val		= kind == MEM_PROF_LIVE ? site->live_bytes : site->alloc_bytes;
+
+			// Outermost frame first, the call site is the leaf
+			for (int j = site->frames_cnt - 1; j >= 0; j--) {
+				dst.off += dprintf(dst, j == site->frames_cnt - 1 ? "%p" : ";%p", site->frames[j]);
+			}
+			if (site->file != NULL || site->frames_cnt == 0) {
+				if (site->frames_cnt > 0) {
+					dst.off += dprintf(dst, ";");
+				}
+				dst.off += print_site(dst, site);
+			}
+			dst.off += dprintf(dst, " %llu\n", (unsigned long long)val);
+		}
+	}
+
+	return dst.off - off;
+}
@@ -0,0 +1,508 @@
+#include "mem.h"
+
+#include "c_thread.h"
+#include "log.h"
+#include "platform.h"
+#include "simd_priv.h"
+
+#include <string.h>
+
+// Streaming threshold used when the last level cache size is unknown
+#define SIMD_STREAM_DEFAULT (8 * 1024 * 1024)
+
+typedef struct simd_s {
+	void (*swap)(unsigned char *p1, unsigned char *p2, size_t size);
+	// Only called from the streaming threshold on
+	void (*set)(unsigned char *dst, int val, size_t size);
+	void (*cpy)(unsigned char *dst, const unsigned char *src, size_t size);
+	int (*cmp)(const unsigned char *l, const unsigned char *r, size_t size);
+} simd_t;
+
+static void swap_tail(unsigned char *p1, unsigned char *p2, size_t size)
+{
+	size_t i = 0;
+	for (; i + sizeof(u64) <= size; i += sizeof(u64)) {
+		u64 a, b;
+		memcpy(&a, p1 + i, sizeof(u64));
+		memcpy(&b, p2 + i, sizeof(u64));
+		memcpy(p1 + i, &b, sizeof(u64));
+		memcpy(p2 + i, &a, sizeof(u64));
+	}
+
+	for (; i < size; i++) {
+		const unsigned char tmp = p1[i];
+		p1[i]			= p2[i];
+		p2[i]			= tmp;
+	}
+}
+
+static void set_libc(unsigned char *dst, int val, size_t size)
+{
+	memset(dst, val, size);
+}
+
+static void cpy_libc(unsigned char *dst, const unsigned char *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+static int cmp_libc(const unsigned char *l, const unsigned char *r, size_t size)
+{
+	return memcmp(l, r, size);
+}
+
+static const simd_t s_scalar = { swap_tail, set_libc, cpy_libc, cmp_libc };
+
+static const simd_t *s_simd = &s_scalar;
+static int s_level;
+static size_t s_stream = SIMD_STREAM_DEFAULT;
+
+#if defined(SIMD_X86)
+
+static int cmp_tail(const unsigned char *l, const unsigned char *r, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (l[i] != r[i]) {
+			return (int)l[i] - (int)r[i];
+		}
+	}
+	return 0;
+}
+
+// Stores bypass the caches so buffers larger than them do not evict the working set
+static void set_sse2(unsigned char *dst, int val, size_t size)
+{
+	size_t head = (16 - (size_t)dst % 16) % 16;
+	head	    = head < size ? head : size;
+	memset(dst, val, head);
+
+	const __m128i v = _mm_set1_epi8((char)val);
+	size_t i	= head;
+	for (; i + 64 <= size; i += 64) {
+		_mm_stream_si128((__m128i *)(dst + i), v);
+		_mm_stream_si128((__m128i *)(dst + i + 16), v);
+		_mm_stream_si128((__m128i *)(dst + i + 32), v);
+		_mm_stream_si128((__m128i *)(dst + i + 48), v);
+	}
+	_mm_sfence();
+
+	memset(dst + i, val, size - i);
+}
+
+static void cpy_sse2(unsigned char *dst, const unsigned char *src, size_t size)
+{
+	size_t head = (16 - (size_t)dst % 16) % 16;
+	head	    = head < size ? head : size;
+	memcpy(dst, src, head);
+
+	size_t i = head;
+	for (; i + 64 <= size; i += 64) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		const __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		const __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+		const __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+		_mm_stream_si128((__m128i *)(dst + i), a);
+		_mm_stream_si128((__m128i *)(dst + i + 16), b);
+		_mm_stream_si128((__m128i *)(dst + i + 32), c);
+		_mm_stream_si128((__m128i *)(dst + i + 48), d);
+	}
+	_mm_sfence();
+
+	memcpy(dst + i, src + i, size - i);
+}
+
+static void swap_sse2(unsigned char *p1, unsigned char *p2, size_t size)
+{
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		const __m128i a0 = _mm_loadu_si128((const __m128i *)(p1 + i));
+		const __m128i a1 = _mm_loadu_si128((const __m128i *)(p1 + i + 16));
+		const __m128i b0 = _mm_loadu_si128((const __m128i *)(p2 + i));
+		const __m128i b1 = _mm_loadu_si128((const __m128i *)(p2 + i + 16));
+		_mm_storeu_si128((__m128i *)(p1 + i), b0);
+		_mm_storeu_si128((__m128i *)(p1 + i + 16), b1);
+		_mm_storeu_si128((__m128i *)(p2 + i), a0);
+		_mm_storeu_si128((__m128i *)(p2 + i + 16), a1);
+	}
+
+	swap_tail(p1 + i, p2 + i, size - i);
+}
+
+static int cmp_sse2(const unsigned char *l, const unsigned char *r, size_t size)
+{
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		const __m128i a	   = _mm_loadu_si128((const __m128i *)(l + i));
+		const __m128i b	   = _mm_loadu_si128((const __m128i *)(r + i));
+		const unsigned neq = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+		if (neq != 0) {
+			const int at = first_bit(neq);
+			return (int)l[i + at] - (int)r[i + at];
+		}
+	}
+
+	return cmp_tail(l + i, r + i, size - i);
+}
+
+SIMD_TARGET("avx2")
+static void set_avx2(unsigned char *dst, int val, size_t size)
+{
+	size_t head = (32 - (size_t)dst % 32) % 32;
+	head	    = head < size ? head : size;
+	memset(dst, val, head);
+
+	const __m256i v = _mm256_set1_epi8((char)val);
+	size_t i	= head;
+	for (; i + 128 <= size; i += 128) {
+		_mm256_stream_si256((__m256i *)(dst + i), v);
+		_mm256_stream_si256((__m256i *)(dst + i + 32), v);
+		_mm256_stream_si256((__m256i *)(dst + i + 64), v);
+		_mm256_stream_si256((__m256i *)(dst + i + 96), v);
+	}
+	_mm_sfence();
+
+	memset(dst + i, val, size - i);
+}
+
+SIMD_TARGET("avx2")
+static void cpy_avx2(unsigned char *dst, const unsigned char *src, size_t size)
+{
+	size_t head = (32 - (size_t)dst % 32) % 32;
+	head	    = head < size ? head : size;
+	memcpy(dst, src, head);
+
+	size_t i = head;
+	for (; i + 128 <= size; i += 128) {
+		const __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+		const __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+		const __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+		_mm256_stream_si256((__m256i *)(dst + i), a);
+		_mm256_stream_si256((__m256i *)(dst + i + 32), b);
+		_mm256_stream_si256((__m256i *)(dst + i + 64), c);
+		_mm256_stream_si256((__m256i *)(dst + i + 96), d);
+	}
+	_mm_sfence();
+
+	memcpy(dst + i, src + i, size - i);
+}
+
+SIMD_TARGET("avx2")
+static void swap_avx2(unsigned char *p1, unsigned char *p2, size_t size)
+{
+	size_t i = 0;
+	for (; i + 64 <= size; i += 64) {
+		const __m256i a0 = _mm256_loadu_si256((const __m256i *)(p1 + i));
+		const __m256i a1 = _mm256_loadu_si256((const __m256i *)(p1 + i + 32));
+		const __m256i b0 = _mm256_loadu_si256((const __m256i *)(p2 + i));
+		const __m256i b1 = _mm256_loadu_si256((const __m256i *)(p2 + i + 32));
+		_mm256_storeu_si256((__m256i *)(p1 + i), b0);
+		_mm256_storeu_si256((__m256i *)(p1 + i + 32), b1);
+		_mm256_storeu_si256((__m256i *)(p2 + i), a0);
+		_mm256_storeu_si256((__m256i *)(p2 + i + 32), a1);
+	}
+
+	swap_sse2(p1 + i, p2 + i, size - i);
+}
+
+SIMD_TARGET("avx2")
+static int cmp_avx2(const unsigned char *l, const unsigned char *r, size_t size)
+{
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		const __m256i a	   = _mm256_loadu_si256((const __m256i *)(l + i));
+		const __m256i b	   = _mm256_loadu_si256((const __m256i *)(r + i));
+		const unsigned neq = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+		if (neq != 0) {
+			const int at = first_bit(neq);
+			return (int)l[i + at] - (int)r[i + at];
+		}
+	}
+
+	return cmp_sse2(l + i, r + i, size - i);
+}
+
+SIMD_TARGET("avx512f,avx512bw")
+static void set_avx512(unsigned char *dst, int val, size_t size)
+{
+	size_t head = (64 - (size_t)dst % 64) % 64;
+	head	    = head < size ? head : size;
+	memset(dst, val, head);
+
+	const __m512i v = _mm512_set1_epi8((char)val);
+	size_t i	= head;
+	for (; i + 256 <= size; i += 256) {
+		_mm512_stream_si512((void *)(dst + i), v);
+		_mm512_stream_si512((void *)(dst + i + 64), v);
+		_mm512_stream_si512((void *)(dst + i + 128), v);
+		_mm512_stream_si512((void *)(dst + i + 192), v);
+	}
+	_mm_sfence();
+
+	memset(dst + i, val, size - i);
+}
+
+SIMD_TARGET("avx512f,avx512bw")
+static void cpy_avx512(unsigned char *dst, const unsigned char *src, size_t size)
+{
+	size_t head = (64 - (size_t)dst % 64) % 64;
+	head	    = head < size ? head : size;
+	memcpy(dst, src, head);
+
+	size_t i = head;
+	for (; i + 256 <= size; i += 256) {
+		const __m512i a = _mm512_loadu_si512((const void *)(src + i));
+		const __m512i b = _mm512_loadu_si512((const void *)(src + i + 64));
+		const __m512i c = _mm512_loadu_si512((const void *)(src + i + 128));
+		const __m512i d = _mm512_loadu_si512((const void *)(src + i + 192));
+		_mm512_stream_si512((void *)(dst + i), a);
+		_mm512_stream_si512((void *)(dst + i + 64), b);
+		_mm512_stream_si512((void *)(dst + i + 128), c);
+		_mm512_stream_si512((void *)(dst + i + 192), d);
+	}
+	_mm_sfence();
+
+	memcpy(dst + i, src + i, size - i);
+}
+
+SIMD_TARGET("avx512f,avx512bw")
+static void swap_avx512(unsigned char *p1, unsigned char *p2, size_t size)
+{
+	size_t i = 0;
+	for (; i + 128 <= size; i += 128) {
+		const __m512i a0 = _mm512_loadu_si512((const void *)(p1 + i));
+		const __m512i a1 = _mm512_loadu_si512((const void *)(p1 + i + 64));
+		const __m512i b0 = _mm512_loadu_si512((const void *)(p2 + i));
+		const __m512i b1 = _mm512_loadu_si512((const void *)(p2 + i + 64));
+		_mm512_storeu_si512((void *)(p1 + i), b0);
+		_mm512_storeu_si512((void *)(p1 + i + 64), b1);
+		_mm512_storeu_si512((void *)(p2 + i), a0);
+		_mm512_storeu_si512((void *)(p2 + i + 64), a1);
+	}
+
+	for (; i < size; i += 64) {
+		const __mmask64 mask = size - i >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << (size - i)) - 1;
+		const __m512i a	     = _mm512_maskz_loadu_epi8(mask, p1 + i);
+		const __m512i b	     = _mm512_maskz_loadu_epi8(mask, p2 + i);
+		_mm512_mask_storeu_epi8(p1 + i, mask, b);
+		_mm512_mask_storeu_epi8(p2 + i, mask, a);
+	}
+}
+
+SIMD_TARGET("avx512f,avx512bw")
+static int cmp_avx512(const unsigned char *l, const unsigned char *r, size_t size)
+{
+	size_t i = 0;
+	for (; i + 256 <= size; i += 256) {
+		// Differences of all four vectors are merged, so the loop has a single branch
+		const __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512((const void *)(l + i)), _mm512_loadu_si512((const void *)(r + i)));
+		const __m512i x1 = _mm512_xor_si512(_mm512_loadu_si512((const void *)(l + i + 64)), _mm512_loadu_si512((const void *)(r + i + 64)));
+		const __m512i x2 = _mm512_xor_si512(_mm512_loadu_si512((const void *)(l + i + 128)), _mm512_loadu_si512((const void *)(r + i + 128)));
+		const __m512i x3 = _mm512_xor_si512(_mm512_loadu_si512((const void *)(l + i + 192)), _mm512_loadu_si512((const void *)(r + i + 192)));
+		if (_mm512_test_epi64_mask(_mm512_or_si512(_mm512_or_si512(x0, x1), _mm512_or_si512(x2, x3)), _mm512_set1_epi64(-1)) != 0) {
+			break;
+		}
+	}
+
+	// Masked loads cover the tail without touching bytes past it
+	for (; i < size; i += 64) {
+		const __mmask64 mask = size - i >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << (size - i)) - 1;
+		const __m512i a	     = _mm512_maskz_loadu_epi8(mask, l + i);
+		const __m512i b	     = _mm512_maskz_loadu_epi8(mask, r + i);
+		const u64 neq	     = (u64)_mm512_mask_cmpneq_epi8_mask(mask, a, b);
+		if (neq != 0) {
+			const int at = first_bit(neq);
+			return (int)l[i + at] - (int)r[i + at];
+		}
+	}
+
+	return 0;
+}
+
+static const simd_t s_sse2   = { swap_sse2, set_sse2, cpy_sse2, cmp_sse2 };
+static const simd_t s_avx2   = { swap_avx2, set_avx2, cpy_avx2, cmp_avx2 };
+static const simd_t s_avx512 = { swap_avx512, set_avx512, cpy_avx512, cmp_avx512 };
+
+static void cpuid(u32 leaf, u32 sub, u32 regs[4])
+{
+	#if defined(C_WIN)
+	int r[4];
+	__cpuidex(r, (int)leaf, (int)sub);
+	for (int i = 0; i < 4; i++) {
+		regs[i] = (u32)r[i];
+	}
+	#else
+	__cpuid_count(leaf, sub, regs[0], regs[1], regs[2], regs[3]);
+	#endif
+}
+
+// Register state the OS saves on context switches, wide registers are only usable if it does
+static u64 xgetbv()
+{
+	#if defined(C_WIN)
+	return _xgetbv(0);
+	#else
+	u32 lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((u64)hi << 32) | lo;
+	#endif
+}
+
+static int simd_level()
+{
+	u32 regs[4];
+	cpuid(0, 0, regs);
+	const u32 max = regs[0];
+
+	cpuid(1, 0, regs);
+	if (!((regs[3] >> 26) & 1)) {
+		return MEM_SIMD_NONE;
+	}
+
+	if (max < 7 || !((regs[2] >> 27) & 1)) {
+		return MEM_SIMD_SSE2;
+	}
+
+	const u64 xcr0 = xgetbv();
+	if ((xcr0 & 0x6) != 0x6) {
+		return MEM_SIMD_SSE2;
+	}
+
+	cpuid(7, 0, regs);
+	if (!((regs[1] >> 5) & 1)) {
+		return MEM_SIMD_SSE2;
+	}
+
+	if ((xcr0 & 0xe0) != 0xe0 || !((regs[1] >> 16) & 1) || !((regs[1] >> 30) & 1)) {
+		return MEM_SIMD_AVX2;
+	}
+
+	return MEM_SIMD_AVX512;
+}
+
+// Size of the largest data or unified cache, from the deterministic cache parameters leaf of Intel or AMD
+static size_t cache_size()
+{
+	u32 regs[4];
+	cpuid(0x80000000, 0, regs);
+	const u32 ext = regs[0];
+
+	const u32 leaves[] = { 4, 0x8000001d };
+	size_t size	   = 0;
+	for (int l = 0; l < 2; l++) {
+		if (leaves[l] == 0x8000001d && ext < 0x8000001d) {
+			continue;
+		}
+
+		for (u32 sub = 0; sub < 16; sub++) {
+			cpuid(leaves[l], sub, regs);
+			const u32 type = regs[0] & 0x1f;
+			if (type == 0) {
+				break;
+			}
+			if (type == 2) {
+				continue;
+			}
+
+			const size_t ways  = ((regs[1] >> 22) & 0x3ff) + 1;
+			const size_t parts = ((regs[1] >> 12) & 0x3ff) + 1;
+			const size_t line  = (regs[1] & 0xfff) + 1;
+			const size_t sets  = (size_t)regs[2] + 1;
+			if (ways * parts * line * sets > size) {
+				size = ways * parts * line * sets;
+			}
+		}
+
+		if (size > 0) {
+			break;
+		}
+	}
+
+	return size;
+}
+
+#endif
+
+int mem_simd_set(int level, size_t stream)
+{
+#if defined(SIMD_X86)
+	const int max = simd_level();
+	level	      = level > max ? max : level;
+
+	if (stream == 0) {
+		stream = cache_size();
+	}
+#else
+	level = MEM_SIMD_NONE;
+#endif
+	s_stream = stream == 0 ? SIMD_STREAM_DEFAULT : stream;
+
+	const simd_t *simd = &s_scalar;
+#if defined(SIMD_X86)
+	switch (level) {
+	case MEM_SIMD_SSE2: simd = &s_sse2; break;
+	case MEM_SIMD_AVX2: simd = &s_avx2; break;
+	case MEM_SIMD_AVX512: simd = &s_avx512; break;
+	default: level = MEM_SIMD_NONE; break;
+	}
+#endif
+
+	s_level = level;
+	c_atomic_storep((void *volatile *)&s_simd, (void *)simd);
+
+	return level;
+}
+
+int mem_simd_get()
+{
+	return s_level;
+}
+
+static const simd_t *simd()
+{
+	return c_atomic_loadp((void *const volatile *)&s_simd);
+}
+
+void *mem_set(void *dst, int val, size_t size)
+{
+	if (dst == NULL) {
+		return NULL;
+	}
+
+	if (size < s_stream) {
+		return memset(dst, val, size);
+	}
+
+	simd()->set(dst, val, size);
+	return dst;
+}
+
+void *mem_cpy(void *dst, size_t size, const void *src, size_t len)
+{
+	if (len > size) {
+		log_error("cutils", "mem", NULL, "destination too small %d/%d", size, len);
+		return NULL;
+	}
+
+	if (len < s_stream) {
+		return memcpy(dst, src, len);
+	}
+
+	simd()->cpy(dst, src, len);
+	return dst;
+}
+
+int mem_cmp(const void *l, const void *r, size_t size)
+{
+	return simd()->cmp(l, r, size);
+}
+
+int mem_swap(void *ptr1, void *ptr2, size_t size)
+{
+	if (ptr1 == NULL || ptr2 == NULL) {
+		return 1;
+	}
+
+	simd()->swap(ptr1, ptr2, size);
+	return 0;
+}
@@ -0,0 +1,332 @@
+#include "mem_trace.h"
+
+#include "c_thread.h"
+#include "c_time.h"
+#include "mem_priv.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC   "CMTR"
+#define TRACE_VERSION 1
+#define TRACE_IDS     1024
+// Op, four varints and a sixth for the old size of reallocs
+#define TRACE_REC_MAX (1 + 6 * 10)
+
+// Live block keyed by its address, ids are what the trace refers to instead of addresses
+typedef struct trace_id_s {
+	uintptr_t key;
+	u64 id;
+} trace_id_t;
+
+static volatile u32 s_active;
+static volatile u32 s_lock;
+static print_buf_t *s_pbuf;
+static u64 s_time;
+static u64 s_next;
+
+static trace_id_t *s_ids;
+static u32 s_ids_cap;
+static u32 s_ids_cnt;
+
+// Set while the current thread writes a record, allocations made meanwhile are not traced
+static C_THREAD_LOCAL int s_inside;
+
+// Held across reallocs and writes to the sink, waiters give up the processor instead of spinning on it
+static void trace_lock()
+{
+	while (!c_atomic_cas32(&s_lock, 0, 1)) {
+		c_thread_yield();
+	}
+	s_inside = 1;
+}
+
+static void trace_unlock()
+{
+	s_inside = 0;
+	c_atomic_store32(&s_lock, 0);
+}
+
+static u32 hash_key(uintptr_t key, u32 cap)
+{
+	return (u32)((((u64)key >> 4) * 0x9E3779B97F4A7C15ULL) >> 32) & (cap - 1);
+}
+
+static int ids_put(trace_id_t *ids, u32 cap, uintptr_t key, u64 id)
+{
+	u32 i = hash_key(key, cap);
+	while (ids[i].key != 0) {
+		i = (i + 1) & (cap - 1);
+	}
+	ids[i] = (trace_id_t){ .key = key, .id = id };
+	return 0;
+}
+
+static int ids_grow()
+{
+	const u32 cap	= s_ids_cap == 0 ? TRACE_IDS : s_ids_cap * 2;
+	trace_id_t *ids = calloc(cap, sizeof(trace_id_t));
+	if (ids == NULL) {
+		return 1;
+	}
+
+	for (u32 i = 0; i < s_ids_cap; i++) {
+		if (s_ids[i].key != 0) {
+			ids_put(ids, cap, s_ids[i].key, s_ids[i].id);
+		}
+	}
+
+	free(s_ids);
+	s_ids	  = ids;
+	s_ids_cap = cap;
+	return 0;
+}
+
+static u64 ids_add(uintptr_t key)
+{
+	if ((s_ids_cnt + 1) * 2 > s_ids_cap && ids_grow()) {
+		return 0;
+	}
+
+	const u64 id = ++s_next;
+	ids_put(s_ids, s_ids_cap, key, id);
+	s_ids_cnt++;
+	return id;
+}
+
+static void ids_del(u32 i)
+{
+	const u32 mask = s_ids_cap - 1;
+
+	s_ids_cnt--;
+	for (;;) {
+		s_ids[i].key = 0;
+		u32 j	     = i;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (s_ids[j].key == 0) {
+				return;
+			}
+			const u32 k = hash_key(s_ids[j].key, s_ids_cap);
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+				continue;
+			}
+			s_ids[i] = s_ids[j];
+			i	 = j;
+			break;
+		}
+	}
+}
+
+// Removes the block and returns its id, 0 if it was allocated before the trace started
+static u64 ids_take(uintptr_t key)
+{
+	if (s_ids_cap == 0) {
+		return 0;
+	}
+
+	u32 i = hash_key(key, s_ids_cap);
+	while (s_ids[i].key != 0) {
+		if (s_ids[i].key == key) {
+			const u64 id = s_ids[i].id;
+			ids_del(i);
+			return id;
+		}
+		i = (i + 1) & (s_ids_cap - 1);
+	}
+
+	return 0;
+}
+
+static int put_varint(u8 *buf, u64 val)
+{
+	int len = 0;
+	while (val >= 0x80) {
+		buf[len++] = (u8)(val | 0x80);
+		val >>= 7;
+	}
+	buf[len++] = (u8)val;
+	return len;
+}
+
+static void write_rec(int op, u64 id, size_t size, size_t old_size)
+{
+	u8 rec[TRACE_REC_MAX];
+
+	const u64 now = c_mono();
+	int len	      = 0;
+	rec[len++]    = (u8)op;
+	len += put_varint(&rec[len], now - s_time);
+	len += put_varint(&rec[len], c_thread_id());
+	len += put_varint(&rec[len], id);
+	len += put_varint(&rec[len], size);
+	if (op == MEM_TRACE_REALLOC) {
+		len += put_varint(&rec[len], old_size);
+	}
+	s_time = now;
+
+	print_buf_write(s_pbuf, rec, (size_t)len);
+}
+
+int mem_trace_lock()
+{
+	if (s_inside || !c_atomic_load32(&s_active)) {
+		return 0;
+	}
+
+	trace_lock();
+	if (!c_atomic_load32(&s_active)) {
+		trace_unlock();
+		return 0;
+	}
+
+	return 1;
+}
+
+void mem_trace_alloc(int op, void *ptr, size_t size)
+{
+	if (ptr == NULL || !mem_trace_lock()) {
+		return;
+	}
+
+	const u64 id = ids_add((uintptr_t)ptr);
+	if (id != 0) {
+		write_rec(op, id, size, 0);
+	}
+
+	trace_unlock();
+}
+
+void mem_trace_realloc(uintptr_t memory, void *ptr, size_t new_size, size_t old_size)
+{
+	if (ptr != NULL) {
+		const u64 id = ids_take(memory);
+		if (id == 0) {
+			const u64 new_id = ids_add((uintptr_t)ptr);
+			if (new_id != 0) {
+				write_rec(MEM_TRACE_ALLOC, new_id, new_size, 0);
+			}
+		} else {
+			ids_put(s_ids, s_ids_cap, (uintptr_t)ptr, id);
+			s_ids_cnt++;
+			write_rec(MEM_TRACE_REALLOC, id, new_size, old_size);
+		}
+	}
+
+	trace_unlock();
+}
+
+void mem_trace_free(void *ptr, size_t size)
+{
+	if (!mem_trace_lock()) {
+		return;
+	}
+
+	const u64 id = ids_take((uintptr_t)ptr);
+	if (id != 0) {
+		write_rec(MEM_TRACE_FREE, id, size, 0);
+	}
+
+	trace_unlock();
+}
+
+int mem_trace_start(print_buf_t *pbuf)
+{
+	if (pbuf == NULL || c_atomic_load32(&s_active)) {
+		return 1;
+	}
+
+	trace_lock();
+
+	free(s_ids);
+	s_ids	  = NULL;
+	s_ids_cap = 0;
+	s_ids_cnt = 0;
+	s_next	  = 0;
+	s_time	  = c_mono();
+	s_pbuf	  = pbuf;
+
+	const u8 header[] = { TRACE_MAGIC[0], TRACE_MAGIC[1], TRACE_MAGIC[2], TRACE_MAGIC[3], TRACE_VERSION };
+	int ret		  = print_buf_write(pbuf, header, sizeof(header));
+	if (ret == 0) {
+		c_atomic_store32(&s_active, 1);
+	}
+
+	trace_unlock();
+
+	return ret;
+}
+
+int mem_trace_stop()
+{
+	if (!c_atomic_load32(&s_active)) {
+		return 1;
+	}
+
+	trace_lock();
+	c_atomic_store32(&s_active, 0);
+	print_buf_t *pbuf = s_pbuf;
+	free(s_ids);
+	s_ids	  = NULL;
+	s_ids_cap = 0;
+	s_ids_cnt = 0;
+	trace_unlock();
+
+	return print_buf_flush(pbuf);
+}
+
+int mem_trace_header(FILE *file)
+{
+	u8 header[5];
+	if (file == NULL || fread(header, 1, sizeof(header), file) != sizeof(header)) {
+		return 1;
+	}
+
+	return memcmp(header, TRACE_MAGIC, 4) != 0 || header[4] != TRACE_VERSION;
+}
+
+static int get_varint(FILE *file, u64 *val)
+{
+	*val = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		const int c = fgetc(file);
+		if (c == EOF) {
+			return 1;
+		}
+
+		*val |= (u64)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int mem_trace_read(FILE *file, mem_trace_op_t *op)
+{
+	if (file == NULL || op == NULL) {
+		return 1;
+	}
+
+	const int c = fgetc(file);
+	if (c == EOF || c >= __MEM_TRACE_MAX) {
+		return 1;
+	}
+
+	u64 dt, thread, id, size, old_size = 0;
+	if (get_varint(file, &dt) || get_varint(file, &thread) || get_varint(file, &id) || get_varint(file, &size) ||
+	    (c == MEM_TRACE_REALLOC && get_varint(file, &old_size))) {
+		return 1;
+	}
+
+	op->op	     = c;
+	op->time     = op->time + dt;
+	op->thread   = (u32)thread;
+	op->id	     = id;
+	op->size     = (size_t)size;
+	op->old_size = (size_t)old_size;
+
+	return 0;
+}
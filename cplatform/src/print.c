@@ -1,20 +1,36 @@
+#define _POSIX_C_SOURCE 199506L
+
 #include "print.h"
 
+#include "c_time.h"
 #include "log.h"
+#include "mem.h"
 #include "platform.h"
+#include "print_priv.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <locale.h>
 #include <stdio.h>
+#include <string.h>
 #include <wchar.h>
 
 #if defined(C_WIN)
 	#include <io.h>
 #else
 	#include <locale.h>
+	#include <sys/uio.h>
+	#include <unistd.h>
 #endif
 
+// Output up to this length is formatted on the stack and written at once
+#define PRINT_STACK 512
+
+// Buffers registered for c_fflush() of their file
+static print_buf_t *s_bufs[PRINT_BUFS_MAX];
+static u32 s_bufs_cnt;
+static u32 s_bufs_lock;
+
 static FILE *file_reopen(const char *path, const char *mode, FILE *file)
 {
 	errno = 0;
@@ -33,24 +49,48 @@ int c_print_init()
 {
 	const char *locale = setlocale(LC_ALL, "en_US.UTF-8");
 	log_debug("cplatform", "print", NULL, "locale set to %s", locale);
+#if defined(C_WIN)
+	// Wide output is written as UTF-8
+	SetConsoleOutputCP(CP_UTF8);
+#endif
 	return 0;
 }
 
+static int file_printv(FILE *file, const char *fmt, va_list args)
+{
+	char buf[PRINT_STACK];
+
+	va_list copy;
+	va_copy(copy, args);
+	const int len = print_fmt(buf, sizeof(buf), fmt, copy);
+	va_end(copy);
+
+	if (len >= 0 && (size_t)len < sizeof(buf)) {
+		return fwrite(buf, 1, (size_t)len, file) == (size_t)len ? len : -1;
+	}
+
+	va_copy(copy, args);
+#if defined(C_WIN)
+	const int ret = vfprintf_s(file, fmt, copy);
+#else
+	const int ret = vfprintf(file, fmt, copy);
+#endif
+	va_end(copy);
+	return ret;
+}
+
 int c_printv(const char *fmt, va_list args)
 {
 	if (fmt == NULL) {
 		return 0;
 	}
 
-	va_list copy;
-	va_copy(copy, args);
 	errno	= 0;
-	int ret = vprintf(fmt, copy);
+	int ret = file_printv(stdout, fmt, args);
 	if (ret < 0 && errno == 0) {
 		file_reopen(NULL, "w", stdout);
-		ret = vprintf(fmt, copy);
+		ret = file_printv(stdout, fmt, args);
 	}
-	va_end(copy);
 	return ret;
 }
 
@@ -69,26 +109,18 @@ int c_fprintv(FILE *file, const char *fmt, va_list args)
 		return 0;
 	}
 
-	va_list copy;
-	va_copy(copy, args);
-	int ret;
-	errno = 0;
-#if defined(C_WIN)
-	ret = vfprintf_s(file, fmt, copy);
-#else
-	ret = vfprintf(file, fmt, copy);
-#endif
+	errno	= 0;
+	int ret = file_printv(file, fmt, args);
 	if (ret < 0) {
 		int errnum = errno;
 		if (errnum == 0 && (file == stdout || file == stderr)) {
 			file_reopen(NULL, "w", file);
-			ret = vfprintf(file, fmt, copy);
+			ret = file_printv(file, fmt, args);
 		} else {
 			log_error("cplatform", "print", NULL, "failed to write to file: %s (%d)", log_strerror(errnum), errnum);
 			ret = 0;
 		}
 	}
-	va_end(copy);
 	return ret;
 }
 
@@ -111,21 +143,11 @@ int c_sprintv(char *buf, size_t size, int off, const char *fmt, va_list args)
 
 	va_list copy;
 	va_copy(copy, args);
-	int ret;
-#if defined(C_WIN)
-	if (buf == NULL && size == 0) {
-		ret = vsnprintf(buf, size / sizeof(char) - off, fmt, copy);
-	} else {
-		ret = vsnprintf_s(buf, size / sizeof(char) - off, size / sizeof(char) - off, fmt, copy);
-	}
-	va_end(copy);
-#else
-	ret = vsnprintf(buf, size / sizeof(char) - off, fmt, copy);
+	int ret = print_fmt(buf, size / sizeof(char) - off, fmt, copy);
 	va_end(copy);
 	if (size > 0 && (size_t)ret > size - off) {
 		return 0;
 	}
-#endif
 	return ret;
 }
 
@@ -138,27 +160,100 @@ int c_sprintf(char *buf, size_t size, int off, const char *fmt, ...)
 	return ret;
 }
 
-int c_wprintv(const wchar *fmt, va_list args)
+// UTF-8 output of a wide format
+typedef struct wide_buf_s {
+	char *data;
+	int len;
+	char stack[PRINT_STACK];
+} wide_buf_t;
+
+// Transcodes the format to UTF-8 and formats it narrow, -1 if libc wide stdio has to format it
+static int wide_fmt(wide_buf_t *wbuf, const wchar *fmt, va_list args)
 {
-	if (fmt == NULL) {
-		return 0;
+	char stack[PRINT_STACK];
+
+	wbuf->data = wbuf->stack;
+	wbuf->len  = -1;
+
+	const size_t fmt_len = wcslen(fmt);
+	const size_t need    = c_wchar_to_utf8(stack, sizeof(stack), fmt, fmt_len) + 1;
+	char *nfmt	     = stack;
+	if (need > sizeof(stack)) {
+		nfmt = mem_alloc(need);
+		if (nfmt == NULL) {
+			return -1;
+		}
+		c_wchar_to_utf8(nfmt, need, fmt, fmt_len);
+	}
+
+	if (print_fmt_narrow(nfmt)) {
+		va_list copy;
+		va_copy(copy, args);
+		wbuf->len = print_fmt(wbuf->stack, sizeof(wbuf->stack), nfmt, copy);
+		va_end(copy);
+
+		if (wbuf->len >= (int)sizeof(wbuf->stack)) {
+			wbuf->data = mem_alloc((size_t)wbuf->len + 1);
+			if (wbuf->data == NULL) {
+				wbuf->len = -1;
+			} else {
+				va_copy(copy, args);
+				print_fmt(wbuf->data, (size_t)wbuf->len + 1, nfmt, copy);
+				va_end(copy);
+			}
+		}
 	}
 
+	if (nfmt != stack) {
+		mem_free(nfmt, need);
+	}
+	return wbuf->len;
+}
+
+static void wide_free(wide_buf_t *wbuf)
+{
+	if (wbuf->data != wbuf->stack && wbuf->data != NULL) {
+		mem_free(wbuf->data, (size_t)wbuf->len + 1);
+	}
+}
+
+// Writes the output as UTF-8 through the narrow stream, returns its length in wide characters
+static int file_wprintv(FILE *file, const wchar *fmt, va_list args)
+{
+	wide_buf_t wbuf;
+	if (wide_fmt(&wbuf, fmt, args) >= 0) {
+		const size_t len = (size_t)wbuf.len;
+		const int ret	 = fwrite(wbuf.data, 1, len, file) == len ? (int)c_utf8_to_wchar(NULL, 0, wbuf.data, len) : -1;
+		wide_free(&wbuf);
+		return ret;
+	}
+	wide_free(&wbuf);
+
 	va_list copy;
 	va_copy(copy, args);
+	int mode = c_setmodew(file);
+#if defined(C_WIN)
+	const int ret = vfwprintf_s(file, fmt, copy);
+#else
+	const int ret = vfwprintf(file, fmt, copy);
+#endif
+	c_setmode(file, mode);
+	va_end(copy);
+	return ret;
+}
 
-	int mode = c_setmodew(stdout);
+int c_wprintv(const wchar *fmt, va_list args)
+{
+	if (fmt == NULL) {
+		return 0;
+	}
 
 	errno	= 0;
-	int ret = vwprintf(fmt, copy);
+	int ret = file_wprintv(stdout, fmt, args);
 	if (ret < 0 && errno == 0) {
 		file_reopen(NULL, "w", stdout);
-		ret = vwprintf(fmt, copy);
+		ret = file_wprintv(stdout, fmt, args);
 	}
-
-	c_setmode(stdout, mode);
-
-	va_end(copy);
 	return ret;
 }
 
@@ -177,28 +272,18 @@ int c_fwprintv(FILE *file, const wchar *fmt, va_list args)
 		return 0;
 	}
 
-	va_list copy;
-	va_copy(copy, args);
-	int ret;
-	errno = 0;
-#if defined(C_WIN)
-	int mode = c_setmodew(file);
-	ret	 = vfwprintf_s(file, fmt, copy);
-	c_setmode(file, mode);
-#else
-	ret = vfwprintf(file, fmt, copy);
-#endif
+	errno	= 0;
+	int ret = file_wprintv(file, fmt, args);
 	if (ret < 0) {
 		int errnum = errno;
 		if (errnum == 0 && (file == stdout || file == stderr)) {
 			file_reopen(NULL, "w", file);
-			ret = vfwprintf(file, fmt, copy);
+			ret = file_wprintv(file, fmt, args);
 		} else {
 			log_error("cplatform", "print", NULL, "failed to write to file: %s (%d)", log_strerror(errnum), errnum);
 			ret = 0;
 		}
 	}
-	va_end(copy);
 	return ret;
 }
 
@@ -217,7 +302,16 @@ int c_swprintv(wchar *buf, size_t size, int off, const wchar *fmt, va_list args)
 		return 0;
 	}
 
-	buf = buf == NULL ? buf : &buf[off];
+	buf		 = buf == NULL ? buf : &buf[off];
+	const size_t cap = size / sizeof(wchar) - off;
+
+	wide_buf_t wbuf;
+	if (wide_fmt(&wbuf, fmt, args) >= 0) {
+		const size_t ret = c_utf8_to_wchar(buf, cap, wbuf.data, (size_t)wbuf.len);
+		wide_free(&wbuf);
+		return size > 0 && ret >= cap ? 0 : (int)ret;
+	}
+	wide_free(&wbuf);
 
 	va_list copy;
 	va_copy(copy, args);
@@ -225,11 +319,11 @@ int c_swprintv(wchar *buf, size_t size, int off, const wchar *fmt, va_list args)
 #if defined(C_WIN)
 	#pragma warning(push)
 	#pragma warning(disable : 6387)
-	ret = vswprintf_s(buf, size / sizeof(wchar) - off, fmt, copy);
+	ret = vswprintf_s(buf, cap, fmt, copy);
 	#pragma warning(push)
 	va_end(copy);
 #else
-	ret = vswprintf(buf, size / sizeof(wchar) - off, fmt, copy);
+	ret = vswprintf(buf, cap, fmt, copy);
 	va_end(copy);
 
 	if (size > 0 && (size_t)ret > size - off) {
@@ -248,13 +342,57 @@ int c_swprintf(wchar *buf, size_t size, int off, const wchar *fmt, ...)
 	return ret;
 }
 
+static void bufs_lock()
+{
+	while (!c_atomic_cas32(&s_bufs_lock, 0, 1)) {
+		c_atomic_pause();
+	}
+}
+
+static void bufs_unlock()
+{
+	c_atomic_store32(&s_bufs_lock, 0);
+}
+
+// Flushed outside of the registry lock, reporting an error may flush again. The
+// buffers are pinned until then so print_buf_free() waits before freeing them
+static u32 bufs_pin(FILE *file, print_buf_t **bufs)
+{
+	u32 cnt = 0;
+
+	bufs_lock();
+	for (u32 i = 0; i < s_bufs_cnt; i++) {
+		if (file == NULL || s_bufs[i]->file == file) {
+			c_atomic_add32(&s_bufs[i]->users, 1);
+			bufs[cnt++] = s_bufs[i];
+		}
+	}
+	bufs_unlock();
+
+	return cnt;
+}
+
 int c_fflush(FILE *file)
 {
 	if (file == NULL) {
 		return 1;
 	}
 
-	return fflush(file);
+	int ret = fflush(file);
+
+	if (c_atomic_load32(&s_bufs_cnt) == 0) {
+		return ret;
+	}
+
+	print_buf_t *bufs[PRINT_BUFS_MAX];
+	const u32 cnt = bufs_pin(file, bufs);
+
+	for (u32 i = 0; i < cnt; i++) {
+		ret |= print_buf_flush(bufs[i]);
+		c_atomic_add32(&bufs[i]->users, (u32)-1);
+	}
+
+	return ret;
 }
 
 int c_setmode(FILE *file, int mode)
@@ -310,6 +448,611 @@ int c_fprintv_cb(print_dst_t dst, const char *fmt, va_list args)
 	return ret;
 }
 
+static int fd_write(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+#if defined(C_WIN)
+		int n = _write(fd, data, (unsigned int)len);
+#else
+		ssize_t n = write(fd, data, len);
+#endif
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == 0 ? 1 : errno;
+		}
+		data += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int fd_writev(int fd, const char *head, size_t head_len, const char *tail, size_t tail_len)
+{
+#if defined(C_WIN)
+	int ret = fd_write(fd, head, head_len);
+	return ret ? ret : fd_write(fd, tail, tail_len);
+#else
+	struct iovec iov[2] = {
+		{ .iov_base = (void *)head, .iov_len = head_len },
+		{ .iov_base = (void *)tail, .iov_len = tail_len },
+	};
+
+	ssize_t n;
+	do {
+		n = writev(fd, iov, 2);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		return errno == 0 ? 1 : errno;
+	}
+
+	// Finish a short write with plain writes
+	size_t done = (size_t)n;
+	if (done < head_len) {
+		int ret = fd_write(fd, head + done, head_len - done);
+		return ret ? ret : fd_write(fd, tail, tail_len);
+	}
+	done -= head_len;
+	return fd_write(fd, tail + done, tail_len - done);
+#endif
+}
+
+static int fd_writes(int fd, const print_slice_t *slices, size_t cnt)
+{
+#if defined(C_WIN)
+	for (size_t i = 0; i < cnt; i++) {
+		int ret = fd_write(fd, slices[i].data, slices[i].len);
+		if (ret) {
+			return ret;
+		}
+	}
+	return 0;
+#else
+	struct iovec iov[PRINT_IOV_SLICES];
+	for (size_t i = 0; i < cnt; i++) {
+		iov[i] = (struct iovec){ .iov_base = (void *)slices[i].data, .iov_len = slices[i].len };
+	}
+
+	size_t first = 0;
+	while (first < cnt) {
+		ssize_t n = writev(fd, iov + first, (int)(cnt - first));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == 0 ? 1 : errno;
+		}
+
+		// A short write resumes inside the slice it stopped in
+		size_t done = (size_t)n;
+		while (first < cnt && done >= iov[first].iov_len) {
+			done -= iov[first].iov_len;
+			first++;
+		}
+		if (first < cnt) {
+			iov[first].iov_base = (char *)iov[first].iov_base + done;
+			iov[first].iov_len -= done;
+		}
+	}
+	return 0;
+#endif
+}
+
+static int buf_report(int *err, int errnum)
+{
+	// Logged once and outside of the buffer lock, the log may write to this buffer
+	if (errnum != 0 && *err == 0) {
+		*err = errnum;
+		return errnum;
+	}
+	return 0;
+}
+
+static void buf_error(int errnum)
+{
+	if (errnum != 0) {
+		log_error("cplatform", "print", NULL, "failed to write to file: %s (%d)", log_strerror(errnum), errnum);
+	}
+}
+
+static int buf_flush(print_buf_t *pbuf)
+{
+	int errnum = 0;
+	if (pbuf->len > 0) {
+		errnum	  = fd_write(pbuf->fd, pbuf->data, pbuf->len);
+		pbuf->len = 0;
+	}
+	pbuf->flushed = c_mono_coarse();
+	return errnum;
+}
+
+static int buf_due(const print_buf_t *pbuf)
+{
+	return pbuf->flush_ms > 0 && pbuf->len > 0 && c_mono_coarse() - pbuf->flushed >= (u64)pbuf->flush_ms * 1000000;
+}
+
+print_buf_t *print_buf_init(print_buf_t *pbuf, FILE *file, size_t size, u32 flush_ms, int flush_level)
+{
+	if (pbuf == NULL || file == NULL || size == 0) {
+		return NULL;
+	}
+
+	pbuf->data = mem_alloc(size);
+	if (pbuf->data == NULL) {
+		return NULL;
+	}
+
+	// Anything already buffered by stdio goes out before our writes
+	fflush(file);
+
+#if defined(C_WIN)
+	pbuf->fd = _fileno(file);
+#else
+	pbuf->fd = fileno(file);
+#endif
+	pbuf->file	  = file;
+	pbuf->size	  = size;
+	pbuf->len	  = 0;
+	pbuf->flush_ms	  = flush_ms;
+	pbuf->flush_level = flush_level;
+	pbuf->flushed	  = c_mono_coarse();
+	pbuf->err	  = 0;
+	pbuf->users	  = 0;
+	c_mutex_init(&pbuf->mutex);
+
+	bufs_lock();
+	const int full = s_bufs_cnt >= PRINT_BUFS_MAX;
+	if (!full) {
+		s_bufs[s_bufs_cnt] = pbuf;
+		c_atomic_store32(&s_bufs_cnt, s_bufs_cnt + 1);
+	}
+	bufs_unlock();
+
+	// Output of an unregistered buffer would be missed by c_fflush()
+	if (full) {
+		log_error("cplatform", "print", NULL, "too many print buffers: %d", PRINT_BUFS_MAX);
+		c_mutex_free(&pbuf->mutex);
+		mem_free(pbuf->data, size);
+		pbuf->data = NULL;
+		return NULL;
+	}
+
+	return pbuf;
+}
+
+int print_buf_free(print_buf_t *pbuf)
+{
+	if (pbuf == NULL || pbuf->data == NULL) {
+		return 1;
+	}
+
+	bufs_lock();
+	for (u32 i = 0; i < s_bufs_cnt; i++) {
+		if (s_bufs[i] == pbuf) {
+			s_bufs[i] = s_bufs[s_bufs_cnt - 1];
+			c_atomic_store32(&s_bufs_cnt, s_bufs_cnt - 1);
+			break;
+		}
+	}
+	bufs_unlock();
+
+	while (c_atomic_load32(&pbuf->users) != 0) {
+		c_thread_yield();
+	}
+
+	int ret = print_buf_flush(pbuf);
+
+	c_mutex_free(&pbuf->mutex);
+	mem_free(pbuf->data, pbuf->size);
+	pbuf->data = NULL;
+	return ret;
+}
+
+int print_buf_flush(print_buf_t *pbuf)
+{
+	if (pbuf == NULL || pbuf->data == NULL) {
+		return 1;
+	}
+
+	c_mutex_lock(&pbuf->mutex);
+	int errnum = buf_flush(pbuf);
+	int report = buf_report(&pbuf->err, errnum);
+	c_mutex_unlock(&pbuf->mutex);
+
+	buf_error(report);
+	return errnum != 0;
+}
+
+int print_bufs_flush_due()
+{
+	if (c_atomic_load32(&s_bufs_cnt) == 0) {
+		return 0;
+	}
+
+	print_buf_t *bufs[PRINT_BUFS_MAX];
+	const u32 cnt = bufs_pin(NULL, bufs);
+
+	int ret = 0;
+	for (u32 i = 0; i < cnt; i++) {
+		print_buf_t *pbuf = bufs[i];
+
+		c_mutex_lock(&pbuf->mutex);
+		const int errnum = buf_due(pbuf) ? buf_flush(pbuf) : 0;
+		const int report = buf_report(&pbuf->err, errnum);
+		c_mutex_unlock(&pbuf->mutex);
+
+		buf_error(report);
+		ret |= errnum != 0;
+		c_atomic_add32(&pbuf->users, (u32)-1);
+	}
+
+	return ret;
+}
+
+int print_buf_write(print_buf_t *pbuf, const void *data, size_t len)
+{
+	if (pbuf == NULL || pbuf->data == NULL || (data == NULL && len > 0)) {
+		return 1;
+	}
+
+	int errnum = 0;
+
+	c_mutex_lock(&pbuf->mutex);
+
+	if (len <= pbuf->size - pbuf->len) {
+		memcpy(pbuf->data + pbuf->len, data, len);
+		pbuf->len += len;
+	} else if (len < pbuf->size) {
+		errnum = buf_flush(pbuf);
+		memcpy(pbuf->data, data, len);
+		pbuf->len = len;
+	} else {
+		errnum	      = fd_writev(pbuf->fd, pbuf->data, pbuf->len, data, len);
+		pbuf->len     = 0;
+		pbuf->flushed = c_mono_coarse();
+	}
+
+	if (errnum == 0 && buf_due(pbuf)) {
+		errnum = buf_flush(pbuf);
+	}
+
+	const int report = buf_report(&pbuf->err, errnum);
+	c_mutex_unlock(&pbuf->mutex);
+
+	buf_error(report);
+	return errnum != 0;
+}
+
+int c_bprintv_cb(print_dst_t dst, const char *fmt, va_list args)
+{
+	print_buf_t *pbuf = dst.priv;
+	if (pbuf == NULL || pbuf->data == NULL || fmt == NULL) {
+		return 0;
+	}
+
+	int errnum = 0;
+	va_list copy;
+
+	c_mutex_lock(&pbuf->mutex);
+
+	size_t avail = pbuf->size - pbuf->len;
+	va_copy(copy, args);
+	int len = print_fmt(pbuf->data + pbuf->len, avail, fmt, copy);
+	va_end(copy);
+
+	if (len < 0) {
+		len = 0;
+	} else if ((size_t)len < avail) {
+		pbuf->len += (size_t)len;
+	} else if ((size_t)len < pbuf->size) {
+		errnum = buf_flush(pbuf);
+		va_copy(copy, args);
+		print_fmt(pbuf->data, pbuf->size, fmt, copy);
+		va_end(copy);
+		pbuf->len = (size_t)len;
+	} else {
+		// Larger than the whole buffer, write both in one call
+		char *tmp = mem_alloc((size_t)len + 1);
+		if (tmp == NULL) {
+			len = 0;
+		} else {
+			va_copy(copy, args);
+			print_fmt(tmp, (size_t)len + 1, fmt, copy);
+			va_end(copy);
+			errnum	      = fd_writev(pbuf->fd, pbuf->data, pbuf->len, tmp, (size_t)len);
+			pbuf->len     = 0;
+			pbuf->flushed = c_mono_coarse();
+			mem_free(tmp, (size_t)len + 1);
+		}
+	}
+
+	if (errnum == 0 && buf_due(pbuf)) {
+		errnum = buf_flush(pbuf);
+	}
+
+	errnum = buf_report(&pbuf->err, errnum);
+	c_mutex_unlock(&pbuf->mutex);
+
+	buf_error(errnum);
+	return len;
+}
+
+print_dyn_t *print_dyn_init(print_dyn_t *dyn, size_t size)
+{
+	if (dyn == NULL) {
+		return NULL;
+	}
+
+	dyn->data   = dyn->buf;
+	dyn->size   = sizeof(dyn->buf);
+	dyn->len    = 0;
+	dyn->err    = 0;
+	dyn->buf[0] = '\0';
+
+	if (size > sizeof(dyn->buf)) {
+		dyn->data = mem_alloc(size);
+		if (dyn->data == NULL) {
+			return NULL;
+		}
+		dyn->size    = size;
+		dyn->data[0] = '\0';
+	}
+
+	return dyn;
+}
+
+int print_dyn_free(print_dyn_t *dyn)
+{
+	if (dyn == NULL) {
+		return 1;
+	}
+
+	if (dyn->data != dyn->buf) {
+		mem_free(dyn->data, dyn->size);
+	}
+
+	dyn->data   = dyn->buf;
+	dyn->size   = sizeof(dyn->buf);
+	dyn->len    = 0;
+	dyn->buf[0] = '\0';
+	return 0;
+}
+
+void print_dyn_reset(print_dyn_t *dyn)
+{
+	if (dyn == NULL) {
+		return;
+	}
+
+	dyn->len     = 0;
+	dyn->err     = 0;
+	dyn->data[0] = '\0';
+}
+
+char *print_dyn_take(print_dyn_t *dyn, size_t *size)
+{
+	if (dyn == NULL || size == NULL || dyn->len == 0) {
+		return NULL;
+	}
+
+	char *str = dyn->data;
+	*size	  = dyn->size;
+
+	if (str == dyn->buf) {
+		str = mem_alloc(dyn->len + 1);
+		if (str == NULL) {
+			return NULL;
+		}
+		memcpy(str, dyn->buf, dyn->len + 1);
+		*size = dyn->len + 1;
+	}
+
+	dyn->data   = dyn->buf;
+	dyn->size   = sizeof(dyn->buf);
+	dyn->len    = 0;
+	dyn->buf[0] = '\0';
+	return str;
+}
+
+static int dyn_grow(print_dyn_t *dyn, size_t need)
+{
+	size_t size = dyn->size * 2;
+	while (size < need) {
+		size *= 2;
+	}
+
+	char *data;
+	if (dyn->data == dyn->buf) {
+		data = mem_alloc(size);
+		if (data != NULL) {
+			memcpy(data, dyn->buf, dyn->len + 1);
+		}
+	} else {
+		data = mem_realloc(dyn->data, size, dyn->size);
+	}
+
+	if (data == NULL) {
+		return 1;
+	}
+
+	dyn->data = data;
+	dyn->size = size;
+	return 0;
+}
+
+int c_dynprintv_cb(print_dst_t dst, const char *fmt, va_list args)
+{
+	print_dyn_t *dyn = dst.priv;
+	if (dyn == NULL || dyn->data == NULL || fmt == NULL) {
+		return 0;
+	}
+
+	size_t avail = dyn->size - dyn->len;
+	va_list copy;
+	va_copy(copy, args);
+	int len = print_fmt(dyn->data + dyn->len, avail, fmt, copy);
+	va_end(copy);
+
+	if (len < 0) {
+		dyn->data[dyn->len] = '\0';
+		return 0;
+	}
+
+	if ((size_t)len >= avail) {
+		if (dyn_grow(dyn, dyn->len + (size_t)len + 1)) {
+			// Keeps what was printed before, the partial output is cut off
+			dyn->err	    = 1;
+			dyn->data[dyn->len] = '\0';
+			return 0;
+		}
+
+		va_copy(copy, args);
+		print_fmt(dyn->data + dyn->len, dyn->size - dyn->len, fmt, copy);
+		va_end(copy);
+	}
+
+	dyn->len += (size_t)len;
+	return len;
+}
+
+print_iov_t *print_iov_init(print_iov_t *iov, FILE *file)
+{
+	if (iov == NULL || file == NULL) {
+		return NULL;
+	}
+
+	// Anything already buffered by stdio goes out before our writes
+	fflush(file);
+
+	iov->file = file;
+#if defined(C_WIN)
+	iov->fd = _fileno(file);
+#else
+	iov->fd = fileno(file);
+#endif
+	iov->cnt = 0;
+	iov->len = 0;
+	iov->err = 0;
+	c_mutex_init(&iov->mutex);
+
+	return iov;
+}
+
+int print_iov_free(print_iov_t *iov)
+{
+	if (iov == NULL || iov->file == NULL) {
+		return 1;
+	}
+
+	int ret = print_iov_flush(iov);
+
+	c_mutex_free(&iov->mutex);
+	iov->file = NULL;
+	return ret;
+}
+
+static int iov_flush(print_iov_t *iov)
+{
+	int errnum = 0;
+	if (iov->cnt > 0) {
+		errnum = fd_writes(iov->fd, iov->slices, iov->cnt);
+	}
+	iov->cnt = 0;
+	iov->len = 0;
+	return errnum;
+}
+
+int print_iov_flush(print_iov_t *iov)
+{
+	if (iov == NULL || iov->file == NULL) {
+		return 1;
+	}
+
+	c_mutex_lock(&iov->mutex);
+	int errnum = iov_flush(iov);
+	int report = buf_report(&iov->err, errnum);
+	c_mutex_unlock(&iov->mutex);
+
+	buf_error(report);
+	return errnum != 0;
+}
+
+// Formats output too large for the scratch or left to libc in one piece and writes it with the pending slices
+static int iov_whole(print_iov_t *iov, const char *fmt, va_list args, int *errnum)
+{
+	va_list copy;
+	va_copy(copy, args);
+	int len = print_fmt(NULL, 0, fmt, copy);
+	va_end(copy);
+	if (len <= 0) {
+		return 0;
+	}
+
+	char *tmp = mem_alloc((size_t)len + 1);
+	if (tmp == NULL) {
+		return 0;
+	}
+
+	va_copy(copy, args);
+	print_fmt(tmp, (size_t)len + 1, fmt, copy);
+	va_end(copy);
+
+	if (iov->cnt == PRINT_IOV_SLICES) {
+		*errnum = iov_flush(iov);
+	}
+	iov->slices[iov->cnt++] = (print_slice_t){ .data = tmp, .len = (size_t)len };
+
+	const int ret = iov_flush(iov);
+	*errnum	      = *errnum ? *errnum : ret;
+
+	mem_free(tmp, (size_t)len + 1);
+	return len;
+}
+
+int c_iovprintv_cb(print_dst_t dst, const char *fmt, va_list args)
+{
+	print_iov_t *iov = dst.priv;
+	if (iov == NULL || iov->file == NULL || fmt == NULL) {
+		return 0;
+	}
+
+	int errnum = 0;
+	int len;
+
+	c_mutex_lock(&iov->mutex);
+
+	// Into the free slices and scratch, again after a flush if they ran out
+	for (int retry = 0;; retry++) {
+		print_refs_t refs = { .slices = iov->slices + iov->cnt, .max = PRINT_IOV_SLICES - iov->cnt };
+
+		va_list copy;
+		va_copy(copy, args);
+		len = print_fmt_refs(&refs, iov->scratch + iov->len, sizeof(iov->scratch) - iov->len, fmt, copy);
+		va_end(copy);
+
+		if (len >= 0) {
+			iov->cnt += refs.cnt;
+			iov->len += refs.used;
+			break;
+		}
+
+		if (retry > 0 || iov->cnt == 0) {
+			len = iov_whole(iov, fmt, args, &errnum);
+			break;
+		}
+
+		errnum = iov_flush(iov);
+	}
+
+	errnum = buf_report(&iov->err, errnum);
+	c_mutex_unlock(&iov->mutex);
+
+	buf_error(errnum);
+	return len;
+}
+
 int c_wprintv_cb(wprint_dst_t dst, const wchar *fmt, va_list args)
 {
 	(void)dst;
@@ -346,6 +1089,53 @@ int dprintf(print_dst_t dst, const char *fmt, ...)
 	return ret;
 }
 
+int dcprintv(print_dst_t dst, const char *fmt, va_list args)
+{
+	if (dst.cb == NULL) {
+		return 0;
+	}
+
+	const print_prog_t *prev = print_prog_use(print_prog_get(fmt));
+	int ret			 = dst.cb(dst, fmt, args);
+	print_prog_use(prev);
+	return ret;
+}
+
+int dcprintf(print_dst_t dst, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int ret = dcprintv(dst, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+int dsync(print_dst_t dst, int level)
+{
+	if (dst.cb == c_iovprintv_cb) {
+		return dst.priv == NULL ? 0 : print_iov_flush(dst.priv);
+	}
+
+	if (dst.cb == c_mapprintv_cb) {
+		print_map_t *map = dst.priv;
+		if (map == NULL || map->sync_level < 0 || level < map->sync_level) {
+			return 0;
+		}
+		return print_map_flush(map);
+	}
+
+	if (dst.cb != c_bprintv_cb) {
+		return 0;
+	}
+
+	print_buf_t *pbuf = dst.priv;
+	if (pbuf == NULL || pbuf->flush_level < 0 || level < pbuf->flush_level) {
+		return 0;
+	}
+
+	return print_buf_flush(pbuf);
+}
+
 int dwprintv(wprint_dst_t dst, const wchar *fmt, va_list args)
 {
 	if (dst.cb == NULL) {
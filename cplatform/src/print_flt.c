@@ -0,0 +1,901 @@
+#include "print_priv.h"
+
+#include "print.h"
+#include "type.h"
+
+#include <string.h>
+
+// 32-bit limbs, holds the scaled bounds of the smallest and largest doubles
+#define FLT_LIMBS 40
+// Digits generated for an exactly rounded conversion, longer ones go to libc
+#define FLT_DIGITS (PRINT_FLT_BUF - 32)
+
+typedef struct flt_big_s {
+	u32 d[FLT_LIMBS];
+	int n;
+} flt_big_t;
+
+// Significand and binary exponent, f * 2^e
+typedef struct flt_fp_s {
+	u64 f;
+	int e;
+} flt_fp_t;
+
+// Normalized 10^k, k from -348 to 340 in steps of 8
+typedef struct flt_pow_s {
+	u64 f;
+	s16 e;
+	s16 k;
+} flt_pow_t;
+
+// Finite value decomposed as f * 2^e
+typedef struct flt_val_s {
+	u64 f;
+	int e;
+	int neg;
+	// The next smaller value is half as far away as the next larger one
+	int lower_closer;
+} flt_val_t;
+
+enum {
+	FLT_FINITE,
+	FLT_INF,
+	FLT_NAN,
+};
+
+static const flt_pow_t s_pows[] = {
+	{ 0xfa8fd5a0081c0288ULL, -1220, -348 },
+	{ 0xbaaee17fa23ebf76ULL, -1193, -340 },
+	{ 0x8b16fb203055ac76ULL, -1166, -332 },
+	{ 0xcf42894a5dce35eaULL, -1140, -324 },
+	{ 0x9a6bb0aa55653b2dULL, -1113, -316 },
+	{ 0xe61acf033d1a45dfULL, -1087, -308 },
+	{ 0xab70fe17c79ac6caULL, -1060, -300 },
+	{ 0xff77b1fcbebcdc4fULL, -1034, -292 },
+	{ 0xbe5691ef416bd60cULL, -1007, -284 },
+	{ 0x8dd01fad907ffc3cULL, -980, -276 },
+	{ 0xd3515c2831559a83ULL, -954, -268 },
+	{ 0x9d71ac8fada6c9b5ULL, -927, -260 },
+	{ 0xea9c227723ee8bcbULL, -901, -252 },
+	{ 0xaecc49914078536dULL, -874, -244 },
+	{ 0x823c12795db6ce57ULL, -847, -236 },
+	{ 0xc21094364dfb5637ULL, -821, -228 },
+	{ 0x9096ea6f3848984fULL, -794, -220 },
+	{ 0xd77485cb25823ac7ULL, -768, -212 },
+	{ 0xa086cfcd97bf97f4ULL, -741, -204 },
+	{ 0xef340a98172aace5ULL, -715, -196 },
+	{ 0xb23867fb2a35b28eULL, -688, -188 },
+	{ 0x84c8d4dfd2c63f3bULL, -661, -180 },
+	{ 0xc5dd44271ad3cdbaULL, -635, -172 },
+	{ 0x936b9fcebb25c996ULL, -608, -164 },
+	{ 0xdbac6c247d62a584ULL, -582, -156 },
+	{ 0xa3ab66580d5fdaf6ULL, -555, -148 },
+	{ 0xf3e2f893dec3f126ULL, -529, -140 },
+	{ 0xb5b5ada8aaff80b8ULL, -502, -132 },
+	{ 0x87625f056c7c4a8bULL, -475, -124 },
+	{ 0xc9bcff6034c13053ULL, -449, -116 },
+	{ 0x964e858c91ba2655ULL, -422, -108 },
+	{ 0xdff9772470297ebdULL, -396, -100 },
+	{ 0xa6dfbd9fb8e5b88fULL, -369, -92 },
+	{ 0xf8a95fcf88747d94ULL, -343, -84 },
+	{ 0xb94470938fa89bcfULL, -316, -76 },
+	{ 0x8a08f0f8bf0f156bULL, -289, -68 },
+	{ 0xcdb02555653131b6ULL, -263, -60 },
+	{ 0x993fe2c6d07b7facULL, -236, -52 },
+	{ 0xe45c10c42a2b3b06ULL, -210, -44 },
+	{ 0xaa242499697392d3ULL, -183, -36 },
+	{ 0xfd87b5f28300ca0eULL, -157, -28 },
+	{ 0xbce5086492111aebULL, -130, -20 },
+	{ 0x8cbccc096f5088ccULL, -103, -12 },
+	{ 0xd1b71758e219652cULL, -77, -4 },
+	{ 0x9c40000000000000ULL, -50, 4 },
+	{ 0xe8d4a51000000000ULL, -24, 12 },
+	{ 0xad78ebc5ac620000ULL, 3, 20 },
+	{ 0x813f3978f8940984ULL, 30, 28 },
+	{ 0xc097ce7bc90715b3ULL, 56, 36 },
+	{ 0x8f7e32ce7bea5c70ULL, 83, 44 },
+	{ 0xd5d238a4abe98068ULL, 109, 52 },
+	{ 0x9f4f2726179a2245ULL, 136, 60 },
+	{ 0xed63a231d4c4fb27ULL, 162, 68 },
+	{ 0xb0de65388cc8ada8ULL, 189, 76 },
+	{ 0x83c7088e1aab65dbULL, 216, 84 },
+	{ 0xc45d1df942711d9aULL, 242, 92 },
+	{ 0x924d692ca61be758ULL, 269, 100 },
+	{ 0xda01ee641a708deaULL, 295, 108 },
+	{ 0xa26da3999aef774aULL, 322, 116 },
+	{ 0xf209787bb47d6b85ULL, 348, 124 },
+	{ 0xb454e4a179dd1877ULL, 375, 132 },
+	{ 0x865b86925b9bc5c2ULL, 402, 140 },
+	{ 0xc83553c5c8965d3dULL, 428, 148 },
+	{ 0x952ab45cfa97a0b3ULL, 455, 156 },
+	{ 0xde469fbd99a05fe3ULL, 481, 164 },
+	{ 0xa59bc234db398c25ULL, 508, 172 },
+	{ 0xf6c69a72a3989f5cULL, 534, 180 },
+	{ 0xb7dcbf5354e9beceULL, 561, 188 },
+	{ 0x88fcf317f22241e2ULL, 588, 196 },
+	{ 0xcc20ce9bd35c78a5ULL, 614, 204 },
+	{ 0x98165af37b2153dfULL, 641, 212 },
+	{ 0xe2a0b5dc971f303aULL, 667, 220 },
+	{ 0xa8d9d1535ce3b396ULL, 694, 228 },
+	{ 0xfb9b7cd9a4a7443cULL, 720, 236 },
+	{ 0xbb764c4ca7a44410ULL, 747, 244 },
+	{ 0x8bab8eefb6409c1aULL, 774, 252 },
+	{ 0xd01fef10a657842cULL, 800, 260 },
+	{ 0x9b10a4e5e9913129ULL, 827, 268 },
+	{ 0xe7109bfba19c0c9dULL, 853, 276 },
+	{ 0xac2820d9623bf429ULL, 880, 284 },
+	{ 0x80444b5e7aa7cf85ULL, 907, 292 },
+	{ 0xbf21e44003acdd2dULL, 933, 300 },
+	{ 0x8e679c2f5e44ff8fULL, 960, 308 },
+	{ 0xd433179d9c8cb841ULL, 986, 316 },
+	{ 0x9e19db92b4e31ba9ULL, 1013, 324 },
+	{ 0xeb96bf6ebadf77d9ULL, 1039, 332 },
+	{ 0xaf87023b9bf0ee6bULL, 1066, 340 },
+};
+
+static const u32 s_pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+
+static int flt_double(double val, flt_val_t *v)
+{
+	u64 bits;
+	memcpy(&bits, &val, sizeof(bits));
+
+	const u64 frac = bits & (((u64)1 << 52) - 1);
+	const int exp  = (int)(bits >> 52) & 0x7ff;
+
+	v->neg = (int)(bits >> 63);
+	if (exp == 0x7ff) {
+		return frac == 0 ? FLT_INF : FLT_NAN;
+	}
+
+	v->f		= exp == 0 ? frac : frac | (u64)1 << 52;
+	v->e		= exp == 0 ? -1074 : exp - 1075;
+	v->lower_closer = exp > 1 && frac == 0;
+	return FLT_FINITE;
+}
+
+static int flt_float(float val, flt_val_t *v)
+{
+	u32 bits;
+	memcpy(&bits, &val, sizeof(bits));
+
+	const u32 frac = bits & ((1U << 23) - 1);
+	const int exp  = (int)(bits >> 23) & 0xff;
+
+	v->neg = (int)(bits >> 31);
+	if (exp == 0xff) {
+		return frac == 0 ? FLT_INF : FLT_NAN;
+	}
+
+	v->f		= exp == 0 ? frac : frac | 1U << 23;
+	v->e		= exp == 0 ? -149 : exp - 150;
+	v->lower_closer = exp > 1 && frac == 0;
+	return FLT_FINITE;
+}
+
+static int bit_len(u64 val)
+{
+	int len = 0;
+	while (val != 0) {
+		val >>= 1;
+		len++;
+	}
+	return len;
+}
+
+static void big_set(flt_big_t *b, u64 val)
+{
+	b->d[0] = (u32)val;
+	b->d[1] = (u32)(val >> 32);
+	b->n	= val >> 32 ? 2 : val ? 1 : 0;
+}
+
+static void big_shl(flt_big_t *b, int bits)
+{
+	if (b->n == 0 || bits == 0) {
+		return;
+	}
+
+	const int limbs = bits / 32;
+	const int shift = bits % 32;
+
+	if (shift > 0) {
+		u32 carry = 0;
+		for (int i = 0; i < b->n; i++) {
+			const u32 val = b->d[i];
+			b->d[i]	      = val << shift | carry;
+			carry	      = val >> (32 - shift);
+		}
+		if (carry != 0) {
+			b->d[b->n++] = carry;
+		}
+	}
+
+	if (limbs > 0) {
+		memmove(&b->d[limbs], b->d, (size_t)b->n * sizeof(u32));
+		memset(b->d, 0, (size_t)limbs * sizeof(u32));
+		b->n += limbs;
+	}
+}
+
+static void big_mul(flt_big_t *b, u32 mul)
+{
+	u64 carry = 0;
+	for (int i = 0; i < b->n; i++) {
+		const u64 val = (u64)b->d[i] * mul + carry;
+		b->d[i]	      = (u32)val;
+		carry	      = val >> 32;
+	}
+	if (carry != 0) {
+		b->d[b->n++] = (u32)carry;
+	}
+}
+
+static void big_pow10(flt_big_t *b, int exp)
+{
+	for (; exp >= 9; exp -= 9) {
+		big_mul(b, s_pow10[9]);
+	}
+	if (exp > 0) {
+		big_mul(b, s_pow10[exp]);
+	}
+}
+
+static int big_cmp(const flt_big_t *l, const flt_big_t *r)
+{
+	if (l->n != r->n) {
+		return l->n < r->n ? -1 : 1;
+	}
+
+	for (int i = l->n - 1; i >= 0; i--) {
+		if (l->d[i] != r->d[i]) {
+			return l->d[i] < r->d[i] ? -1 : 1;
+		}
+	}
+
+	return 0;
+}
+
+static void big_add(flt_big_t *res, const flt_big_t *l, const flt_big_t *r)
+{
+	const int n = l->n > r->n ? l->n : r->n;
+
+	u64 carry = 0;
+	for (int i = 0; i < n; i++) {
+		const u64 val = (u64)(i < l->n ? l->d[i] : 0) + (i < r->n ? r->d[i] : 0) + carry;
+		res->d[i]     = (u32)val;
+		carry	      = val >> 32;
+	}
+
+	res->n = n;
+	if (carry != 0) {
+		res->d[res->n++] = (u32)carry;
+	}
+}
+
+// Requires l >= r
+static void big_sub(flt_big_t *l, const flt_big_t *r)
+{
+	u32 borrow = 0;
+	for (int i = 0; i < l->n; i++) {
+		const u64 sub = (u64)(i < r->n ? r->d[i] : 0) + borrow;
+		borrow	      = l->d[i] < sub;
+		l->d[i]	      = (u32)(l->d[i] - sub);
+	}
+
+	while (l->n > 0 && l->d[l->n - 1] == 0) {
+		l->n--;
+	}
+}
+
+// Quotient of at most 9, the remainder is left in r
+static int big_divmod(flt_big_t *r, const flt_big_t *s)
+{
+	int q = 0;
+	while (big_cmp(r, s) >= 0) {
+		big_sub(r, s);
+		q++;
+	}
+	return q;
+}
+
+// Lower bound of the number of integer digits of f * 2^e, never above the actual one
+static int est_digits(u64 f, int e)
+{
+	const int lg = e + bit_len(f) - 1;
+	return (lg >= 0 ? (lg * 78913) >> 18 : -((-lg * 78914 + (1 << 18) - 1) >> 18)) + 1;
+}
+
+static flt_fp_t fp_norm(flt_fp_t x)
+{
+	while (!(x.f & 0xffc0000000000000ULL)) {
+		x.f <<= 10;
+		x.e -= 10;
+	}
+	while (!(x.f & 0x8000000000000000ULL)) {
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+
+// Upper half of the 128-bit product, rounded
+static flt_fp_t fp_mul(flt_fp_t x, flt_fp_t y)
+{
+	const u64 a = x.f >> 32, b = x.f & 0xffffffff;
+	const u64 c = y.f >> 32, d = y.f & 0xffffffff;
+
+	const u64 ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+
+	u64 mid = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff);
+	mid += 1U << 31;
+
+	return (flt_fp_t){ ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64 };
+}
+
+// Power that scales the binary exponent of the product into [-60, -32]
+static const flt_pow_t *cached_pow(int e)
+{
+	const int min = -60 - (e + 64);
+
+	int lo = 0, hi = (int)(sizeof(s_pows) / sizeof(s_pows[0])) - 1;
+	while (lo < hi) {
+		const int mid = (lo + hi) / 2;
+		if (s_pows[mid].e < min) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return &s_pows[lo];
+}
+
+// Moves the last digit towards w while it stays inside the bounds, fails if the result is not provably the closest
+static int round_weed(char *digits, int len, u64 dist_high_w, u64 unsafe, u64 rest, u64 ten_kappa, u64 unit)
+{
+	const u64 small = dist_high_w - unit;
+	const u64 big	= dist_high_w + unit;
+
+	while (rest < small && unsafe - rest >= ten_kappa && (rest + ten_kappa < small || small - rest >= rest + ten_kappa - small)) {
+		digits[len - 1]--;
+		rest += ten_kappa;
+	}
+
+	if (rest < big && unsafe - rest >= ten_kappa && (rest + ten_kappa < big || big - rest > rest + ten_kappa - big)) {
+		return 0;
+	}
+
+	return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+static int digit_gen(flt_fp_t low, flt_fp_t w, flt_fp_t high, char *digits, int *len, int *kappa)
+{
+	u64 unit	     = 1;
+	const flt_fp_t too_low  = { low.f - unit, low.e };
+	const flt_fp_t too_high = { high.f + unit, high.e };
+	u64 unsafe	     = too_high.f - too_low.f;
+
+	const int shift = -w.e;
+	const u64 one	= (u64)1 << shift;
+
+	u32 integrals	= (u32)(too_high.f >> shift);
+	u64 fractionals = too_high.f & (one - 1);
+
+	u32 divisor = 1;
+	*kappa	    = 1;
+	while (integrals / divisor >= 10) {
+		divisor *= 10;
+		(*kappa)++;
+	}
+
+	*len = 0;
+	while (*kappa > 0) {
+		digits[(*len)++] = (char)('0' + integrals / divisor);
+		integrals %= divisor;
+		(*kappa)--;
+
+		const u64 rest = ((u64)integrals << shift) + fractionals;
+		if (rest < unsafe) {
+			return round_weed(digits, *len, too_high.f - w.f, unsafe, rest, (u64)divisor << shift, unit);
+		}
+		divisor /= 10;
+	}
+
+	for (;;) {
+		fractionals *= 10;
+		unit *= 10;
+		unsafe *= 10;
+
+		digits[(*len)++] = (char)('0' + (fractionals >> shift));
+		fractionals &= one - 1;
+		(*kappa)--;
+
+		if (fractionals < unsafe) {
+			return round_weed(digits, *len, (too_high.f - w.f) * unit, unsafe, fractionals, one, unit);
+		}
+	}
+}
+
+// Grisu3, fails for the few values it can not prove the shortest digits for
+static int grisu(const flt_val_t *v, char *digits, int *len, int *exp)
+{
+	const flt_fp_t w = fp_norm((flt_fp_t){ v->f, v->e });
+	const flt_fp_t high = fp_norm((flt_fp_t){ (v->f << 1) + 1, v->e - 1 });
+
+	flt_fp_t low = v->lower_closer ? (flt_fp_t){ (v->f << 2) - 1, v->e - 2 } : (flt_fp_t){ (v->f << 1) - 1, v->e - 1 };
+	low.f <<= low.e - high.e;
+	low.e = high.e;
+
+	const flt_pow_t *pow = cached_pow(w.e);
+	const flt_fp_t c     = { pow->f, pow->e };
+
+	int kappa;
+	if (!digit_gen(fp_mul(low, c), fp_mul(w, c), fp_mul(high, c), digits, len, &kappa)) {
+		return 0;
+	}
+
+	*exp = kappa - pow->k;
+	return 1;
+}
+
+// Burger and Dybvig free-format digits with exact arithmetic, the fallback of grisu()
+static void dragon(const flt_val_t *v, char *digits, int *len, int *exp)
+{
+	flt_big_t r, s, high, low, sum;
+
+	const int lc = v->lower_closer;
+	big_set(&r, v->f);
+	if (v->e >= 0) {
+		big_shl(&r, v->e + 1 + lc);
+		big_set(&s, 2 << lc);
+		big_set(&high, 1);
+		big_shl(&high, v->e + lc);
+		big_set(&low, 1);
+		big_shl(&low, v->e);
+	} else {
+		big_shl(&r, 1 + lc);
+		big_set(&s, 1);
+		big_shl(&s, 1 + lc - v->e);
+		big_set(&high, 1 << lc);
+		big_set(&low, 1);
+	}
+
+	int k = est_digits(v->f, v->e);
+	if (k >= 0) {
+		big_pow10(&s, k);
+	} else {
+		big_pow10(&r, -k);
+		big_pow10(&high, -k);
+		big_pow10(&low, -k);
+	}
+
+	// Round-to-even reading accepts the bounds themselves for even significands
+	const int even = (v->f & 1) == 0;
+
+	for (;;) {
+		big_add(&sum, &r, &high);
+		const int cmp = big_cmp(&sum, &s);
+		if (even ? cmp < 0 : cmp <= 0) {
+			break;
+		}
+		big_mul(&s, 10);
+		k++;
+	}
+
+	*len = 0;
+	for (;;) {
+		big_mul(&r, 10);
+		big_mul(&high, 10);
+		big_mul(&low, 10);
+
+		int d = big_divmod(&r, &s);
+
+		const int cmp_low = big_cmp(&r, &low);
+		big_add(&sum, &r, &high);
+		const int cmp_high = big_cmp(&sum, &s);
+
+		const int tc1 = even ? cmp_low <= 0 : cmp_low < 0;
+		const int tc2 = even ? cmp_high >= 0 : cmp_high > 0;
+
+		if (!tc1 && !tc2) {
+			digits[(*len)++] = (char)('0' + d);
+			continue;
+		}
+
+		if (tc1 && tc2) {
+			big_shl(&r, 1);
+			const int half = big_cmp(&r, &s);
+			d += half > 0 || (half == 0 && (d & 1));
+		} else if (tc2) {
+			d++;
+		}
+
+		digits[(*len)++] = (char)('0' + d);
+		break;
+	}
+
+	*exp = k - *len;
+}
+
+static void shortest(const flt_val_t *v, char *digits, int *len, int *exp)
+{
+	if (!grisu(v, digits, len, exp)) {
+		dragon(v, digits, len, exp);
+	}
+}
+
+typedef struct flt_out_s {
+	char *buf;
+	int len;
+} flt_out_t;
+
+static void out_char(flt_out_t *out, char c)
+{
+	out->buf[out->len++] = c;
+}
+
+static void out_digits(flt_out_t *out, const char *digits, int len)
+{
+	memcpy(out->buf + out->len, digits, (size_t)len);
+	out->len += len;
+}
+
+static void out_zeros(flt_out_t *out, int len)
+{
+	memset(out->buf + out->len, '0', (size_t)len);
+	out->len += len;
+}
+
+static void out_exp(flt_out_t *out, int exp, char e)
+{
+	out_char(out, e);
+	out_char(out, exp < 0 ? '-' : '+');
+	exp = exp < 0 ? -exp : exp;
+	if (exp >= 100) {
+		out_char(out, (char)('0' + exp / 100));
+	}
+	out_char(out, (char)('0' + exp / 10 % 10));
+	out_char(out, (char)('0' + exp % 10));
+}
+
+// Digits of 0.d1d2... * 10^dp with prec digits after the point, missing digits are zeros
+static void layout_fixed(flt_out_t *out, const char *digits, int len, int dp, int prec)
+{
+	if (dp > 0) {
+		const int ints = dp < len ? dp : len;
+		out_digits(out, digits, ints);
+		out_zeros(out, dp - ints);
+	} else {
+		out_char(out, '0');
+	}
+
+	if (prec == 0) {
+		return;
+	}
+
+	out_char(out, '.');
+	for (int i = dp; i < dp + prec; i++) {
+		out_char(out, i >= 0 && i < len ? digits[i] : '0');
+	}
+}
+
+static void layout_exp(flt_out_t *out, const char *digits, int len, int dp, int prec, char e)
+{
+	out_char(out, len > 0 ? digits[0] : '0');
+	if (prec > 0) {
+		out_char(out, '.');
+		for (int i = 1; i <= prec; i++) {
+			out_char(out, i < len ? digits[i] : '0');
+		}
+	}
+	out_exp(out, len > 0 ? dp - 1 : 0, e);
+}
+
+// Shortest digits laid out like %.<prec>g, without the trailing zeros
+static int layout_short(char *buf, const char *digits, int len, int exp, int neg, int prec)
+{
+	flt_out_t out = { .buf = buf };
+	if (neg) {
+		out_char(&out, '-');
+	}
+
+	const int x = exp + len - 1;
+	if (x >= -4 && x < prec) {
+		layout_fixed(&out, digits, len, x + 1, len - x - 1 > 0 ? len - x - 1 : 0);
+	} else {
+		layout_exp(&out, digits, len, x + 1, len - 1, 'e');
+	}
+
+	return out.len;
+}
+
+// Source of the exact decimal digits of f * 2^e, in 64 bits while the value allows it
+typedef struct flt_gen_s {
+	int big;
+	char ints[20];
+	int ints_len;
+	int ints_pos;
+	u64 frac;
+	int shift;
+	flt_big_t r;
+	flt_big_t s;
+} flt_gen_t;
+
+static int gen_init(flt_gen_t *g, u64 f, int e)
+{
+	const int bits = bit_len(f);
+
+	g->big = e >= 0 ? bits + e > 64 : -e > 60;
+	if (!g->big) {
+		u64 ints      = e >= 0 ? f << e : f >> -e;
+		g->frac	      = e >= 0 ? 0 : f & (((u64)1 << -e) - 1);
+		g->shift      = e >= 0 ? 0 : -e;
+		g->ints_pos   = 0;
+		g->ints_len   = 0;
+
+		char tmp[20];
+		while (ints != 0) {
+			tmp[g->ints_len++] = (char)('0' + ints % 10);
+			ints /= 10;
+		}
+		for (int i = 0; i < g->ints_len; i++) {
+			g->ints[i] = tmp[g->ints_len - 1 - i];
+		}
+
+		if (g->ints_len > 0) {
+			return g->ints_len;
+		}
+
+		int dp = 0;
+		while ((g->frac * 10) >> g->shift == 0) {
+			g->frac *= 10;
+			dp--;
+		}
+		return dp;
+	}
+
+	big_set(&g->r, f);
+	big_set(&g->s, 1);
+	if (e >= 0) {
+		big_shl(&g->r, e);
+	} else {
+		big_shl(&g->s, -e);
+	}
+
+	int k = est_digits(f, e);
+	if (k >= 0) {
+		big_pow10(&g->s, k);
+	} else {
+		big_pow10(&g->r, -k);
+	}
+
+	while (big_cmp(&g->r, &g->s) >= 0) {
+		big_mul(&g->s, 10);
+		k++;
+	}
+
+	return k;
+}
+
+static int gen_next(flt_gen_t *g)
+{
+	if (g->big) {
+		big_mul(&g->r, 10);
+		return big_divmod(&g->r, &g->s);
+	}
+
+	if (g->ints_pos < g->ints_len) {
+		return g->ints[g->ints_pos++] - '0';
+	}
+
+	g->frac *= 10;
+	const int d = (int)(g->frac >> g->shift);
+	g->frac &= g->shift == 0 ? 0 : ((u64)1 << g->shift) - 1;
+	return d;
+}
+
+// Whether any digit after the ones generated is not zero
+static int gen_sticky(const flt_gen_t *g)
+{
+	if (g->big) {
+		return g->r.n != 0;
+	}
+
+	for (int i = g->ints_pos; i < g->ints_len; i++) {
+		if (g->ints[i] != '0') {
+			return 1;
+		}
+	}
+	return g->frac != 0;
+}
+
+// Correctly rounded digits, prec digits after the point if fixed or prec + 1 significant ones, -1 if too many
+static int exact(u64 f, int e, int fixed, int prec, char *digits, int *dp)
+{
+	if (f == 0) {
+		*dp = 1;
+		const int len = fixed ? 0 : prec + 1;
+		if (len > FLT_DIGITS) {
+			return -1;
+		}
+		memset(digits, '0', (size_t)len);
+		return len;
+	}
+
+	flt_gen_t g;
+	*dp = gen_init(&g, f, e);
+
+	int len = fixed ? *dp + prec : prec + 1;
+	if (len + 1 > FLT_DIGITS) {
+		return -1;
+	}
+	if (len < 0) {
+		return 0;
+	}
+
+	for (int i = 0; i < len; i++) {
+		digits[i] = (char)('0' + gen_next(&g));
+	}
+
+	// Ties go to even like the default rounding mode
+	const int next = gen_next(&g);
+	if (next < 5 || (next == 5 && !gen_sticky(&g) && (len == 0 || !((digits[len - 1] - '0') & 1)))) {
+		return len;
+	}
+
+	int i = len - 1;
+	while (i >= 0 && digits[i] == '9') {
+		digits[i--] = '0';
+	}
+
+	if (i >= 0) {
+		digits[i]++;
+		return len;
+	}
+
+	digits[0] = '1';
+	memset(&digits[1], '0', (size_t)len);
+	(*dp)++;
+	return fixed ? len + 1 : len;
+}
+
+int print_flt(char *buf, double val, int conv, int prec)
+{
+	flt_val_t v;
+	if (flt_double(val, &v) != FLT_FINITE) {
+		return -1;
+	}
+
+	char digits[FLT_DIGITS];
+	flt_out_t out = { .buf = buf };
+	const char e  = conv == 'E' || conv == 'G' ? 'E' : 'e';
+
+	int dp;
+	switch (conv) {
+	case 'f':
+	case 'F': {
+		const int len = exact(v.f, v.e, 1, prec, digits, &dp);
+		if (len < 0 || (dp > 0 ? dp : 1) + prec + 2 > PRINT_FLT_BUF) {
+			return -1;
+		}
+		layout_fixed(&out, digits, len, dp, prec);
+		break;
+	}
+	case 'e':
+	case 'E': {
+		const int len = exact(v.f, v.e, 0, prec, digits, &dp);
+		if (len < 0) {
+			return -1;
+		}
+		layout_exp(&out, digits, len, dp, prec, e);
+		break;
+	}
+	default: {
+		const int sig = prec == 0 ? 1 : prec;
+		int len	      = exact(v.f, v.e, 0, sig - 1, digits, &dp);
+		if (len < 0) {
+			return -1;
+		}
+
+		// Trailing zeros are dropped unless the # flag asks for them
+		while (len > 1 && digits[len - 1] == '0') {
+			len--;
+		}
+
+		const int x = v.f == 0 ? 0 : dp - 1;
+		if (x >= -4 && x < sig) {
+			layout_fixed(&out, digits, len, dp, len - dp > 0 ? len - dp : 0);
+		} else {
+			layout_exp(&out, digits, len, dp, len - 1, e);
+		}
+		break;
+	}
+	}
+
+	return out.len;
+}
+
+static int put_special(char *buf, size_t size, int type, int neg)
+{
+	const char *str = type == FLT_INF ? (neg ? "-inf" : "inf") : (neg ? "-nan" : "nan");
+	return c_sprintf(buf, size, 0, "%s", str);
+}
+
+static int put_buf(char *buf, size_t size, const char *str, int len)
+{
+	if (size > 0) {
+		const size_t cnt = (size_t)len < size - 1 ? (size_t)len : size - 1;
+		memcpy(buf, str, cnt);
+		buf[cnt] = '\0';
+	}
+	return len;
+}
+
+int c_dtoa(double val, char *buf, size_t size)
+{
+	flt_val_t v;
+	const int type = flt_double(val, &v);
+	if (type != FLT_FINITE) {
+		return put_special(buf, size, type, v.neg);
+	}
+
+	char str[PRINT_DTOA_SIZE];
+	if (v.f == 0) {
+		return put_buf(buf, size, v.neg ? "-0" : "0", v.neg ? 2 : 1);
+	}
+
+	char digits[20];
+	int len, exp;
+	shortest(&v, digits, &len, &exp);
+	return put_buf(buf, size, str, layout_short(str, digits, len, exp, v.neg, 17));
+}
+
+int c_ftoa(float val, char *buf, size_t size)
+{
+	flt_val_t v;
+	const int type = flt_float(val, &v);
+	if (type != FLT_FINITE) {
+		return put_special(buf, size, type, v.neg);
+	}
+
+	char str[PRINT_DTOA_SIZE];
+	if (v.f == 0) {
+		return put_buf(buf, size, v.neg ? "-0" : "0", v.neg ? 2 : 1);
+	}
+
+	char digits[20];
+	int len, exp;
+	shortest(&v, digits, &len, &exp);
+	return put_buf(buf, size, str, layout_short(str, digits, len, exp, v.neg, 9));
+}
+
+static int dtoa_prec(double val, int prec, char conv, char *buf, size_t size)
+{
+	flt_val_t v;
+	const int type = flt_double(val, &v);
+	if (type != FLT_FINITE) {
+		return put_special(buf, size, type, v.neg);
+	}
+
+	prec = prec < 0 ? 6 : prec;
+
+	char str[PRINT_FLT_BUF + 1];
+	str[0]	      = '-';
+	const int len = print_flt(str + v.neg, val, conv, prec);
+	if (len < 0) {
+		return c_sprintf(buf, size, 0, conv == 'f' ? "%.*f" : "%.*e", prec, val);
+	}
+
+	return put_buf(buf, size, str, len + v.neg);
+}
+
+int c_dtoa_fixed(double val, int prec, char *buf, size_t size)
+{
+	return dtoa_prec(val, prec, 'f', buf, size);
+}
+
+int c_dtoa_exp(double val, int prec, char *buf, size_t size)
+{
+	return dtoa_prec(val, prec, 'e', buf, size);
+}
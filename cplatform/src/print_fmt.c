@@ -0,0 +1,637 @@
+#include "print_priv.h"
+
+#include "c_thread.h"
+#include "platform.h"
+#include "type.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Digits of a u64 in octal, the longest conversion
+#define FMT_DIGITS 24
+
+// Width or precision taken from the arguments
+#define FMT_STAR -2
+
+// Shorter pieces are copied even when they could be referenced
+#define FMT_REF_MIN 16
+
+// Cached programs, a power of two, and conversions per program
+#define PROG_SLOTS  256
+#define PROG_PROBES 8
+#define PROG_OPS    16
+
+enum {
+	FMT_LEFT  = 1 << 0,
+	FMT_ZERO  = 1 << 1,
+	FMT_PLUS  = 1 << 2,
+	FMT_SPACE = 1 << 3,
+};
+
+enum {
+	FMT_LEN_NONE,
+	FMT_LEN_HH,
+	FMT_LEN_H,
+	FMT_LEN_L,
+	FMT_LEN_LL,
+	FMT_LEN_Z,
+	FMT_LEN_J,
+	FMT_LEN_T,
+};
+
+typedef struct fmt_out_s {
+	char *buf;
+	size_t size;
+	size_t len;
+	print_refs_t *refs;
+	size_t mark;
+} fmt_out_t;
+
+typedef struct fmt_spec_s {
+	int flags;
+	int width;
+	int prec;
+	int len;
+	char conv;
+} fmt_spec_t;
+
+enum {
+	PROG_BUSY,
+	PROG_READY,
+	PROG_LIBC,
+};
+
+// Literal run followed by a conversion, the last one has none
+typedef struct fmt_op_s {
+	u16 lit;
+	u16 lit_len;
+	char conv;
+	u8 flags;
+	u8 len;
+	s16 width;
+	s16 prec;
+} fmt_op_t;
+
+struct print_prog_s {
+	const char *volatile fmt;
+	volatile u32 state;
+	u32 cnt;
+	fmt_op_t ops[PROG_OPS];
+};
+
+static const char s_pairs[] = "0001020304050607080910111213141516171819"
+			      "2021222324252627282930313233343536373839"
+			      "4041424344454647484950515253545556575859"
+			      "6061626364656667686970717273747576777879"
+			      "8081828384858687888990919293949596979899";
+
+static const char s_hex[]  = "0123456789abcdef";
+static const char s_hexu[] = "0123456789ABCDEF";
+
+// Open addressing keyed by the format address, slots are claimed once and never freed
+static print_prog_t s_progs[PROG_SLOTS];
+
+static C_THREAD_LOCAL const print_prog_t *s_prog;
+
+// Counts everything, stores what fits and leaves room for the terminator
+static void out_put(fmt_out_t *out, const char *str, size_t len)
+{
+	if (len > 0 && out->len + 1 < out->size) {
+		const size_t avail = out->size - 1 - out->len;
+		const size_t cnt   = len < avail ? len : avail;
+		char *dst	   = out->buf + out->len;
+		// Most pieces are a few characters, a loop is cheaper than the call
+		if (cnt <= 16) {
+			for (size_t i = 0; i < cnt; i++) {
+				dst[i] = str[i];
+			}
+		} else {
+			memcpy(dst, str, cnt);
+		}
+	}
+	out->len += len;
+}
+
+static void refs_add(print_refs_t *refs, const char *data, size_t len)
+{
+	if (refs->cnt == refs->max) {
+		refs->full = 1;
+		return;
+	}
+	refs->slices[refs->cnt++] = (print_slice_t){ .data = data, .len = len };
+}
+
+// Ends the run of copied output since the last reference
+static void refs_cut(fmt_out_t *out)
+{
+	if (out->len > out->mark) {
+		refs_add(out->refs, out->buf + out->mark, out->len - out->mark);
+		out->mark = out->len;
+	}
+}
+
+// Output that stays in place for as long as the references are used
+static void out_ref(fmt_out_t *out, const char *str, size_t len)
+{
+	if (out->refs == NULL || len < FMT_REF_MIN) {
+		out_put(out, str, len);
+		return;
+	}
+
+	refs_cut(out);
+	refs_add(out->refs, str, len);
+	out->refs->ref_len += len;
+}
+
+static void out_fill(fmt_out_t *out, char c, size_t len)
+{
+	if (len > 0 && out->len + 1 < out->size) {
+		const size_t avail = out->size - 1 - out->len;
+		memset(out->buf + out->len, c, len < avail ? len : avail);
+	}
+	out->len += len;
+}
+
+// Converts backwards from end two digits at a time, returns the first digit
+static char *conv_dec(char *end, u64 val)
+{
+	while (val >= 100) {
+		const size_t pair = (size_t)(val % 100) * 2;
+		val /= 100;
+		end -= 2;
+		memcpy(end, &s_pairs[pair], 2);
+	}
+
+	if (val >= 10) {
+		end -= 2;
+		memcpy(end, &s_pairs[val * 2], 2);
+	} else {
+		*--end = (char)('0' + val);
+	}
+
+	return end;
+}
+
+static char *conv_hex(char *end, u64 val, const char *digits)
+{
+	do {
+		*--end = digits[val & 0xf];
+		val >>= 4;
+	} while (val != 0);
+
+	return end;
+}
+
+static char *conv_oct(char *end, u64 val)
+{
+	do {
+		*--end = (char)('0' + (val & 7));
+		val >>= 3;
+	} while (val != 0);
+
+	return end;
+}
+
+static void put_int(fmt_out_t *out, const fmt_spec_t *spec, const char *prefix, size_t prefix_len, const char *digits, size_t len)
+{
+	size_t zeros = spec->prec > 0 && (size_t)spec->prec > len ? (size_t)spec->prec - len : 0;
+	size_t body  = prefix_len + zeros + len;
+	size_t width = spec->width > 0 ? (size_t)spec->width : 0;
+
+	// The zero flag is ignored once a precision is given
+	if ((spec->flags & (FMT_ZERO | FMT_LEFT)) == FMT_ZERO && spec->prec < 0 && width > body) {
+		zeros += width - body;
+		body = width;
+	}
+
+	const size_t pad = width > body ? width - body : 0;
+
+	if (!(spec->flags & FMT_LEFT)) {
+		out_fill(out, ' ', pad);
+	}
+	out_put(out, prefix, prefix_len);
+	out_fill(out, '0', zeros);
+	out_put(out, digits, len);
+	if (spec->flags & FMT_LEFT) {
+		out_fill(out, ' ', pad);
+	}
+}
+
+static void put_str(fmt_out_t *out, const fmt_spec_t *spec, const char *str, size_t len, void (*put)(fmt_out_t *out, const char *str, size_t len))
+{
+	const size_t width = spec->width > 0 ? (size_t)spec->width : 0;
+	const size_t pad   = width > len ? width - len : 0;
+
+	if (!(spec->flags & FMT_LEFT)) {
+		out_fill(out, ' ', pad);
+	}
+	put(out, str, len);
+	if (spec->flags & FMT_LEFT) {
+		out_fill(out, ' ', pad);
+	}
+}
+
+static int finish(fmt_out_t *out)
+{
+	if (out->size > 0) {
+		out->buf[out->len < out->size ? out->len : out->size - 1] = '\0';
+	}
+	return (int)out->len;
+}
+
+// Parses the conversion after a '%', returns the character following it
+static const char *parse_spec(const char *p, fmt_spec_t *spec)
+{
+	*spec = (fmt_spec_t){ .prec = -1 };
+
+	for (;; p++) {
+		if (*p == '-') {
+			spec->flags |= FMT_LEFT;
+		} else if (*p == '0') {
+			spec->flags |= FMT_ZERO;
+		} else if (*p == '+') {
+			spec->flags |= FMT_PLUS;
+		} else if (*p == ' ') {
+			spec->flags |= FMT_SPACE;
+		} else {
+			break;
+		}
+	}
+
+	if (*p == '*') {
+		spec->width = FMT_STAR;
+		p++;
+	} else {
+		while (*p >= '0' && *p <= '9') {
+			spec->width = spec->width * 10 + (*p++ - '0');
+		}
+	}
+
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->prec = FMT_STAR;
+			p++;
+		} else {
+			spec->prec = 0;
+			while (*p >= '0' && *p <= '9') {
+				spec->prec = spec->prec * 10 + (*p++ - '0');
+			}
+		}
+	}
+
+	switch (*p) {
+	case 'h':
+		spec->len = p[1] == 'h' ? FMT_LEN_HH : FMT_LEN_H;
+		p += spec->len == FMT_LEN_HH ? 2 : 1;
+		break;
+	case 'l':
+		spec->len = p[1] == 'l' ? FMT_LEN_LL : FMT_LEN_L;
+		p += spec->len == FMT_LEN_LL ? 2 : 1;
+		break;
+	case 'z':
+		spec->len = FMT_LEN_Z;
+		p++;
+		break;
+	case 'j':
+		spec->len = FMT_LEN_J;
+		p++;
+		break;
+	case 't':
+		spec->len = FMT_LEN_T;
+		p++;
+		break;
+	default: break;
+	}
+
+	spec->conv = *p;
+	return *p == '\0' ? p : p + 1;
+}
+
+// Whether the engine handles the conversion, decided from the format alone
+static int spec_valid(const fmt_spec_t *spec)
+{
+	switch (spec->conv) {
+	case 'd':
+	case 'i': return 1;
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'o': return !(spec->flags & (FMT_PLUS | FMT_SPACE));
+	case 'c':
+	case 's': return spec->len == FMT_LEN_NONE && !(spec->flags & FMT_ZERO);
+	case 'p':
+#if defined(C_WIN)
+		return 0;
+#else
+		return spec->len == FMT_LEN_NONE && !(spec->flags & ~FMT_LEFT) && spec->prec == -1;
+#endif
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G': return spec->len == FMT_LEN_NONE || spec->len == FMT_LEN_L;
+	case '%': return spec->flags == 0 && spec->width == 0 && spec->prec == -1 && spec->len == FMT_LEN_NONE;
+	default: return 0;
+	}
+}
+
+// Converts one argument of a valid conversion, 1 if it has to go to libc after all
+static int put_conv(fmt_out_t *out, fmt_spec_t spec, va_list *args)
+{
+	if (spec.width == FMT_STAR) {
+		spec.width = va_arg(*args, int);
+		if (spec.width < 0) {
+			spec.flags |= FMT_LEFT;
+			spec.width = -spec.width;
+		}
+	}
+
+	if (spec.prec == FMT_STAR) {
+		spec.prec = va_arg(*args, int);
+		spec.prec = spec.prec < 0 ? -1 : spec.prec;
+	}
+
+	char tmp[FMT_DIGITS];
+	char *end = tmp + sizeof(tmp);
+
+	switch (spec.conv) {
+	case 'd':
+	case 'i': {
+		s64 val;
+		switch (spec.len) {
+		case FMT_LEN_HH: val = (signed char)va_arg(*args, int); break;
+		case FMT_LEN_H: val = (short)va_arg(*args, int); break;
+		case FMT_LEN_L: val = va_arg(*args, long); break;
+		case FMT_LEN_LL: val = va_arg(*args, long long); break;
+		case FMT_LEN_Z:
+		case FMT_LEN_T: val = va_arg(*args, ptrdiff_t); break;
+		case FMT_LEN_J: val = va_arg(*args, intmax_t); break;
+		default: val = va_arg(*args, int); break;
+		}
+
+		const char sign = val < 0 ? '-' : spec.flags & FMT_PLUS ? '+' : spec.flags & FMT_SPACE ? ' ' : '\0';
+		// Negated as unsigned, so the smallest value does not overflow
+		const u64 mag	  = val < 0 ? (u64)0 - (u64)val : (u64)val;
+		const char *first = spec.prec == 0 && mag == 0 ? end : conv_dec(end, mag);
+		put_int(out, &spec, &sign, sign != '\0', first, (size_t)(end - first));
+		return 0;
+	}
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'o': {
+		u64 val;
+		switch (spec.len) {
+		case FMT_LEN_HH: val = (unsigned char)va_arg(*args, unsigned int); break;
+		case FMT_LEN_H: val = (unsigned short)va_arg(*args, unsigned int); break;
+		case FMT_LEN_L: val = va_arg(*args, unsigned long); break;
+		case FMT_LEN_LL: val = va_arg(*args, unsigned long long); break;
+		case FMT_LEN_Z: val = va_arg(*args, size_t); break;
+		case FMT_LEN_J: val = va_arg(*args, uintmax_t); break;
+		case FMT_LEN_T: val = (u64)(size_t)va_arg(*args, ptrdiff_t); break;
+		default: val = va_arg(*args, unsigned int); break;
+		}
+
+		const char *first = end;
+		if (spec.prec != 0 || val != 0) {
+			first = spec.conv == 'u' ? conv_dec(end, val) : spec.conv == 'o' ? conv_oct(end, val) : conv_hex(end, val, spec.conv == 'x' ? s_hex : s_hexu);
+		}
+		put_int(out, &spec, "", 0, first, (size_t)(end - first));
+		return 0;
+	}
+	case 'c': {
+		const char c = (char)va_arg(*args, int);
+		put_str(out, &spec, &c, 1, out_put);
+		return 0;
+	}
+	case 's': {
+		const char *str = va_arg(*args, const char *);
+		// Printed differently by every libc
+		if (str == NULL) {
+			return 1;
+		}
+		size_t str_len;
+		if (spec.prec >= 0) {
+			const char *nul = memchr(str, '\0', (size_t)spec.prec);
+			str_len		= nul == NULL ? (size_t)spec.prec : (size_t)(nul - str);
+		} else {
+			str_len = strlen(str);
+		}
+		put_str(out, &spec, str, str_len, out_ref);
+		return 0;
+	}
+	case 'p': {
+		const void *ptr = va_arg(*args, const void *);
+		if (ptr == NULL) {
+			return 1;
+		}
+		const char *first = conv_hex(end, (u64)(uintptr_t)ptr, s_hex);
+		put_int(out, &spec, "0x", 2, first, (size_t)(end - first));
+		return 0;
+	}
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G': {
+		const double val = va_arg(*args, double);
+
+		char body[PRINT_FLT_BUF];
+		const int body_len = print_flt(body, val, spec.conv, spec.prec < 0 ? 6 : spec.prec);
+		if (body_len < 0) {
+			return 1;
+		}
+
+		u64 bits;
+		memcpy(&bits, &val, sizeof(bits));
+		const char sign = bits >> 63 ? '-' : spec.flags & FMT_PLUS ? '+' : spec.flags & FMT_SPACE ? ' ' : '\0';
+
+		// The precision is spent on the digits, zeros still pad to the width
+		spec.prec = -1;
+		put_int(out, &spec, &sign, sign != '\0', body, (size_t)body_len);
+		return 0;
+	}
+	case '%': out_put(out, "%", 1); return 0;
+	default: return 1;
+	}
+}
+
+static int prog_run(fmt_out_t *out, const print_prog_t *prog, va_list *args)
+{
+	for (u32 i = 0; i < prog->cnt; i++) {
+		const fmt_op_t *op = &prog->ops[i];
+		out_ref(out, prog->fmt + op->lit, op->lit_len);
+		if (op->conv == '\0') {
+			break;
+		}
+
+		const fmt_spec_t spec = { .flags = op->flags, .width = op->width, .prec = op->prec, .len = op->len, .conv = op->conv };
+		if (put_conv(out, spec, args)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Fills a claimed slot, formats the engine does not handle or that do not fit are left to libc
+static void prog_compile(print_prog_t *prog, const char *fmt)
+{
+	u32 cnt	      = 0;
+	const char *p = fmt;
+	for (;;) {
+		const char *pct = strchr(p, '%');
+		const char *lit = pct == NULL ? p + strlen(p) : pct;
+		if (cnt == PROG_OPS || (size_t)(p - fmt) > 0xffff || (size_t)(lit - p) > 0xffff) {
+			break;
+		}
+
+		fmt_op_t *op = &prog->ops[cnt++];
+		*op	     = (fmt_op_t){ .lit = (u16)(p - fmt), .lit_len = (u16)(lit - p) };
+		if (pct == NULL) {
+			prog->cnt = cnt;
+			c_atomic_store32(&prog->state, PROG_READY);
+			return;
+		}
+
+		fmt_spec_t spec;
+		p = parse_spec(pct + 1, &spec);
+		if (!spec_valid(&spec) || spec.width > 0x7fff || spec.prec > 0x7fff) {
+			break;
+		}
+
+		op->conv  = spec.conv;
+		op->flags = (u8)spec.flags;
+		op->len	  = (u8)spec.len;
+		op->width = (s16)spec.width;
+		op->prec  = (s16)spec.prec;
+	}
+
+	c_atomic_store32(&prog->state, PROG_LIBC);
+}
+
+const print_prog_t *print_prog_get(const char *fmt)
+{
+	const size_t hash = (size_t)(((u64)(uintptr_t)fmt * 0x9e3779b97f4a7c15ULL) >> 32);
+
+	for (size_t i = 0; i < PROG_PROBES; i++) {
+		print_prog_t *prog = &s_progs[(hash + i) & (PROG_SLOTS - 1)];
+
+		const char *key = c_atomic_loadp((void *const volatile *)&prog->fmt);
+		if (key == NULL) {
+			if (c_atomic_casp((void *volatile *)&prog->fmt, NULL, (void *)fmt)) {
+				prog_compile(prog, fmt);
+				key = fmt;
+			} else {
+				key = c_atomic_loadp((void *const volatile *)&prog->fmt);
+			}
+		}
+
+		if (key == fmt) {
+			// Still being compiled by another thread, parsed this time
+			return c_atomic_load32(&prog->state) == PROG_READY ? prog : NULL;
+		}
+	}
+
+	return NULL;
+}
+
+const print_prog_t *print_prog_use(const print_prog_t *prog)
+{
+	const print_prog_t *prev = s_prog;
+	s_prog			 = prog;
+	return prev;
+}
+
+int print_fmt_narrow(const char *fmt)
+{
+	for (const char *p = strchr(fmt, '%'); p != NULL; p = strchr(p, '%')) {
+		fmt_spec_t spec;
+		p = parse_spec(p + 1, &spec);
+		switch (spec.conv) {
+		case 'c':
+		case 's':
+			if (spec.len != FMT_LEN_NONE || spec.width != 0 || spec.prec != -1) {
+				return 0;
+			}
+			break;
+		case 'C':
+		case 'S':
+		case 'n': return 0;
+		default: break;
+		}
+	}
+
+	return 1;
+}
+
+// Formats into out, 1 if libc has to format it instead
+static int fmt_run(fmt_out_t *out, const char *fmt, va_list args)
+{
+	va_list copy;
+	va_copy(copy, args);
+
+	int ret = 0;
+	if (s_prog != NULL && s_prog->fmt == fmt) {
+		ret = prog_run(out, s_prog, &copy);
+		va_end(copy);
+		return ret;
+	}
+
+	const char *p = fmt;
+	for (;;) {
+		const char *pct = strchr(p, '%');
+		if (pct == NULL) {
+			out_ref(out, p, strlen(p));
+			break;
+		}
+
+		out_ref(out, p, (size_t)(pct - p));
+
+		fmt_spec_t spec;
+		p = parse_spec(pct + 1, &spec);
+		if (!spec_valid(&spec) || put_conv(out, spec, &copy)) {
+			ret = 1;
+			break;
+		}
+	}
+
+	va_end(copy);
+	return ret;
+}
+
+int print_fmt(char *buf, size_t size, const char *fmt, va_list args)
+{
+	fmt_out_t out = { .buf = buf, .size = buf == NULL ? 0 : size };
+
+	if (fmt_run(&out, fmt, args)) {
+		va_list copy;
+		va_copy(copy, args);
+		const int ret = vsnprintf(buf, out.size, fmt, copy);
+		va_end(copy);
+		return ret;
+	}
+
+	return finish(&out);
+}
+
+int print_fmt_refs(print_refs_t *refs, char *buf, size_t size, const char *fmt, va_list args)
+{
+	fmt_out_t out = { .buf = buf, .size = size, .refs = refs };
+
+	if (fmt_run(&out, fmt, args)) {
+		return -1;
+	}
+
+	refs_cut(&out);
+	if (refs->full || (out.len > 0 && out.len >= size)) {
+		return -1;
+	}
+
+	refs->used = out.len;
+	return (int)(out.len + refs->ref_len);
+}
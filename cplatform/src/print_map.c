@@ -0,0 +1,316 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "print.h"
+
+#include "log.h"
+#include "platform.h"
+#include "print_priv.h"
+
+#include <errno.h>
+
+#if defined(C_WIN)
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+// Window size when no chunk is given
+#define MAP_CHUNK_DEFAULT (4 * 1024 * 1024)
+
+// Windows have to start at multiples of it
+static size_t map_gran()
+{
+	static size_t gran;
+	if (gran == 0) {
+#if defined(C_WIN)
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		gran = info.dwAllocationGranularity;
+#else
+		gran = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	}
+	return gran;
+}
+
+static int map_report(int *err, int errnum)
+{
+	// Logged once and outside of the lock, the log may write to this file
+	if (errnum != 0 && *err == 0) {
+		*err = errnum;
+		return errnum;
+	}
+	return 0;
+}
+
+static void map_error(int errnum)
+{
+	if (errnum == 0) {
+		return;
+	}
+#if defined(C_WIN)
+	log_error("cplatform", "print", NULL, "failed to write to mapped file: %d", errnum);
+#else
+	log_error("cplatform", "print", NULL, "failed to write to mapped file: %s (%d)", log_strerror(errnum), errnum);
+#endif
+}
+
+static void win_unmap(print_map_t *map)
+{
+	if (map->data == NULL) {
+		return;
+	}
+
+#if defined(C_WIN)
+	UnmapViewOfFile(map->data);
+	CloseHandle(map->mapping);
+	map->mapping = NULL;
+#else
+	munmap(map->data, map->size);
+#endif
+	map->data = NULL;
+	map->size = 0;
+}
+
+// Hands the pages written since the last sync to the system, waits until they are on disk if wait is set
+static int win_sync(print_map_t *map, int wait)
+{
+	int errnum = 0;
+
+	const u64 from = map->synced > map->base ? map->synced : map->base;
+	if (map->data != NULL && map->len > from) {
+		// The range has to start on a page
+		const size_t off = (size_t)(from - map->base) / map_gran() * map_gran();
+		const size_t len = (size_t)(map->len - map->base) - off;
+#if defined(C_WIN)
+		if (!FlushViewOfFile(map->data + off, len)) {
+			errnum = (int)GetLastError();
+		}
+#else
+		if (msync(map->data + off, len, wait ? MS_SYNC : MS_ASYNC) != 0) {
+			errnum = errno;
+		}
+#endif
+	}
+
+	// Windows moved away from were only handed over
+	if (errnum == 0 && wait) {
+#if defined(C_WIN)
+		if (!FlushFileBuffers(map->file)) {
+			errnum = (int)GetLastError();
+		}
+#else
+		if (fsync(map->fd) != 0) {
+			errnum = errno;
+		}
+#endif
+	}
+
+	map->synced = map->len;
+	return errnum;
+}
+
+// Maps a window from the page of the written end with room for need more bytes, preallocating the file for it
+static int win_move(print_map_t *map, size_t need)
+{
+	const size_t gran = map_gran();
+	const u64 base	  = map->len / gran * gran;
+	const size_t head = (size_t)(map->len - base);
+
+	size_t size = map->chunk;
+	if (head + need > size) {
+		size = (head + need + gran - 1) / gran * gran;
+	}
+
+	int errnum = win_sync(map, 0);
+	win_unmap(map);
+
+#if defined(C_WIN)
+	// A mapping past the end of the file grows it
+	const u64 end = base + size;
+	map->mapping  = CreateFileMappingA(map->file, NULL, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)end, NULL);
+	if (map->mapping == NULL) {
+		return (int)GetLastError();
+	}
+
+	map->data = MapViewOfFile(map->mapping, FILE_MAP_WRITE, (DWORD)(base >> 32), (DWORD)base, size);
+	if (map->data == NULL) {
+		errnum = (int)GetLastError();
+		CloseHandle(map->mapping);
+		map->mapping = NULL;
+		return errnum;
+	}
+#else
+	// Writing to pages past the end of the file would fault, and this way running out of space shows here
+	const int ret = posix_fallocate(map->fd, (off_t)base, (off_t)size);
+	if (ret != 0) {
+		return ret;
+	}
+
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, (off_t)base);
+	if (data == MAP_FAILED) {
+		return errno;
+	}
+
+	posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+	map->data = data;
+#endif
+
+	map->base = base;
+	map->size = size;
+	return errnum;
+}
+
+print_map_t *print_map_init(print_map_t *map, const char *path, size_t chunk, size_t sync_bytes, int sync_level)
+{
+	if (map == NULL || path == NULL) {
+		return NULL;
+	}
+
+	u64 len;
+#if defined(C_WIN)
+	map->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER size;
+	if (map->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(map->file, &size)) {
+		log_error("cplatform", "print", NULL, "failed to open file: %s: %d", path, GetLastError());
+		if (map->file != INVALID_HANDLE_VALUE) {
+			CloseHandle(map->file);
+		}
+		return NULL;
+	}
+	map->mapping = NULL;
+	len	     = (u64)size.QuadPart;
+#else
+	struct stat st;
+	map->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (map->fd < 0 || fstat(map->fd, &st) != 0) {
+		int errnum = errno;
+		log_error("cplatform", "print", NULL, "failed to open file: %s: %s (%d)", path, log_strerror(errnum), errnum);
+		if (map->fd >= 0) {
+			close(map->fd);
+		}
+		return NULL;
+	}
+	len = (u64)st.st_size;
+#endif
+
+	const size_t gran = map_gran();
+	chunk		  = chunk == 0 ? MAP_CHUNK_DEFAULT : chunk;
+
+	// The window is mapped by the first print
+	map->data	= NULL;
+	map->base	= len;
+	map->size	= 0;
+	map->len	= len;
+	map->synced	= len;
+	map->chunk	= (chunk + gran - 1) / gran * gran;
+	map->sync_bytes = sync_bytes;
+	map->sync_level = sync_level;
+	map->err	= 0;
+	c_mutex_init(&map->mutex);
+
+	return map;
+}
+
+int print_map_free(print_map_t *map)
+{
+	if (map == NULL || map->chunk == 0) {
+		return 1;
+	}
+
+	win_unmap(map);
+
+	int errnum = 0;
+#if defined(C_WIN)
+	LARGE_INTEGER end;
+	end.QuadPart = (LONGLONG)map->len;
+	if (!SetFilePointerEx(map->file, end, NULL, FILE_BEGIN) || !SetEndOfFile(map->file)) {
+		errnum = (int)GetLastError();
+	}
+	CloseHandle(map->file);
+#else
+	if (ftruncate(map->fd, (off_t)map->len) != 0) {
+		errnum = errno;
+	}
+	close(map->fd);
+#endif
+
+	c_mutex_free(&map->mutex);
+	map->chunk = 0;
+
+	map_error(map_report(&map->err, errnum));
+	return errnum != 0;
+}
+
+static int map_sync(print_map_t *map, int wait)
+{
+	if (map == NULL || map->chunk == 0) {
+		return 1;
+	}
+
+	c_mutex_lock(&map->mutex);
+	int errnum = win_sync(map, wait);
+	int report = map_report(&map->err, errnum);
+	c_mutex_unlock(&map->mutex);
+
+	map_error(report);
+	return errnum != 0;
+}
+
+int print_map_sync(print_map_t *map)
+{
+	return map_sync(map, 1);
+}
+
+int print_map_flush(print_map_t *map)
+{
+	return map_sync(map, 0);
+}
+
+int c_mapprintv_cb(print_dst_t dst, const char *fmt, va_list args)
+{
+	print_map_t *map = dst.priv;
+	if (map == NULL || map->chunk == 0 || fmt == NULL) {
+		return 0;
+	}
+
+	int errnum = 0;
+	va_list copy;
+
+	c_mutex_lock(&map->mutex);
+
+	// Into the rest of the window, again after moving it if the output and its terminator did not fit
+	size_t avail = map->data == NULL ? 0 : (size_t)(map->base + map->size - map->len);
+	va_copy(copy, args);
+	int len = print_fmt(avail == 0 ? NULL : map->data + (map->len - map->base), avail, fmt, copy);
+	va_end(copy);
+
+	if (len > 0 && (size_t)len >= avail) {
+		errnum = win_move(map, (size_t)len + 1);
+		if (map->data == NULL) {
+			len = 0;
+		} else {
+			avail = (size_t)(map->base + map->size - map->len);
+			va_copy(copy, args);
+			print_fmt(map->data + (map->len - map->base), avail, fmt, copy);
+			va_end(copy);
+		}
+	}
+
+	if (len < 0) {
+		len = 0;
+	}
+	map->len += (u64)len;
+
+	if (errnum == 0 && map->sync_bytes > 0 && map->len - map->synced >= map->sync_bytes) {
+		errnum = win_sync(map, 0);
+	}
+
+	errnum = map_report(&map->err, errnum);
+	c_mutex_unlock(&map->mutex);
+
+	map_error(errnum);
+	return len;
+}
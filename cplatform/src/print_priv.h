@@ -0,0 +1,56 @@
+#ifndef PRINT_PRIV_H
+#define PRINT_PRIV_H
+
+#include "print.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+
+// Longest %f, %e or %g body print_flt() produces
+#define PRINT_FLT_BUF 512
+
+// vsnprintf() for the conversions the library uses: d i u x X o c s p f F e E
+// g G % with flags - 0 + space, width, precision and the hh h l ll z j t
+// lengths. Integers and finite doubles are converted without the locale,
+// anything else goes to libc.
+int print_fmt(char *buf, size_t size, const char *fmt, va_list args);
+
+// Output of print_fmt_refs() as slices. Format literals and %s arguments are
+// referenced where they are, everything else is copied into the buffer.
+typedef struct print_refs_s {
+	print_slice_t *slices;
+	size_t cnt;
+	size_t max;
+	size_t used;
+	size_t ref_len;
+	int full;
+} print_refs_t;
+
+// print_fmt() into at most max slices and a buffer of size bytes, the used
+// part of the buffer is not terminated. -1 if it does not fit or the format
+// has to go to libc, nothing is usable then.
+int print_fmt_refs(print_refs_t *refs, char *buf, size_t size, const char *fmt, va_list args);
+
+// Whether a wide format transcoded to UTF-8 prints the same through
+// print_fmt(). Wide strings and widths or precisions of strings count
+// characters instead of bytes, those have to go to libc wide stdio.
+int print_fmt_narrow(const char *fmt);
+
+// Hands the written pages of a mapped destination to the system without waiting
+int print_map_flush(print_map_t *map);
+
+typedef struct print_prog_s print_prog_t;
+
+// Program compiled from a format that stays in place, cached by its address.
+// NULL if the engine does not handle the format or the cache is full.
+const print_prog_t *print_prog_get(const char *fmt);
+
+// Makes print_fmt() on this thread run prog when given its format instead of
+// parsing it, returns the previous program
+const print_prog_t *print_prog_use(const print_prog_t *prog);
+
+// Correctly rounded %f, %e or %g of the magnitude of a finite value into buf
+// of PRINT_FLT_BUF bytes, not terminated. -1 if it does not fit.
+int print_flt(char *buf, double val, int conv, int prec);
+
+#endif
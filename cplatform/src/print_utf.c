@@ -0,0 +1,636 @@
+#include "print.h"
+
+#include "mem.h"
+#include "simd_priv.h"
+
+#include <string.h>
+
+#define UTF_BAD	    0xffffffffu
+#define UTF_REPLACE 0xfffd
+
+// Wide characters are UTF-16 where wchar has 16 bits and UTF-32 otherwise
+#define UTF_WIDE16 (sizeof(wchar) == 2)
+
+typedef struct utf_simd_s {
+	// Leading ASCII bytes of src
+	size_t (*ascii)(const u8 *src, size_t len);
+	// Widens or narrows the leading ASCII characters, returns how many
+	size_t (*widen)(wchar *dst, const u8 *src, size_t len);
+	size_t (*narrow)(u8 *dst, const wchar *src, size_t len);
+	// Length of the valid prefix
+	size_t (*valid)(const u8 *src, size_t len);
+} utf_simd_t;
+
+// Decodes the sequence at src. Invalid ones decode to UTF_BAD and consume the
+// lead and the continuation bytes that still fit it, so each gets a single
+// replacement character.
+static size_t utf8_dec(const u8 *src, size_t len, u32 *cp)
+{
+	const u8 c = src[0];
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	}
+
+	size_t n;
+	u32 val;
+	u8 lo = 0x80, hi = 0xbf;
+	if (c >= 0xc2 && c <= 0xdf) {
+		n   = 2;
+		val = c & 0x1f;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		// Overlong forms and surrogates are cut off by the range of the second byte
+		n   = 3;
+		val = c & 0x0f;
+		lo  = c == 0xe0 ? 0xa0 : 0x80;
+		hi  = c == 0xed ? 0x9f : 0xbf;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		n   = 4;
+		val = c & 0x07;
+		lo  = c == 0xf0 ? 0x90 : 0x80;
+		hi  = c == 0xf4 ? 0x8f : 0xbf;
+	} else {
+		*cp = UTF_BAD;
+		return 1;
+	}
+
+	for (size_t i = 1; i < n; i++) {
+		if (i == len || src[i] < lo || src[i] > hi) {
+			*cp = UTF_BAD;
+			return i;
+		}
+		val = (val << 6) | (src[i] & 0x3f);
+		lo  = 0x80;
+		hi  = 0xbf;
+	}
+
+	*cp = val;
+	return n;
+}
+
+// Decodes the wide character at src, lone surrogates and values past U+10FFFF decode to UTF_BAD
+static size_t wide_dec(const wchar *src, size_t len, u32 *cp)
+{
+	const u32 c = (u32)src[0];
+	if (UTF_WIDE16 && c >= 0xd800 && c <= 0xdbff && len > 1 && (u32)src[1] >= 0xdc00 && (u32)src[1] <= 0xdfff) {
+		*cp = 0x10000 + ((c - 0xd800) << 10) + ((u32)src[1] - 0xdc00);
+		return 2;
+	}
+
+	*cp = (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff ? UTF_BAD : c;
+	return 1;
+}
+
+static size_t utf8_enc(u8 *dst, u32 cp)
+{
+	if (cp < 0x80) {
+		dst[0] = (u8)cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		dst[0] = (u8)(0xc0 | (cp >> 6));
+		dst[1] = (u8)(0x80 | (cp & 0x3f));
+		return 2;
+	}
+	if (cp < 0x10000) {
+		dst[0] = (u8)(0xe0 | (cp >> 12));
+		dst[1] = (u8)(0x80 | ((cp >> 6) & 0x3f));
+		dst[2] = (u8)(0x80 | (cp & 0x3f));
+		return 3;
+	}
+	dst[0] = (u8)(0xf0 | (cp >> 18));
+	dst[1] = (u8)(0x80 | ((cp >> 12) & 0x3f));
+	dst[2] = (u8)(0x80 | ((cp >> 6) & 0x3f));
+	dst[3] = (u8)(0x80 | (cp & 0x3f));
+	return 4;
+}
+
+static size_t wide_enc(wchar *dst, u32 cp)
+{
+	if (UTF_WIDE16 && cp >= 0x10000) {
+		dst[0] = (wchar)(0xd800 + ((cp - 0x10000) >> 10));
+		dst[1] = (wchar)(0xdc00 + ((cp - 0x10000) & 0x3ff));
+		return 2;
+	}
+	dst[0] = (wchar)cp;
+	return 1;
+}
+
+static size_t ascii_scalar(const u8 *src, size_t len)
+{
+	size_t i = 0;
+	for (; i + sizeof(u64) <= len; i += sizeof(u64)) {
+		u64 word;
+		memcpy(&word, src + i, sizeof(word));
+		if (word & 0x8080808080808080ULL) {
+			break;
+		}
+	}
+
+	while (i < len && src[i] < 0x80) {
+		i++;
+	}
+	return i;
+}
+
+static size_t widen_scalar(wchar *dst, const u8 *src, size_t len)
+{
+	size_t i = 0;
+	while (i < len && src[i] < 0x80) {
+		dst[i] = src[i];
+		i++;
+	}
+	return i;
+}
+
+static size_t narrow_scalar(u8 *dst, const wchar *src, size_t len)
+{
+	size_t i = 0;
+	while (i < len && (u32)src[i] < 0x80) {
+		dst[i] = (u8)src[i];
+		i++;
+	}
+	return i;
+}
+
+static size_t valid_scalar(const u8 *src, size_t len)
+{
+	size_t i = 0;
+	while (i < len) {
+		i += ascii_scalar(src + i, len - i);
+		if (i == len) {
+			break;
+		}
+
+		u32 cp;
+		const size_t n = utf8_dec(src + i, len - i, &cp);
+		if (cp == UTF_BAD) {
+			return i;
+		}
+		i += n;
+	}
+	return len;
+}
+
+static const utf_simd_t s_scalar = { ascii_scalar, widen_scalar, narrow_scalar, valid_scalar };
+
+#if defined(SIMD_X86)
+
+// Blocks with a non-ASCII byte are still converted whole, only the ASCII
+// prefix counts. The rest of a run shorter than a block is left to the
+// scalar code, so no legacy SSE code runs with dirty AVX state.
+
+static size_t ascii_sse2(const u8 *src, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		const int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(src + i)));
+		if (mask != 0) {
+			return i + (size_t)first_bit((u64)mask);
+		}
+	}
+
+	return i + ascii_scalar(src + i, len - i);
+}
+
+static size_t widen_sse2(wchar *dst, const u8 *src, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		const __m128i v	 = _mm_loadu_si128((const __m128i *)(src + i));
+		const __m128i lo = _mm_unpacklo_epi8(v, zero);
+		const __m128i hi = _mm_unpackhi_epi8(v, zero);
+		if (UTF_WIDE16) {
+			_mm_storeu_si128((__m128i *)(dst + i), lo);
+			_mm_storeu_si128((__m128i *)(dst + i + 8), hi);
+		} else {
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(lo, zero));
+			_mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(lo, zero));
+			_mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpacklo_epi16(hi, zero));
+			_mm_storeu_si128((__m128i *)(dst + i + 12), _mm_unpackhi_epi16(hi, zero));
+		}
+
+		const int mask = _mm_movemask_epi8(v);
+		if (mask != 0) {
+			return i + (size_t)first_bit((u64)mask);
+		}
+	}
+
+	return i + widen_scalar(dst + i, src + i, len - i);
+}
+
+static size_t narrow_sse2(u8 *dst, const wchar *src, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		__m128i v;
+		int mask;
+		if (UTF_WIDE16) {
+			v = _mm_loadu_si128((const __m128i *)(src + i));
+			// Two bits per character
+			mask = ~_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16(~0x7f)), zero)) & 0x5555;
+		} else {
+			const __m128i a	   = _mm_loadu_si128((const __m128i *)(src + i));
+			const __m128i b	   = _mm_loadu_si128((const __m128i *)(src + i + 4));
+			const __m128i high = _mm_set1_epi32(~0x7f);
+
+			const int ma = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(a, high), zero)));
+			const int mb = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(b, high), zero)));
+			// Saturates the characters past ASCII, those are not counted
+			v    = _mm_packs_epi32(a, b);
+			mask = ~(ma | mb << 4) & 0xff;
+		}
+		_mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(v, v));
+
+		if (mask != 0) {
+			return i + (size_t)first_bit((u64)mask) / (UTF_WIDE16 ? 2 : 1);
+		}
+	}
+
+	return i + narrow_scalar(dst + i, src + i, len - i);
+}
+
+// Without a byte shuffle only the ASCII runs are skipped in vectors
+static size_t valid_sse2(const u8 *src, size_t len)
+{
+	size_t i = 0;
+	while (i < len) {
+		i += ascii_sse2(src + i, len - i);
+		if (i == len) {
+			break;
+		}
+
+		u32 cp;
+		const size_t n = utf8_dec(src + i, len - i, &cp);
+		if (cp == UTF_BAD) {
+			return i;
+		}
+		i += n;
+	}
+	return len;
+}
+
+SIMD_TARGET("avx2")
+static size_t ascii_avx2(const u8 *src, size_t len)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		const u32 mask = (u32)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(src + i)));
+		if (mask != 0) {
+			_mm256_zeroupper();
+			return i + (size_t)first_bit(mask);
+		}
+	}
+
+	_mm256_zeroupper();
+	return i + ascii_scalar(src + i, len - i);
+}
+
+SIMD_TARGET("avx2")
+static size_t widen_avx2(wchar *dst, const u8 *src, size_t len)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		if (UTF_WIDE16) {
+			_mm256_storeu_si256((__m256i *)(dst + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+			_mm256_storeu_si256((__m256i *)(dst + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+		} else {
+			for (size_t j = 0; j < 32; j += 8) {
+				_mm256_storeu_si256((__m256i *)(dst + i + j), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i + j))));
+			}
+		}
+
+		const u32 mask = (u32)_mm256_movemask_epi8(v);
+		if (mask != 0) {
+			_mm256_zeroupper();
+			return i + (size_t)first_bit(mask);
+		}
+	}
+
+	_mm256_zeroupper();
+	return i + widen_scalar(dst + i, src + i, len - i);
+}
+
+SIMD_TARGET("avx2")
+static size_t narrow_avx2(u8 *dst, const wchar *src, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m256i v;
+		u32 mask;
+		if (UTF_WIDE16) {
+			v    = _mm256_loadu_si256((const __m256i *)(src + i));
+			mask = ~(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(v, _mm256_set1_epi16(~0x7f)), _mm256_setzero_si256())) & 0x55555555;
+		} else {
+			const __m256i a	   = _mm256_loadu_si256((const __m256i *)(src + i));
+			const __m256i b	   = _mm256_loadu_si256((const __m256i *)(src + i + 8));
+			const __m256i high = _mm256_set1_epi32(~0x7f);
+
+			const u32 ma = (u32)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(a, high), _mm256_setzero_si256())));
+			const u32 mb = (u32)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(b, high), _mm256_setzero_si256())));
+			// Packing works per 128-bit lane, the permute restores the order
+			v    = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xd8);
+			mask = ~(ma | mb << 8) & 0xffff;
+		}
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+
+		if (mask != 0) {
+			_mm256_zeroupper();
+			return i + (size_t)first_bit(mask) / (UTF_WIDE16 ? 2 : 1);
+		}
+	}
+
+	_mm256_zeroupper();
+	return i + narrow_scalar(dst + i, src + i, len - i);
+}
+
+// Error classes of a byte pair, looked up from the high and low nibble of
+// the first byte and the high nibble of the second one. A pair is invalid if
+// all three lookups share a class, see Keiser and Lemire, "Validating UTF-8
+// In Less Than One Instruction Per Byte".
+enum {
+	UTF_TOO_SHORT	   = 1 << 0,
+	UTF_TOO_LONG	   = 1 << 1,
+	UTF_OVERLONG_3	   = 1 << 2,
+	UTF_TOO_LARGE	   = 1 << 3,
+	UTF_SURROGATE	   = 1 << 4,
+	UTF_OVERLONG_2	   = 1 << 5,
+	UTF_TOO_LARGE_1000 = 1 << 6,
+	UTF_OVERLONG_4	   = 1 << 6,
+	UTF_TWO_CONTS	   = 1 << 7,
+	UTF_CARRY	   = UTF_TOO_SHORT | UTF_TOO_LONG | UTF_TWO_CONTS,
+};
+
+static const u8 s_byte_1_high[16] = {
+	UTF_TOO_LONG,
+	UTF_TOO_LONG,
+	UTF_TOO_LONG,
+	UTF_TOO_LONG,
+	UTF_TOO_LONG,
+	UTF_TOO_LONG,
+	UTF_TOO_LONG,
+	UTF_TOO_LONG,
+	UTF_TWO_CONTS,
+	UTF_TWO_CONTS,
+	UTF_TWO_CONTS,
+	UTF_TWO_CONTS,
+	UTF_TOO_SHORT | UTF_OVERLONG_2,
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT | UTF_OVERLONG_3 | UTF_SURROGATE,
+	UTF_TOO_SHORT | UTF_TOO_LARGE | UTF_TOO_LARGE_1000 | UTF_OVERLONG_4,
+};
+
+static const u8 s_byte_1_low[16] = {
+	UTF_CARRY | UTF_OVERLONG_3 | UTF_OVERLONG_2 | UTF_OVERLONG_4,
+	UTF_CARRY | UTF_OVERLONG_2,
+	UTF_CARRY,
+	UTF_CARRY,
+	UTF_CARRY | UTF_TOO_LARGE,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000 | UTF_SURROGATE,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000,
+	UTF_CARRY | UTF_TOO_LARGE | UTF_TOO_LARGE_1000,
+};
+
+static const u8 s_byte_2_high[16] = {
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT,
+	UTF_TOO_LONG | UTF_OVERLONG_2 | UTF_TWO_CONTS | UTF_OVERLONG_3 | UTF_TOO_LARGE_1000 | UTF_OVERLONG_4,
+	UTF_TOO_LONG | UTF_OVERLONG_2 | UTF_TWO_CONTS | UTF_OVERLONG_3 | UTF_TOO_LARGE,
+	UTF_TOO_LONG | UTF_OVERLONG_2 | UTF_TWO_CONTS | UTF_SURROGATE | UTF_TOO_LARGE,
+	UTF_TOO_LONG | UTF_OVERLONG_2 | UTF_TWO_CONTS | UTF_SURROGATE | UTF_TOO_LARGE,
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT,
+	UTF_TOO_SHORT,
+};
+
+// Bytes of the previous block shifted in front of the current one
+	#define UTF_PREV(_in, _prev, _n) _mm256_alignr_epi8(_in, _mm256_permute2x128_si256(_prev, _in, 0x21), 16 - (_n))
+
+SIMD_TARGET("avx2")
+static __m256i utf_lookup(const u8 *table, __m256i idx)
+{
+	return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table)), idx);
+}
+
+// Non-zero bytes where the block is not valid given the block before it
+SIMD_TARGET("avx2")
+static __m256i utf_check(__m256i in, __m256i prev)
+{
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+	const __m256i prev1 = UTF_PREV(in, prev, 1);
+	const __m256i b1h   = utf_lookup(s_byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+	const __m256i b1l   = utf_lookup(s_byte_1_low, _mm256_and_si256(prev1, nibble));
+	const __m256i b2h   = utf_lookup(s_byte_2_high, _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble));
+	const __m256i sc    = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+	// Third and fourth bytes of a sequence have to be continuations, nothing else may be
+	const __m256i third  = _mm256_subs_epu8(UTF_PREV(in, prev, 2), _mm256_set1_epi8(0xe0 - 0x80));
+	const __m256i fourth = _mm256_subs_epu8(UTF_PREV(in, prev, 3), _mm256_set1_epi8(0xf0 - 0x80));
+	const __m256i must   = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+
+	return _mm256_xor_si256(must, sc);
+}
+
+// Non-zero if the block ends inside a sequence
+SIMD_TARGET("avx2")
+static __m256i utf_incomplete(__m256i in)
+{
+	const __m256i max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+					     -1, (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+	return _mm256_subs_epu8(in, max);
+}
+
+SIMD_TARGET("avx2")
+static size_t valid_avx2(const u8 *src, size_t len)
+{
+	__m256i prev	   = _mm256_setzero_si256();
+	__m256i incomplete = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for (;; i += 32) {
+		__m256i in;
+		if (i + 32 <= len) {
+			in = _mm256_loadu_si256((const __m256i *)(src + i));
+		} else {
+			// The zeros after the end show sequences cut off by it
+			u8 tail[32] = { 0 };
+			memcpy(tail, src + i, len - i);
+			in = _mm256_loadu_si256((const __m256i *)tail);
+		}
+
+		__m256i err = incomplete;
+		if (_mm256_movemask_epi8(in) != 0) {
+			err	   = utf_check(in, prev);
+			incomplete = utf_incomplete(in);
+		} else {
+			incomplete = _mm256_setzero_si256();
+		}
+
+		const int last = i + 32 >= len;
+		if (last) {
+			err = _mm256_or_si256(err, incomplete);
+		}
+		if (!_mm256_testz_si256(err, err)) {
+			break;
+		}
+		if (last) {
+			return len;
+		}
+		prev = in;
+	}
+
+	_mm256_zeroupper();
+
+	// Everything before the previous block is valid, the scalar scan finds the exact position
+	size_t start = i >= 32 ? i - 32 : 0;
+	for (int j = 0; j < 3 && start > 0 && (src[start] & 0xc0) == 0x80; j++) {
+		start--;
+	}
+	return start + valid_scalar(src + start, len - start);
+}
+
+static const utf_simd_t s_sse2 = { ascii_sse2, widen_sse2, narrow_sse2, valid_sse2 };
+static const utf_simd_t s_avx2 = { ascii_avx2, widen_avx2, narrow_avx2, valid_avx2 };
+
+#endif
+
+// Kernels of the level mem_simd_set() selected
+static const utf_simd_t *utf_simd()
+{
+#if defined(SIMD_X86)
+	switch (mem_simd_get()) {
+	case MEM_SIMD_NONE: return &s_scalar;
+	case MEM_SIMD_SSE2: return &s_sse2;
+	default: return &s_avx2;
+	}
+#else
+	return &s_scalar;
+#endif
+}
+
+size_t c_utf8_valid(const char *str, size_t len)
+{
+	if (str == NULL) {
+		return 0;
+	}
+
+	return utf_simd()->valid((const u8 *)str, len);
+}
+
+size_t c_utf8_to_wchar(wchar *dst, size_t size, const char *src, size_t len)
+{
+	if (src == NULL || (dst == NULL && size > 0)) {
+		return 0;
+	}
+
+	const utf_simd_t *simd = utf_simd();
+	const u8 *str	       = (const u8 *)src;
+	// Room for the terminator
+	const size_t cap = size > 0 ? size - 1 : 0;
+
+	// Written length, a character that does not fit ends the output
+	size_t fit = 0;
+	size_t out = 0;
+	size_t i   = 0;
+	while (i < len) {
+		const size_t avail = len - i;
+		size_t n;
+		if (out < cap) {
+			n   = simd->widen(dst + out, str + i, avail < cap - out ? avail : cap - out);
+			fit = out + n;
+		} else {
+			n = simd->ascii(str + i, avail);
+		}
+		i += n;
+		out += n;
+
+		// Sequences up to the next ASCII byte
+		while (i < len && str[i] >= 0x80) {
+			u32 cp;
+			i += utf8_dec(str + i, len - i, &cp);
+
+			wchar units[2];
+			const size_t cnt = wide_enc(units, cp == UTF_BAD ? UTF_REPLACE : cp);
+			if (out + cnt <= cap) {
+				memcpy(dst + out, units, cnt * sizeof(wchar));
+				fit = out + cnt;
+			}
+			out += cnt;
+		}
+	}
+
+	if (size > 0) {
+		dst[fit] = L'\0';
+	}
+	return out;
+}
+
+size_t c_wchar_to_utf8(char *dst, size_t size, const wchar *src, size_t len)
+{
+	if (src == NULL || (dst == NULL && size > 0)) {
+		return 0;
+	}
+
+	const utf_simd_t *simd = utf_simd();
+	u8 *str		       = (u8 *)dst;
+	const size_t cap       = size > 0 ? size - 1 : 0;
+
+	// Written length, a character that does not fit ends the output
+	size_t fit = 0;
+	size_t out = 0;
+	size_t i   = 0;
+	while (i < len) {
+		const size_t avail = len - i;
+		size_t n;
+		if (out < cap) {
+			n   = simd->narrow(str + out, src + i, avail < cap - out ? avail : cap - out);
+			fit = out + n;
+		} else {
+			n = 0;
+			while (n < avail && (u32)src[i + n] < 0x80) {
+				n++;
+			}
+		}
+		i += n;
+		out += n;
+
+		while (i < len && (u32)src[i] >= 0x80) {
+			u32 cp;
+			i += wide_dec(src + i, len - i, &cp);
+
+			u8 bytes[4];
+			const size_t cnt = utf8_enc(bytes, cp == UTF_BAD ? UTF_REPLACE : cp);
+			if (out + cnt <= cap) {
+				memcpy(str + out, bytes, cnt);
+				fit = out + cnt;
+			}
+			out += cnt;
+		}
+	}
+
+	if (size > 0) {
+		dst[fit] = '\0';
+	}
+	return out;
+}
@@ -0,0 +1,41 @@
+#ifndef SIMD_PRIV_H
+#define SIMD_PRIV_H
+
+#include "platform.h"
+#include "type.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+	#define SIMD_X86
+	#include <immintrin.h>
+	#if defined(C_WIN)
+		#include <intrin.h>
+		#define SIMD_TARGET(_target)
+	#else
+		#include <cpuid.h>
+		#define SIMD_TARGET(_target) __attribute__((target(_target)))
+	#endif
+#endif
+
+#if defined(SIMD_X86)
+static inline int first_bit(u64 mask)
+{
+	#if defined(C_WIN)
+	unsigned long idx;
+		#if defined(_M_IX86)
+	// No 64-bit scan on 32-bit targets, the high half is only looked at when the low one is empty
+	if (_BitScanForward(&idx, (unsigned long)mask)) {
+		return (int)idx;
+	}
+	_BitScanForward(&idx, (unsigned long)(mask >> 32));
+	return (int)idx + 32;
+		#else
+	_BitScanForward64(&idx, mask);
+	return (int)idx;
+		#endif
+	#else
+	return __builtin_ctzll(mask);
+	#endif
+}
+#endif
+
+#endif
@@ -0,0 +1,428 @@
+#include "c_thread.h"
+#include "c_time.h"
+#include "cplatform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CHURN_THREADS 4
+#define CHURN_OPS     1000000
+#define CHURN_SLOTS   256
+
+// Bytes processed per kernel and size, bounds the repetitions
+#define KERNEL_BYTES (256 * 1024 * 1024)
+
+#define FORMAT_OPS 1000000
+
+#define DTOA_OPS 1000000
+
+#define SINK_RECORDS 200000
+
+// Bytes of text transcoded per kernel and level
+#define UTF_BYTES (64 * 1024 * 1024)
+#define UTF_SIZE  4096
+
+#define WFORMAT_OPS 1000000
+
+enum {
+	CHURN_LIBC,
+	CHURN_MEM,
+};
+
+typedef struct churn_s {
+	int kind;
+	u64 ns;
+} churn_t;
+
+static int churn_thread(void *arg)
+{
+	churn_t *churn = arg;
+
+	void *ptrs[CHURN_SLOTS]	 = { 0 };
+	size_t sizes[CHURN_SLOTS] = { 0 };
+	u32 seed		 = c_thread_id();
+
+	const u64 start = c_mono();
+	for (int i = 0; i < CHURN_OPS; i++) {
+		seed		 = seed * 1103515245 + 12345;
+		const int slot	 = (seed >> 8) % CHURN_SLOTS;
+		const size_t len = 16 + (seed >> 16) % 1024;
+
+		if (churn->kind == CHURN_LIBC) {
+			free(ptrs[slot]);
+			ptrs[slot] = malloc(len);
+		} else {
+			mem_free(ptrs[slot], sizes[slot]);
+			ptrs[slot] = mem_alloc(len);
+		}
+		sizes[slot]	     = len;
+		*(char *)ptrs[slot] = (char)i;
+	}
+	churn->ns = c_mono() - start;
+
+	for (int slot = 0; slot < CHURN_SLOTS; slot++) {
+		if (churn->kind == CHURN_LIBC) {
+			free(ptrs[slot]);
+		} else {
+			mem_free(ptrs[slot], sizes[slot]);
+		}
+	}
+
+	return 0;
+}
+
+static void bench_churn(const char *name, int kind)
+{
+	c_thread_t threads[CHURN_THREADS];
+	churn_t churns[CHURN_THREADS];
+
+	for (int i = 0; i < CHURN_THREADS; i++) {
+		churns[i].kind = kind;
+		c_thread_create(&threads[i], churn_thread, &churns[i]);
+	}
+
+	u64 ns = 0;
+	for (int i = 0; i < CHURN_THREADS; i++) {
+		c_thread_join(threads[i]);
+		ns += churns[i].ns;
+	}
+
+	c_printf("%-16s %6.1f ns/op\n", name, (double)ns / (CHURN_THREADS * CHURN_OPS));
+}
+
+enum {
+	KERNEL_SET,
+	KERNEL_CPY,
+	KERNEL_CMP,
+	KERNEL_SWAP,
+};
+
+static volatile int s_sink;
+
+static void swap_bytes(unsigned char *p1, unsigned char *p2, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		unsigned char tmp = p1[i];
+		p1[i]		  = p2[i];
+		p2[i]		  = tmp;
+	}
+}
+
+static double kernel_run(int kernel, int libc, unsigned char *a, unsigned char *b, size_t size)
+{
+	const size_t reps = size >= KERNEL_BYTES ? 1 : KERNEL_BYTES / size;
+
+	const u64 start = c_mono();
+	for (size_t i = 0; i < reps; i++) {
+		switch (kernel) {
+		case KERNEL_SET: libc ? memset(a, (int)i, size) : mem_set(a, (int)i, size); break;
+		case KERNEL_CPY: libc ? memcpy(a, b, size) : mem_cpy(a, size, b, size); break;
+		case KERNEL_CMP: s_sink += libc ? memcmp(a, b, size) : mem_cmp(a, b, size); break;
+		case KERNEL_SWAP:
+			if (libc) {
+				swap_bytes(a, b, size);
+			} else {
+				mem_swap(a, b, size);
+			}
+			break;
+		}
+		s_sink += a[i % size];
+	}
+	const u64 ns = c_mono() - start;
+
+	return (double)(reps * size) / (double)(ns == 0 ? 1 : ns);
+}
+
+static void bench_kernels(size_t max)
+{
+	static const char *names[] = { "set", "cpy", "cmp", "swap" };
+
+	unsigned char *a = malloc(max);
+	unsigned char *b = malloc(max);
+	if (a == NULL || b == NULL) {
+		free(a);
+		free(b);
+		c_printf("kernels: can not allocate %zu B\n", max);
+		return;
+	}
+
+	memset(a, 1, max);
+	memset(b, 1, max);
+
+	c_printf("kernels, GB/s, libc (byte loop for swap) / mem, simd level %d:\n", mem_simd_get());
+	c_printf("%12s %15s %15s %15s %15s\n", "size", names[0], names[1], names[2], names[3]);
+	for (size_t size = 8; size <= max; size *= 8) {
+		c_printf("%12zu", size);
+		for (int kernel = KERNEL_SET; kernel <= KERNEL_SWAP; kernel++) {
+			const double libc = kernel_run(kernel, 1, a, b, size);
+			const double mem  = kernel_run(kernel, 0, a, b, size);
+			c_printf(" %7.2f/%-7.2f", libc, mem);
+		}
+		c_printf("\n");
+	}
+
+	free(a);
+	free(b);
+}
+
+enum {
+	FORMAT_INTS,
+	FORMAT_MIXED,
+	FORMAT_STRS,
+};
+
+enum {
+	FORMAT_LIBC,
+	FORMAT_ENGINE,
+	FORMAT_PROG,
+};
+
+static int format_run(int kind, int impl, char *buf, size_t size, int i)
+{
+	switch (kind) {
+	case FORMAT_INTS:
+		switch (impl) {
+		case FORMAT_LIBC: return snprintf(buf, size, "%d %u %x %llu", i, (unsigned)i * 7919, (unsigned)i, (unsigned long long)i * 1000003);
+		case FORMAT_ENGINE: return c_sprintf(buf, size, 0, "%d %u %x %llu", i, (unsigned)i * 7919, (unsigned)i, (unsigned long long)i * 1000003);
+		default: return dcprintf(PRINT_DST_BUF(buf, size, 0), "%d %u %x %llu", i, (unsigned)i * 7919, (unsigned)i, (unsigned long long)i * 1000003);
+		}
+	case FORMAT_MIXED:
+		switch (impl) {
+		case FORMAT_LIBC: return snprintf(buf, size, "[%s:%-5s] %03ld %zu B %p", "cplatform", "mem", (long)i % 1000, (size_t)i, (void *)buf);
+		case FORMAT_ENGINE: return c_sprintf(buf, size, 0, "[%s:%-5s] %03ld %zu B %p", "cplatform", "mem", (long)i % 1000, (size_t)i, (void *)buf);
+		default: return dcprintf(PRINT_DST_BUF(buf, size, 0), "[%s:%-5s] %03ld %zu B %p", "cplatform", "mem", (long)i % 1000, (size_t)i, (void *)buf);
+		}
+	default:
+		switch (impl) {
+		case FORMAT_LIBC: return snprintf(buf, size, "%s %.*s %s", "a string argument", 6, "truncated", "and another one");
+		case FORMAT_ENGINE: return c_sprintf(buf, size, 0, "%s %.*s %s", "a string argument", 6, "truncated", "and another one");
+		default: return dcprintf(PRINT_DST_BUF(buf, size, 0), "%s %.*s %s", "a string argument", 6, "truncated", "and another one");
+		}
+	}
+}
+
+static void bench_format()
+{
+	static const char *names[] = { "ints", "mixed", "strs" };
+
+	char buf[256];
+
+	c_printf("format, ns/op, snprintf / c_sprintf / dcprintf:\n");
+	for (int kind = FORMAT_INTS; kind <= FORMAT_STRS; kind++) {
+		double ns[3];
+		for (int impl = FORMAT_LIBC; impl <= FORMAT_PROG; impl++) {
+			const u64 start = c_mono();
+			for (int i = 0; i < FORMAT_OPS; i++) {
+				s_sink += format_run(kind, impl, buf, sizeof(buf), i);
+			}
+			ns[impl] = (double)(c_mono() - start) / FORMAT_OPS;
+		}
+		c_printf("%-8s %6.1f / %6.1f / %-6.1f\n", names[kind], ns[FORMAT_LIBC], ns[FORMAT_ENGINE], ns[FORMAT_PROG]);
+	}
+}
+
+static double dtoa_val(u64 *state)
+{
+	// Decimal-looking values, the common case, and random bit patterns
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	if (*state >> 63) {
+		return (double)(*state >> 40) / 1000;
+	}
+
+	const u64 bits = (*state & 0x800fffffffffffffULL) | (u64)(1023 + (int)((*state >> 52) % 200) - 100) << 52;
+	double val;
+	memcpy(&val, &bits, sizeof(val));
+	return val;
+}
+
+static void bench_dtoa()
+{
+	static const char *names[] = { "shortest", "%.2f", "%e" };
+
+	char buf[64];
+
+	c_printf("dtoa, ns/op, snprintf / cplatform:\n");
+	for (int kind = 0; kind < 3; kind++) {
+		double ns[2];
+		for (int libc = 0; libc < 2; libc++) {
+			u64 state	= 1;
+			const u64 start	= c_mono();
+			for (int i = 0; i < DTOA_OPS; i++) {
+				const double val = dtoa_val(&state);
+				switch (kind) {
+				case 0: s_sink += libc ? snprintf(buf, sizeof(buf), "%.17g", val) : c_dtoa(val, buf, sizeof(buf)); break;
+				case 1: s_sink += libc ? snprintf(buf, sizeof(buf), "%.2f", val) : c_sprintf(buf, sizeof(buf), 0, "%.2f", val); break;
+				default: s_sink += libc ? snprintf(buf, sizeof(buf), "%e", val) : c_sprintf(buf, sizeof(buf), 0, "%e", val); break;
+				}
+			}
+			ns[libc] = (double)(c_mono() - start) / DTOA_OPS;
+		}
+		c_printf("%-8s %6.1f / %-6.1f\n", names[kind], ns[1], ns[0]);
+	}
+}
+
+static void sink_run(const char *name, print_dst_t dst)
+{
+	static const char *msg = "connection from 10.0.0.1 accepted, handing over to worker";
+
+	const u64 start = c_mono();
+	for (int i = 0; i < SINK_RECORDS; i++) {
+		dcprintf(dst, "%s %-5s [%s:%s] %s:%d: %s\n", "2024-01-01 12:00:00.000", "INFO", "server", "listener.c", "listener_accept", i, msg);
+		dsync(dst, LOG_INFO);
+	}
+	c_printf("%-8s %6.1f\n", name, (double)(c_mono() - start) / SINK_RECORDS);
+}
+
+// Log-like records into the null device, one write per record except for the
+// buffered sink, and into a mapped file
+static void bench_sinks()
+{
+#if defined(C_WIN)
+	FILE *file = fopen("NUL", "wb");
+#else
+	FILE *file = fopen("/dev/null", "wb");
+#endif
+	if (file == NULL) {
+		return;
+	}
+
+	c_printf("sinks, ns/record:\n");
+	sink_run("file", PRINT_DST_FILE(file));
+
+	print_buf_t pbuf;
+	print_buf_init(&pbuf, file, 64 * 1024, 0, PRINT_BUF_LEVEL_NONE);
+	sink_run("buffered", PRINT_DST_BUFFERED(&pbuf));
+	print_buf_free(&pbuf);
+
+	print_iov_t iov;
+	print_iov_init(&iov, file);
+	sink_run("iov", PRINT_DST_IOV(&iov));
+	print_iov_free(&iov);
+
+	fclose(file);
+
+	// A real file, mappings of the null device do not grow
+	print_map_t map;
+	if (print_map_init(&map, "bench_map.txt", 0, 0, PRINT_BUF_LEVEL_NONE) != NULL) {
+		sink_run("mmap", PRINT_DST_MMAP(&map));
+		print_map_free(&map);
+		remove("bench_map.txt");
+	}
+}
+
+// ASCII text and text with a non-ASCII character every few bytes
+static void bench_utf()
+{
+	static const char *names[] = { "ascii", "mixed" };
+	static char text[UTF_SIZE];
+	static wchar wide[UTF_SIZE + 1];
+	static char back[UTF_SIZE + 1];
+
+	const int max = mem_simd_get();
+
+	c_printf("utf, GB/s, valid / to wchar / to utf8 per simd level:\n");
+	for (int kind = 0; kind < 2; kind++) {
+		size_t len = 0;
+		while (len + 3 <= sizeof(text)) {
+			if (kind == 1 && len % 8 == 0) {
+				memcpy(text + len, "\xc3\xa9", 2);
+				len += 2;
+			} else {
+				text[len] = (char)('a' + len % 26);
+				len++;
+			}
+		}
+		const size_t cnt = c_utf8_to_wchar(NULL, 0, text, len);
+
+		c_printf("%-8s", names[kind]);
+		for (int level = MEM_SIMD_NONE; level <= max; level++) {
+			mem_simd_set(level, 0);
+
+			double gbs[3];
+			for (int op = 0; op < 3; op++) {
+				const u64 start = c_mono();
+				for (size_t done = 0; done < UTF_BYTES; done += len) {
+					switch (op) {
+					case 0: s_sink += (int)c_utf8_valid(text, len); break;
+					case 1: s_sink += (int)c_utf8_to_wchar(wide, UTF_SIZE + 1, text, len); break;
+					default: s_sink += (int)c_wchar_to_utf8(back, sizeof(back), wide, cnt); break;
+					}
+				}
+				const u64 ns = c_mono() - start;
+				gbs[op]	     = (double)UTF_BYTES / (double)(ns == 0 ? 1 : ns);
+			}
+			c_printf(" %5.2f/%5.2f/%-5.2f", gbs[0], gbs[1], gbs[2]);
+		}
+		c_printf("\n");
+	}
+	mem_simd_set(MEM_SIMD_AVX512, 0);
+
+	wchar buf[256];
+	double ns[2];
+	for (int libc = 0; libc < 2; libc++) {
+		const u64 start = c_mono();
+		for (int i = 0; i < WFORMAT_OPS; i++) {
+			if (libc) {
+				s_sink += swprintf(buf, 256, L"[%s:%s] %03d \u2500 %s", "cplatform", "print", i % 1000, "wide");
+			} else {
+				s_sink += c_swprintf(buf, sizeof(buf), 0, L"[%s:%s] %03d \u2500 %s", "cplatform", "print", i % 1000, "wide");
+			}
+		}
+		ns[libc] = (double)(c_mono() - start) / WFORMAT_OPS;
+	}
+	c_printf("wide format, ns/op, swprintf / c_swprintf: %6.1f / %-6.1f\n", ns[1], ns[0]);
+}
+
+// Every finite float has to read back from c_ftoa(), too slow for the unit tests
+static int ftoa_check()
+{
+	char buf[PRINT_DTOA_SIZE];
+	u64 failed = 0;
+
+	for (u32 bits = 0; bits < 0x7f800000; bits++) {
+		float val;
+		memcpy(&val, &bits, sizeof(val));
+		c_ftoa(val, buf, sizeof(buf));
+		const float back = strtof(buf, NULL);
+		if (memcmp(&back, &val, sizeof(val)) != 0) {
+			if (failed++ < 16) {
+				c_printf("ftoa: %08x: %s\n", bits, buf);
+			}
+		}
+	}
+
+	c_printf("ftoa: %llu of 2139095040 floats failed\n", (unsigned long long)failed);
+	return failed > 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "ftoa") == 0) {
+		return ftoa_check();
+	}
+
+	// Largest kernel size, 1 GB by default
+	const size_t max = argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : (size_t)1 << 30;
+
+	cplatform_t cplatform = { 0 };
+	cplatform_init(&cplatform);
+
+	c_printf("alloc/free churn, %d threads, 16-1040 B:\n", CHURN_THREADS);
+	bench_churn("malloc", CHURN_LIBC);
+	bench_churn("mem_alloc", CHURN_MEM);
+	mem_cache_set(64 * 1024);
+	bench_churn("mem_alloc cache", CHURN_MEM);
+	mem_cache_set(0);
+
+	bench_kernels(max);
+
+	bench_format();
+	bench_dtoa();
+	bench_sinks();
+	bench_utf();
+
+	mem_print(PRINT_DST_STD());
+
+	cplatform_free(&cplatform);
+	return 0;
+}
@@ -1,12 +1,24 @@
 #include "test_cplatform.h"
 
+#include "c_thread.h"
 #include "c_time.h"
 #include "cplatform.h"
 #include "log.h"
+#include "log_bin.h"
 #include "mem.h"
+#include "mem_arena.h"
+#include "mem_dom.h"
+#include "mem_pool.h"
+#include "mem_prof.h"
+#include "mem_trace.h"
 #include "platform.h"
 
 #include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define EXPECT(_check)                                  \
@@ -67,118 +79,1690 @@ static int file_delete(const char *path)
 	return ret;
 }
 
+static const char *file_text(const char *path, char *buf, size_t size)
+{
+	FILE *file = file_open(path, "rb");
+	if (file == NULL) {
+		buf[0] = '\0';
+		return buf;
+	}
+
+	size_t len = fread(buf, 1, size - 1, file);
+	buf[len]   = '\0';
+	fclose(file);
+	return buf;
+}
+
 static int t_init_free()
 {
 	int ret = 0;
 
-	EXPECT(cplatform_init(NULL) == NULL);
-	EXPECT(cplatform_free(NULL) == 1);
+	EXPECT(cplatform_init(NULL) == NULL);
+	EXPECT(cplatform_free(NULL) == 1);
+
+	return ret;
+}
+
+static int t_time()
+{
+	int ret = 0;
+
+	c_time();
+	c_sleep(1);
+	c_time_str(NULL);
+
+	char buf[C_TIME_BUF_SIZE_MAX] = { 0 };
+	EXPECT_STR(c_time_fmt(buf, 0), "1970-01-01 00:00:00.000");
+	EXPECT_STR(c_time_fmt(buf, 1700000000123), "2023-11-14 22:13:20.123");
+	EXPECT_STR(c_time_fmt(buf, 1700000005004), "2023-11-14 22:13:25.004");
+	EXPECT_STR(c_time_fmt(buf, 1700000045999), "2023-11-14 22:14:05.999");
+	EXPECT_STR(c_time_fmt(buf, 1709251199000), "2024-02-29 23:59:59.000");
+	EXPECT_STR(c_time_fmt(buf, 1709251200000), "2024-03-01 00:00:00.000");
+
+	EXPECT_STR(c_time_fmtf(buf, sizeof(buf), 1700000000, 123456789, C_TIME_US), "2023-11-14 22:13:20.123456");
+	EXPECT_STR(c_time_fmtf(buf, sizeof(buf), 1700000000, 123456789, C_TIME_NS), "2023-11-14 22:13:20.123456789");
+	EXPECT_STR(c_time_fmtf(buf, sizeof(buf), 1700000000, 5000000, C_TIME_MS | C_TIME_ISO), "2023-11-14T22:13:20.005Z");
+	EXPECT_STR(c_time_fmtf(buf, sizeof(buf), 1700000000, 1, C_TIME_NS | C_TIME_ISO), "2023-11-14T22:13:20.000000001Z");
+	EXPECT(c_time_fmtf(buf, 30, 0, 0, C_TIME_NS | C_TIME_ISO) == NULL);
+	EXPECT(c_time_fmtf(buf, sizeof(buf), 0, 0, C_TIME_PREC_MASK) == NULL);
+	EXPECT(c_time_strf(NULL, 0, C_TIME_MS) == NULL);
+	EXPECT(c_time_strf(buf, C_TIME_BUF_SIZE, C_TIME_MS) != NULL);
+	EXPECT(strlen(buf) == C_TIME_BUF_SIZE - 1);
+
+	return ret;
+}
+
+static int t_time_mono()
+{
+	int ret = 0;
+
+	const u64 mono	 = c_mono();
+	const u64 coarse = c_mono_coarse();
+	const u64 cycles = c_clock(C_CLOCK_CYCLES);
+	const u64 cnt	 = c_cycles();
+
+	c_sleep(2);
+
+	EXPECT(c_clock(C_CLOCK_MONO) - mono >= 2000000);
+	EXPECT(c_clock(C_CLOCK_COARSE) >= coarse);
+	EXPECT(c_clock(C_CLOCK_CYCLES) - cycles >= 1900000);
+	EXPECT(c_cycles() > cnt);
+	EXPECT(c_cycles_ns(0) == 0);
+
+	const u64 freq = c_cycles_freq();
+	if (freq != 0) {
+		EXPECT(c_cycles_ns(freq) > 999000000 && c_cycles_ns(freq) < 1001000000);
+		EXPECT(c_cycles_ns(freq * 3600) > 3599999000000 && c_cycles_ns(freq * 3600) < 3600001000000);
+		EXPECT(c_cycles_calibrate(0) == 1);
+	}
+
+	return ret;
+}
+
+static int print_callback(log_event_t *ev)
+{
+	(void)ev;
+	return 0;
+}
+
+static int t_log()
+{
+	int ret = 0;
+
+	const log_t *log = log_get();
+
+	log_t tmp = *log;
+	log_set(&tmp);
+
+	EXPECT(log_add_callback(log_std_cb, PRINT_DST_NONE(), LOG_TRACE, 1) == 0);
+
+	for (int i = 1; i < LOG_MAX_CALLBACKS; i++) {
+		EXPECT(log_add_callback(print_callback, PRINT_DST_NONE(), LOG_TRACE, 1) == 0);
+	}
+
+	EXPECT(log_add_callback(print_callback, PRINT_DST_NONE(), LOG_TRACE, 1) == 1);
+
+	int quiet  = log_set_quiet(0);
+	int level  = log_set_level(LOG_TRACE);
+	int header = log_set_header(0);
+	log_trace("test_cplatform", "main", NULL, "");
+	log_set_header(header);
+
+	log_trace(NULL, NULL, NULL, NULL);
+	log_trace("test_cplatform", "main", "test", "trace");
+	log_debug("test_cplatform", "main", "test", "debug");
+	log_info("test_cplatform", "main", "test", "info");
+	log_warn("test_cplatform", "main", "test", "warn");
+	log_error("test_cplatform", "main", "test", "error");
+	log_fatal("test_cplatform", "main", "test", "fatal");
+
+	log_set_level(level);
+	log_set_quiet(quiet);
+
+	log_set(NULL);
+	EXPECT(log_add_callback(print_callback, PRINT_DST_NONE(), LOG_TRACE, 1) == 1);
+	log_set_level(LOG_FATAL);
+	log_set_quiet(0);
+	log_set_header(0);
+	log_init(NULL);
+	log_level_str(LOG_TRACE);
+
+	log_set((log_t *)log);
+
+	return ret;
+}
+
+static int s_site_evals;
+
+static int site_eval()
+{
+	return ++s_site_evals;
+}
+
+#undef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_INFO
+
+static void site_compiled_out()
+{
+	log_debug("test_cplatform", "main", NULL, "%d", site_eval());
+	log_info("test_cplatform", "main", NULL, "%d", site_eval());
+}
+
+#undef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_TRACE
+
+static int t_log_site()
+{
+	int ret = 0;
+
+	const log_t *log = log_get();
+
+	log_t tmp = { 0 };
+	log_set(&tmp);
+	log_set_level(LOG_WARN);
+	log_set_quiet(1);
+
+	s_site_evals = 0;
+	for (int i = 0; i < 3; i++) {
+		log_trace("test_cplatform", "main", NULL, "%d", site_eval());
+	}
+	EXPECT(s_site_evals == 0);
+
+	log_site_t site = { 0 };
+	EXPECT(log_site_update(&site, LOG_TRACE) == 0);
+	EXPECT(site.state == log_generation);
+
+	EXPECT(log_add_callback(print_callback, PRINT_DST_NONE(), LOG_DEBUG, 1) == 0);
+	EXPECT(site.state != log_generation);
+	for (int i = 0; i < 3; i++) {
+		log_trace("test_cplatform", "main", NULL, "%d", site_eval());
+		log_debug("test_cplatform", "main", NULL, "%d", site_eval());
+	}
+	EXPECT(s_site_evals == 3);
+
+	// A thread with its own log is asked separately, the cached flag stays with the shared one
+	log_t local = { 0 };
+	log_set_local(&local);
+	log_set_quiet(1);
+	EXPECT(log_add_callback(print_callback, PRINT_DST_NONE(), LOG_TRACE, 1) == 0);
+	for (int i = 0; i < 3; i++) {
+		log_trace("test_cplatform", "main", NULL, "%d", site_eval());
+	}
+	EXPECT(s_site_evals == 6);
+	EXPECT(log_site_update(&site, LOG_TRACE) == 1);
+	EXPECT(site.state == log_generation);
+	log_set_local(NULL);
+	EXPECT(log_site_update(&site, LOG_TRACE) == 0);
+	log_trace("test_cplatform", "main", NULL, "%d", site_eval());
+	EXPECT(s_site_evals == 6);
+
+	u32 gen = log_generation;
+	log_set_level(LOG_TRACE);
+	log_set_quiet(1);
+	EXPECT(log_generation != gen);
+
+	EXPECT(log_add_callback(print_callback, PRINT_DST_NONE(), LOG_TRACE, 1) == 0);
+	log_trace("test_cplatform", "main", NULL, "%d", site_eval());
+	EXPECT(s_site_evals == 7);
+
+	site_compiled_out();
+	EXPECT(s_site_evals == 8);
+
+	// Filled in without log_add_callback(), counted when set
+	log_t direct	    = { .level = LOG_TRACE, .quiet = 1 };
+	direct.callbacks[0] = (log_callback_t){ .log = print_callback, .level = LOG_TRACE };
+	log_set(&direct);
+	EXPECT(direct.callbacks_cnt == 1);
+	log_trace("test_cplatform", "main", NULL, "%d", site_eval());
+	EXPECT(s_site_evals == 9);
+
+	log_set(NULL);
+	EXPECT(log_site_update(&site, LOG_FATAL) == 0);
+	log_fatal("test_cplatform", "main", NULL, "%d", site_eval());
+	EXPECT(s_site_evals == 9);
+
+	log_set((log_t *)log);
+
+	return ret;
+}
+
+#define THREADS_CNT  4
+#define THREADS_LOGS 1000
+
+static C_THREAD_LOCAL int s_thread_cnt;
+static u32 s_shared_cnt;
+
+static int thread_local_callback(log_event_t *ev)
+{
+	(void)ev;
+	s_thread_cnt++;
+	return 0;
+}
+
+static int thread_shared_callback(log_event_t *ev)
+{
+	(void)ev;
+	c_atomic_add32(&s_shared_cnt, 1);
+	return 0;
+}
+
+static int log_thread(void *arg)
+{
+	log_t *shared = arg;
+
+	log_t local = { 0 };
+	log_set_local(&local);
+	if (log_get() != &local) {
+		return 1;
+	}
+
+	log_set_quiet(1);
+	log_add_callback(thread_local_callback, PRINT_DST_NONE(), LOG_INFO, 0);
+
+	for (int i = 0; i < THREADS_LOGS; i++) {
+		log_info("test_cplatform", "main", NULL, "local %d", i);
+	}
+
+	log_set_local(NULL);
+	if (log_get() != shared) {
+		return 1;
+	}
+
+	for (int i = 0; i < THREADS_LOGS; i++) {
+		log_info("test_cplatform", "main", NULL, "shared %d", i);
+	}
+
+	return s_thread_cnt != THREADS_LOGS;
+}
+
+static int t_log_threads()
+{
+	int ret = 0;
+
+	const log_t *log = log_get();
+
+	log_t tmp = { 0 };
+	log_set(&tmp);
+	log_set_quiet(1);
+	EXPECT(log_add_callback(thread_shared_callback, PRINT_DST_NONE(), LOG_INFO, 0) == 0);
+
+	c_thread_t threads[THREADS_CNT];
+	for (int i = 0; i < THREADS_CNT; i++) {
+		EXPECT(c_thread_create(&threads[i], log_thread, &tmp) == 0);
+	}
+
+	for (int i = 1; i < LOG_MAX_CALLBACKS; i++) {
+		EXPECT(log_add_callback(print_callback, PRINT_DST_NONE(), LOG_INFO, 0) == 0);
+	}
+
+	for (int i = 0; i < THREADS_CNT; i++) {
+		EXPECT(c_thread_join(threads[i]) == 0);
+	}
+
+	EXPECT(s_shared_cnt == THREADS_CNT * THREADS_LOGS);
+	EXPECT(s_thread_cnt == 0);
+	EXPECT(log_set_local(NULL) == NULL);
+
+	log_set((log_t *)log);
+
+	return ret;
+}
+
+static int log_buf_thread(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < THREADS_LOGS; i++) {
+		log_info("test_cplatform", "main", NULL, "buf");
+	}
+	return 0;
+}
+
+static int t_log_buf_threads()
+{
+	int ret = 0;
+
+	const log_t *log = log_get();
+
+	static char buf[THREADS_CNT * THREADS_LOGS * 4 + 1];
+
+	log_t tmp = { 0 };
+	log_set(&tmp);
+	log_set_quiet(1);
+	EXPECT(log_add_callback(log_std_cb, PRINT_DST_BUF(buf, sizeof(buf), 0), LOG_INFO, 0) == 0);
+
+	// Records from all threads end up one after another, none over another
+	c_thread_t threads[THREADS_CNT];
+	for (int i = 0; i < THREADS_CNT; i++) {
+		EXPECT(c_thread_create(&threads[i], log_buf_thread, NULL) == 0);
+	}
+
+	for (int i = 0; i < THREADS_CNT; i++) {
+		EXPECT(c_thread_join(threads[i]) == 0);
+	}
+
+	EXPECT(tmp.callbacks[0].print.off == THREADS_CNT * THREADS_LOGS * 4);
+	EXPECT(strlen(buf) == THREADS_CNT * THREADS_LOGS * 4);
+
+	log_set((log_t *)log);
+
+	return ret;
+}
+
+static char s_render[64];
+
+static int render_callback(log_event_t *ev)
+{
+	s_render[0] = '\0';
+	if (ev->msg != NULL && ev->head != NULL) {
+		c_sprintf(s_render, sizeof(s_render), 0, "%.*s|%.*s", ev->head_len, ev->head, ev->msg_len, ev->msg);
+	}
+	return 0;
+}
+
+static int t_log_render()
+{
+	int ret = 0;
+
+	const log_t *log = log_get();
+
+	log_t tmp = { 0 };
+	log_set(&tmp);
+	log_set_level(LOG_TRACE);
+	log_set_quiet(1);
+
+	EXPECT(log_add_callback(render_callback, PRINT_DST_NONE(), LOG_TRACE, 0) == 0);
+	log_info("test_cplatform", "main", "tag", "msg %d", 1);
+	EXPECT_STR(s_render, "");
+
+	static char buf[4096];
+	EXPECT(log_add_callback(log_std_cb, PRINT_DST_BUF(buf, sizeof(buf), 0), LOG_TRACE, 0) == 0);
+	log_info("test_cplatform", "main", "tag", "msg %d", 2);
+	EXPECT_STR(s_render, "[tag] |msg 2");
+	EXPECT_STR(buf, "[tag] msg 2\n");
+
+	static char exp[2100];
+	mem_set(exp, 'a', sizeof(exp) - 2);
+	exp[sizeof(exp) - 2] = '\n';
+	tmp.callbacks[1].print.off = 0;
+	log_info("test_cplatform", "main", NULL, "%.*s", (int)sizeof(exp) - 2, exp);
+	EXPECT_STR(s_render, "");
+	EXPECT_STR(buf, exp);
+
+	log_set((log_t *)log);
+
+	return ret;
+}
+
+static int s_async_cnt;
+static int s_async_bad;
+
+static int async_callback(log_event_t *ev)
+{
+	char exp[32] = { 0 };
+	c_sprintf(exp, sizeof(exp), 0, "async %d", s_async_cnt);
+
+	char buf[32] = { 0 };
+	c_sprintv(buf, sizeof(buf), 0, ev->fmt, ev->ap);
+
+	if (strcmp(buf, exp) != 0 || ev->level != LOG_INFO || ev->line == 0) {
+		s_async_bad++;
+	}
+
+	s_async_cnt++;
+	return 0;
+}
+
+static int t_log_async()
+{
+	int ret = 0;
+
+	const log_t *log = log_get();
+
+	log_t tmp = { 0 };
+	log_set(&tmp);
+	log_set_level(LOG_TRACE);
+	log_set_quiet(1);
+
+	EXPECT(log_async_start(0, LOG_OVERFLOW_BLOCK) == 1);
+	EXPECT(log_async_dropped(NULL, NULL) == 1);
+	EXPECT(log_async_stop() == 1);
+	EXPECT(log_flush() == 0);
+
+	EXPECT(log_add_callback(async_callback, PRINT_DST_NONE(), LOG_INFO, 1) == 0);
+
+	EXPECT(log_async_start(3, LOG_OVERFLOW_BLOCK) == 0);
+	EXPECT(log_async_start(3, LOG_OVERFLOW_BLOCK) == 1);
+	log_trace("test_cplatform", "main", NULL, "filtered");
+	for (int i = 0; i < 100; i++) {
+		log_info("test_cplatform", "main", NULL, "async %d", i);
+	}
+	EXPECT(log_flush() == 0);
+	EXPECT(s_async_cnt == 100);
+	EXPECT(s_async_bad == 0);
+
+	u64 newest = 1;
+	u64 oldest = 1;
+	EXPECT(log_async_dropped(&newest, &oldest) == 0);
+	EXPECT(newest == 0 && oldest == 0);
+	EXPECT(log_async_stop() == 0);
+
+	s_async_cnt = 0;
+	EXPECT(log_async_start(4, LOG_OVERFLOW_DROP_NEWEST) == 0);
+	int dropped = 0;
+	for (int i = 0; i < 100; i++) {
+		dropped += log_log(LOG_INFO, "test_cplatform", "main", __func__, __LINE__, NULL, "async %d", i - dropped);
+	}
+	EXPECT(log_flush() == 0);
+	EXPECT(log_async_dropped(&newest, NULL) == 0);
+	EXPECT(newest == (u64)dropped);
+	EXPECT((u64)s_async_cnt + newest == 100);
+	EXPECT(s_async_bad == 0);
+	EXPECT(log_async_stop() == 0);
+
+	s_async_cnt = 0;
+	EXPECT(log_async_start(4, LOG_OVERFLOW_DROP_OLDEST) == 0);
+	for (int i = 0; i < 100; i++) {
+		log_info("test_cplatform", "main", NULL, "dropped");
+	}
+	EXPECT(log_flush() == 0);
+	EXPECT(log_async_dropped(NULL, &oldest) == 0);
+	EXPECT((u64)s_async_cnt + oldest == 100);
+	EXPECT(log_async_stop() == 0);
+
+	log_set((log_t *)log);
+
+	return ret;
+}
+
+static u32 s_async_stop_cnt;
+static volatile u32 s_async_stop_done;
+
+static int async_stop_callback(log_event_t *ev)
+{
+	(void)ev;
+	c_atomic_add32(&s_async_stop_cnt, 1);
+	return 0;
+}
+
+static int async_stop_thread(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < THREADS_LOGS; i++) {
+		log_info("test_cplatform", "main", NULL, "stop %d", i);
+	}
+	c_atomic_add32(&s_async_stop_done, 1);
+	return 0;
+}
+
+static int t_log_async_stop()
+{
+	int ret = 0;
+
+	const log_t *log = log_get();
+
+	log_t tmp = { 0 };
+	log_set(&tmp);
+	log_set_quiet(1);
+	EXPECT(log_add_callback(async_stop_callback, PRINT_DST_NONE(), LOG_INFO, 1) == 0);
+
+	c_thread_t threads[THREADS_CNT];
+	for (int i = 0; i < THREADS_CNT; i++) {
+		EXPECT(c_thread_create(&threads[i], async_stop_thread, NULL) == 0);
+	}
+
+	// Records pushed while the queue goes away are neither lost nor read from freed memory
+	while (c_atomic_load32(&s_async_stop_done) < THREADS_CNT) {
+		EXPECT(log_async_start(8, LOG_OVERFLOW_BLOCK) == 0);
+		c_thread_yield();
+		EXPECT(log_async_stop() == 0);
+	}
+
+	for (int i = 0; i < THREADS_CNT; i++) {
+		EXPECT(c_thread_join(threads[i]) == 0);
+	}
+
+	EXPECT(s_async_stop_cnt == THREADS_CNT * THREADS_LOGS);
+	EXPECT(tmp.async_users == 0);
+
+	log_set((log_t *)log);
+
+	return ret;
+}
+
+static int t_log_bin()
+{
+	int ret = 0;
+
+	const log_t *log = log_get();
+
+	log_t tmp = { 0 };
+	log_set(&tmp);
+	log_set_level(LOG_TRACE);
+	log_set_quiet(1);
+
+	EXPECT(log_bin_init(NULL, NULL) == NULL);
+	EXPECT(log_bin_free(NULL) == 1);
+	EXPECT(log_bin_decode(NULL, PRINT_DST_NONE()) == 1);
+
+	const char *path = "log.bin";
+
+	static log_bin_t bin;
+	FILE *file = file_open(path, "wb+");
+	EXPECT(log_bin_init(&bin, file) == &bin);
+
+	static char exp[4096];
+	EXPECT(log_add_callback(log_std_cb, PRINT_DST_BUF(exp, sizeof(exp), 0), LOG_TRACE, 1) == 0);
+	EXPECT(log_add_callback(log_bin_cb, PRINT_DST_BIN(&bin), LOG_TRACE, 1) == 0);
+
+	const char *str = "abcdef";
+	for (int i = 0; i < 3; i++) {
+		log_info("test_cplatform", "main", "tag", "int %d %5u %-4x %03ld %lld %zu %hhd|", i, i, 255 + i, 7L, -1LL, (size_t)42, 300);
+		log_warn("test_cplatform", "main", NULL, "str %s %.*s %-8.3s %c %% %p", str, i, str, str, 'x', (void *)str);
+		log_error("test_cplatform", "main", NULL, "double %.2f %g %e %*d", 3.14159 * i, 1e-5, 12345.678, 6, i);
+	}
+	log_info("test_cplatform", "main", NULL, "ldouble %.20Lf %Lg", (long double)1 / 3, (long double)1 / 7);
+	log_debug("test_cplatform", "main", NULL, "positional %1$d", 1);
+	log_trace(NULL, "main", NULL, "null %s", NULL);
+
+	EXPECT(log_bin_free(&bin) == 0);
+
+	static char act[4096];
+	fseek(file, 0, SEEK_SET);
+	EXPECT(log_bin_decode(file, PRINT_DST_BUF(act, sizeof(act), 0)) == 0);
+	fclose(file);
+	file_delete(path);
+
+	EXPECT(act[0] != '\0');
+	EXPECT_STR(act, exp);
+
+	log_set((log_t *)log);
+
+	return ret;
+}
+
+#define MEM_THREADS 4
+#define MEM_ALLOCS  10000
+
+static int mem_thread(void *arg)
+{
+	(void)arg;
+
+	for (int i = 0; i < MEM_ALLOCS; i++) {
+		void *ptr = mem_alloc(32);
+		if (ptr == NULL) {
+			return 1;
+		}
+		mem_free(ptr, 32);
+	}
+
+	return 0;
+}
+
+static int t_mem_threads()
+{
+	int ret = 0;
+
+	mem_t *mem = (mem_t *)mem_get();
+
+	mem_t mm = { 0 };
+	mem_sset(&mm);
+
+	c_thread_t threads[MEM_THREADS];
+	for (int i = 0; i < MEM_THREADS; i++) {
+		EXPECT(c_thread_create(&threads[i], mem_thread, NULL) == 0);
+	}
+	for (int i = 0; i < MEM_THREADS; i++) {
+		EXPECT(c_thread_join(threads[i]) == 0);
+	}
+
+	EXPECT(mem_get()->mem == 0);
+	EXPECT(mem_get()->allocs == MEM_THREADS * MEM_ALLOCS);
+	EXPECT(mem_get()->total == MEM_THREADS * MEM_ALLOCS * 32);
+
+	void *big = mem_alloc(1024 * 1024);
+	mem_free(big, 1024 * 1024);
+	EXPECT(mem_get()->mem == 0 && mem_get()->peak >= 1024 * 1024);
+
+	mem_sset(mem);
+
+	return ret;
+}
+
+static int cache_thread(void *arg)
+{
+	(void)arg;
+
+	void *ptrs[64] = { 0 };
+	u32 seed       = c_thread_id();
+	for (int i = 0; i < MEM_ALLOCS; i++) {
+		seed		 = seed * 1103515245 + 12345;
+		const int slot	 = (seed >> 8) % 64;
+		const size_t len = (size_t)(slot + 1) * 24;
+		if (ptrs[slot] != NULL) {
+			mem_free(ptrs[slot], len);
+		}
+		ptrs[slot] = mem_alloc(len);
+		if (ptrs[slot] == NULL) {
+			return 1;
+		}
+		mem_set(ptrs[slot], slot, len);
+	}
+
+	for (int slot = 0; slot < 64; slot++) {
+		mem_free(ptrs[slot], (size_t)(slot + 1) * 24);
+	}
+
+	return 0;
+}
+
+static volatile u32 s_cache_step;
+
+// Keeps its blocks cached until caching was disabled, then exits
+static int cache_disable_thread(void *arg)
+{
+	(void)arg;
+
+	void *ptrs[8];
+	for (int i = 0; i < 8; i++) {
+		ptrs[i] = mem_alloc(100);
+	}
+	for (int i = 0; i < 8; i++) {
+		mem_free(ptrs[i], 100);
+	}
+	c_atomic_store32(&s_cache_step, 1);
+
+	while (c_atomic_load32(&s_cache_step) != 2) {
+		c_thread_yield();
+	}
+
+	return 0;
+}
+
+static int t_mem_cache()
+{
+	int ret = 0;
+
+	mem_t *mem = (mem_t *)mem_get();
+
+	mem_t mm = { 0 };
+	mem_sset(&mm);
+
+	EXPECT(mem_cache_set(4096) == 0);
+
+	void *a = mem_alloc(20);
+	mem_free(a, 20);
+	void *b = mem_alloc(30);
+	EXPECT(b == a);
+	EXPECT(mem_get()->classes[1].size == 32 && mem_get()->classes[1].hits == 1 && mem_get()->classes[1].misses == 1);
+
+	mem_set(b, 0xff, 30);
+	mem_free(b, 30);
+	EXPECT(mem_get()->classes[1].cached == 32);
+
+	char *c = mem_calloc(5, 5);
+	EXPECT(c == b && c[0] == 0 && c[24] == 0);
+	mem_free(c, 25);
+
+	c_thread_t threads[MEM_THREADS];
+	for (int i = 0; i < MEM_THREADS; i++) {
+		EXPECT(c_thread_create(&threads[i], cache_thread, NULL) == 0);
+	}
+	for (int i = 0; i < MEM_THREADS; i++) {
+		EXPECT(c_thread_join(threads[i]) == 0);
+	}
+	EXPECT(mem_get()->mem == 0);
+
+	char buf[2048] = { 0 };
+	EXPECT(mem_print(PRINT_DST_BUF(buf, sizeof(buf), 0)) > 0);
+	EXPECT(strstr(buf, "cache stats:") != NULL);
+
+	EXPECT(mem_cache_set(0) == 0);
+	size_t cached = 0;
+	for (int i = 0; i < MEM_CLASSES; i++) {
+		cached += mem_get()->classes[i].cached;
+	}
+	EXPECT(cached == 0);
+
+	// Allocated while disabled, too small for its class
+	void *d = mem_alloc(20);
+	EXPECT(mem_cache_set(4096) == 0);
+	mem_free(d, 20);
+	EXPECT(mem_get()->classes[1].cached == 0);
+
+	c_thread_t thread;
+	s_cache_step = 0;
+	EXPECT(c_thread_create(&thread, cache_disable_thread, NULL) == 0);
+	while (c_atomic_load32(&s_cache_step) != 1) {
+		c_thread_yield();
+	}
+	EXPECT(mem_cache_set(0) == 0);
+	c_atomic_store32(&s_cache_step, 2);
+	EXPECT(c_thread_join(thread) == 0);
+	EXPECT(mem_get()->classes[6].cached == 0);
+	EXPECT(mem_get()->mem == 0);
+
+	mem_sset(mem);
+
+	return ret;
+}
+
+static int t_mem_map()
+{
+	int ret = 0;
+
+	mem_t *mem = (mem_t *)mem_get();
+
+	mem_t mm = { 0 };
+	mem_sset(&mm);
+
+	EXPECT(mem_map_set(64 * 1024, 0) == 0);
+
+	char *a = mem_alloc(128 * 1024);
+	EXPECT(a != NULL && mem_get()->maps == 1 && mem_get()->map_mem == 128 * 1024 && mem_get()->map_resident == 0);
+
+	mem_set(a, 0x5a, 128 * 1024);
+	EXPECT(mem_get()->map_resident == 128 * 1024);
+
+	a = mem_realloc(a, 4 * 1024 * 1024, 128 * 1024);
+	EXPECT(a != NULL && a[0] == 0x5a && a[128 * 1024 - 1] == 0x5a);
+	EXPECT(mem_get()->maps == 1 && mem_get()->map_mem == 4 * 1024 * 1024 && mem_get()->mem == 4 * 1024 * 1024);
+
+	char *b = mem_alloc(60 * 1024);
+	EXPECT(mem_get()->maps == 1);
+	b = mem_realloc(b, 192 * 1024, 60 * 1024);
+	EXPECT(mem_get()->maps == 2 && mem_get()->map_mem == 4 * 1024 * 1024 + 192 * 1024);
+	mem_free(b, 192 * 1024);
+
+	mem_free(a, 4 * 1024 * 1024);
+	EXPECT(mem_get()->mem == 0 && mem_get()->maps == 2);
+
+	char *c = mem_calloc(1, 3 * 1024 * 1024);
+	EXPECT(c == a && c[0] == 0 && c[128 * 1024 - 1] == 0);
+	mem_free(c, 3 * 1024 * 1024);
+
+	// Shrunk below the threshold it stays mapped, and is still found by the free of its new size
+	char *d = mem_alloc(256 * 1024);
+	d	= mem_realloc(d, 1024, 256 * 1024);
+	EXPECT(d != NULL && mem_get()->mem == 1024);
+	mem_free(d, 1024);
+	EXPECT(mem_get()->mem == 0);
+
+	char buf[1024] = { 0 };
+	EXPECT(mem_print(PRINT_DST_BUF(buf, sizeof(buf), 0)) > 0);
+	EXPECT(strstr(buf, "map stats:") != NULL);
+
+	EXPECT(mem_map_set(0, 0) == 0);
+	EXPECT(mem_get()->maps == 0 && mem_get()->map_mem == 0);
+
+	mem_sset(mem);
+
+	return ret;
+}
+
+static int t_mem_arena()
+{
+	int ret = 0;
+
+	mem_t *mem = (mem_t *)mem_get();
+
+	mem_t mm = { 0 };
+	mem_sset(&mm);
+
+	mem_arena_t arena = { 0 };
+	EXPECT(mem_arena_init(NULL, 64) == NULL);
+	EXPECT(mem_arena_init(&arena, 0) == NULL);
+	EXPECT(mem_arena_init(&arena, 64) == &arena);
+
+	EXPECT(mem_arena_alloc_aligned(&arena, 8, 3) == NULL);
+
+	char *a = mem_arena_alloc(&arena, 10);
+	char *b = mem_arena_alloc(&arena, 10);
+	EXPECT(a != NULL && b != NULL);
+	EXPECT((size_t)a % 16 == 0 && (size_t)b % 16 == 0);
+	EXPECT(b == a + 16);
+	EXPECT(arena.chunks == 1 && mem_get()->arena_chunks == 1 && mem_get()->arena_mem == 20);
+
+	mem_arena_mark_t mark = mem_arena_mark(&arena);
+
+	char *c = mem_arena_alloc_aligned(&arena, 1, 64);
+	EXPECT(c != NULL && (size_t)c % 64 == 0);
+	char *d = mem_arena_alloc(&arena, 200);
+	EXPECT(d != NULL && arena.chunks >= 2);
+	EXPECT(mem_get()->arena_mem == 221 && mem_get()->arena_peak == 221);
+
+	// Opens a chunk of its own, padded for the alignment whatever mem_alloc() returned
+	char *e = mem_arena_alloc_aligned(&arena, 300, 4096);
+	EXPECT(e != NULL && (size_t)e % 4096 == 0);
+	mem_set(e, 0x5a, 300);
+	EXPECT(mem_get()->arena_mem == 521);
+	EXPECT(mem_arena_alloc_aligned(&arena, (size_t)-1 - 8, 16) == NULL);
+
+	EXPECT(mem_arena_rewind(&arena, mark) == 0);
+	EXPECT(arena.chunks == 1 && mem_get()->arena_chunks == 1 && mem_get()->arena_mem == 20);
+	EXPECT(mem_arena_alloc(&arena, 10) == a + 32);
+
+	char buf[512] = { 0 };
+	EXPECT(mem_print(PRINT_DST_BUF(buf, sizeof(buf), 0)) > 0);
+	EXPECT(strstr(buf, "arena stats:") != NULL);
+
+	EXPECT(mem_arena_reset(&arena) == 0);
+	EXPECT(arena.chunks == 1 && arena.used == 0 && mem_get()->arena_mem == 0);
+	EXPECT(mem_arena_alloc(&arena, 10) == a);
+
+	EXPECT(mem_arena_free(NULL) == 1);
+	EXPECT(mem_arena_free(&arena) == 0);
+	EXPECT(mem_get()->arena_chunks == 0 && mem_get()->arena_mem == 0 && mem_get()->arena_peak == 521);
+	EXPECT(mem_get()->mem == 0);
+
+	mem_sset(mem);
+
+	return ret;
+}
+
+#define POOL_THREADS 4
+#define POOL_OBJS    1000
+
+static int pool_thread(void *arg)
+{
+	mem_pool_t *pool = arg;
+
+	void *objs[POOL_OBJS];
+	for (int round = 0; round < 10; round++) {
+		for (int i = 0; i < POOL_OBJS; i++) {
+			objs[i]		= mem_pool_alloc(pool);
+			*(int *)objs[i] = i;
+		}
+		for (int i = 0; i < POOL_OBJS; i++) {
+			if (*(int *)objs[i] != i) {
+				return 1;
+			}
+			mem_pool_release(pool, objs[i]);
+		}
+	}
+
+	return mem_pool_flush(pool);
+}
+
+static volatile u32 s_pool_step;
+
+static void pool_wait(u32 step)
+{
+	while (c_atomic_load32(&s_pool_step) != step) {
+		c_thread_yield();
+	}
+}
+
+static int pool_stale_thread(void *arg)
+{
+	mem_pool_t *pool = arg;
+	int ret		 = 0;
+
+	void *obj = mem_pool_alloc(pool);
+	mem_pool_release(pool, obj);
+	c_atomic_store32(&s_pool_step, 1);
+
+	// Freed with objects still in the cache of this thread
+	pool_wait(2);
+	ret |= mem_pool_alloc(pool) != NULL;
+	c_atomic_store32(&s_pool_step, 3);
+
+	// The cache is handed to the next pool without its stale objects
+	pool_wait(4);
+	obj = mem_pool_alloc(pool);
+	ret |= obj == NULL;
+	mem_set(obj, 0, 100);
+	mem_pool_release(pool, obj);
+	ret |= mem_pool_flush(pool);
+	c_atomic_store32(&s_pool_step, 5);
+
+	return ret;
+}
+
+static int t_mem_pool()
+{
+	int ret = 0;
+
+	mem_t *mem = (mem_t *)mem_get();
+
+	mem_t mm = { 0 };
+	mem_sset(&mm);
+
+	mem_pool_t pool = { 0 };
+	EXPECT(mem_pool_init(NULL, 16, 4, 0) == NULL);
+	EXPECT(mem_pool_init(&pool, 0, 4, 0) == NULL);
+	EXPECT(mem_pool_init(&pool, 16, 0, 0) == NULL);
+	EXPECT(mem_pool_init(&pool, 24, 4, 0) == &pool);
+	EXPECT(pool.slot == 32);
+
+	char *a = mem_pool_alloc(&pool);
+	char *b = mem_pool_alloc(&pool);
+	EXPECT(a != NULL && (size_t)a % 64 == 0 && b == a + 32);
+	EXPECT(pool.live == 2 && mem_get()->pool_live == 2 && mem_get()->pool_slabs == 1);
+
+	mem_pool_release(&pool, a);
+	EXPECT(mem_pool_alloc(&pool) == a);
+
+	void *objs[4];
+	for (int i = 0; i < 4; i++) {
+		objs[i] = mem_pool_alloc(&pool);
+	}
+	EXPECT(pool.slabs_cnt == 2 && mem_get()->pool_slabs == 2 && mem_get()->pool_live == 6 && mem_get()->pool_used == 6 * 24);
+
+	char buf[512] = { 0 };
+	EXPECT(mem_print(PRINT_DST_BUF(buf, sizeof(buf), 0)) > 0);
+	EXPECT(strstr(buf, "pool stats:") != NULL);
+
+	for (int i = 0; i < 4; i++) {
+		mem_pool_release(&pool, objs[i]);
+	}
+	mem_pool_release(&pool, a);
+	mem_pool_release(&pool, b);
+	EXPECT(pool.live == 0 && pool.peak == 6);
+
+	EXPECT(mem_pool_free(NULL) == 1);
+	EXPECT(mem_pool_free(&pool) == 0);
+	EXPECT(mem_get()->pool_slabs == 0 && mem_get()->pool_mem == 0 && mem_get()->pool_live == 0);
+
+	EXPECT(mem_pool_init(&pool, 100, 64, MEM_POOL_CACHE) == &pool);
+	EXPECT(pool.slot == 128);
+
+	a = mem_pool_alloc(&pool);
+	EXPECT(a != NULL && pool.live == MEM_POOL_CACHE_SIZE / 2);
+	mem_pool_release(&pool, a);
+	EXPECT(mem_pool_alloc(&pool) == a);
+	mem_pool_release(&pool, a);
+	EXPECT(mem_pool_flush(&pool) == 0);
+	EXPECT(pool.live == 0);
+
+	c_thread_t threads[POOL_THREADS];
+	for (int i = 0; i < POOL_THREADS; i++) {
+		EXPECT(c_thread_create(&threads[i], pool_thread, &pool) == 0);
+	}
+	for (int i = 0; i < POOL_THREADS; i++) {
+		EXPECT(c_thread_join(threads[i]) == 0);
+	}
+	EXPECT(pool.live == 0 && mem_get()->pool_live == 0);
+
+	EXPECT(mem_pool_free(&pool) == 0);
+	EXPECT(mem_get()->mem == 0);
+
+	c_thread_t thread;
+	EXPECT(mem_pool_init(&pool, 100, 64, MEM_POOL_CACHE) == &pool);
+	EXPECT(c_thread_create(&thread, pool_stale_thread, &pool) == 0);
+	pool_wait(1);
+	EXPECT(mem_pool_free(&pool) == 0);
+	c_atomic_store32(&s_pool_step, 2);
+	pool_wait(3);
+	EXPECT(mem_pool_init(&pool, 100, 64, MEM_POOL_CACHE) == &pool);
+	c_atomic_store32(&s_pool_step, 4);
+	pool_wait(5);
+	EXPECT(c_thread_join(thread) == 0);
+	EXPECT(pool.live == 0);
+	EXPECT(mem_pool_free(&pool) == 0);
+	EXPECT(mem_get()->mem == 0);
+
+	mem_sset(mem);
+
+	return ret;
+}
+
+static unsigned long long prof_value(const char *dump, const char *site)
+{
+	const char *line = strstr(dump, site);
+	if (line == NULL) {
+		return 0;
+	}
+
+	const char *end = strchr(line, '\n');
+	while (end > line && end[-1] != ' ') {
+		end--;
+	}
+
+	return strtoull(end, NULL, 10);
+}
+
+static int t_mem_prof()
+{
+	int ret = 0;
+
+	static char buf[16 * 1024];
+
+	EXPECT(mem_prof_start(0, 0) == 1);
+	EXPECT(mem_prof_start(1, 0) == 0);
+
+	void *ptrs[4];
+	for (int i = 0; i < 4; i++) {
+		ptrs[i] = mem_alloc_site(64);
+	}
+	void *big = mem_calloc_site(2, 150);
+	big	  = mem_realloc_site(big, 400, 300);
+
+	buf[0] = '\0';
+	EXPECT(mem_prof_dump(PRINT_DST_BUF(buf, sizeof(buf), 0), MEM_PROF_ALLOCS) > 0);
+	EXPECT(strstr(buf, " 256\n") != NULL && strstr(buf, " 300\n") != NULL && strstr(buf, " 400\n") != NULL);
+
+	for (int i = 0; i < 4; i++) {
+		mem_free(ptrs[i], 64);
+	}
+
+	buf[0] = '\0';
+	EXPECT(mem_prof_dump(PRINT_DST_BUF(buf, sizeof(buf), 0), MEM_PROF_LIVE) > 0);
+	EXPECT(strstr(buf, " 256\n") == NULL && strstr(buf, " 300\n") == NULL && strstr(buf, " 400\n") != NULL);
+	mem_free(big, 400);
+
+	buf[0] = '\0';
+	EXPECT(mem_print(PRINT_DST_BUF(buf, sizeof(buf), 0)) > 0);
+	EXPECT(strstr(buf, "top sites:") != NULL);
+
+	EXPECT(mem_prof_start(4096, 0) == 0);
+	for (int i = 0; i < 10000; i++) {
+		mem_free(mem_alloc_site(64), 64);
+	}
+	buf[0] = '\0';
+	mem_prof_dump(PRINT_DST_BUF(buf, sizeof(buf), 0), MEM_PROF_ALLOCS);
+	const unsigned long long est = prof_value(buf, "t_mem_prof (");
+	EXPECT(est > 640000 * 7 / 10 && est < 640000 * 13 / 10);
+
+	// Into a destination that allocates while printing
+	EXPECT(mem_prof_start(1, 0) == 0);
+	for (int i = 0; i < 64; i++) {
+		mem_free(mem_alloc_at(48, __FILE__, i + 1, __func__), 48);
+	}
+	print_dyn_t dyn;
+	print_dyn_init(&dyn, 0);
+	EXPECT(mem_prof_dump(PRINT_DST_DYN(&dyn), MEM_PROF_ALLOCS) > 0);
+	EXPECT(strstr(dyn.data, " 48\n") != NULL);
+	print_dyn_free(&dyn);
+
+	EXPECT(mem_prof_start(1, MEM_PROF_BACKTRACE) == 0);
+	mem_free(mem_alloc_site(32), 32);
+	buf[0] = '\0';
+	mem_prof_dump(PRINT_DST_BUF(buf, sizeof(buf), 0), MEM_PROF_ALLOCS);
+	EXPECT(strstr(buf, ";t_mem_prof (") != NULL);
+
+	EXPECT(mem_prof_stop() == 0);
+	EXPECT(mem_prof_stop() == 1);
+
+	return ret;
+}
+
+static int t_print()
+{
+	int ret = 0;
+
+	EXPECT(c_printv(NULL, NULL) == 0);
+	EXPECT(c_fprintv(NULL, NULL, NULL) == 0);
+	const char *temp = "temp.txt";
+
+	FILE *file = file_open(temp, "wb+");
+	fclose(file);
+	file = file_open(temp, "r");
+
+	int level = log_set_level(LOG_FATAL);
+	EXPECT(c_fwprintf(file, L"Test") == 0);
+	EXPECT(c_fprintf(file, "Test") == 0);
+	log_set_level(level);
+
+	fclose(file);
+	file_delete(temp);
+
+	EXPECT(c_sprintv(NULL, 0, 0, NULL, NULL) == 0);
+	EXPECT(dprintf(PRINT_DST_NONE(), NULL) == 0);
+#ifdef C_LINUX
+	char cbuf[2] = { 0 };
+	EXPECT(dprintf(PRINT_DST_BUF(cbuf, sizeof(cbuf), 0), "abc") == 0);
+#endif
+
+	EXPECT(c_wprintv(NULL, NULL) == 0);
+	EXPECT(c_fwprintv(NULL, NULL, NULL) == 0);
+	EXPECT(c_swprintv(NULL, 0, 0, NULL, NULL) == 0);
+	EXPECT(dwprintf(PRINT_DST_WNONE(), NULL) == 0);
+#ifdef C_LINUX
+	wchar wbuf[2] = { 0 };
+	EXPECT(dwprintf(PRINT_DST_WBUF(wbuf, sizeof(wbuf), 0), L"abc") == 0);
+#endif
+
+	EXPECT(c_setmode(NULL, 0) == 0);
+	EXPECT(c_fflush(NULL) == 1);
+
+	return ret;
+}
+
+#define EXPECT_FMT(_fmt, ...)                                                             \
+	{                                                                                 \
+		char _act[4096], _exp[4096];                                              \
+		const int _act_len = c_sprintf(_act, sizeof(_act), 0, _fmt, __VA_ARGS__); \
+		const int _exp_len = snprintf(_exp, sizeof(_exp), _fmt, __VA_ARGS__);     \
+		EXPECT(_act_len == _exp_len);                                             \
+		EXPECT_STR(_act, _exp);                                                   \
+	}
+
+static int t_print_fmt()
+{
+	int ret = 0;
+
+	static const long long vals[] = {
+		0, 1, -1, 9, 10, 99, 100, 12345, -12345, 999999, 1000000, INT_MAX, INT_MIN, UINT_MAX, LLONG_MAX, LLONG_MIN,
+	};
+
+	for (size_t i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+		const long long v = vals[i];
+		EXPECT_FMT("%d|%i|%u|%x|%X|%o", (int)v, (int)v, (unsigned)v, (unsigned)v, (unsigned)v, (unsigned)v);
+		EXPECT_FMT("%5d|%-5d|%05d|%.3d|%8.3d|%-8.3d|%+d|% d|%.0d", (int)v, (int)v, (int)v, (int)v, (int)v, (int)v, (int)v, (int)v, (int)v);
+		EXPECT_FMT("%ld|%lu|%lx|%03ld|%-12ld|", (long)v, (unsigned long)v, (unsigned long)v, (long)v, (long)v);
+		EXPECT_FMT("%lld|%llu|%llx|%llX|%llo|%+025lld", v, (unsigned long long)v, (unsigned long long)v, (unsigned long long)v, (unsigned long long)v, v);
+		EXPECT_FMT("%zu|%zx|%jd|%ju|%td", (size_t)v, (size_t)v, (intmax_t)v, (uintmax_t)v, (ptrdiff_t)v);
+		EXPECT_FMT("%tu|%tx|%to", (ptrdiff_t)v, (ptrdiff_t)v, (ptrdiff_t)v);
+		EXPECT_FMT("%hd|%hu|%hhd|%hhu|%hx", (short)v, (unsigned short)v, (signed char)v, (unsigned char)v, (unsigned short)v);
+		EXPECT_FMT("%*d|%-*d|%.*d|%*.*u", 7, (int)v, 7, (int)v, 4, (int)v, -9, 3, (unsigned)v);
+	}
+
+	EXPECT_FMT("%s|%5s|%-5s|%.2s|%.*s|%10.3s|%s", "abc", "abc", "abc", "abc", 5, "abcdefgh", "abcdef", "");
+	EXPECT_FMT("%.*s|%-*s|", 3, "ab", -6, "xy");
+	EXPECT_FMT("%c|%3c|%-3c|%%|100%%", 'a', 'b', 'c');
+	EXPECT_FMT("%p|%20p|%-20p|", (void *)&ret, (void *)&ret, (void *)&ret);
+	EXPECT_FMT("no conversions %s", "");
+
+	// Not handled by the engine, formatted by libc
+	EXPECT_FMT("%#x|%#o|%p|%#g", 255u, 8u, (void *)NULL, 1.0);
+	EXPECT_FMT("%d %s %f", 42, "mixed", 3.0);
+
+	// Output longer than the stack buffer of file writes
+	char big[1024];
+	const int big_len = c_sprintf(big, sizeof(big), 0, "%600d|%s", 1, "end");
+	EXPECT(big_len == 604);
+
+	const char *path = "print_fmt.txt";
+	FILE *file	 = file_open(path, "wb+");
+	EXPECT(c_fprintf(file, "%d-%s|", -7, "short") == 9);
+	EXPECT(c_fprintf(file, "%600d|%s", 1, "end") == 604);
+	rewind(file);
+	char read[1024] = { 0 };
+	EXPECT(fread(read, 1, sizeof(read), file) == 613);
+	EXPECT(memcmp(read, "-7-short|", 9) == 0 && memcmp(read + 9, big, 604) == 0);
+	fclose(file);
+	file_delete(path);
+
+	return ret;
+}
+
+// Twice, the first call compiles the format and the second runs the program
+#define EXPECT_PROG(_fmt, ...)                                                                          \
+	for (int _run = 0; _run < 2; _run++) {                                                          \
+		char _act[256], _exp[256];                                                              \
+		const int _act_len = dcprintf(PRINT_DST_BUF(_act, sizeof(_act), 0), _fmt, __VA_ARGS__); \
+		const int _exp_len = snprintf(_exp, sizeof(_exp), _fmt, __VA_ARGS__);                   \
+		EXPECT(_act_len == _exp_len);                                                           \
+		EXPECT_STR(_act, _exp);                                                                 \
+	}
+
+#define PROG_THREADS 4
+#define PROG_CALLS   1000
+
+// All threads race to compile the same format
+static int prog_thread(void *arg)
+{
+	const int id = (int)(intptr_t)arg;
+
+	char buf[64], exp[64];
+	for (int i = 0; i < PROG_CALLS; i++) {
+		dcprintf(PRINT_DST_BUF(buf, sizeof(buf), 0), "thread %d: %5d %s", id, i, "call");
+		snprintf(exp, sizeof(exp), "thread %d: %5d %s", id, i, "call");
+		if (strcmp(buf, exp) != 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int t_print_prog()
+{
+	int ret = 0;
+
+	for (int i = -3; i < 3; i++) {
+		EXPECT_PROG("%d|%5u|%-8x|%08X|%+lld|%.3zu", i * 12345, (unsigned)i, (unsigned)i, (unsigned)i, (long long)i * ((long long)1 << 40), (size_t)i & 0xffff);
+		EXPECT_PROG("[%s:%-5s] %.*s|%*d|%c%%", "pkg", "file", i + 3, "precision", i * 4, i, 'x');
+		EXPECT_PROG("%.3f|%10.2e|%g", i / 7.0, i * 1e10, i * 0.1);
+	}
+
+	EXPECT_PROG("no conversions%s", "");
+	EXPECT_PROG("%p", (void *)&ret);
+
+	// Decided per call or left to libc, the program must not change the output
+	EXPECT_PROG("%p|%d", (void *)NULL, 1);
+	EXPECT_PROG("%#x|%d", 255u, 1);
+	EXPECT_PROG("%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d", 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20);
+
+	// Same program into a growable destination
+	print_dyn_t dyn = { 0 };
+	print_dyn_init(&dyn, 0);
+	for (int i = 0; i < 100; i++) {
+		dcprintf(PRINT_DST_DYN(&dyn), "%03d,", i);
+	}
+	EXPECT(dyn.len == 400);
+	EXPECT(memcmp(dyn.data, "000,001,", 8) == 0 && memcmp(dyn.data + 396, "099,", 4) == 0);
+	print_dyn_free(&dyn);
+
+	EXPECT(dcprintf(PRINT_DST_NONE(), "%d", 1) == 0);
+
+	c_thread_t threads[PROG_THREADS];
+	for (int i = 0; i < PROG_THREADS; i++) {
+		EXPECT(c_thread_create(&threads[i], prog_thread, (void *)(intptr_t)i) == 0);
+	}
+	for (int i = 0; i < PROG_THREADS; i++) {
+		EXPECT(c_thread_join(threads[i]) == 0);
+	}
 
 	return ret;
 }
 
-static int t_time()
+// Random bit patterns, biased towards values near 1 and towards subnormals
+static double flt_rand(u64 *state)
+{
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+
+	u64 bits = *state ^ (*state >> 29);
+	if ((*state >> 60) < 4) {
+		bits = (bits & 0x800fffffffffffffULL) | (u64)(1023 + (int)((*state >> 33) % 80) - 40) << 52;
+	} else if ((*state >> 60) == 4) {
+		bits &= 0x800fffffffffffffULL;
+	}
+
+	double val;
+	memcpy(&val, &bits, sizeof(val));
+	return val;
+}
+
+// Digits of a c_dtoa() result without leading and trailing zeros
+static int flt_digits(const char *str)
+{
+	int cnt = 0, zeros = 0, lead = 1;
+	for (; *str != '\0' && *str != 'e'; str++) {
+		if (*str < '0' || *str > '9' || (*str == '0' && lead)) {
+			continue;
+		}
+		lead  = 0;
+		zeros = *str == '0' ? zeros + 1 : 0;
+		cnt++;
+	}
+	return cnt - zeros;
+}
+
+static int t_print_flt()
 {
 	int ret = 0;
 
-	c_time();
-	c_sleep(1);
-	c_time_str(NULL);
+	static const double vals[] = {
+		0, -0.0, 0.5, 1.5, 2.5, -2.5, 0.125, 0.1, 1.0 / 3, 9.5, 99.5, 999.9999, 1e15, 1e16, 1e21, 1e22, 1e23, 1e-5, 9.999999e-5,
+		123456789012345678.0, 1e-300, DBL_MAX, DBL_MIN, 4.9e-324, 2.2250738585072009e-308,
+	};
+
+	for (size_t i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+		const double v = vals[i];
+		EXPECT_FMT("%f|%.0f|%.1f|%.20f|%F", v, v, v, v, v);
+		EXPECT_FMT("%e|%.0e|%.3e|%.40e|%E", v, v, v, v, v);
+		EXPECT_FMT("%g|%.0g|%.3g|%.10g|%.17g|%G", v, v, v, v, v, v);
+		EXPECT_FMT("%10.3f|%-12.4e|%+f|% g|%010.2f|%-+15.3e|%lf", v, v, v, v, v, v, v);
+	}
+
+	char buf[PRINT_DTOA_SIZE];
+	char std[512];
+
+	u64 state = 1;
+	for (int i = 0; i < 20000; i++) {
+		const double v = flt_rand(&state);
+		if (v != v || v - v != 0) {
+			continue;
+		}
+
+		EXPECT_FMT("%f|%.2f|%e|%.15e|%g|%.17g", v, v, v, v, v, v);
+
+		// Reads back as the same value and no shorter %g does
+		EXPECT(c_dtoa(v, buf, sizeof(buf)) == (int)strlen(buf));
+		const double back = strtod(buf, NULL);
+		EXPECT(memcmp(&back, &v, sizeof(v)) == 0);
+		const int digits = flt_digits(buf);
+		if (digits > 1) {
+			snprintf(std, sizeof(std), "%.*g", digits - 1, v);
+			const double shorter = strtod(std, NULL);
+			EXPECT(memcmp(&shorter, &v, sizeof(v)) != 0);
+		}
+	}
+
+	for (u32 bits = 0; bits < 0x7f800000; bits += 0x10001) {
+		float v;
+		memcpy(&v, &bits, sizeof(v));
+		c_ftoa(v, buf, sizeof(buf));
+		const float back = strtof(buf, NULL);
+		EXPECT(memcmp(&back, &v, sizeof(v)) == 0);
+	}
+
+	c_dtoa(0.1, buf, sizeof(buf));
+	EXPECT_STR(buf, "0.1");
+	c_dtoa(1e23, buf, sizeof(buf));
+	EXPECT_STR(buf, "1e+23");
+	c_dtoa(-0.0, buf, sizeof(buf));
+	EXPECT_STR(buf, "-0");
+	c_dtoa(DBL_MAX, buf, sizeof(buf));
+	EXPECT_STR(buf, "1.7976931348623157e+308");
+	c_dtoa(5e-324, buf, sizeof(buf));
+	EXPECT_STR(buf, "5e-324");
+	c_ftoa(0.1f, buf, sizeof(buf));
+	EXPECT_STR(buf, "0.1");
+	c_ftoa(16777216.0f, buf, sizeof(buf));
+	EXPECT_STR(buf, "16777216");
+	c_dtoa(INFINITY, buf, sizeof(buf));
+	EXPECT_STR(buf, "inf");
+	c_dtoa(-NAN, buf, sizeof(buf));
+	EXPECT_STR(buf, "-nan");
+
+	EXPECT(c_dtoa_fixed(123.456, 2, buf, sizeof(buf)) == 6);
+	EXPECT_STR(buf, "123.46");
+	c_dtoa_fixed(2.5, 0, buf, sizeof(buf));
+	EXPECT_STR(buf, "2");
+	c_dtoa_exp(123.456, 3, buf, sizeof(buf));
+	EXPECT_STR(buf, "1.235e+02");
+	c_dtoa_exp(-5e-324, 2, buf, sizeof(buf));
+	EXPECT_STR(buf, "-4.94e-324");
+
+	// Truncated like snprintf()
+	EXPECT(c_dtoa(1.0 / 3, buf, 5) == 18);
+	EXPECT_STR(buf, "0.33");
 
 	return ret;
 }
 
-static int print_callback(log_event_t *ev)
+static volatile u32 s_buf_flushing;
+
+static int buf_flush_thread(void *arg)
 {
-	(void)ev;
+	while (c_atomic_load32(&s_buf_flushing)) {
+		c_fflush(arg);
+	}
 	return 0;
 }
 
-static int t_log()
+static int t_print_buf()
 {
 	int ret = 0;
 
+	const char *path = "print_buf.txt";
+	char text[128]	 = { 0 };
+
+	FILE *file = file_open(path, "wb+");
+
+	print_buf_t pbuf = { 0 };
+	EXPECT(print_buf_init(NULL, file, 16, 0, LOG_ERROR) == NULL);
+	EXPECT(print_buf_init(&pbuf, NULL, 16, 0, LOG_ERROR) == NULL);
+	EXPECT(print_buf_init(&pbuf, file, 16, 0, LOG_ERROR) == &pbuf);
+
+	print_dst_t dst = PRINT_DST_BUFFERED(&pbuf);
+
+	EXPECT(dprintf(dst, "%s", "abc") == 3);
+	EXPECT_STR(file_text(path, text, sizeof(text)), "");
+
+	EXPECT(dprintf(dst, "%s", "0123456789abcdef") == 16);
+	EXPECT_STR(file_text(path, text, sizeof(text)), "abc0123456789abcdef");
+
+	EXPECT(dprintf(dst, "%d", 123456789) == 9);
+	EXPECT(dprintf(dst, "%s", "xyzwv") == 5);
+	EXPECT(dprintf(dst, "%s", "ABCDE") == 5);
+	EXPECT_STR(file_text(path, text, sizeof(text)), "abc0123456789abcdef123456789xyzwv");
+
+	EXPECT(dsync(dst, LOG_INFO) == 0);
+	EXPECT_STR(file_text(path, text, sizeof(text)), "abc0123456789abcdef123456789xyzwv");
+	EXPECT(dsync(dst, LOG_ERROR) == 0);
+	EXPECT_STR(file_text(path, text, sizeof(text)), "abc0123456789abcdef123456789xyzwvABCDE");
+
+	EXPECT(dprintf(dst, "%c", '!') == 1);
+	EXPECT(c_fflush(file) == 0);
+	EXPECT_STR(file_text(path, text, sizeof(text)), "abc0123456789abcdef123456789xyzwvABCDE!");
+
 	const log_t *log = log_get();
 
-	log_t tmp = *log;
+	log_t tmp = { 0 };
 	log_set(&tmp);
+	log_set_quiet(1);
+	EXPECT(log_add_callback(log_std_cb, dst, LOG_TRACE, 0) == 0);
 
-	EXPECT(log_add_callback(log_std_cb, PRINT_DST_NONE(), LOG_TRACE, 1) == 0);
+	log_info("test_cplatform", "main", NULL, "i");
+	EXPECT_STR(file_text(path, text, sizeof(text)), "abc0123456789abcdef123456789xyzwvABCDE!");
+	log_error("test_cplatform", "main", NULL, "e");
+	EXPECT_STR(file_text(path, text, sizeof(text)), "abc0123456789abcdef123456789xyzwvABCDE!i\ne\n");
 
-	for (int i = 1; i < LOG_MAX_CALLBACKS; i++) {
-		EXPECT(log_add_callback(print_callback, PRINT_DST_NONE(), LOG_TRACE, 1) == 0);
+	log_set((log_t *)log);
+
+	EXPECT(dprintf(dst, "%s", "end") == 3);
+	EXPECT(print_buf_write(NULL, "x", 1) == 1);
+	EXPECT(print_buf_write(&pbuf, "0123456789ABCDEFG", 17) == 0);
+	EXPECT(print_buf_write(&pbuf, "#", 1) == 0);
+	EXPECT_STR(file_text(path, text, sizeof(text)), "abc0123456789abcdef123456789xyzwvABCDE!i\ne\nend0123456789ABCDEFG");
+	EXPECT(print_buf_free(&pbuf) == 0);
+	EXPECT(print_buf_free(&pbuf) == 1);
+	EXPECT(print_buf_write(&pbuf, "x", 1) == 1);
+	EXPECT_STR(file_text(path, text, sizeof(text)), "abc0123456789abcdef123456789xyzwvABCDE!i\ne\nend0123456789ABCDEFG#");
+
+	// The tail goes out once flush_ms elapsed, without another write
+	EXPECT(print_buf_init(&pbuf, file, 16, 1, PRINT_BUF_LEVEL_NONE) == &pbuf);
+	EXPECT(print_buf_write(&pbuf, "~", 1) == 0);
+	c_sleep(30);
+	EXPECT(print_bufs_flush_due() == 0);
+	EXPECT_STR(file_text(path, text, sizeof(text)), "abc0123456789abcdef123456789xyzwvABCDE!i\ne\nend0123456789ABCDEFG#~");
+	EXPECT(print_buf_free(&pbuf) == 0);
+
+	print_buf_t bufs[PRINT_BUFS_MAX] = { 0 };
+	for (int i = 0; i < PRINT_BUFS_MAX; i++) {
+		EXPECT(print_buf_init(&bufs[i], file, 16, 0, LOG_ERROR) == &bufs[i]);
+	}
+	int level = log_set_level(LOG_FATAL);
+	EXPECT(print_buf_init(&pbuf, file, 16, 0, LOG_ERROR) == NULL);
+	log_set_level(level);
+	for (int i = 0; i < PRINT_BUFS_MAX; i++) {
+		EXPECT(print_buf_free(&bufs[i]) == 0);
 	}
 
-	EXPECT(log_add_callback(print_callback, PRINT_DST_NONE(), LOG_TRACE, 1) == 1);
+	// Buffers freed while another thread flushes their file
+	c_thread_t thread;
+	s_buf_flushing = 1;
+	EXPECT(c_thread_create(&thread, buf_flush_thread, file) == 0);
+	for (int i = 0; i < 1000; i++) {
+		EXPECT(print_buf_init(&pbuf, file, 16, 0, LOG_ERROR) == &pbuf);
+		EXPECT(dprintf(dst, "%c", '.') == 1);
+		EXPECT(print_buf_free(&pbuf) == 0);
+	}
+	c_atomic_store32(&s_buf_flushing, 0);
+	EXPECT(c_thread_join(thread) == 0);
 
-	int quiet  = log_set_quiet(0);
-	int level  = log_set_level(LOG_TRACE);
-	int header = log_set_header(0);
-	log_trace("test_cplatform", "main", NULL, "");
-	log_set_header(header);
+	fclose(file);
+	file_delete(path);
 
-	log_trace(NULL, NULL, NULL, NULL);
-	log_trace("test_cplatform", "main", "test", "trace");
-	log_debug("test_cplatform", "main", "test", "debug");
-	log_info("test_cplatform", "main", "test", "info");
-	log_warn("test_cplatform", "main", "test", "warn");
-	log_error("test_cplatform", "main", "test", "error");
-	log_fatal("test_cplatform", "main", "test", "fatal");
+	return ret;
+}
 
-	log_set_level(level);
-	log_set_quiet(quiet);
+static int t_print_dyn()
+{
+	int ret = 0;
 
-	log_set(NULL);
-	EXPECT(log_add_callback(print_callback, PRINT_DST_NONE(), LOG_TRACE, 1) == 1);
-	log_set_level(LOG_FATAL);
-	log_set_quiet(0);
-	log_set_header(0);
-	log_init(NULL);
-	log_level_str(LOG_TRACE);
+	print_dyn_t dyn = { 0 };
+	size_t size	= 0;
+
+	EXPECT(print_dyn_init(NULL, 0) == NULL);
+	EXPECT(print_dyn_init(&dyn, 0) == &dyn);
+	EXPECT(print_dyn_take(&dyn, &size) == NULL);
+
+	print_dst_t dst = PRINT_DST_DYN(&dyn);
+	EXPECT(dprintf(dst, "%s %d", "inline", 1) == 8);
+	EXPECT(dyn.data == dyn.buf && dyn.len == 8);
+	EXPECT_STR(dyn.data, "inline 1");
+
+	char *str = print_dyn_take(&dyn, &size);
+	EXPECT(str != NULL && size == 9);
+	EXPECT_STR(str, "inline 1");
+	EXPECT(dyn.len == 0 && dyn.data == dyn.buf);
+	mem_free(str, size);
+
+	char exp[1024] = { 0 };
+	int off	       = 0;
+	for (int i = 0; i < 100; i++) {
+		EXPECT(dprintf(dst, "%d,", i) == (i < 10 ? 2 : 3));
+		off += c_sprintf(exp, sizeof(exp), off, "%d,", i);
+	}
+	EXPECT(dyn.data != dyn.buf && dyn.len == (size_t)off && dyn.size > dyn.len);
+	EXPECT_STR(dyn.data, exp);
 
-	log_set((log_t *)log);
+	// Larger than twice the capacity, grows in one step
+	EXPECT(dprintf(dst, "%1000d", 7) == 1000);
+	EXPECT(dyn.len == (size_t)off + 1000 && dyn.data[dyn.len - 1] == '7');
+
+	print_dyn_reset(&dyn);
+	EXPECT(dyn.len == 0 && dyn.data[0] == '\0');
+	EXPECT(dprintf(dst, "reset") == 5);
+	EXPECT_STR(dyn.data, "reset");
+
+	str = print_dyn_take(&dyn, &size);
+	EXPECT(str != NULL && size > 1000);
+	EXPECT_STR(str, "reset");
+	mem_free(str, size);
+
+	EXPECT(print_dyn_init(&dyn, 4096) == &dyn);
+	EXPECT(dyn.data != dyn.buf && dyn.size == 4096);
+	EXPECT(dprintf(dst, "%s", "heap") == 4);
+	EXPECT(print_dyn_free(&dyn) == 0);
+	EXPECT(print_dyn_free(NULL) == 1);
 
 	return ret;
 }
 
-static int t_print()
+static int t_print_iov()
 {
 	int ret = 0;
 
-	EXPECT(c_printv(NULL, NULL) == 0);
-	EXPECT(c_fprintv(NULL, NULL, NULL) == 0);
-	const char *temp = "temp.txt";
+	const char *path = "print_iov.txt";
+	char text[4096]	 = { 0 };
+	char exp[4096]	 = { 0 };
+
+	FILE *file = file_open(path, "wb+");
+
+	print_iov_t iov = { 0 };
+	EXPECT(print_iov_init(NULL, file) == NULL);
+	EXPECT(print_iov_init(&iov, NULL) == NULL);
+	EXPECT(print_iov_init(&iov, file) == &iov);
+
+	print_dst_t dst = PRINT_DST_IOV(&iov);
+
+	// Literals and long strings are referenced, numbers and short strings copied
+	const char *str = "a string long enough to be referenced";
+	EXPECT(dprintf(dst, "%s|%5d|%-4s|", str, 42, "ab") == 49);
+	EXPECT(dprintf(dst, "literal run long enough to be referenced: %.*s%c\n", 8, str, '!') == 52);
+	EXPECT(iov.cnt > 2);
+	EXPECT_STR(file_text(path, text, sizeof(text)), "");
+	EXPECT(dsync(dst, LOG_TRACE) == 0);
+	EXPECT(iov.cnt == 0 && iov.len == 0);
+	EXPECT_STR(file_text(path, text, sizeof(text)),
+		   "a string long enough to be referenced|   42|ab  |literal run long enough to be referenced: a string!\n");
+
+	// More pieces than slices and more output than the scratch
+	int len = (int)strlen(text);
+	for (int i = 0; i < 40; i++) {
+		EXPECT(dcprintf(dst, "%s %03d ", str, i) == 42);
+		len += snprintf(exp + len, sizeof(exp) - (size_t)len, "%s %03d ", str, i);
+	}
+	EXPECT(dprintf(dst, "%1500d|%s", 7, "end") == 1504);
+	EXPECT(dsync(dst, LOG_TRACE) == 0);
+	memcpy(exp, text, strlen(text));
+	len += snprintf(exp + len, sizeof(exp) - (size_t)len, "%1500d|%s", 7, "end");
+	EXPECT_STR(file_text(path, text, sizeof(text)), exp);
+
+	// Left to libc, written in one piece
+	EXPECT(dprintf(dst, "%#x", 255u) == 4);
+	EXPECT(print_iov_flush(&iov) == 0);
+	len += snprintf(exp + len, sizeof(exp) - (size_t)len, "%#x", 255u);
+	EXPECT_STR(file_text(path, text, sizeof(text)), exp);
+
+	const log_t *log = log_get();
+
+	log_t tmp = { 0 };
+	log_set(&tmp);
+	log_set_quiet(1);
+	EXPECT(log_add_callback(log_std_cb, dst, LOG_TRACE, 0) == 0);
+	log_info("test_cplatform", "main", NULL, "a message long enough to be referenced");
+	log_set((log_t *)log);
+
+	snprintf(exp + len, sizeof(exp) - (size_t)len, "a message long enough to be referenced\n");
+	EXPECT_STR(file_text(path, text, sizeof(text)), exp);
+
+	EXPECT(dprintf(dst, "%s", "x") == 1);
+	EXPECT(print_iov_free(&iov) == 0);
+	EXPECT(print_iov_free(&iov) == 1);
+	EXPECT(print_iov_flush(&iov) == 1);
+	EXPECT(dprintf(dst, "%s", "y") == 0);
+	snprintf(exp + len, sizeof(exp) - (size_t)len, "a message long enough to be referenced\nx");
+	EXPECT_STR(file_text(path, text, sizeof(text)), exp);
 
-	FILE *file = file_open(temp, "wb+");
 	fclose(file);
-	file = file_open(temp, "r");
+	file_delete(path);
 
-	int level = log_set_level(LOG_FATAL);
-	EXPECT(c_fwprintf(file, L"Test") == 0);
-	EXPECT(c_fprintf(file, "Test") == 0);
-	log_set_level(level);
+	return ret;
+}
+
+static long file_size(const char *path)
+{
+	FILE *file = file_open(path, "rb");
+	if (file == NULL) {
+		return -1;
+	}
 
+	fseek(file, 0, SEEK_END);
+	const long size = ftell(file);
 	fclose(file);
-	file_delete(temp);
+	return size;
+}
 
-	EXPECT(c_sprintv(NULL, 0, 0, NULL, NULL) == 0);
-	EXPECT(dprintf(PRINT_DST_NONE(), NULL) == 0);
-#ifdef C_LINUX
-	char cbuf[2] = { 0 };
-	EXPECT(dprintf(PRINT_DST_BUF(cbuf, sizeof(cbuf), 0), "abc") == 0);
-#endif
+static int t_print_map()
+{
+	int ret = 0;
 
-	EXPECT(c_wprintv(NULL, NULL) == 0);
-	EXPECT(c_fwprintv(NULL, NULL, NULL) == 0);
-	EXPECT(c_swprintv(NULL, 0, 0, NULL, NULL) == 0);
-	EXPECT(dwprintf(PRINT_DST_WNONE(), NULL) == 0);
-#ifdef C_LINUX
-	wchar wbuf[2] = { 0 };
-	EXPECT(dwprintf(PRINT_DST_WBUF(wbuf, sizeof(wbuf), 0), L"abc") == 0);
-#endif
+	const char *path = "print_map.txt";
+	static char text[32768];
+	static char exp[32768];
 
-	EXPECT(c_setmode(NULL, 0) == 0);
-	EXPECT(c_fflush(NULL) == 1);
+	file_delete(path);
+
+	print_map_t map = { 0 };
+	EXPECT(print_map_init(NULL, path, 0, 0, PRINT_BUF_LEVEL_NONE) == NULL);
+	EXPECT(print_map_init(&map, NULL, 0, 0, PRINT_BUF_LEVEL_NONE) == NULL);
+	// Smallest window, records move it often
+	EXPECT(print_map_init(&map, path, 1, 1000, LOG_ERROR) == &map);
+
+	print_dst_t dst = PRINT_DST_MMAP(&map);
+
+	int len = 0;
+	for (int i = 0; i < 300; i++) {
+		EXPECT(dcprintf(dst, "record %03d: %s\n", i, "appended through the mapping") == 41);
+		len += snprintf(exp + len, sizeof(exp) - (size_t)len, "record %03d: %s\n", i, "appended through the mapping");
+	}
+	EXPECT(map.len == (u64)len && map.len - map.synced < 1000);
+
+	// Larger than a window
+	EXPECT(dprintf(dst, "%6000d|\n", 7) == 6002);
+	len += snprintf(exp + len, sizeof(exp) - (size_t)len, "%6000d|\n", 7);
+	EXPECT(dprintf(dst, "%s\n", "end") == 4);
+	len += snprintf(exp + len, sizeof(exp) - (size_t)len, "%s\n", "end");
+	EXPECT(dsync(dst, LOG_WARN) == 0 && map.synced < map.len);
+	EXPECT(dsync(dst, LOG_ERROR) == 0 && map.synced == map.len);
+	EXPECT(print_map_sync(&map) == 0);
+
+	// Preallocated past the written length until freed
+	EXPECT(file_size(path) > len);
+	EXPECT_STR(file_text(path, text, sizeof(text)), exp);
+
+	const log_t *log = log_get();
+
+	log_t tmp = { 0 };
+	log_set(&tmp);
+	log_set_quiet(1);
+	EXPECT(log_add_callback(log_std_cb, dst, LOG_TRACE, 0) == 0);
+	log_info("test_cplatform", "main", NULL, "logged into the mapping %d", 1);
+	log_set((log_t *)log);
+	len += snprintf(exp + len, sizeof(exp) - (size_t)len, "logged into the mapping 1\n");
+
+	EXPECT(print_map_free(&map) == 0);
+	EXPECT(print_map_free(&map) == 1);
+	EXPECT(print_map_sync(&map) == 1);
+	EXPECT(dprintf(dst, "%s", "x") == 0);
+	EXPECT(file_size(path) == len);
+	EXPECT_STR(file_text(path, text, sizeof(text)), exp);
+
+	// Appends to the existing output
+	EXPECT(print_map_init(&map, path, 0, 0, PRINT_BUF_LEVEL_NONE) == &map);
+	EXPECT(dprintf(dst, "%s\n", "appended") == 9);
+	EXPECT(print_map_free(&map) == 0);
+	len += snprintf(exp + len, sizeof(exp) - (size_t)len, "appended\n");
+	EXPECT(file_size(path) == len);
+	EXPECT_STR(file_text(path, text, sizeof(text)), exp);
+
+	file_delete(path);
 
 	return ret;
 }
@@ -260,6 +1844,156 @@ static int t_wfile()
 	return ret;
 }
 
+// Random UTF-8 with every sequence length, some bytes overwritten
+static size_t utf_rand(u64 *state, char *buf, size_t size)
+{
+	size_t len = 0;
+	while (len + 4 <= size) {
+		*state	    = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+		const u32 r = (u32)(*state >> 33);
+
+		u32 cp;
+		switch (r % 8) {
+		case 0: cp = 0x80 + r % 0x780; break;
+		case 1: cp = 0x800 + r % 0xd000; break;
+		case 2: cp = 0x10000 + r % 0x100000; break;
+		default: cp = r % 0x80; break;
+		}
+
+		wchar wide[2];
+		const size_t cnt = sizeof(wchar) == 2 && cp >= 0x10000 ? 2 : 1;
+		if (cnt == 2) {
+			wide[0] = (wchar)(0xd800 + ((cp - 0x10000) >> 10));
+			wide[1] = (wchar)(0xdc00 + ((cp - 0x10000) & 0x3ff));
+		} else {
+			wide[0] = (wchar)cp;
+		}
+		len += c_wchar_to_utf8(buf + len, size - len, wide, cnt);
+	}
+
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	for (u32 i = (u32)(*state >> 60) % 4; i > 0 && len > 0; i--) {
+		*state			  = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+		buf[(*state >> 33) % len] = (char)(*state >> 16);
+	}
+
+	return len;
+}
+
+#define UTF_SIZE 300
+
+static int t_utf()
+{
+	int ret = 0;
+
+	static const struct {
+		const char *str;
+		size_t valid;
+	} cases[] = {
+		{ "abc", 3 },
+		{ "\xc3\xa9", 2 },
+		{ "\xe2\x94\xbc", 3 },
+		{ "\xef\xbf\xbf", 3 },
+		{ "\xf0\x9f\x98\x80", 4 },
+		{ "\xf4\x8f\xbf\xbf", 4 },
+		{ "\x80", 0 },
+		{ "\xc3", 0 },
+		{ "\xc0\x80", 0 },
+		{ "\xc1\xbf", 0 },
+		{ "\xe0\x9f\x80", 0 },
+		{ "\xed\xa0\x80", 0 },
+		{ "\xf0\x8f\xbf\xbf", 0 },
+		{ "\xf4\x90\x80\x80", 0 },
+		{ "\xf5\x80\x80\x80", 0 },
+		{ "\xe2\x94", 0 },
+		{ "\xc3\xa9\xa9", 2 },
+	};
+
+	static char src[UTF_SIZE];
+	static wchar wide[UTF_SIZE + 1];
+	static wchar exp[UTF_SIZE + 1];
+	static char back[UTF_SIZE + 1];
+
+	const int max = mem_simd_get();
+
+	for (int level = MEM_SIMD_NONE; level <= max; level++) {
+		EXPECT(mem_simd_set(level, 0) == level);
+
+		// Every case at every position of a block
+		for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+			const size_t len = strlen(cases[i].str);
+			EXPECT(c_utf8_valid(cases[i].str, len) == cases[i].valid);
+
+			for (size_t pos = 0; pos < 70; pos++) {
+				memset(src, 'a', 100);
+				memcpy(src + pos, cases[i].str, len);
+				const size_t valid = cases[i].valid == len ? 100 : pos + cases[i].valid;
+				EXPECT(c_utf8_valid(src, 100) == valid);
+				EXPECT(c_utf8_valid(src, pos + len) == pos + cases[i].valid);
+			}
+		}
+	}
+
+	// The kernels against the scalar code on random input
+	u64 state = 1;
+	for (int i = 0; i < 400; i++) {
+		size_t len = utf_rand(&state, src, sizeof(src));
+		len -= (size_t)(state >> 40) % (len + 1) / 2;
+
+		mem_simd_set(MEM_SIMD_NONE, 0);
+		const size_t valid = c_utf8_valid(src, len);
+		const size_t cnt   = c_utf8_to_wchar(exp, UTF_SIZE + 1, src, len);
+
+		for (int level = MEM_SIMD_NONE; level <= max; level++) {
+			mem_simd_set(level, 0);
+
+			EXPECT(c_utf8_valid(src, len) == valid);
+			EXPECT(c_utf8_to_wchar(wide, UTF_SIZE + 1, src, len) == cnt);
+			EXPECT(memcmp(wide, exp, (cnt + 1) * sizeof(wchar)) == 0);
+			if (valid == len) {
+				EXPECT(c_wchar_to_utf8(back, sizeof(back), wide, cnt) == len);
+				EXPECT(memcmp(back, src, len) == 0 && back[len] == '\0');
+			}
+		}
+	}
+
+	EXPECT(mem_simd_set(MEM_SIMD_AVX512, 0) == max);
+
+	// Invalid sequences become one replacement character each
+	EXPECT(c_utf8_to_wchar(wide, 8, "a\xe0\x80z", 4) == 4);
+	EXPECT_WSTR(wide, L"a\ufffd\ufffdz");
+	EXPECT(c_utf8_to_wchar(wide, 8, "a\xe1\x80z", 4) == 3);
+	EXPECT_WSTR(wide, L"a\ufffdz");
+
+	const wchar lone[] = { 'a', 0xd800, 'b', 0 };
+	EXPECT(c_wchar_to_utf8(back, sizeof(back), lone, 3) == 5);
+	EXPECT_STR(back, "a\xef\xbf\xbd" "b");
+
+	// Truncated output is terminated and does not split characters
+	EXPECT(c_utf8_to_wchar(wide, 3, "a\xc3\xa9\xe2\x82\xac", 6) == 3);
+	EXPECT_WSTR(wide, L"a\u00e9");
+	EXPECT(c_utf8_to_wchar(wide, 2, "\xf0\x9f\x98\x80", 4) == (sizeof(wchar) == 2 ? 2 : 1));
+	EXPECT(c_utf8_to_wchar(NULL, 0, "a\xc3\xa9", 3) == 2);
+	EXPECT(c_wchar_to_utf8(back, 3, L"a\u00e9", 2) == 3);
+	EXPECT_STR(back, "a");
+	EXPECT(c_wchar_to_utf8(NULL, 0, L"\u253C", 1) == 3);
+
+	wchar buf[64] = { 0 };
+	EXPECT(c_swprintf(buf, sizeof(buf), 0, L"%5d|%s|\u00e9", 42, "\xc3\xa9t\xc3\xa9") == 11);
+	EXPECT_WSTR(buf, L"   42|\u00e9t\u00e9|\u00e9");
+	EXPECT(c_swprintf(buf, sizeof(buf), 0, L"%3s|%ls", "a", L"\u00e9") == 5);
+	EXPECT_WSTR(buf, L"  a|\u00e9");
+	EXPECT(c_swprintf(NULL, 0, 0, L"\u00e9%d", 10) == 3);
+
+	memset(src, 'a', sizeof(src) - 1);
+	src[sizeof(src) - 1] = '\0';
+	static wchar big[UTF_SIZE * 2 + 1];
+	EXPECT(c_swprintf(big, sizeof(big), 0, L"%s%s", src, src) == (UTF_SIZE - 1) * 2);
+	EXPECT(big[0] == 'a' && big[(UTF_SIZE - 1) * 2 - 1] == 'a' && big[(UTF_SIZE - 1) * 2] == 0);
+
+	return ret;
+}
+
 static int t_mem()
 {
 	int ret = 0;
@@ -310,6 +2044,9 @@ static int t_mem()
 	EXPECT(mem_realloc(ptr, 2, 1) == NULL);
 	mem_oom(0);
 
+	EXPECT(mem_calloc(SIZE_MAX / 2 + 9, 2) == NULL);
+	EXPECT(mem_calloc(2, SIZE_MAX / 2 + 9) == NULL);
+
 	data = mem_alloc(0);
 	EXPECT(mem_set(NULL, 0, 0) == NULL);
 	EXPECT(mem_set(data, 0, 0) != NULL);
@@ -352,18 +2089,308 @@ static int t_mem()
 	return ret;
 }
 
+static int t_mem_aligned()
+{
+	int ret = 0;
+
+	mem_t *mem = (mem_t *)mem_get();
+
+	mem_t mm = { 0 };
+	mem_sset(&mm);
+
+	const size_t line = mem_cache_line();
+	EXPECT(line >= 16 && (line & (line - 1)) == 0);
+
+	int level = log_set_level(LOG_FATAL);
+	EXPECT(mem_alloc_aligned(16, 0) == NULL);
+	EXPECT(mem_alloc_aligned(16, 48) == NULL);
+	log_set_level(level);
+
+	char *a = mem_alloc_aligned(100, MEM_CACHE_LINE);
+	EXPECT(a != NULL && (size_t)a % MEM_CACHE_LINE == 0);
+	mem_set(a, 'a', 100);
+
+	char *b = mem_calloc_aligned(2, 2048, 4096);
+	EXPECT(b != NULL && (size_t)b % 4096 == 0 && b[0] == 0 && b[4095] == 0);
+	EXPECT(mem_get()->mem == 4196 && mem_get()->allocs == 2);
+
+	a = mem_realloc_aligned(a, 5000, 100, 256);
+	EXPECT(a != NULL && (size_t)a % 256 == 0 && a[0] == 'a' && a[99] == 'a');
+	EXPECT(mem_get()->mem == 9096 && mem_get()->reallocs == 1);
+
+	level = log_set_level(LOG_FATAL);
+	mem_oom(1);
+	EXPECT(mem_alloc_aligned(1, 16) == NULL);
+	EXPECT(mem_calloc_aligned(1, 1, 16) == NULL);
+	EXPECT(mem_realloc_aligned(a, 6000, 5000, 256) == NULL);
+	mem_oom(0);
+	EXPECT(mem_calloc_aligned(SIZE_MAX / 2 + 9, 2, 16) == NULL);
+	log_set_level(level);
+
+	mem_free_aligned(a, 5000);
+	mem_free_aligned(b, 4096);
+	mem_free_aligned(NULL, 0);
+	EXPECT(mem_get()->mem == 0);
+
+	EXPECT(mem_map_set(64 * 1024, 0) == 0);
+	char *c = mem_alloc_aligned(128 * 1024, 4096);
+	EXPECT(c != NULL && (size_t)c % 4096 == 0 && mem_get()->maps == 1);
+	c = mem_realloc_aligned(c, 256 * 1024, 128 * 1024, 4096);
+	EXPECT(c != NULL && (size_t)c % 4096 == 0 && mem_get()->maps == 1 && mem_get()->map_mem == 256 * 1024);
+	mem_free_aligned(c, 256 * 1024);
+	EXPECT(mem_map_set(0, 0) == 0);
+	EXPECT(mem_get()->mem == 0 && mem_get()->maps == 0);
+
+	mem_sset(mem);
+
+	return ret;
+}
+
+static int t_mem_trace()
+{
+	int ret = 0;
+
+	const char *path = "mem_trace.bin";
+
+	FILE *file	 = file_open(path, "wb+");
+	print_buf_t pbuf = { 0 };
+	EXPECT(print_buf_init(&pbuf, file, 64, 0, PRINT_BUF_LEVEL_NONE) == &pbuf);
+
+	void *before = mem_alloc(8);
+
+	EXPECT(mem_trace_start(NULL) == 1);
+	EXPECT(mem_trace_start(&pbuf) == 0);
+	EXPECT(mem_trace_start(&pbuf) == 1);
+
+	void *a = mem_alloc(10);
+	void *b = mem_calloc(2, 8);
+	a	= mem_realloc(a, 100, 10);
+	mem_free(b, 16);
+	mem_free(before, 8);
+	mem_free(a, 100);
+
+	EXPECT(mem_trace_stop() == 0);
+	EXPECT(mem_trace_stop() == 1);
+	EXPECT(print_buf_free(&pbuf) == 0);
+
+	const mem_trace_op_t exp[] = {
+		{ MEM_TRACE_ALLOC, 0, 0, 1, 10, 0 },   { MEM_TRACE_CALLOC, 0, 0, 2, 16, 0 }, { MEM_TRACE_REALLOC, 0, 0, 1, 100, 10 },
+		{ MEM_TRACE_FREE, 0, 0, 2, 16, 0 },    { MEM_TRACE_FREE, 0, 0, 1, 100, 0 },
+	};
+
+	rewind(file);
+	EXPECT(mem_trace_header(file) == 0);
+
+	mem_trace_op_t op = { 0 };
+	u64 time	  = 0;
+	for (size_t i = 0; i < sizeof(exp) / sizeof(exp[0]); i++) {
+		EXPECT(mem_trace_read(file, &op) == 0);
+		EXPECT(op.op == exp[i].op && op.id == exp[i].id && op.size == exp[i].size && op.old_size == exp[i].old_size);
+		EXPECT(op.thread == c_thread_id() && op.time >= time);
+		time = op.time;
+	}
+	EXPECT(mem_trace_read(file, &op) == 1);
+
+	fclose(file);
+	file_delete(path);
+
+	return ret;
+}
+
+static void dom_soft(mem_dom_t *dom, void *priv)
+{
+	(void)dom;
+	(*(int *)priv)++;
+}
+
+static volatile u32 s_dom_step;
+
+static int dom_set_thread(void *arg)
+{
+	mem_dom_set(arg);
+	c_atomic_store32(&s_dom_step, 1);
+
+	while (c_atomic_load32(&s_dom_step) != 2) {
+		c_thread_yield();
+	}
+
+	mem_dom_set(NULL);
+	return 0;
+}
+
+static int t_mem_dom()
+{
+	int ret = 0;
+
+	mem_dom_t app, parser, cache;
+	EXPECT(mem_dom_init(NULL, "app", NULL) == NULL);
+	EXPECT(mem_dom_init(&app, "app", NULL) == &app);
+	EXPECT(mem_dom_init(&parser, "parser", &app) == &parser);
+	EXPECT(mem_dom_init(&cache, "cache", &app) == &cache);
+
+	int shed = 0;
+	EXPECT(mem_dom_budget(NULL, 0, 0, NULL, NULL) == 1);
+	EXPECT(mem_dom_budget(&cache, 100, 200, dom_soft, &shed) == 0);
+
+	EXPECT(mem_dom_get() == NULL);
+	EXPECT(mem_dom_set(&parser) == NULL);
+	void *a = mem_alloc(64);
+	void *b = mem_calloc(2, 16);
+	b	= mem_realloc(b, 16, 32);
+	EXPECT(mem_dom_set(NULL) == &parser);
+	EXPECT(parser.mem == 80 && parser.peak == 96 && parser.total == 96 && parser.allocs == 2);
+
+	void *c = mem_dom_alloc(&cache, 90);
+	EXPECT(shed == 0);
+	c = mem_dom_realloc(&cache, c, 150, 90);
+	EXPECT(shed == 1);
+	EXPECT(mem_dom_alloc(&cache, 100) == NULL);
+	EXPECT(mem_dom_realloc(&cache, c, 250, 150) == NULL);
+	EXPECT(cache.mem == 150 && cache.allocs == 1);
+	EXPECT(app.mem == 230 && app.peak == 230 && app.allocs == 3);
+
+	c = mem_dom_realloc(&cache, c, 50, 150);
+	c = mem_dom_realloc(&cache, c, 120, 50);
+	EXPECT(shed == 2);
+
+	char buf[1024] = { 0 };
+	EXPECT(mem_dom_print(PRINT_DST_BUF(buf, sizeof(buf), 0)) > 0);
+	EXPECT(strstr(buf, "domain stats:\n    app: mem: 200 B") != NULL);
+	EXPECT(strstr(buf, "\n        parser: mem: 80 B, peak: 96 B") != NULL);
+	EXPECT(strstr(buf, "\n        cache: mem: 120 B, peak: 150 B, total: 220 B, allocs: 1, soft: 100 B, hard: 200 B\n") != NULL);
+
+	EXPECT(mem_dom_free(&app) == 1);
+
+	mem_dom_release(&cache, c, 120);
+	mem_dom_release(&parser, a, 64);
+	EXPECT(mem_dom_free(&cache) == 0);
+	EXPECT(parser.mem == 16 && app.mem == 16);
+	mem_dom_release(&parser, b, 16);
+
+	// Refused while set on another thread, the calling one lets go of it
+	c_thread_t thread;
+	EXPECT(c_thread_create(&thread, dom_set_thread, &parser) == 0);
+	while (c_atomic_load32(&s_dom_step) != 1) {
+		c_thread_yield();
+	}
+	EXPECT(mem_dom_free(&parser) == 1);
+	c_atomic_store32(&s_dom_step, 2);
+	EXPECT(c_thread_join(thread) == 0);
+	EXPECT(mem_dom_set(&parser) == NULL);
+	EXPECT(mem_dom_free(&parser) == 0);
+	EXPECT(mem_dom_get() == NULL && parser.users == 0);
+	EXPECT(mem_dom_free(&app) == 0);
+
+	buf[0] = '\0';
+	EXPECT(mem_dom_print(PRINT_DST_BUF(buf, sizeof(buf), 0)) == 0);
+
+	return ret;
+}
+
+#define SIMD_SIZE 520
+
+static int sign(int val)
+{
+	return (val > 0) - (val < 0);
+}
+
+static int t_mem_simd()
+{
+	int ret = 0;
+
+	static unsigned char a[SIMD_SIZE + 2];
+	static unsigned char b[SIMD_SIZE + 2];
+	static unsigned char c[SIMD_SIZE + 2];
+
+	const int max = mem_simd_set(MEM_SIMD_AVX512, 0);
+	EXPECT(max == mem_simd_get());
+
+	// Small streaming thresholds, so the streaming paths run as well, also on blocks shorter than a vector
+	const size_t streams[] = { 1, 256 };
+	for (size_t st = 0; st < sizeof(streams) / sizeof(streams[0]); st++) {
+		for (int level = MEM_SIMD_NONE; level <= max; level++) {
+			EXPECT(mem_simd_set(level, streams[st]) == level);
+
+			for (size_t size = 0; size <= SIMD_SIZE; size++) {
+				const size_t off = size % 2;
+
+				for (size_t i = 0; i < sizeof(a); i++) {
+					a[i] = (unsigned char)(i * 7);
+					b[i] = (unsigned char)(i * 13 + 1);
+				}
+
+				mem_set(c, 0, sizeof(c));
+				mem_set(c + off, 0xa5, size);
+				int ok = c[off + size] == 0 && (off == 0 || c[0] == 0);
+				for (size_t i = 0; i < size; i++) {
+					ok &= c[off + i] == 0xa5;
+				}
+				EXPECT(ok);
+
+				mem_cpy(c + off, size, a + 1, size);
+				EXPECT(memcmp(c + off, a + 1, size) == 0 && c[off + size] == 0);
+
+				EXPECT(mem_cmp(c + off, a + 1, size) == 0);
+				if (size > 0) {
+					c[off + size - 1]++;
+					EXPECT(sign(mem_cmp(c + off, a + 1, size)) == sign(memcmp(c + off, a + 1, size)));
+					c[off + size / 2] = 0;
+					EXPECT(sign(mem_cmp(c + off, a + 1, size)) == sign(memcmp(c + off, a + 1, size)));
+				}
+
+				EXPECT(mem_swap(a + off, b, size) == 0);
+				ok = a[off + size] == (unsigned char)((off + size) * 7);
+				for (size_t i = 0; i < size; i++) {
+					ok &= a[off + i] == (unsigned char)(i * 13 + 1) && b[i] == (unsigned char)((off + i) * 7);
+				}
+				EXPECT(ok);
+			}
+		}
+	}
+
+	EXPECT(mem_simd_set(MEM_SIMD_AVX512, 0) == max);
+
+	return ret;
+}
+
 int test_cplatform()
 {
 	int ret = 0;
 
 	EXPECT(t_init_free() == 0);
 	EXPECT(t_time() == 0);
+	EXPECT(t_time_mono() == 0);
 	EXPECT(t_log() == 0);
+	EXPECT(t_log_site() == 0);
+	EXPECT(t_log_threads() == 0);
+	EXPECT(t_log_buf_threads() == 0);
+	EXPECT(t_log_render() == 0);
+	EXPECT(t_log_async() == 0);
+	EXPECT(t_log_async_stop() == 0);
+	EXPECT(t_log_bin() == 0);
 	EXPECT(t_mem() == 0);
+	EXPECT(t_mem_threads() == 0);
+	EXPECT(t_mem_cache() == 0);
+	EXPECT(t_mem_map() == 0);
+	EXPECT(t_mem_aligned() == 0);
+	EXPECT(t_mem_trace() == 0);
+	EXPECT(t_mem_dom() == 0);
+	EXPECT(t_mem_simd() == 0);
+	EXPECT(t_mem_arena() == 0);
+	EXPECT(t_mem_pool() == 0);
+	EXPECT(t_mem_prof() == 0);
 	EXPECT(t_print() == 0);
+	EXPECT(t_print_fmt() == 0);
+	EXPECT(t_print_flt() == 0);
+	EXPECT(t_print_prog() == 0);
+	EXPECT(t_print_buf() == 0);
+	EXPECT(t_print_dyn() == 0);
+	EXPECT(t_print_iov() == 0);
+	EXPECT(t_print_map() == 0);
 	EXPECT(t_char() == 0);
 	EXPECT(t_file() == 0);
 	EXPECT(t_wfile() == 0);
+	EXPECT(t_utf() == 0);
 
 	return ret;
 }
@@ -0,0 +1,50 @@
+#include "cplatform.h"
+#include "log_bin.h"
+
+static FILE *file_open(const char *path, const char *mode)
+{
+	FILE *file = NULL;
+#if defined(C_WIN)
+	fopen_s(&file, path, mode);
+#else
+	file = fopen(path, mode);
+#endif
+	return file;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 3) {
+		c_fprintf(stderr, "usage: %s <log.bin> [log.txt]\n", argv[0]);
+		return 1;
+	}
+
+	cplatform_t cplatform = { 0 };
+	cplatform_init(&cplatform);
+
+	int ret = 1;
+
+	FILE *in = file_open(argv[1], "rb");
+	if (in == NULL) {
+		log_error("logdecode", "main", NULL, "failed to open file: %s", argv[1]);
+		goto exit;
+	}
+
+	FILE *out = argc > 2 ? file_open(argv[2], "w") : stdout;
+	if (out == NULL) {
+		log_error("logdecode", "main", NULL, "failed to open file: %s", argv[2]);
+		fclose(in);
+		goto exit;
+	}
+
+	ret = log_bin_decode(in, PRINT_DST_FILE(out));
+
+	fclose(in);
+	if (out != stdout) {
+		fclose(out);
+	}
+
+exit:
+	cplatform_free(&cplatform);
+	return ret;
+}
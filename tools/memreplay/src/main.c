@@ -0,0 +1,399 @@
+#include "c_time.h"
+#include "cplatform.h"
+#include "mem_arena.h"
+#include "mem_pool.h"
+#include "mem_trace.h"
+#include "platform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(C_WIN)
+	#include <psapi.h>
+#endif
+
+#define REPLAY_PAGE	   4096
+#define REPLAY_ARENA_CHUNK (1024 * 1024)
+#define REPLAY_POOLS	   8
+#define REPLAY_POOL_MIN	   16
+#define REPLAY_POOL_SLABS  64
+
+typedef struct backend_s {
+	const char *name;
+	void (*init)();
+	void *(*alloc)(size_t size);
+	void *(*realloc)(void *ptr, size_t new_size, size_t old_size);
+	void (*free)(void *ptr, size_t size);
+	void (*done)();
+} backend_t;
+
+typedef struct trace_s {
+	mem_trace_op_t *ops;
+	size_t cnt;
+	size_t cap;
+	u64 ids;
+} trace_t;
+
+static mem_arena_t s_arena;
+static mem_pool_t s_pools[REPLAY_POOLS];
+
+static FILE *file_open(const char *path, const char *mode)
+{
+	FILE *file = NULL;
+#if defined(C_WIN)
+	fopen_s(&file, path, mode);
+#else
+	file = fopen(path, mode);
+#endif
+	return file;
+}
+
+static void none()
+{
+}
+
+static void *libc_alloc(size_t size)
+{
+	return malloc(size);
+}
+
+static void *libc_realloc(void *ptr, size_t new_size, size_t old_size)
+{
+	(void)old_size;
+	return realloc(ptr, new_size);
+}
+
+static void libc_free(void *ptr, size_t size)
+{
+	(void)size;
+	free(ptr);
+}
+
+static void cache_init()
+{
+	mem_cache_set(1024 * 1024);
+}
+
+static void cache_done()
+{
+	mem_cache_set(0);
+}
+
+// Arena blocks are only released all at once, frees leave them in place
+static void arena_init()
+{
+	mem_arena_init(&s_arena, REPLAY_ARENA_CHUNK);
+}
+
+static void *arena_alloc(size_t size)
+{
+	return mem_arena_alloc(&s_arena, size);
+}
+
+static void *arena_realloc(void *ptr, size_t new_size, size_t old_size)
+{
+	if (new_size <= old_size) {
+		return ptr;
+	}
+
+	void *res = mem_arena_alloc(&s_arena, new_size);
+	if (res != NULL) {
+		memcpy(res, ptr, old_size);
+	}
+	return res;
+}
+
+static void arena_free(void *ptr, size_t size)
+{
+	(void)ptr;
+	(void)size;
+}
+
+static void arena_done()
+{
+	mem_arena_free(&s_arena);
+}
+
+// One pool per power of two up to REPLAY_POOL_MIN << (REPLAY_POOLS - 1), larger blocks use mem_alloc()
+static int pool_index(size_t size)
+{
+	int i = 0;
+	while (i < REPLAY_POOLS && ((size_t)REPLAY_POOL_MIN << i) < size) {
+		i++;
+	}
+	return i;
+}
+
+static void pool_init()
+{
+	for (int i = 0; i < REPLAY_POOLS; i++) {
+		mem_pool_init(&s_pools[i], (size_t)REPLAY_POOL_MIN << i, REPLAY_POOL_SLABS, MEM_POOL_CACHE);
+	}
+}
+
+static void *pool_alloc(size_t size)
+{
+	const int i = pool_index(size);
+	return i < REPLAY_POOLS ? mem_pool_alloc(&s_pools[i]) : mem_alloc(size);
+}
+
+static void pool_release(void *ptr, size_t size)
+{
+	const int i = pool_index(size);
+	if (i < REPLAY_POOLS) {
+		mem_pool_release(&s_pools[i], ptr);
+	} else {
+		mem_free(ptr, size);
+	}
+}
+
+static void *pool_realloc(void *ptr, size_t new_size, size_t old_size)
+{
+	if (pool_index(new_size) == pool_index(old_size) && pool_index(new_size) < REPLAY_POOLS) {
+		return ptr;
+	}
+
+	void *res = pool_alloc(new_size);
+	if (res != NULL) {
+		memcpy(res, ptr, old_size < new_size ? old_size : new_size);
+		pool_release(ptr, old_size);
+	}
+	return res;
+}
+
+static void pool_done()
+{
+	for (int i = 0; i < REPLAY_POOLS; i++) {
+		mem_pool_free(&s_pools[i]);
+	}
+}
+
+static const backend_t s_backends[] = {
+	{ "libc", none, libc_alloc, libc_realloc, libc_free, none },
+	{ "mem", none, mem_alloc, mem_realloc, mem_free, none },
+	{ "cache", cache_init, mem_alloc, mem_realloc, mem_free, cache_done },
+	{ "arena", arena_init, arena_alloc, arena_realloc, arena_free, arena_done },
+	{ "pool", pool_init, pool_alloc, pool_realloc, pool_release, pool_done },
+};
+
+// Resets the peak resident set size where the system allows it, returns the current size
+static size_t rss_reset()
+{
+#if defined(C_WIN)
+	PROCESS_MEMORY_COUNTERS pmc;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? pmc.WorkingSetSize : 0;
+#else
+	FILE *file = file_open("/proc/self/clear_refs", "w");
+	if (file != NULL) {
+		fputs("5", file);
+		fclose(file);
+	}
+
+	size_t rss = 0;
+	file	   = file_open("/proc/self/statm", "r");
+	if (file != NULL) {
+		unsigned long size, pages;
+		if (fscanf(file, "%lu %lu", &size, &pages) == 2) {
+			rss = (size_t)pages * REPLAY_PAGE;
+		}
+		fclose(file);
+	}
+	return rss;
+#endif
+}
+
+static size_t rss_peak()
+{
+#if defined(C_WIN)
+	PROCESS_MEMORY_COUNTERS pmc;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? pmc.PeakWorkingSetSize : 0;
+#else
+	FILE *file = file_open("/proc/self/status", "r");
+	if (file == NULL) {
+		return 0;
+	}
+
+	char line[128];
+	size_t peak = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		unsigned long kb;
+		if (sscanf(line, "VmHWM: %lu kB", &kb) == 1) {
+			peak = (size_t)kb * 1024;
+			break;
+		}
+	}
+	fclose(file);
+	return peak;
+#endif
+}
+
+static int trace_load(trace_t *trace, FILE *file)
+{
+	if (mem_trace_header(file)) {
+		return 1;
+	}
+
+	mem_trace_op_t op = { 0 };
+	while (mem_trace_read(file, &op) == 0) {
+		if (trace->cnt == trace->cap) {
+			const size_t cap    = trace->cap == 0 ? 1024 : trace->cap * 2;
+			mem_trace_op_t *ops = realloc(trace->ops, cap * sizeof(mem_trace_op_t));
+			if (ops == NULL) {
+				return 1;
+			}
+			trace->ops = ops;
+			trace->cap = cap;
+		}
+
+		trace->ops[trace->cnt++] = op;
+		trace->ids		 = op.id > trace->ids ? op.id : trace->ids;
+	}
+
+	return 0;
+}
+
+// Writes one byte per page, so the blocks become resident like they would when used
+static void touch(void *ptr, size_t size)
+{
+	for (size_t i = 0; i < size; i += REPLAY_PAGE) {
+		((volatile char *)ptr)[i] = 1;
+	}
+}
+
+// Replays the trace in recorded order on the current thread
+static int replay(const trace_t *trace, const backend_t *backend, void **ptrs, size_t *sizes)
+{
+	memset(ptrs, 0, (size_t)(trace->ids + 1) * sizeof(void *));
+	memset(sizes, 0, (size_t)(trace->ids + 1) * sizeof(size_t));
+
+	const size_t rss = rss_reset();
+	backend->init();
+
+	size_t live = 0, peak = 0, failed = 0;
+
+	const u64 start = c_mono();
+	for (size_t i = 0; i < trace->cnt; i++) {
+		const mem_trace_op_t *op = &trace->ops[i];
+
+		switch (op->op) {
+		case MEM_TRACE_ALLOC:
+		case MEM_TRACE_CALLOC:
+			ptrs[op->id] = backend->alloc(op->size);
+			if (ptrs[op->id] == NULL) {
+				failed++;
+				continue;
+			}
+			if (op->op == MEM_TRACE_CALLOC) {
+				memset(ptrs[op->id], 0, op->size);
+			} else {
+				touch(ptrs[op->id], op->size);
+			}
+			sizes[op->id] = op->size;
+			live += op->size;
+			break;
+		case MEM_TRACE_REALLOC: {
+			if (ptrs[op->id] == NULL) {
+				failed++;
+				continue;
+			}
+			void *ptr = backend->realloc(ptrs[op->id], op->size, sizes[op->id]);
+			if (ptr == NULL) {
+				failed++;
+				continue;
+			}
+			live += op->size - sizes[op->id];
+			ptrs[op->id]  = ptr;
+			sizes[op->id] = op->size;
+			break;
+		}
+		case MEM_TRACE_FREE:
+			if (ptrs[op->id] != NULL) {
+				backend->free(ptrs[op->id], sizes[op->id]);
+				live -= sizes[op->id];
+				ptrs[op->id] = NULL;
+			}
+			break;
+		default: break;
+		}
+
+		peak = live > peak ? live : peak;
+	}
+	const u64 ns = c_mono() - start;
+
+	const size_t rss_peak_size = rss_peak();
+
+	for (u64 id = 0; id <= trace->ids; id++) {
+		if (ptrs[id] != NULL) {
+			backend->free(ptrs[id], sizes[id]);
+		}
+	}
+	backend->done();
+
+	// Share of the resident growth not backed by live blocks, 0 if the system does not report it
+	const size_t grown = rss_peak_size > rss ? rss_peak_size - rss : 0;
+	const double frag  = grown > peak ? (double)(grown - peak) * 100 / (double)grown : 0;
+
+	c_printf("%-8s %12.0f %12zu %12zu %7.1f%% %8zu\n", backend->name, (double)trace->cnt * 1000000000 / (double)(ns == 0 ? 1 : ns), peak, grown, frag,
+		 failed);
+
+	return failed > 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		c_fprintf(stderr, "usage: %s <trace.bin> [libc|mem|cache|arena|pool ...]\n", argv[0]);
+		return 1;
+	}
+
+	cplatform_t cplatform = { 0 };
+	cplatform_init(&cplatform);
+
+	int ret	      = 1;
+	trace_t trace = { 0 };
+	void **ptrs   = NULL;
+	size_t *sizes = NULL;
+
+	FILE *file = file_open(argv[1], "rb");
+	if (file == NULL) {
+		log_error("memreplay", "main", NULL, "failed to open file: %s", argv[1]);
+		goto exit;
+	}
+
+	if (trace_load(&trace, file)) {
+		log_error("memreplay", "main", NULL, "invalid trace: %s", argv[1]);
+		fclose(file);
+		goto exit;
+	}
+	fclose(file);
+
+	ptrs  = malloc((size_t)(trace.ids + 1) * sizeof(void *));
+	sizes = malloc((size_t)(trace.ids + 1) * sizeof(size_t));
+	if (ptrs == NULL || sizes == NULL) {
+		log_error("memreplay", "main", NULL, "out of memory");
+		goto exit;
+	}
+
+	const u64 duration = trace.cnt > 0 ? trace.ops[trace.cnt - 1].time : 0;
+	c_printf("%zu ops, %llu blocks, recorded over %.3f s\n", trace.cnt, (unsigned long long)trace.ids, (double)duration / 1000000000);
+	c_printf("%-8s %12s %12s %12s %8s %8s\n", "backend", "ops/s", "peak live", "peak rss", "frag", "failed");
+
+	ret = 0;
+	for (size_t i = 0; i < sizeof(s_backends) / sizeof(s_backends[0]); i++) {
+		int selected = argc == 2;
+		for (int j = 2; j < argc && !selected; j++) {
+			selected = strcmp(argv[j], s_backends[i].name) == 0;
+		}
+
+		if (selected) {
+			ret |= replay(&trace, &s_backends[i], ptrs, sizes);
+		}
+	}
+
+exit:
+	free(ptrs);
+	free(sizes);
+	free(trace.ops);
+	cplatform_free(&cplatform);
+	return ret;
+}